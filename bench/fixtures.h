@@ -0,0 +1,123 @@
+#ifndef BENCH_FIXTURES_H
+#define BENCH_FIXTURES_H
+
+#include <math.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <string>
+
+/*
+ * Deterministic synthetic fixtures, byte for byte the same as the ones
+ * fixtures.rb makes, so the native and Ruby numbers are measured on the
+ * same prints. Nothing here depends on the platform's rand().
+ */
+
+#define FIXTURE_WIDTH 320
+#define FIXTURE_HEIGHT 400
+#define FIXTURE_DPI 500
+#define FIXTURE_MINUTIAE 35
+
+/* splitmix64 */
+typedef struct fixture_rng {
+	uint64_t state;
+} fixture_rng;
+
+static inline uint64_t fixture_next(fixture_rng *rng) {
+	uint64_t z = (rng->state += 0x9e3779b97f4a7c15ull);
+
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+
+	return z ^ (z >> 31);
+}
+
+/* Uniform in [lo, hi], near enough for fixtures. */
+static inline int fixture_range(fixture_rng *rng, int lo, int hi) {
+	return lo + (int) (fixture_next(rng) % (uint64_t) (hi - lo + 1));
+}
+
+static inline void fixture_put16(std::string &out, unsigned int v) {
+	out.push_back((char) (v >> 8));
+	out.push_back((char) v);
+}
+
+/*
+ * An ANSI 378-2004 FMD with one view of FIXTURE_MINUTIAE minutiae drawn
+ * from seed. A nonzero mate jitters the same minutiae a few pixels and
+ * degrees, which the matcher scores as the same finger.
+ */
+static inline std::string fixture_fmd(uint64_t seed, uint64_t mate = 0) {
+	fixture_rng rng = { seed }, jitter = { seed ^ (mate * 0xd1b54a32d192ed03ull) };
+	std::string view, out;
+
+	view.push_back(1);
+	view.push_back(0);
+	view.push_back(80);
+	view.push_back(FIXTURE_MINUTIAE);
+	for(int i = 0; i < FIXTURE_MINUTIAE; i++) {
+		int type = fixture_range(&rng, 1, 2);
+		int x = fixture_range(&rng, 20, 300);
+		int y = fixture_range(&rng, 20, 380);
+		int angle = fixture_range(&rng, 0, 179);
+		int quality = fixture_range(&rng, 40, 100);
+
+		if(mate) {
+			x += fixture_range(&jitter, -3, 3);
+			y += fixture_range(&jitter, -3, 3);
+			angle = (angle + fixture_range(&jitter, -2, 2) + 180) % 180;
+		}
+		fixture_put16(view, type << 14 | x);
+		fixture_put16(view, y);
+		view.push_back((char) angle);
+		view.push_back((char) quality);
+	}
+	fixture_put16(view, 0);
+
+	out.append("FMR\0 20\0", 8);
+	fixture_put16(out, 26 + view.size());
+	out.append(6, '\0');
+	fixture_put16(out, FIXTURE_WIDTH);
+	fixture_put16(out, FIXTURE_HEIGHT);
+	fixture_put16(out, 197);
+	fixture_put16(out, 197);
+	out.push_back(1);
+	out.push_back(0);
+	out += view;
+
+	return out;
+}
+
+/*
+ * An 8-bit FIXTURE_WIDTH x FIXTURE_HEIGHT ridge pattern: concentric
+ * ridges bent by forty phase singularities, which the extractor finds
+ * minutiae in.
+ */
+static inline std::string fixture_image(uint64_t seed) {
+	fixture_rng rng = { seed };
+	int cx = FIXTURE_WIDTH / 2 + fixture_range(&rng, -20, 20);
+	int cy = FIXTURE_HEIGHT / 2 + fixture_range(&rng, -20, 20);
+	int px[40], py[40], sign[40];
+	std::string out(FIXTURE_WIDTH * FIXTURE_HEIGHT, '\0');
+
+	for(int i = 0; i < 40; i++) {
+		px[i] = fixture_range(&rng, 30, FIXTURE_WIDTH - 30);
+		py[i] = fixture_range(&rng, 30, FIXTURE_HEIGHT - 30);
+		sign[i] = fixture_range(&rng, 0, 1) ? 1 : -1;
+	}
+
+	for(int y = 0; y < FIXTURE_HEIGHT; y++) {
+		for(int x = 0; x < FIXTURE_WIDTH; x++) {
+			double phase = sqrt((double) (x - cx) * (x - cx) + (double) (y - cy) * (y - cy) * 1.3) * 0.6;
+
+			for(int i = 0; i < 40; i++) {
+				phase += sign[i] * atan2((double) (y - py[i]), (double) (x - px[i]));
+			}
+			out[y * FIXTURE_WIDTH + x] = (char) (sin(phase) > 0 ? 40 : 215);
+		}
+	}
+
+	return out;
+}
+
+#endif
@@ -0,0 +1,76 @@
+# Deterministic synthetic fixtures, byte for byte the same as the ones
+# fixtures.h makes, so the native and Ruby numbers are measured on the
+# same prints.
+module Fixtures
+	WIDTH = 320
+	HEIGHT = 400
+	DPI = 500
+	MINUTIAE = 35
+
+	MASK = 0xffff_ffff_ffff_ffff
+
+	# splitmix64
+	class Rng
+		def initialize(seed)
+			@state = seed & MASK
+		end
+
+		def next
+			@state = (@state + 0x9e37_79b9_7f4a_7c15) & MASK
+			z = @state
+			z = ((z ^ (z >> 30)) * 0xbf58_476d_1ce4_e5b9) & MASK
+			z = ((z ^ (z >> 27)) * 0x94d0_49bb_1331_11eb) & MASK
+			z ^ (z >> 31)
+		end
+
+		def range(lo, hi)
+			lo + self.next % (hi - lo + 1)
+		end
+	end
+
+	# An ANSI 378-2004 FMD with one view of MINUTIAE minutiae drawn from
+	# seed. A nonzero mate jitters the same minutiae a few pixels and
+	# degrees, which the matcher scores as the same finger.
+	def self.fmd(seed, mate = 0)
+		rng = Rng.new(seed)
+		jitter = Rng.new(seed ^ ((mate * 0xd1b5_4a32_d192_ed03) & MASK))
+
+		minutiae = MINUTIAE.times.map do
+			type = rng.range(1, 2)
+			x = rng.range(20, 300)
+			y = rng.range(20, 380)
+			angle = rng.range(0, 179)
+			quality = rng.range(40, 100)
+			if mate != 0
+				x += jitter.range(-3, 3)
+				y += jitter.range(-3, 3)
+				angle = (angle + jitter.range(-2, 2) + 180) % 180
+			end
+			[type << 14 | x, y, angle, quality].pack('nnCC')
+		end
+
+		view = [1, 0, 80, MINUTIAE].pack('C4') + minutiae.join + [0].pack('n')
+		header = "FMR\0 20\0".b + [26 + view.bytesize].pack('n') + "\0" * 6 +
+			[WIDTH, HEIGHT, 197, 197].pack('n4') + [1, 0].pack('C2')
+
+		(header + view).b.freeze
+	end
+
+	# An 8-bit WIDTH x HEIGHT ridge pattern the extractor finds minutiae in.
+	def self.image(seed)
+		rng = Rng.new(seed)
+		cx = WIDTH / 2 + rng.range(-20, 20)
+		cy = HEIGHT / 2 + rng.range(-20, 20)
+		points = 40.times.map { [rng.range(30, WIDTH - 30), rng.range(30, HEIGHT - 30), rng.range(0, 1) == 1 ? 1 : -1] }
+
+		out = String.new(capacity: WIDTH * HEIGHT, encoding: Encoding::BINARY)
+		HEIGHT.times do |y|
+			WIDTH.times do |x|
+				phase = Math.sqrt((x - cx).to_f * (x - cx) + (y - cy).to_f * (y - cy) * 1.3) * 0.6
+				points.each { |px, py, sign| phase += sign * Math.atan2((y - py).to_f, (x - px).to_f) }
+				out << (Math.sin(phase) > 0 ? 40 : 215)
+			end
+		end
+		out.freeze
+	end
+end
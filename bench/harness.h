@@ -0,0 +1,245 @@
+#ifndef BENCH_HARNESS_H
+#define BENCH_HARNESS_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <string>
+#include <vector>
+
+/*
+ * A small harness in the manner of Google Benchmark, without the
+ * dependency: each case runs its timed loop for a doubling number of
+ * iterations until one batch takes min_time, and the results are written
+ * in Google Benchmark's JSON layout so its compare.py and existing
+ * dashboards read them unchanged.
+ *
+ *   static void bench_thing(bench_state *state) {
+ *       ... setup ...
+ *       while(bench_keep_running(state)) {
+ *           ... timed work ...
+ *       }
+ *       state->items = state->iterations;
+ *   }
+ */
+
+typedef struct bench_state {
+	long long arg;
+	long long iterations;
+	long long remaining;
+	long long items;
+	std::string label;
+	std::string error;
+
+	double real_start;
+	double cpu_start;
+	double real_seconds;
+	double cpu_seconds;
+} bench_state;
+
+typedef struct bench_case {
+	const char *name;
+	void (*func)(bench_state *state);
+	long long arg;
+} bench_case;
+
+static inline double bench_clock(clockid_t clock) {
+	struct timespec now;
+
+	clock_gettime(clock, &now);
+
+	return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+/* Starts the clocks on the first call and stops them after the last. */
+static inline int bench_keep_running(bench_state *state) {
+	if(state->remaining == state->iterations) {
+		state->real_start = bench_clock(CLOCK_MONOTONIC);
+		state->cpu_start = bench_clock(CLOCK_PROCESS_CPUTIME_ID);
+	}
+	if(state->remaining-- > 0 && state->error.empty()) {
+		return 1;
+	}
+
+	state->real_seconds = bench_clock(CLOCK_MONOTONIC) - state->real_start;
+	state->cpu_seconds = bench_clock(CLOCK_PROCESS_CPUTIME_ID) - state->cpu_start;
+
+	return 0;
+}
+
+/* Stops the case; it is reported with the message instead of timings. */
+static inline void bench_skip(bench_state *state, const std::string &error) {
+	state->error = error;
+}
+
+/* Keeps the compiler from discarding a result. */
+template <class T>
+static inline void bench_keep(const T &value) {
+	asm volatile("" : : "g"(&value) : "memory");
+}
+
+typedef struct bench_options {
+	double min_time;
+	const char *filter;
+	const char *out;
+} bench_options;
+
+static inline std::string bench_name(const bench_case *c) {
+	std::string name = c->name;
+
+	if(c->arg) {
+		name += "/" + std::to_string(c->arg);
+	}
+
+	return name;
+}
+
+static inline std::string bench_json_string(const std::string &s) {
+	std::string out = "\"";
+
+	for(char ch : s) {
+		if(ch == '"' || ch == '\\') {
+			out += '\\';
+		}
+		out += ch;
+	}
+
+	return out + "\"";
+}
+
+static inline void bench_write_json(FILE *out, const std::vector<std::string> &runs, const char *executable) {
+	char host[256] = "";
+	char date[64];
+	time_t now = time(NULL);
+
+	gethostname(host, sizeof(host) - 1);
+	strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%S%z", localtime(&now));
+
+	fprintf(out, "{\n  \"context\": {\n");
+	fprintf(out, "    \"date\": %s,\n", bench_json_string(date).c_str());
+	fprintf(out, "    \"host_name\": %s,\n", bench_json_string(host).c_str());
+	fprintf(out, "    \"executable\": %s,\n", bench_json_string(executable).c_str());
+	fprintf(out, "    \"num_cpus\": %ld,\n", sysconf(_SC_NPROCESSORS_ONLN));
+	fprintf(out, "    \"library_build_type\": \"release\"\n  },\n");
+	fprintf(out, "  \"benchmarks\": [\n");
+	for(size_t i = 0; i < runs.size(); i++) {
+		fprintf(out, "%s%s\n", runs[i].c_str(), i + 1 < runs.size() ? "," : "");
+	}
+	fprintf(out, "  ]\n}\n");
+}
+
+static inline std::string bench_run(const bench_case *c, const bench_options *opts) {
+	std::string name = bench_name(c), json;
+	bench_state state;
+	char buf[512];
+
+	/* Double the batch until it takes long enough to time. */
+	for(long long n = 1;; n *= 2) {
+		state = bench_state();
+		state.arg = c->arg;
+		state.iterations = state.remaining = n;
+		c->func(&state);
+		if(!state.error.empty() || state.real_seconds >= opts->min_time || n >= (1ll << 40)) {
+			break;
+		}
+		if(state.real_seconds > 0 && state.real_seconds * 2 < opts->min_time) {
+			long long want = (long long) (n * opts->min_time / state.real_seconds);
+
+			while(n * 4 <= want) {
+				n *= 2;
+			}
+		}
+	}
+
+	if(!state.error.empty()) {
+		fprintf(stderr, "%-32s %s\n", name.c_str(), state.error.c_str());
+		return "    {\"name\": " + bench_json_string(name) + ", \"run_name\": " + bench_json_string(name) +
+			", \"run_type\": \"iteration\", \"error_occurred\": true, \"error_message\": " + bench_json_string(state.error) + "}";
+	}
+
+	double real_ns = state.real_seconds * 1e9 / state.iterations;
+	double cpu_ns = state.cpu_seconds * 1e9 / state.iterations;
+
+	fprintf(stderr, "%-32s %14.0f ns %14.0f ns %12lld", name.c_str(), real_ns, cpu_ns, state.iterations);
+	if(state.items) {
+		fprintf(stderr, " %12.4g items/s", state.items / state.real_seconds);
+	}
+	fprintf(stderr, " %s\n", state.label.c_str());
+
+	snprintf(buf, sizeof(buf),
+		"\"run_type\": \"iteration\", \"repetitions\": 1, \"threads\": 1, \"iterations\": %lld, "
+		"\"real_time\": %.3f, \"cpu_time\": %.3f, \"time_unit\": \"ns\"",
+		state.iterations, real_ns, cpu_ns
+	);
+	json = "    {\"name\": " + bench_json_string(name) + ", \"run_name\": " + bench_json_string(name) + ", " + buf;
+	if(state.items) {
+		snprintf(buf, sizeof(buf), ", \"items_per_second\": %.3f", state.items / state.real_seconds);
+		json += buf;
+	}
+	if(!state.label.empty()) {
+		json += ", \"label\": " + bench_json_string(state.label);
+	}
+
+	return json + "}";
+}
+
+/*
+ * Whether name is filter or one of its cases: "identify" selects
+ * "identify/1000", but "identify/1000" does not select "identify/10000".
+ */
+static inline bool bench_selected(const std::string &name, const char *filter) {
+	size_t len = strlen(filter);
+
+	if(name.compare(0, len, filter) != 0) {
+		return false;
+	}
+
+	return !len || name.size() == len || filter[len - 1] == '/' || name[len] == '/';
+}
+
+/*
+ * Runs every case --filter selects, each for at least
+ * --min-time seconds, and writes the JSON to --out (or stdout).
+ */
+static inline int bench_main(int argc, char **argv, const bench_case *cases, size_t case_cnt) {
+	bench_options opts = { 0.5, NULL, NULL };
+	std::vector<std::string> runs;
+	FILE *out = stdout;
+
+	for(int i = 1; i < argc; i++) {
+		if(!strncmp(argv[i], "--min-time=", 11)) {
+			opts.min_time = atof(argv[i] + 11);
+		} else if(!strncmp(argv[i], "--filter=", 9)) {
+			opts.filter = argv[i] + 9;
+		} else if(!strncmp(argv[i], "--out=", 6)) {
+			opts.out = argv[i] + 6;
+		} else {
+			fprintf(stderr, "usage: %s [--filter=name] [--min-time=seconds] [--out=results.json]\n", argv[0]);
+			return 2;
+		}
+	}
+
+	fprintf(stderr, "%-32s %17s %17s %12s\n", "Benchmark", "Time", "CPU", "Iterations");
+	for(size_t i = 0; i < case_cnt; i++) {
+		if(opts.filter && !bench_selected(bench_name(&cases[i]), opts.filter)) {
+			continue;
+		}
+		runs.push_back(bench_run(&cases[i], &opts));
+	}
+
+	if(opts.out && !(out = fopen(opts.out, "w"))) {
+		perror(opts.out);
+		return 1;
+	}
+	bench_write_json(out, runs, argv[0]);
+	if(out != stdout) {
+		fclose(out);
+	}
+
+	return 0;
+}
+
+#endif
@@ -0,0 +1,119 @@
+#include "fixtures.h"
+#include "harness.h"
+#include "u_are_u/dpfj.h"
+
+/*
+ * The matcher and extractor on their own, with no Ruby in the way, for
+ * comparison with what the same calls cost through the extension.
+ */
+
+#define BENCH_FORMAT DPFJ_FMD_ANSI_378_2004
+#define BENCH_THRESHOLD (DPFJ_PROBABILITY_ONE / 100000)
+#define BENCH_CANDIDATES 10
+
+/* Fixtures are built once and shared, however often a case is rerun. */
+static std::vector<std::string> &bench_gallery(size_t cnt) {
+	static std::vector<std::string> gallery;
+
+	while(gallery.size() < cnt) {
+		gallery.push_back(fixture_fmd(gallery.size() + 1));
+	}
+
+	return gallery;
+}
+
+static void bench_compare(bench_state *state, int mated) {
+	std::string a = fixture_fmd(1), b = mated ? fixture_fmd(1, 1) : fixture_fmd(2);
+	unsigned int score = 0;
+	int rc = DPFJ_SUCCESS;
+
+	while(bench_keep_running(state)) {
+		rc = dpfj_compare(
+			BENCH_FORMAT, (unsigned char*) &a[0], a.size(), 0,
+			BENCH_FORMAT, (unsigned char*) &b[0], b.size(), 0,
+			&score
+		);
+		bench_keep(score);
+	}
+	if(rc != DPFJ_SUCCESS) {
+		bench_skip(state, "dpfj_compare failed");
+	}
+	state->items = state->iterations;
+	state->label = "score " + std::to_string(score);
+}
+
+static void bench_compare_mated(bench_state *state) {
+	bench_compare(state, 1);
+}
+
+static void bench_compare_nonmated(bench_state *state) {
+	bench_compare(state, 0);
+}
+
+/* One probe against arg prints, mated with the one in the middle. */
+static void bench_identify(bench_state *state) {
+	size_t cnt = state->arg;
+	std::vector<std::string> &gallery = bench_gallery(cnt);
+	std::vector<unsigned char*> fmds(cnt);
+	std::vector<unsigned int> fmds_size(cnt);
+	std::string probe = fixture_fmd(cnt / 2 + 1, 1);
+	DPFJ_CANDIDATE candidates[BENCH_CANDIDATES];
+	unsigned int candidate_cnt = 0;
+	int rc = DPFJ_SUCCESS;
+
+	for(size_t i = 0; i < cnt; i++) {
+		fmds[i] = (unsigned char*) &gallery[i][0];
+		fmds_size[i] = gallery[i].size();
+	}
+
+	while(bench_keep_running(state)) {
+		candidate_cnt = BENCH_CANDIDATES;
+		rc = dpfj_identify(
+			BENCH_FORMAT, (unsigned char*) &probe[0], probe.size(), 0,
+			BENCH_FORMAT, cnt, &fmds[0], &fmds_size[0],
+			BENCH_THRESHOLD, &candidate_cnt, candidates
+		);
+		bench_keep(candidates);
+	}
+	if(rc != DPFJ_SUCCESS) {
+		bench_skip(state, "dpfj_identify failed");
+	}
+	state->items = state->iterations * (long long) cnt;
+	state->label = std::to_string(candidate_cnt) + " candidates";
+}
+
+static void bench_extract(bench_state *state) {
+	static std::string image = fixture_image(1);
+	unsigned char fmd[MAX_FMD_SIZE];
+	unsigned int size = 0;
+	int rc = DPFJ_SUCCESS;
+
+	while(bench_keep_running(state)) {
+		size = MAX_FMD_SIZE;
+		rc = dpfj_create_fmd_from_raw(
+			(const unsigned char*) image.data(), image.size(),
+			FIXTURE_WIDTH, FIXTURE_HEIGHT, FIXTURE_DPI,
+			DPFJ_POSITION_UNKNOWN, 0,
+			BENCH_FORMAT, fmd, &size
+		);
+		bench_keep(fmd);
+	}
+	if(rc != DPFJ_SUCCESS) {
+		bench_skip(state, "dpfj_create_fmd_from_raw failed");
+	}
+	state->items = state->iterations;
+	state->label = std::to_string(size) + " byte FMD";
+}
+
+static const bench_case cases[] = {
+	{ "dpfj_compare/mated", bench_compare_mated, 0 },
+	{ "dpfj_compare/nonmated", bench_compare_nonmated, 0 },
+	{ "dpfj_identify", bench_identify, 1000 },
+	{ "dpfj_identify", bench_identify, 10000 },
+	{ "dpfj_identify", bench_identify, 100000 },
+	{ "dpfj_create_fmd_from_raw", bench_extract, 0 },
+};
+
+int main(int argc, char **argv) {
+	return bench_main(argc, argv, cases, sizeof(cases) / sizeof(cases[0]));
+}
@@ -0,0 +1,70 @@
+# The extension's entry points under benchmark-ips, on the same fixtures
+# as native.cpp, so the two sets of numbers show what Ruby costs on top of
+# the matcher: the Array-of-Integers API against the String one, a file
+# loaded into a Template (and on into an Array) against one read into a
+# String, and identify over an Array (copied per call) against a Gallery
+# (decoded once).
+#
+#   ruby bench/ruby.rb [--filter=name] [--time=seconds] [--sizes=1000,10000] [--out=results.json]
+
+require 'benchmark/ips'
+require 'tmpdir'
+require 'fingerprint'
+
+require_relative 'fixtures'
+
+options = { time: 2.0, sizes: [1_000, 10_000, 100_000] }
+ARGV.each do |arg|
+	case arg
+	when /\A--filter=(.*)\z/ then options[:filter] = $1
+	when /\A--time=(.*)\z/ then options[:time] = Float($1)
+	when /\A--sizes=(.*)\z/ then options[:sizes] = $1.split(',').map { |size| Integer(size) }
+	when /\A--out=(.*)\z/ then options[:out] = $1
+	else abort "usage: #{$0} [--filter=name] [--time=seconds] [--sizes=1000,10000] [--out=results.json]"
+	end
+end
+
+F = KeyMe::Fingerprint
+
+enrolled = Fixtures.fmd(1)
+mated = Fixtures.fmd(1, 1)
+enrolled_array = enrolled.bytes
+mated_array = mated.bytes
+image = Fixtures.image(1)
+gallery = Array.new(options[:sizes].max || 0) { |i| Fixtures.fmd(i + 1) }
+
+Dir.mktmpdir('fingerprint-bench') do |dir|
+	path = File.join(dir, 'enrolled.fmd')
+	File.binwrite(path, enrolled)
+
+	Benchmark.ips do |x|
+		x.config(time: options[:time], warmup: options[:time] / 4)
+
+		# Like the native harness, --filter=identify selects identify/1000,
+		# but --filter=identify/1000 does not select identify/10000.
+		filter = options[:filter]
+		report = lambda do |name, &block|
+			selected = !filter || filter.empty? || name == filter || name.start_with?(filter.end_with?('/') ? filter : "#{filter}/")
+			x.report(name, &block) if selected
+		end
+
+		report.('verify_user') { F.verify_user(enrolled_array, mated_array) }
+		report.('verify') { F.verify(enrolled, mated) }
+		report.('load_print') { F.load_print(path) }
+		report.('load_print/to_a') { F.load_print(path).to_a }
+		report.('read_print') { F.read_print(path) }
+		report.('extract_raw') { F.extract_raw(image, Fixtures::WIDTH, Fixtures::HEIGHT, dpi: Fixtures::DPI) }
+
+		options[:sizes].each do |size|
+			prints = gallery.first(size)
+			probe = Fixtures.fmd(size / 2 + 1, 1)
+			indexed = F::Gallery.new
+			prints.each { |print| indexed.add(print) }
+
+			report.("identify/array/#{size}") { F.identify(probe, prints) }
+			report.("identify/gallery/#{size}") { F.identify(probe, indexed) }
+		end
+
+		x.json!(options[:out]) if options[:out]
+	end
+end
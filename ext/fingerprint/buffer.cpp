@@ -0,0 +1,164 @@
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "buffer.h"
+#include "stats.h"
+
+/*
+ * Classes run from 64 bytes to 4 MiB, enough for a raw image. Bigger
+ * requests are malloc'd and freed directly. Each thread keeps up to
+ * BUFFER_CACHE_DEPTH buffers of a class and BUFFER_CACHE_BYTES in all;
+ * anything past that goes back to malloc.
+ */
+#define BUFFER_MIN_SHIFT 6
+#define BUFFER_MAX_SHIFT 22
+#define BUFFER_CLASSES (BUFFER_MAX_SHIFT - BUFFER_MIN_SHIFT + 1)
+#define BUFFER_CACHE_DEPTH 4
+#define BUFFER_CACHE_BYTES (8 * 1024 * 1024)
+
+/* Sits in front of every buffer; 16 bytes keeps the buffer aligned. */
+typedef struct buffer_header {
+	uint32_t cls;
+	uint32_t reserved;
+	uint64_t capa;
+} buffer_header;
+
+typedef struct buffer_cache {
+	buffer_header *free[BUFFER_CLASSES][BUFFER_CACHE_DEPTH];
+	unsigned int cnt[BUFFER_CLASSES];
+	size_t bytes;
+} buffer_cache;
+
+static pthread_key_t buffer_key;
+static __thread buffer_cache *buffer_mine;
+
+/* Bytes malloc'd for buffers and not yet freed, and how many the GC knows of. */
+static size_t buffer_bytes;
+static size_t buffer_reported;
+
+static uint64_t buffer_reuses;
+static uint64_t buffer_mallocs;
+
+static unsigned int buffer_class(size_t size) {
+	unsigned int shift = BUFFER_MIN_SHIFT;
+
+	while(shift <= BUFFER_MAX_SHIFT && ((size_t) 1 << shift) < size) {
+		shift++;
+	}
+
+	return shift - BUFFER_MIN_SHIFT;
+}
+
+static void buffer_release(buffer_header *h) {
+	__atomic_sub_fetch(&buffer_bytes, sizeof(buffer_header) + h->capa, __ATOMIC_RELAXED);
+	free(h);
+}
+
+static void buffer_cache_free(void *ptr) {
+	buffer_cache *cache = (buffer_cache*) ptr;
+
+	for(unsigned int cls = 0; cls < BUFFER_CLASSES; cls++) {
+		for(unsigned int i = 0; i < cache->cnt[cls]; i++) {
+			buffer_release(cache->free[cls][i]);
+		}
+	}
+	free(cache);
+}
+
+static buffer_cache *buffer_cache_mine() {
+	if(!buffer_mine) {
+		buffer_mine = (buffer_cache*) calloc(1, sizeof(buffer_cache));
+		if(buffer_mine) {
+			pthread_setspecific(buffer_key, buffer_mine);
+		}
+	}
+
+	return buffer_mine;
+}
+
+void *buffer_get(size_t size) {
+	unsigned int cls = buffer_class(size);
+	buffer_cache *cache = buffer_cache_mine();
+	buffer_header *h;
+	size_t capa;
+
+	if(cls < BUFFER_CLASSES && cache && cache->cnt[cls]) {
+		h = cache->free[cls][--cache->cnt[cls]];
+		cache->bytes -= h->capa;
+		__atomic_add_fetch(&buffer_reuses, 1, __ATOMIC_RELAXED);
+		return h + 1;
+	}
+
+	capa = cls < BUFFER_CLASSES ? (size_t) 1 << (cls + BUFFER_MIN_SHIFT) : size;
+	h = (buffer_header*) malloc(sizeof(buffer_header) + capa);
+	if(!h) {
+		return NULL;
+	}
+	h->cls = cls;
+	h->capa = capa;
+
+	__atomic_add_fetch(&buffer_bytes, sizeof(buffer_header) + capa, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&buffer_mallocs, 1, __ATOMIC_RELAXED);
+	stats_count(STATS_ALLOCATIONS, 1);
+
+	return h + 1;
+}
+
+void buffer_put(void *buf) {
+	buffer_header *h;
+	buffer_cache *cache;
+
+	if(!buf) {
+		return;
+	}
+	h = (buffer_header*) buf - 1;
+	cache = buffer_cache_mine();
+
+	if(h->cls >= BUFFER_CLASSES || !cache ||
+	   cache->cnt[h->cls] == BUFFER_CACHE_DEPTH ||
+	   cache->bytes + h->capa > BUFFER_CACHE_BYTES) {
+		buffer_release(h);
+		return;
+	}
+
+	cache->free[h->cls][cache->cnt[h->cls]++] = h;
+	cache->bytes += h->capa;
+}
+
+void buffer_account() {
+	size_t bytes = __atomic_load_n(&buffer_bytes, __ATOMIC_RELAXED);
+
+	if(bytes != buffer_reported) {
+		rb_gc_adjust_memory_usage((ssize_t) (bytes - buffer_reported));
+		buffer_reported = bytes;
+	}
+}
+
+/*
+ * KeyMe::Fingerprint.buffer_stats
+ *
+ * A Hash of bytes (held by scratch buffers, in use or cached for reuse),
+ * reuses (buffers handed out again from a cache) and mallocs. In steady
+ * state, mallocs stops growing.
+ */
+VALUE buffer_stats_wrapper(VALUE self) {
+	VALUE result = rb_hash_new();
+
+	rb_hash_aset(result, ID2SYM(rb_intern("bytes")), SIZET2NUM(__atomic_load_n(&buffer_bytes, __ATOMIC_RELAXED)));
+	rb_hash_aset(result, ID2SYM(rb_intern("reuses")), ULL2NUM(__atomic_load_n(&buffer_reuses, __ATOMIC_RELAXED)));
+	rb_hash_aset(result, ID2SYM(rb_intern("mallocs")), ULL2NUM(__atomic_load_n(&buffer_mallocs, __ATOMIC_RELAXED)));
+
+	return result;
+}
+
+void Init_buffer() {
+	pthread_key_create(&buffer_key, buffer_cache_free);
+
+	rb_define_singleton_method(
+		rb_mFingerprint,
+		"buffer_stats",
+		RUBY_METHOD_FUNC(buffer_stats_wrapper),
+		0
+	);
+}
@@ -0,0 +1,27 @@
+#ifndef BUFFER_H
+#define BUFFER_H
+
+#include <stddef.h>
+
+#include "fingerprint.h"
+
+/*
+ * Scratch buffers for prints, FMDs and images, recycled through per-thread
+ * caches of power-of-two size classes. buffer_get and buffer_put take no
+ * lock and are safe without the GVL; a buffer may be put back on a thread
+ * other than the one that got it. buffer_get returns NULL when out of
+ * memory.
+ */
+void *buffer_get(size_t size);
+void buffer_put(void *buf);
+
+/*
+ * Tells the GC how far the memory held by buffers has moved since the last
+ * call, cached ones included. Call with the GVL after a batch of gets and
+ * puts.
+ */
+void buffer_account();
+
+void Init_buffer();
+
+#endif
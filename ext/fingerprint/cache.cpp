@@ -0,0 +1,431 @@
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#endif
+
+#include "cache.h"
+#include "stats.h"
+
+#define DEFAULT_CACHE_MAX_BYTES (16 * 1024 * 1024)
+#define DEFAULT_CACHE_TTL 30.0
+#define CACHE_MIN_BUCKETS 64
+
+/*
+ * The verify cache remembers recent comparison results, so a kiosk
+ * retrying the same probe against the same enrolled print does not run
+ * the matcher again. Entries keep copies of both prints and a hit needs
+ * them byte for byte: the CRC32C only picks the bucket, and a collision
+ * can never turn into someone else's match.
+ *
+ * Entries sit in a chained hash table and on one list, newest first. The
+ * oldest are dropped once their bytes pass max_bytes, or ttl after they
+ * were stored. Everything here runs with the GVL held, which is the lock.
+ */
+typedef struct cache_entry {
+	struct cache_entry *chain;
+	struct cache_entry *newer;
+	struct cache_entry *older;
+	uint32_t hash;
+	int kind;
+	DPFJ_FMD_FORMAT format;
+	unsigned int view1;
+	unsigned int view2;
+	unsigned int fmd1_len;
+	unsigned int fmd2_len;
+	unsigned int result;
+	uint64_t stored;
+	/* fmd1 then fmd2 follow. */
+} cache_entry;
+
+static cache_entry **cache_buckets;
+static unsigned int cache_bucket_cnt;
+static unsigned int cache_entry_cnt;
+static cache_entry *cache_newest;
+static cache_entry *cache_oldest;
+static size_t cache_bytes;
+static size_t cache_max_bytes;
+static uint64_t cache_ttl;
+
+static uint64_t cache_hits;
+static uint64_t cache_misses;
+static uint64_t cache_evictions;
+static uint64_t cache_expirations;
+
+static uint32_t crc32c_table[256];
+
+static uint32_t crc32c_soft(uint32_t crc, const unsigned char *data, size_t len) {
+	crc = ~crc;
+	while(len--) {
+		crc = crc32c_table[(crc ^ *data++) & 0xff] ^ (crc >> 8);
+	}
+
+	return ~crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hard(uint32_t crc, const unsigned char *data, size_t len) {
+	uint64_t crc64 = ~crc;
+
+	for(; len >= 8; data += 8, len -= 8) {
+		uint64_t word;
+
+		memcpy(&word, data, 8);
+		crc64 = _mm_crc32_u64(crc64, word);
+	}
+	crc = (uint32_t) crc64;
+	while(len--) {
+		crc = _mm_crc32_u8(crc, *data++);
+	}
+
+	return ~crc;
+}
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+static uint32_t crc32c_hard(uint32_t crc, const unsigned char *data, size_t len) {
+	crc = ~crc;
+	for(; len >= 8; data += 8, len -= 8) {
+		uint64_t word;
+
+		memcpy(&word, data, 8);
+		crc = __crc32cd(crc, word);
+	}
+	while(len--) {
+		crc = __crc32cb(crc, *data++);
+	}
+
+	return ~crc;
+}
+#endif
+
+static uint32_t (*crc32c_impl)(uint32_t crc, const unsigned char *data, size_t len) = crc32c_soft;
+
+/* CRC32C (Castagnoli), in hardware where the CPU has it. */
+uint32_t crc32c(uint32_t crc, const unsigned char *data, size_t len) {
+	return crc32c_impl(crc, data, len);
+}
+
+static unsigned char *cache_entry_data(cache_entry *e) {
+	return (unsigned char*) (e + 1);
+}
+
+static size_t cache_entry_size(unsigned int fmd1_len, unsigned int fmd2_len) {
+	return sizeof(cache_entry) + fmd1_len + fmd2_len;
+}
+
+void cache_key_init(cache_key *key, int kind, DPFJ_FMD_FORMAT format,
+	const unsigned char *fmd1, unsigned int fmd1_len, unsigned int view1,
+	const unsigned char *fmd2, unsigned int fmd2_len, unsigned int view2) {
+	unsigned int params[5] = { (unsigned int) kind, (unsigned int) format, view1, view2, fmd1_len };
+	uint32_t hash;
+
+	key->kind = kind;
+	key->format = format;
+	key->fmd1 = fmd1;
+	key->fmd1_len = fmd1_len;
+	key->view1 = view1;
+	key->fmd2 = fmd2;
+	key->fmd2_len = fmd2_len;
+	key->view2 = view2;
+	key->hash = 0;
+
+	if(!cache_max_bytes) {
+		return;
+	}
+
+	hash = crc32c(0, (const unsigned char*) params, sizeof(params));
+	hash = crc32c(hash, fmd1, fmd1_len);
+	hash = crc32c(hash, fmd2, fmd2_len);
+	key->hash = hash ? hash : 1;
+}
+
+static int cache_entry_matches(cache_entry *e, const cache_key *key) {
+	const unsigned char *data = cache_entry_data(e);
+
+	return e->hash == key->hash &&
+	       e->kind == key->kind &&
+	       e->format == key->format &&
+	       e->view1 == key->view1 &&
+	       e->view2 == key->view2 &&
+	       e->fmd1_len == key->fmd1_len &&
+	       e->fmd2_len == key->fmd2_len &&
+	       memcmp(data, key->fmd1, key->fmd1_len) == 0 &&
+	       memcmp(data + key->fmd1_len, key->fmd2, key->fmd2_len) == 0;
+}
+
+static cache_entry **cache_bucket(uint32_t hash) {
+	return &cache_buckets[hash & (cache_bucket_cnt - 1)];
+}
+
+static void cache_list_unlink(cache_entry *e) {
+	if(e->newer) {
+		e->newer->older = e->older;
+	} else {
+		cache_newest = e->older;
+	}
+	if(e->older) {
+		e->older->newer = e->newer;
+	} else {
+		cache_oldest = e->newer;
+	}
+}
+
+static void cache_list_push(cache_entry *e) {
+	e->newer = NULL;
+	e->older = cache_newest;
+	if(cache_newest) {
+		cache_newest->newer = e;
+	} else {
+		cache_oldest = e;
+	}
+	cache_newest = e;
+}
+
+static void cache_remove(cache_entry *e) {
+	cache_entry **link = cache_bucket(e->hash);
+
+	while(*link != e) {
+		link = &(*link)->chain;
+	}
+	*link = e->chain;
+	cache_list_unlink(e);
+
+	cache_entry_cnt--;
+	cache_bytes -= cache_entry_size(e->fmd1_len, e->fmd2_len);
+	xfree(e);
+}
+
+static int cache_expired(cache_entry *e, uint64_t now) {
+	return cache_ttl && now - e->stored >= cache_ttl;
+}
+
+static void cache_clear() {
+	while(cache_oldest) {
+		cache_remove(cache_oldest);
+	}
+}
+
+/* Doubles the bucket table once it averages more than one entry a bucket. */
+static void cache_grow() {
+	unsigned int cnt = cache_bucket_cnt ? cache_bucket_cnt * 2 : CACHE_MIN_BUCKETS;
+	cache_entry **buckets = ZALLOC_N(cache_entry*, cnt);
+
+	for(unsigned int i = 0; i < cache_bucket_cnt; i++) {
+		cache_entry *e = cache_buckets[i];
+
+		while(e) {
+			cache_entry *next = e->chain;
+
+			e->chain = buckets[e->hash & (cnt - 1)];
+			buckets[e->hash & (cnt - 1)] = e;
+			e = next;
+		}
+	}
+
+	xfree(cache_buckets);
+	cache_buckets = buckets;
+	cache_bucket_cnt = cnt;
+}
+
+/*
+ * Finds key's result and makes it the newest entry. Returns 0, counting a
+ * miss, if there is none or it has expired.
+ */
+int cache_lookup(const cache_key *key, unsigned int *result) {
+	cache_entry *e;
+
+	if(!key->hash) {
+		return 0;
+	}
+
+	for(e = cache_bucket_cnt ? *cache_bucket(key->hash) : NULL; e; e = e->chain) {
+		if(cache_entry_matches(e, key)) {
+			break;
+		}
+	}
+
+	if(e && cache_expired(e, stats_now())) {
+		cache_remove(e);
+		cache_expirations++;
+		e = NULL;
+	}
+	if(!e) {
+		cache_misses++;
+		return 0;
+	}
+
+	cache_list_unlink(e);
+	cache_list_push(e);
+	cache_hits++;
+	*result = e->result;
+
+	return 1;
+}
+
+/*
+ * Remembers result for key, then drops the oldest entries until the cache
+ * is back under max_bytes, along with any that have expired.
+ */
+void cache_store(const cache_key *key, unsigned int result) {
+	size_t size = cache_entry_size(key->fmd1_len, key->fmd2_len);
+	uint64_t now = stats_now();
+	cache_entry *e;
+
+	if(!key->hash || !cache_max_bytes || size > cache_max_bytes) {
+		return;
+	}
+
+	if(cache_entry_cnt >= cache_bucket_cnt) {
+		cache_grow();
+	}
+
+	/* Another thread may have stored it while this one was matching. */
+	for(e = *cache_bucket(key->hash); e; e = e->chain) {
+		if(cache_entry_matches(e, key)) {
+			cache_remove(e);
+			break;
+		}
+	}
+
+	e = (cache_entry*) xmalloc(size);
+	e->hash = key->hash;
+	e->kind = key->kind;
+	e->format = key->format;
+	e->view1 = key->view1;
+	e->view2 = key->view2;
+	e->fmd1_len = key->fmd1_len;
+	e->fmd2_len = key->fmd2_len;
+	e->result = result;
+	e->stored = now;
+	memcpy(cache_entry_data(e), key->fmd1, key->fmd1_len);
+	memcpy(cache_entry_data(e) + key->fmd1_len, key->fmd2, key->fmd2_len);
+
+	e->chain = *cache_bucket(e->hash);
+	*cache_bucket(e->hash) = e;
+	cache_list_push(e);
+	cache_entry_cnt++;
+	cache_bytes += size;
+
+	while(cache_bytes > cache_max_bytes) {
+		cache_remove(cache_oldest);
+		cache_evictions++;
+	}
+	while(cache_oldest && cache_expired(cache_oldest, now)) {
+		cache_remove(cache_oldest);
+		cache_expirations++;
+	}
+}
+
+/*
+ * KeyMe::Fingerprint.configure_verify_cache(max_bytes: 16 MiB, ttl: 30.0)
+ *
+ * Turns on the verify cache, which verify, verify_user and compare
+ * consult before running the matcher. Results are kept for ttl seconds
+ * (nil for as long as they fit) while the copies of their prints fit in
+ * max_bytes. max_bytes: 0 turns the cache off and empties it.
+ */
+VALUE configure_verify_cache_wrapper(int argc, VALUE *argv, VALUE self) {
+	VALUE opts;
+	ID keys[2];
+	VALUE values[2];
+	double ttl;
+
+	rb_scan_args(argc, argv, ":", &opts);
+	keys[0] = rb_intern("max_bytes");
+	keys[1] = rb_intern("ttl");
+	rb_get_kwargs(opts, keys, 0, 2, values);
+
+	ttl = values[1] == Qundef ? DEFAULT_CACHE_TTL : NIL_P(values[1]) ? 0 : NUM2DBL(values[1]);
+	if(ttl < 0) {
+		rb_raise(rb_eArgError, "ttl must not be negative");
+	}
+
+	cache_max_bytes = values[0] == Qundef ? DEFAULT_CACHE_MAX_BYTES : NUM2SIZET(values[0]);
+	cache_ttl = (uint64_t) (ttl * 1e9);
+	if(!cache_max_bytes) {
+		cache_clear();
+		xfree(cache_buckets);
+		cache_buckets = NULL;
+		cache_bucket_cnt = 0;
+	}
+	while(cache_bytes > cache_max_bytes) {
+		cache_remove(cache_oldest);
+		cache_evictions++;
+	}
+
+	return Qnil;
+}
+
+/*
+ * KeyMe::Fingerprint.clear_verify_cache
+ *
+ * Forgets every cached result, keeping the counters.
+ */
+VALUE clear_verify_cache_wrapper(VALUE self) {
+	cache_clear();
+
+	return Qnil;
+}
+
+/*
+ * KeyMe::Fingerprint.verify_cache_stats
+ *
+ * A Hash of enabled, max_bytes, ttl, entries, bytes, hits, misses,
+ * evictions (dropped for space) and expirations.
+ */
+VALUE verify_cache_stats_wrapper(VALUE self) {
+	VALUE result = rb_hash_new();
+
+	rb_hash_aset(result, ID2SYM(rb_intern("enabled")), cache_max_bytes ? Qtrue : Qfalse);
+	rb_hash_aset(result, ID2SYM(rb_intern("max_bytes")), SIZET2NUM(cache_max_bytes));
+	rb_hash_aset(result, ID2SYM(rb_intern("ttl")), cache_ttl ? DBL2NUM(cache_ttl / 1e9) : Qnil);
+	rb_hash_aset(result, ID2SYM(rb_intern("entries")), UINT2NUM(cache_entry_cnt));
+	rb_hash_aset(result, ID2SYM(rb_intern("bytes")), SIZET2NUM(cache_bytes));
+	rb_hash_aset(result, ID2SYM(rb_intern("hits")), ULL2NUM(cache_hits));
+	rb_hash_aset(result, ID2SYM(rb_intern("misses")), ULL2NUM(cache_misses));
+	rb_hash_aset(result, ID2SYM(rb_intern("evictions")), ULL2NUM(cache_evictions));
+	rb_hash_aset(result, ID2SYM(rb_intern("expirations")), ULL2NUM(cache_expirations));
+
+	return result;
+}
+
+void Init_cache() {
+	for(uint32_t i = 0; i < 256; i++) {
+		uint32_t crc = i;
+
+		for(int bit = 0; bit < 8; bit++) {
+			crc = crc & 1 ? (crc >> 1) ^ 0x82f63b78 : crc >> 1;
+		}
+		crc32c_table[i] = crc;
+	}
+
+#if defined(__x86_64__)
+	if(__builtin_cpu_supports("sse4.2")) {
+		crc32c_impl = crc32c_hard;
+	}
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+	crc32c_impl = crc32c_hard;
+#endif
+
+	rb_define_singleton_method(
+		rb_mFingerprint,
+		"configure_verify_cache",
+		RUBY_METHOD_FUNC(configure_verify_cache_wrapper),
+		-1
+	);
+	rb_define_singleton_method(
+		rb_mFingerprint,
+		"clear_verify_cache",
+		RUBY_METHOD_FUNC(clear_verify_cache_wrapper),
+		0
+	);
+	rb_define_singleton_method(
+		rb_mFingerprint,
+		"verify_cache_stats",
+		RUBY_METHOD_FUNC(verify_cache_stats_wrapper),
+		0
+	);
+}
@@ -0,0 +1,41 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <stdint.h>
+
+#include "fingerprint.h"
+
+/* What a cached result is the result of. */
+enum {
+	CACHE_VERIFY_USER,
+	CACHE_COMPARE
+};
+
+/*
+ * One comparison, as looked up in and stored to the verify cache. hash is
+ * left 0 by cache_key_init while the cache is off, which cache_lookup and
+ * cache_store take as their cue to do nothing.
+ */
+typedef struct cache_key {
+	int kind;
+	DPFJ_FMD_FORMAT format;
+	const unsigned char *fmd1;
+	unsigned int fmd1_len;
+	unsigned int view1;
+	const unsigned char *fmd2;
+	unsigned int fmd2_len;
+	unsigned int view2;
+	uint32_t hash;
+} cache_key;
+
+void cache_key_init(cache_key *key, int kind, DPFJ_FMD_FORMAT format,
+	const unsigned char *fmd1, unsigned int fmd1_len, unsigned int view1,
+	const unsigned char *fmd2, unsigned int fmd2_len, unsigned int view2);
+int cache_lookup(const cache_key *key, unsigned int *result);
+void cache_store(const cache_key *key, unsigned int result);
+
+uint32_t crc32c(uint32_t crc, const unsigned char *data, size_t len);
+
+void Init_cache();
+
+#endif
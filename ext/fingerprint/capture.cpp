@@ -0,0 +1,996 @@
+#include <errno.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "buffer.h"
+#include "capture.h"
+#include "stats.h"
+
+#define DEFAULT_CAPTURE_WINDOW 5
+#define DEFAULT_CAPTURE_SLOTS 4
+
+VALUE rb_cCaptureStream;
+
+static void capture_frame_swap(capture_frame *a, capture_frame *b) {
+	capture_frame t = *a;
+
+	*a = *b;
+	*b = t;
+}
+
+/*
+ * Gives f a buffer of the reader's image size, learned when it was
+ * opened. Returns 0 if it could not be allocated.
+ */
+static int capture_frame_alloc(reader *r, capture_frame *f) {
+	if(!r->image_size) {
+		return 1;
+	}
+	f->image = (unsigned char*) buffer_get(r->image_size);
+	f->capa = f->image ? r->image_size : 0;
+
+	return f->image != NULL;
+}
+
+/*
+ * Reads one frame into f, from the stream or from a capture of up to
+ * timeout milliseconds. f's buffer was sized when the reader was opened;
+ * it only grows here for a reader that would not say its image size.
+ */
+static int capture_frame_read(reader *r, DPFPDD_CAPTURE_PARAM *param, int stream, unsigned int timeout, capture_frame *f) {
+	int rc = DPFPDD_E_MORE_DATA;
+	uint64_t start = stats_start();
+
+	for(unsigned int attempt = 0; attempt < 2 && rc == DPFPDD_E_MORE_DATA; attempt++) {
+		f->size = f->capa;
+		f->result.size = sizeof(f->result);
+		if(stream) {
+			rc = r->ops->get_stream_image(r, param, &f->result, &f->size, f->image);
+		} else {
+			rc = r->ops->capture(r, param, timeout, &f->result, &f->size, f->image);
+		}
+
+		if(rc == DPFPDD_E_MORE_DATA) {
+			unsigned char *image = (unsigned char*) buffer_get(f->size);
+
+			if(!image) {
+				return DPFPDD_E_FAILURE;
+			}
+			buffer_put(f->image);
+			f->image = image;
+			f->capa = f->size;
+		}
+	}
+	stats_since(STATS_CAPTURE, start);
+
+	return rc;
+}
+
+static void *capture_producer(void *ptr) {
+	capture_stream *s = (capture_stream*) ptr;
+
+	pthread_mutex_lock(&s->lock);
+	for(;;) {
+		capture_frame *slot;
+		int rc;
+
+		while(!s->stopping && s->head - s->tail == s->slot_cnt) {
+			pthread_cond_wait(&s->changed, &s->lock);
+		}
+		if(s->stopping) {
+			break;
+		}
+
+		/* The slot at head is the producer's alone until head moves on. */
+		slot = &s->slots[s->head % s->slot_cnt];
+		pthread_mutex_unlock(&s->lock);
+
+		rc = capture_frame_read(s->r, &s->param, 1, 0, slot);
+
+		pthread_mutex_lock(&s->lock);
+		if(rc != DPFPDD_SUCCESS) {
+			if(!s->stopping) {
+				s->rc = rc;
+				s->call = "dpfpdd_get_stream_image";
+				s->stopping = 1;
+				pthread_cond_broadcast(&s->changed);
+			}
+			break;
+		}
+		if(slot->result.quality == DPFPDD_QUALITY_CANCELED) {
+			continue;
+		}
+
+		s->head++;
+		s->frames++;
+		pthread_cond_broadcast(&s->changed);
+	}
+	pthread_mutex_unlock(&s->lock);
+
+	return NULL;
+}
+
+static void *capture_selector(void *ptr) {
+	capture_stream *s = (capture_stream*) ptr;
+
+	pthread_mutex_lock(&s->lock);
+	for(;;) {
+		capture_frame *slot;
+		int good;
+
+		while(!s->stopping && s->head == s->tail) {
+			pthread_cond_wait(&s->changed, &s->lock);
+		}
+		if(s->stopping) {
+			break;
+		}
+
+		slot = &s->slots[s->tail % s->slot_cnt];
+		good = slot->result.quality == DPFPDD_QUALITY_GOOD;
+		if(good) {
+			s->good++;
+		}
+
+		if(!s->armed) {
+			s->armed = !good;
+		} else if(good || s->have_best) {
+			if(good && (!s->have_best || slot->result.score > s->best.result.score)) {
+				capture_frame_swap(slot, &s->best);
+				s->have_best = 1;
+			}
+
+			if(++s->seen >= s->window) {
+				while(!s->stopping && s->have_pending) {
+					pthread_cond_wait(&s->changed, &s->lock);
+				}
+				if(s->stopping) {
+					break;
+				}
+
+				capture_frame_swap(&s->best, &s->pending);
+				s->have_pending = 1;
+				s->have_best = 0;
+				s->seen = 0;
+				s->armed = !good;
+				s->selected++;
+			}
+		}
+
+		s->tail++;
+		pthread_cond_broadcast(&s->changed);
+	}
+	pthread_mutex_unlock(&s->lock);
+
+	return NULL;
+}
+
+static void *capture_extractor(void *ptr) {
+	capture_stream *s = (capture_stream*) ptr;
+	unsigned char *fmd = (unsigned char*) buffer_get(MAX_FMD_SIZE);
+
+	pthread_mutex_lock(&s->lock);
+	while(fmd) {
+		capture_template *t;
+		DPFPDD_IMAGE_INFO *info;
+		unsigned int size = MAX_FMD_SIZE;
+		uint64_t start;
+		int rc;
+
+		while(!s->stopping && !s->have_pending) {
+			pthread_cond_wait(&s->changed, &s->lock);
+		}
+		if(s->stopping) {
+			break;
+		}
+
+		/* pending is the extractor's alone while have_pending is set. */
+		pthread_mutex_unlock(&s->lock);
+		info = &s->pending.result.info;
+		start = stats_start();
+		rc = dpfj_create_fmd_from_raw(
+			s->pending.image, s->pending.size,
+			info->width, info->height, info->res,
+			DPFJ_POSITION_UNKNOWN, 0,
+			s->format, fmd, &size
+		);
+		stats_since(STATS_EXTRACT, start);
+		pthread_mutex_lock(&s->lock);
+
+		s->have_pending = 0;
+		if(rc != DPFJ_SUCCESS) {
+			s->failed++;
+			pthread_cond_broadcast(&s->changed);
+			continue;
+		}
+
+		if(s->template_cnt == CAPTURE_RESULTS) {
+			buffer_put(s->templates[s->template_head].fmd);
+			s->template_head = (s->template_head + 1) % CAPTURE_RESULTS;
+			s->template_cnt--;
+			s->dropped++;
+		}
+		t = &s->templates[(s->template_head + s->template_cnt) % CAPTURE_RESULTS];
+		t->fmd = (unsigned char*) buffer_get(size);
+		if(t->fmd) {
+			memcpy(t->fmd, fmd, size);
+			t->size = size;
+			t->score = s->pending.result.score;
+			s->template_cnt++;
+			s->extracted++;
+		} else {
+			s->failed++;
+		}
+		pthread_cond_broadcast(&s->changed);
+	}
+	pthread_mutex_unlock(&s->lock);
+	buffer_put(fmd);
+
+	return NULL;
+}
+
+/* Joins the threads and leaves streaming mode. Safe without the GVL. */
+static void capture_join(capture_stream *s) {
+	pthread_mutex_lock(&s->lock);
+	s->stopping = 1;
+	pthread_cond_broadcast(&s->changed);
+	pthread_mutex_unlock(&s->lock);
+
+	s->r->ops->cancel(s->r);
+	for(unsigned int i = 0; i < s->thread_cnt; i++) {
+		pthread_join(s->threads[i], NULL);
+	}
+	s->thread_cnt = 0;
+
+	s->r->ops->stop_stream(s->r);
+}
+
+typedef struct join_args {
+	capture_stream *s;
+	int done;
+} join_args;
+
+static void *capture_join_without_gvl(void *ptr) {
+	join_args *args = (join_args*) ptr;
+
+	capture_join(args->s);
+	args->done = 1;
+
+	return NULL;
+}
+
+/*
+ * Joins with the GVL released. The _gvl2 call leaves interrupts to the
+ * caller, to check once it has handed the reader back; if one is already
+ * pending it does not run, and the join is made with the GVL held.
+ */
+static void capture_stop_threads(capture_stream *s) {
+	join_args args;
+
+	args.s = s;
+	args.done = 0;
+	stats_without_gvl2(capture_join_without_gvl, &args, NULL, NULL);
+	if(!args.done) {
+		capture_join(s);
+	}
+}
+
+/* Hands the reader back, for a stream that is not running. */
+static void capture_release(capture_stream *s) {
+	reader_unclaim(s->r);
+	s->r = NULL;
+	s->reader_obj = Qnil;
+}
+
+static void capture_frames_free(capture_stream *s) {
+	for(unsigned int i = 0; i < s->slot_cnt; i++) {
+		buffer_put(s->slots[i].image);
+	}
+	xfree(s->slots);
+	s->slots = NULL;
+	s->slot_cnt = 0;
+	buffer_put(s->best.image);
+	buffer_put(s->pending.image);
+	memset(&s->best, 0, sizeof(s->best));
+	memset(&s->pending, 0, sizeof(s->pending));
+}
+
+static void capture_free(void *ptr) {
+	capture_stream *s = (capture_stream*) ptr;
+
+	if(s->running) {
+		capture_join(s);
+	}
+	if(s->r) {
+		reader_unclaim(s->r);
+	}
+
+	capture_frames_free(s);
+	for(unsigned int i = 0; i < s->template_cnt; i++) {
+		buffer_put(s->templates[(s->template_head + i) % CAPTURE_RESULTS].fmd);
+	}
+
+	pthread_mutex_destroy(&s->lock);
+	pthread_cond_destroy(&s->changed);
+	xfree(s);
+}
+
+static void capture_mark(void *ptr) {
+	capture_stream *s = (capture_stream*) ptr;
+
+	rb_gc_mark(s->reader_obj);
+}
+
+static size_t capture_memsize(const void *ptr) {
+	const capture_stream *s = (const capture_stream*) ptr;
+	size_t size = sizeof(capture_stream) + s->slot_cnt * sizeof(capture_frame);
+
+	for(unsigned int i = 0; i < s->slot_cnt; i++) {
+		size += s->slots[i].capa;
+	}
+	size += s->best.capa + s->pending.capa;
+	for(unsigned int i = 0; i < s->template_cnt; i++) {
+		size += s->templates[(s->template_head + i) % CAPTURE_RESULTS].size;
+	}
+
+	return size;
+}
+
+static const rb_data_type_t capture_type = {
+	"KeyMe::Fingerprint::CaptureStream",
+	{ capture_mark, capture_free, capture_memsize, },
+	NULL, NULL,
+	RUBY_TYPED_FREE_IMMEDIATELY,
+};
+
+static capture_stream *get_capture_stream(VALUE obj) {
+	capture_stream *s;
+
+	TypedData_Get_Struct(obj, capture_stream, &capture_type, s);
+
+	return s;
+}
+
+static VALUE capture_alloc(VALUE klass) {
+	capture_stream *s;
+	VALUE obj = TypedData_Make_Struct(klass, capture_stream, &capture_type, s);
+	pthread_condattr_t attr;
+
+	s->reader_obj = Qnil;
+	pthread_mutex_init(&s->lock, NULL);
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&s->changed, &attr);
+	pthread_condattr_destroy(&attr);
+
+	return obj;
+}
+
+static void *start_stream_without_gvl(void *ptr) {
+	capture_stream *s = (capture_stream*) ptr;
+
+	s->rc = reader_ready(s->r, &s->call);
+	if(s->rc == DPFPDD_SUCCESS) {
+		s->rc = s->r->ops->start_stream(s->r);
+		s->call = "dpfpdd_start_stream";
+	}
+
+	return NULL;
+}
+
+/* Starts a thread with every signal blocked, as the pool does. */
+static int capture_thread_start(pthread_t *thread, void *(*func)(void*), void *arg) {
+	sigset_t all, old;
+	int rc;
+
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	rc = pthread_create(thread, NULL, func, arg);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+	return rc == 0;
+}
+
+static void capture_spawn(capture_stream *s) {
+	void *(*stages[3])(void*) = { capture_producer, capture_selector, capture_extractor };
+
+	for(unsigned int i = 0; i < 3; i++) {
+		if(!capture_thread_start(&s->threads[i], stages[i], s)) {
+			break;
+		}
+		s->thread_cnt++;
+	}
+}
+
+/*
+ * KeyMe::Fingerprint::CaptureStream.new(reader, dpi: 500, format: FMD_ANSI_378_2004, window: 5, slots: 4)
+ *
+ * Puts reader into streaming mode and starts extracting one template per
+ * touch, from the best of the window frames that start with the first
+ * good one. The reader is this stream's until it is stopped.
+ */
+VALUE capture_initialize(int argc, VALUE *argv, VALUE self) {
+	VALUE reader_obj, opts;
+	ID keys[4];
+	VALUE values[4];
+	capture_stream *s = get_capture_stream(self);
+	unsigned int slot_cnt;
+	int allocated;
+
+	rb_scan_args(argc, argv, "1:", &reader_obj, &opts);
+	if(s->r) {
+		rb_raise(rb_eFingerprintError, "capture stream already started");
+	}
+
+	keys[0] = rb_intern("dpi");
+	keys[1] = rb_intern("format");
+	keys[2] = rb_intern("window");
+	keys[3] = rb_intern("slots");
+	rb_get_kwargs(opts, keys, 0, 4, values);
+
+	s->param.size = sizeof(s->param);
+	s->param.image_fmt = DPFPDD_IMG_FMT_PIXEL_BUFFER;
+	s->param.image_proc = DPFPDD_IMG_PROC_NONE;
+	s->param.image_res = values[0] == Qundef ? DEFAULT_READER_DPI : NUM2UINT(values[0]);
+	s->format = values[1] == Qundef ? DEFAULT_FMD_FORMAT : NUM2INT(values[1]);
+	s->window = values[2] == Qundef ? DEFAULT_CAPTURE_WINDOW : NUM2UINT(values[2]);
+	slot_cnt = values[3] == Qundef ? DEFAULT_CAPTURE_SLOTS : NUM2UINT(values[3]);
+	if(s->window < 1 || slot_cnt < 1) {
+		rb_raise(rb_eArgError, "window and slots must be positive");
+	}
+
+	capture_frames_free(s);
+	s->slots = ZALLOC_N(capture_frame, slot_cnt);
+	s->slot_cnt = slot_cnt;
+	s->r = reader_claim(reader_obj);
+	s->reader_obj = reader_obj;
+	s->armed = 1;
+
+	/* From here on the reader is released before anything is raised. */
+	allocated = capture_frame_alloc(s->r, &s->best) && capture_frame_alloc(s->r, &s->pending);
+	for(unsigned int i = 0; allocated && i < slot_cnt; i++) {
+		allocated = capture_frame_alloc(s->r, &s->slots[i]);
+	}
+	if(!allocated) {
+		capture_frames_free(s);
+		capture_release(s);
+		rb_raise(rb_eNoMemError, "could not allocate capture buffers");
+	}
+
+	buffer_account();
+
+	/*
+	 * Not run at all if an interrupt is already pending, leaving call
+	 * unset; see capture_pop. Interrupts are checked only once the
+	 * reader is handed back, or the stream is running and its own.
+	 */
+	s->rc = DPFPDD_E_FAILURE;
+	s->call = NULL;
+	stats_without_gvl2(start_stream_without_gvl, s, NULL, NULL);
+	if(s->rc != DPFPDD_SUCCESS) {
+		int rc = s->rc;
+		const char *call = s->call;
+
+		s->rc = 0;
+		s->call = NULL;
+		capture_release(s);
+		rb_thread_check_ints();
+		if(!call) {
+			rb_raise(rb_eFingerprintError, "interrupted before streaming started");
+		}
+		check_dpfj(rc, call);
+	}
+
+	s->running = 1;
+	capture_spawn(s);
+	if(s->thread_cnt < 3) {
+		capture_stop_threads(s);
+		s->running = 0;
+		capture_release(s);
+		rb_raise(rb_eFingerprintError, "could not start capture threads");
+	}
+	rb_thread_check_ints();
+
+	return self;
+}
+
+typedef struct pop_args {
+	capture_stream *s;
+	struct timespec deadline;
+	int timed;
+	int interrupted;
+	int waited;
+	int found;
+	capture_template t;
+} pop_args;
+
+static void *pop_without_gvl(void *ptr) {
+	pop_args *args = (pop_args*) ptr;
+	capture_stream *s = args->s;
+
+	pthread_mutex_lock(&s->lock);
+	args->waited = 1;
+	while(!s->template_cnt && !s->stopping && !args->interrupted) {
+		if(!args->timed) {
+			pthread_cond_wait(&s->changed, &s->lock);
+		} else if(pthread_cond_timedwait(&s->changed, &s->lock, &args->deadline) == ETIMEDOUT) {
+			break;
+		}
+	}
+	if(s->template_cnt) {
+		args->t = s->templates[s->template_head];
+		s->template_head = (s->template_head + 1) % CAPTURE_RESULTS;
+		s->template_cnt--;
+		args->found = 1;
+	}
+	pthread_mutex_unlock(&s->lock);
+
+	return NULL;
+}
+
+static void pop_ubf(void *ptr) {
+	pop_args *args = (pop_args*) ptr;
+
+	pthread_mutex_lock(&args->s->lock);
+	args->interrupted = 1;
+	pthread_cond_broadcast(&args->s->changed);
+	pthread_mutex_unlock(&args->s->lock);
+}
+
+/*
+ * Waits up to timeout seconds, or for ever when nil, for the next
+ * template. Returns nil on timeout or once the stream has stopped and
+ * every template has been taken; raises if it stopped on a reader error.
+ */
+VALUE capture_pop(int argc, VALUE *argv, VALUE self) {
+	VALUE timeout, result = Qnil;
+	capture_stream *s = get_capture_stream(self);
+	pop_args args;
+
+	rb_scan_args(argc, argv, "01", &timeout);
+
+	args.s = s;
+	args.found = 0;
+	args.timed = !NIL_P(timeout);
+	if(args.timed) {
+		double seconds = NUM2DBL(timeout);
+
+		clock_gettime(CLOCK_MONOTONIC, &args.deadline);
+		args.deadline.tv_sec += (time_t) seconds;
+		args.deadline.tv_nsec += (long) ((seconds - (time_t) seconds) * 1e9);
+		if(args.deadline.tv_nsec >= 1000000000) {
+			args.deadline.tv_sec++;
+			args.deadline.tv_nsec -= 1000000000;
+		}
+	}
+
+	if(!s->slots) {
+		return Qnil;
+	}
+
+	/*
+	 * The _gvl2 variant leaves pending interrupts to us, so a template
+	 * taken just as one arrives is not lost. It does not run the wait at
+	 * all if one is already pending; that counts as interrupted.
+	 */
+	do {
+		args.interrupted = 0;
+		args.waited = 0;
+		rb_thread_call_without_gvl2(pop_without_gvl, &args, pop_ubf, &args);
+		if(args.found) {
+			result = rb_obj_freeze(rb_str_new((char*) args.t.fmd, args.t.size));
+			buffer_put(args.t.fmd);
+		}
+		rb_thread_check_ints();
+	} while(!args.found && (args.interrupted || !args.waited));
+	buffer_account();
+
+	if(!args.found) {
+		if(s->rc != DPFPDD_SUCCESS) {
+			check_dpfj(s->rc, s->call);
+		}
+		return Qnil;
+	}
+
+	return result;
+}
+
+/*
+ * Stops the threads and streaming and hands the reader back. Templates
+ * already extracted can still be popped. Returns self.
+ */
+VALUE capture_stop(VALUE self) {
+	capture_stream *s = get_capture_stream(self);
+
+	if(!s->running) {
+		return self;
+	}
+
+	s->running = 0;
+	capture_stop_threads(s);
+	capture_release(s);
+	rb_thread_check_ints();
+
+	return self;
+}
+
+VALUE capture_running_p(VALUE self) {
+	capture_stream *s = get_capture_stream(self);
+	int running;
+
+	pthread_mutex_lock(&s->lock);
+	running = s->running && !s->stopping;
+	pthread_mutex_unlock(&s->lock);
+
+	return running ? Qtrue : Qfalse;
+}
+
+/*
+ * Frame and template counts so far: frames streamed, good frames, frames
+ * selected, templates extracted, extractions failed and templates dropped
+ * because nobody popped them.
+ */
+VALUE capture_stats(VALUE self) {
+	capture_stream *s = get_capture_stream(self);
+	unsigned long long counts[6];
+	VALUE result = rb_hash_new();
+
+	pthread_mutex_lock(&s->lock);
+	counts[0] = s->frames;
+	counts[1] = s->good;
+	counts[2] = s->selected;
+	counts[3] = s->extracted;
+	counts[4] = s->failed;
+	counts[5] = s->dropped;
+	pthread_mutex_unlock(&s->lock);
+
+	rb_hash_aset(result, ID2SYM(rb_intern("frames")), ULL2NUM(counts[0]));
+	rb_hash_aset(result, ID2SYM(rb_intern("good")), ULL2NUM(counts[1]));
+	rb_hash_aset(result, ID2SYM(rb_intern("selected")), ULL2NUM(counts[2]));
+	rb_hash_aset(result, ID2SYM(rb_intern("extracted")), ULL2NUM(counts[3]));
+	rb_hash_aset(result, ID2SYM(rb_intern("failed")), ULL2NUM(counts[4]));
+	rb_hash_aset(result, ID2SYM(rb_intern("dropped")), ULL2NUM(counts[5]));
+
+	return result;
+}
+
+/* Capture and verify */
+
+/*
+ * One capture_and_verify: the caller's thread captures while a verifier
+ * thread extracts and compares the last good frame, so each frame is
+ * checked while the next is being captured. Frames change hands by
+ * swapping buffers: the capturer owns live, the verifier owns checked,
+ * and pending is the newest good frame not yet taken, replaced if the
+ * verifier falls behind.
+ *
+ * lock guards everything from pending down; changed is broadcast on every
+ * change. capturing is set while the capturer is inside a capture, which
+ * is how a match or an interrupt knows to cancel it.
+ */
+typedef struct live_verify {
+	reader *r;
+	DPFPDD_CAPTURE_PARAM param;
+	DPFJ_FMD_FORMAT format;
+	unsigned char *enrolled;
+	unsigned int enrolled_len;
+	unsigned int threshold;
+	double start;
+	double deadline;
+
+	capture_frame live;
+	double live_seconds;
+	capture_frame checked;
+	double checked_seconds;
+
+	pthread_mutex_t lock;
+	pthread_cond_t changed;
+	capture_frame pending;
+	double pending_seconds;
+	int have_pending;
+	int capturing;
+	int done;
+	int interrupted;
+	int matched;
+	int rc;
+	const char *call;
+
+	unsigned int frames;
+	unsigned int verified;
+	unsigned int score;
+	double capture_seconds;
+	double extract_seconds;
+	double compare_seconds;
+	double total_seconds;
+} live_verify;
+
+/* Cancels the capture in progress until the capturer has noticed. */
+static void live_cancel(live_verify *v) {
+	while(v->capturing) {
+		struct timespec retry;
+
+		pthread_mutex_unlock(&v->lock);
+		v->r->ops->cancel(v->r);
+		pthread_mutex_lock(&v->lock);
+
+		clock_gettime(CLOCK_MONOTONIC, &retry);
+		retry.tv_nsec += 1000000;
+		if(retry.tv_nsec >= 1000000000) {
+			retry.tv_sec++;
+			retry.tv_nsec -= 1000000000;
+		}
+		if(v->capturing) {
+			pthread_cond_timedwait(&v->changed, &v->lock, &retry);
+		}
+	}
+}
+
+static void *live_verifier(void *ptr) {
+	live_verify *v = (live_verify*) ptr;
+	unsigned char *fmd = (unsigned char*) buffer_get(MAX_FMD_SIZE);
+
+	pthread_mutex_lock(&v->lock);
+	while(fmd) {
+		DPFPDD_IMAGE_INFO *info;
+		unsigned int size = MAX_FMD_SIZE, score;
+		double t0, t1, t2;
+		int rc;
+
+		while(!v->done && !v->have_pending) {
+			pthread_cond_wait(&v->changed, &v->lock);
+		}
+		if(!v->have_pending || v->interrupted) {
+			break;
+		}
+
+		capture_frame_swap(&v->pending, &v->checked);
+		v->checked_seconds = v->pending_seconds;
+		v->have_pending = 0;
+		pthread_mutex_unlock(&v->lock);
+
+		info = &v->checked.result.info;
+		t0 = reader_now();
+		rc = dpfj_create_fmd_from_raw(
+			v->checked.image, v->checked.size,
+			info->width, info->height, info->res,
+			DPFJ_POSITION_UNKNOWN, 0,
+			v->format, fmd, &size
+		);
+		t1 = reader_now();
+		if(rc == DPFJ_SUCCESS) {
+			rc = dpfj_compare(
+				v->format, v->enrolled, v->enrolled_len, 0,
+				v->format, fmd, size, 0,
+				&score
+			);
+		}
+		t2 = reader_now();
+		if(stats_enabled) {
+			stats_record(STATS_EXTRACT, (uint64_t) ((t1 - t0) * 1e9));
+			stats_record(STATS_MATCH, (uint64_t) ((t2 - t1) * 1e9));
+		}
+
+		pthread_mutex_lock(&v->lock);
+		if(rc != DPFJ_SUCCESS) {
+			/* A frame too poor to extract is skipped; the next may do. */
+			continue;
+		}
+
+		v->verified++;
+		v->capture_seconds = v->checked_seconds;
+		v->extract_seconds = t1 - t0;
+		v->compare_seconds = t2 - t1;
+		v->total_seconds = t2 - v->start;
+		if(v->verified == 1 || score < v->score) {
+			v->score = score;
+		}
+		if(score < v->threshold) {
+			v->matched = 1;
+			v->done = 1;
+			pthread_cond_broadcast(&v->changed);
+			live_cancel(v);
+			break;
+		}
+	}
+	pthread_mutex_unlock(&v->lock);
+	buffer_put(fmd);
+
+	return NULL;
+}
+
+static void *live_verify_without_gvl(void *ptr) {
+	live_verify *v = (live_verify*) ptr;
+	pthread_t verifier;
+
+	v->rc = reader_ready(v->r, &v->call);
+	if(v->rc != DPFPDD_SUCCESS) {
+		return NULL;
+	}
+	if(!capture_thread_start(&verifier, live_verifier, v)) {
+		v->rc = DPFPDD_E_FAILURE;
+		v->call = "pthread_create";
+		return NULL;
+	}
+
+	pthread_mutex_lock(&v->lock);
+	for(;;) {
+		double now = reader_now(), t0;
+		int rc;
+
+		if(v->done || now >= v->deadline) {
+			break;
+		}
+		v->capturing = 1;
+		pthread_mutex_unlock(&v->lock);
+
+		t0 = reader_now();
+		rc = capture_frame_read(v->r, &v->param, 0, (unsigned int) ((v->deadline - now) * 1000) + 1, &v->live);
+		v->live_seconds = reader_now() - t0;
+
+		pthread_mutex_lock(&v->lock);
+		v->capturing = 0;
+		pthread_cond_broadcast(&v->changed);
+		if(rc != DPFPDD_SUCCESS) {
+			v->rc = rc;
+			v->call = "dpfpdd_capture";
+			break;
+		}
+		if(v->done || v->live.result.quality == DPFPDD_QUALITY_CANCELED || v->live.result.quality == DPFPDD_QUALITY_TIMED_OUT) {
+			break;
+		}
+
+		v->frames++;
+		if(v->live.result.quality == DPFPDD_QUALITY_GOOD) {
+			capture_frame_swap(&v->live, &v->pending);
+			v->pending_seconds = v->live_seconds;
+			v->have_pending = 1;
+		}
+	}
+	v->done = 1;
+	pthread_cond_broadcast(&v->changed);
+	pthread_mutex_unlock(&v->lock);
+
+	pthread_join(verifier, NULL);
+	if(!v->matched) {
+		v->total_seconds = reader_now() - v->start;
+	}
+
+	return NULL;
+}
+
+static void live_verify_ubf(void *ptr) {
+	live_verify *v = (live_verify*) ptr;
+	int capturing;
+
+	pthread_mutex_lock(&v->lock);
+	v->interrupted = 1;
+	v->done = 1;
+	capturing = v->capturing;
+	pthread_cond_broadcast(&v->changed);
+	pthread_mutex_unlock(&v->lock);
+
+	/* Called again and again until the interrupt is taken, so no retry. */
+	if(capturing) {
+		v->r->ops->cancel(v->r);
+	}
+}
+
+/*
+ * KeyMe::Fingerprint.capture_and_verify(reader, enrolled, timeout: 10, threshold:, fmr:, dpi: 500, format: FMD_ANSI_378_2004)
+ *
+ * Captures from reader until a frame matches enrolled or timeout seconds
+ * pass. Each good frame is extracted and compared while the next one is
+ * captured, and the capture in flight is cancelled as soon as one
+ * matches. Returns a Hash of match, the best score, frames captured,
+ * frames verified, and latency: the capture, extract and compare seconds
+ * of the deciding frame (the last one verified if none matched) and the
+ * total from the call to the decision.
+ */
+VALUE capture_and_verify_wrapper(int argc, VALUE *argv, VALUE self) {
+	VALUE reader_obj, enrolled, opts, pinned, result, latency;
+	ID keys[5];
+	VALUE values[5];
+	live_verify v;
+	double timeout;
+	pthread_condattr_t attr;
+
+	rb_scan_args(argc, argv, "2:", &reader_obj, &enrolled, &opts);
+
+	keys[0] = rb_intern("timeout");
+	keys[1] = rb_intern("threshold");
+	keys[2] = rb_intern("fmr");
+	keys[3] = rb_intern("dpi");
+	keys[4] = rb_intern("format");
+	rb_get_kwargs(opts, keys, 0, 5, values);
+
+	memset(&v, 0, sizeof(v));
+	timeout = values[0] == Qundef ? 10.0 : NUM2DBL(values[0]);
+	if(values[1] != Qundef) {
+		v.threshold = NUM2UINT(values[1]);
+	} else if(values[2] != Qundef) {
+		v.threshold = fmr_threshold(values[2]);
+	} else {
+		v.threshold = DEFAULT_THRESHOLD;
+	}
+	v.param.size = sizeof(v.param);
+	v.param.image_fmt = DPFPDD_IMG_FMT_PIXEL_BUFFER;
+	v.param.image_proc = DPFPDD_IMG_PROC_NONE;
+	v.param.image_res = values[3] == Qundef ? DEFAULT_READER_DPI : NUM2UINT(values[3]);
+	v.format = values[4] == Qundef ? DEFAULT_FMD_FORMAT : NUM2INT(values[4]);
+
+	pinned = print_pin(enrolled, &v.enrolled, &v.enrolled_len);
+	v.r = reader_claim(reader_obj);
+	if(!capture_frame_alloc(v.r, &v.live) || !capture_frame_alloc(v.r, &v.checked) || !capture_frame_alloc(v.r, &v.pending)) {
+		buffer_put(v.live.image);
+		buffer_put(v.checked.image);
+		buffer_put(v.pending.image);
+		reader_unclaim(v.r);
+		rb_raise(rb_eNoMemError, "could not allocate capture buffers");
+	}
+
+	pthread_mutex_init(&v.lock, NULL);
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&v.changed, &attr);
+	pthread_condattr_destroy(&attr);
+
+	v.start = reader_now();
+	v.deadline = v.start + timeout;
+	v.rc = DPFPDD_E_FAILURE;
+	v.call = "dpfpdd_capture";
+	rb_thread_call_without_gvl2(live_verify_without_gvl, &v, live_verify_ubf, &v);
+
+	reader_unclaim(v.r);
+	buffer_put(v.live.image);
+	buffer_put(v.checked.image);
+	buffer_put(v.pending.image);
+	buffer_account();
+	pthread_mutex_destroy(&v.lock);
+	pthread_cond_destroy(&v.changed);
+
+	RB_GC_GUARD(pinned);
+
+	/* Raised only now, with the reader given back; see capture_pop. */
+	rb_thread_check_ints();
+	if(v.rc != DPFPDD_SUCCESS) {
+		check_dpfj(v.rc, v.call);
+	}
+
+	latency = rb_hash_new();
+	rb_hash_aset(latency, ID2SYM(rb_intern("capture")), DBL2NUM(v.capture_seconds));
+	rb_hash_aset(latency, ID2SYM(rb_intern("extract")), DBL2NUM(v.extract_seconds));
+	rb_hash_aset(latency, ID2SYM(rb_intern("compare")), DBL2NUM(v.compare_seconds));
+	rb_hash_aset(latency, ID2SYM(rb_intern("total")), DBL2NUM(v.total_seconds));
+
+	result = rb_hash_new();
+	rb_hash_aset(result, ID2SYM(rb_intern("match")), v.matched ? Qtrue : Qfalse);
+	rb_hash_aset(result, ID2SYM(rb_intern("score")), v.verified ? UINT2NUM(v.score) : Qnil);
+	rb_hash_aset(result, ID2SYM(rb_intern("frames")), UINT2NUM(v.frames));
+	rb_hash_aset(result, ID2SYM(rb_intern("verified")), UINT2NUM(v.verified));
+	rb_hash_aset(result, ID2SYM(rb_intern("latency")), latency);
+
+	return result;
+}
+
+void Init_capture() {
+	rb_cCaptureStream = rb_define_class_under(
+		rb_mFingerprint,
+		"CaptureStream",
+		rb_cObject
+	);
+	rb_define_alloc_func(rb_cCaptureStream, capture_alloc);
+
+	rb_define_method(rb_cCaptureStream, "initialize", RUBY_METHOD_FUNC(capture_initialize), -1);
+	rb_define_method(rb_cCaptureStream, "pop", RUBY_METHOD_FUNC(capture_pop), -1);
+	rb_define_method(rb_cCaptureStream, "stop", RUBY_METHOD_FUNC(capture_stop), 0);
+	rb_define_method(rb_cCaptureStream, "running?", RUBY_METHOD_FUNC(capture_running_p), 0);
+	rb_define_method(rb_cCaptureStream, "stats", RUBY_METHOD_FUNC(capture_stats), 0);
+
+	rb_define_singleton_method(
+		rb_mFingerprint,
+		"capture_and_verify",
+		RUBY_METHOD_FUNC(capture_and_verify_wrapper),
+		-1
+	);
+}
@@ -0,0 +1,86 @@
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <pthread.h>
+
+#include "reader.h"
+
+#define CAPTURE_RESULTS 8
+
+typedef struct capture_frame {
+	unsigned char *image;
+	unsigned int capa;
+	unsigned int size;
+	DPFPDD_CAPTURE_RESULT result;
+} capture_frame;
+
+typedef struct capture_template {
+	unsigned char *fmd;
+	unsigned int size;
+	unsigned int score;
+} capture_template;
+
+/*
+ * A streaming capture pipeline: three native threads, each handing the
+ * next a frame by swapping image buffers, so nothing is copied or
+ * allocated once every buffer has grown to the reader's image size.
+ *
+ *   producer   pulls frames off the stream into slots, a ring of
+ *              slot_cnt frames, waiting while the ring is full
+ *   selector   keeps the best-scoring DPFPDD_QUALITY_GOOD frame of the
+ *              window frames that start with the first good one, then
+ *              hands it to the extractor as pending; one per touch, so
+ *              it waits for a frame that is not good before the next
+ *   extractor  turns pending into an FMD on the templates ring, which
+ *              drops its oldest when Ruby falls behind
+ *
+ * lock guards everything below it and changed is broadcast on every
+ * change. The threads never touch Ruby objects.
+ */
+typedef struct capture_stream {
+	reader *r;
+	VALUE reader_obj;
+	DPFPDD_CAPTURE_PARAM param;
+	DPFJ_FMD_FORMAT format;
+	unsigned int window;
+
+	pthread_mutex_t lock;
+	pthread_cond_t changed;
+	pthread_t threads[3];
+	unsigned int thread_cnt;
+
+	capture_frame *slots;
+	unsigned int slot_cnt;
+	unsigned long long head;
+	unsigned long long tail;
+
+	capture_frame best;
+	int have_best;
+	int armed;
+	unsigned int seen;
+
+	capture_frame pending;
+	int have_pending;
+
+	capture_template templates[CAPTURE_RESULTS];
+	unsigned int template_head;
+	unsigned int template_cnt;
+
+	int running;
+	int stopping;
+	int rc;
+	const char *call;
+
+	unsigned long long frames;
+	unsigned long long good;
+	unsigned long long selected;
+	unsigned long long extracted;
+	unsigned long long failed;
+	unsigned long long dropped;
+} capture_stream;
+
+extern VALUE rb_cCaptureStream;
+
+void Init_capture();
+
+#endif
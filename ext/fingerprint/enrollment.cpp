@@ -0,0 +1,257 @@
+#include <pthread.h>
+#include <string.h>
+
+#include "enrollment.h"
+#include "stats.h"
+
+#define ENROLLMENT_ALIGN 8
+
+VALUE rb_cEnrollmentSession;
+
+/* Held across a whole replay: dpfj has one enrollment slot per process. */
+static pthread_mutex_t enrollment_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void enrollment_free(void *ptr) {
+	enrollment *e = (enrollment*) ptr;
+
+	xfree(e->buf);
+	xfree(e->scans);
+	xfree(e);
+}
+
+static size_t enrollment_memsize(const void *ptr) {
+	const enrollment *e = (const enrollment*) ptr;
+
+	return sizeof(enrollment) + e->buf_capa + e->scan_capa * sizeof(enrollment_scan);
+}
+
+static const rb_data_type_t enrollment_type = {
+	"KeyMe::Fingerprint::EnrollmentSession",
+	{ NULL, enrollment_free, enrollment_memsize, },
+	NULL, NULL,
+	RUBY_TYPED_FREE_IMMEDIATELY,
+};
+
+static enrollment *get_enrollment(VALUE obj) {
+	enrollment *e;
+
+	TypedData_Get_Struct(obj, enrollment, &enrollment_type, e);
+
+	return e;
+}
+
+static enrollment *get_idle_enrollment(VALUE obj) {
+	enrollment *e = get_enrollment(obj);
+
+	if(e->busy) {
+		rb_raise(rb_eFingerprintError, "enrollment session is being finalized");
+	}
+
+	return e;
+}
+
+static VALUE enrollment_alloc(VALUE klass) {
+	enrollment *e;
+	VALUE obj = TypedData_Make_Struct(klass, enrollment, &enrollment_type, e);
+
+	e->format = DEFAULT_FMD_FORMAT;
+
+	return obj;
+}
+
+/*
+ * KeyMe::Fingerprint::EnrollmentSession.new(format = FMD_ANSI_378_2004)
+ *
+ * Scans are added in format and the enrolled FMD comes back in it too.
+ */
+VALUE enrollment_initialize(int argc, VALUE *argv, VALUE self) {
+	VALUE format;
+	enrollment *e = get_enrollment(self);
+
+	rb_scan_args(argc, argv, "01", &format);
+	if(!NIL_P(format)) {
+		e->format = NUM2INT(format);
+	}
+
+	return self;
+}
+
+/*
+ * Buffers a copy of fmd for the next finalize. Returns the number of scans
+ * buffered so far.
+ */
+VALUE enrollment_add(int argc, VALUE *argv, VALUE self) {
+	VALUE fmd, view;
+	enrollment *e = get_idle_enrollment(self);
+	enrollment_scan *scan;
+	unsigned char *data;
+	unsigned int len, view_index;
+	size_t need;
+
+	/* Everything that can raise comes before the scan is recorded. */
+	rb_scan_args(argc, argv, "11", &fmd, &view);
+	view_index = NIL_P(view) ? 0 : NUM2UINT(view);
+	print_data(fmd, &data, &len);
+
+	need = e->buf_len + ((len + ENROLLMENT_ALIGN - 1) & ~(ENROLLMENT_ALIGN - 1));
+	if(need > e->buf_capa) {
+		size_t capa = e->buf_capa ? e->buf_capa : 4 * MAX_FMD_SIZE;
+
+		while(capa < need) {
+			capa *= 2;
+		}
+		REALLOC_N(e->buf, unsigned char, capa);
+		e->buf_capa = capa;
+	}
+	if(e->scan_cnt == e->scan_capa) {
+		e->scan_capa = e->scan_capa ? e->scan_capa * 2 : 4;
+		REALLOC_N(e->scans, enrollment_scan, e->scan_capa);
+	}
+
+	scan = &e->scans[e->scan_cnt];
+	scan->offset = e->buf_len;
+	scan->size = len;
+	scan->view = view_index;
+
+	memcpy(e->buf + scan->offset, data, len);
+	e->buf_len = need;
+	e->scan_cnt++;
+
+	return UINT2NUM(e->scan_cnt);
+}
+
+typedef struct enrollment_args {
+	enrollment *e;
+	int ready;
+	int rc;
+	const char *call;
+	unsigned char fmd[MAX_FMD_SIZE];
+	unsigned int fmd_size;
+} enrollment_args;
+
+/*
+ * Feeds the buffered scans to dpfj until it reports enough of them, then
+ * builds the enrollment FMD. Anything left in progress when enrollment_lock
+ * is free is stale (a fork taken mid-replay), so it is finished and
+ * restarted rather than reported.
+ */
+static void *enrollment_replay_without_gvl(void *ptr) {
+	enrollment_args *args = (enrollment_args*) ptr;
+	enrollment *e = args->e;
+
+	pthread_mutex_lock(&enrollment_lock);
+
+	args->call = "dpfj_start_enrollment";
+	args->rc = dpfj_start_enrollment(e->format);
+	if(args->rc == DPFJ_E_ENROLLMENT_IN_PROGRESS) {
+		dpfj_finish_enrollment();
+		args->rc = dpfj_start_enrollment(e->format);
+	}
+	if(args->rc != DPFJ_SUCCESS) {
+		pthread_mutex_unlock(&enrollment_lock);
+		return NULL;
+	}
+
+	args->call = "dpfj_add_to_enrollment";
+	for(unsigned int i = 0; i < e->scan_cnt && !args->ready; i++) {
+		enrollment_scan *scan = &e->scans[i];
+
+		args->rc = dpfj_add_to_enrollment(
+			e->format, e->buf + scan->offset, scan->size, scan->view
+		);
+		if(args->rc == DPFJ_SUCCESS) {
+			args->ready = 1;
+		} else if(args->rc != DPFJ_E_MORE_DATA) {
+			break;
+		}
+	}
+
+	if(args->ready) {
+		args->call = "dpfj_create_enrollment_fmd";
+		args->fmd_size = MAX_FMD_SIZE;
+		args->rc = dpfj_create_enrollment_fmd(args->fmd, &args->fmd_size);
+	} else if(args->rc == DPFJ_E_MORE_DATA) {
+		args->rc = DPFJ_SUCCESS;
+	}
+
+	dpfj_finish_enrollment();
+	pthread_mutex_unlock(&enrollment_lock);
+
+	return NULL;
+}
+
+static VALUE enrollment_replay(VALUE ptr) {
+	stats_without_gvl(enrollment_replay_without_gvl, (void*) ptr, NULL, NULL);
+
+	return Qnil;
+}
+
+static VALUE enrollment_release(VALUE ptr) {
+	((enrollment_args*) ptr)->e->busy = 0;
+
+	return Qnil;
+}
+
+/*
+ * Replays the buffered scans through dpfj's enrollment and returns the
+ * enrolled FMD as a frozen binary String, or nil if dpfj wants more scans.
+ * The scans stay buffered either way. Only the replay itself is
+ * serialized across sessions.
+ */
+VALUE enrollment_finalize(VALUE self) {
+	enrollment_args args;
+
+	args.e = get_idle_enrollment(self);
+	args.ready = 0;
+	args.rc = DPFJ_SUCCESS;
+	args.call = NULL;
+
+	args.e->busy = 1;
+	rb_ensure(enrollment_replay, (VALUE) &args, enrollment_release, (VALUE) &args);
+
+	check_dpfj(args.rc, args.call);
+	if(!args.ready) {
+		return Qnil;
+	}
+
+	return rb_obj_freeze(rb_str_new((char*) args.fmd, args.fmd_size));
+}
+
+VALUE enrollment_clear(VALUE self) {
+	enrollment *e = get_idle_enrollment(self);
+
+	e->buf_len = 0;
+	e->scan_cnt = 0;
+
+	return self;
+}
+
+VALUE enrollment_size(VALUE self) {
+	return UINT2NUM(get_enrollment(self)->scan_cnt);
+}
+
+VALUE enrollment_format(VALUE self) {
+	return INT2NUM(get_enrollment(self)->format);
+}
+
+static void enrollment_atfork_child() {
+	pthread_mutex_init(&enrollment_lock, NULL);
+}
+
+void Init_enrollment() {
+	pthread_atfork(NULL, NULL, enrollment_atfork_child);
+
+	rb_cEnrollmentSession = rb_define_class_under(
+		rb_mFingerprint,
+		"EnrollmentSession",
+		rb_cObject
+	);
+	rb_define_alloc_func(rb_cEnrollmentSession, enrollment_alloc);
+
+	rb_define_method(rb_cEnrollmentSession, "initialize", RUBY_METHOD_FUNC(enrollment_initialize), -1);
+	rb_define_method(rb_cEnrollmentSession, "add", RUBY_METHOD_FUNC(enrollment_add), -1);
+	rb_define_method(rb_cEnrollmentSession, "finalize", RUBY_METHOD_FUNC(enrollment_finalize), 0);
+	rb_define_method(rb_cEnrollmentSession, "clear", RUBY_METHOD_FUNC(enrollment_clear), 0);
+	rb_define_method(rb_cEnrollmentSession, "size", RUBY_METHOD_FUNC(enrollment_size), 0);
+	rb_define_method(rb_cEnrollmentSession, "format", RUBY_METHOD_FUNC(enrollment_format), 0);
+}
@@ -0,0 +1,38 @@
+#ifndef ENROLLMENT_H
+#define ENROLLMENT_H
+
+#include "fingerprint.h"
+
+typedef struct enrollment_scan {
+	size_t offset;
+	unsigned int size;
+	unsigned int view;
+} enrollment_scan;
+
+/*
+ * The scans of one enrollment, copied back to back into buf. dpfj keeps a
+ * single enrollment in progress per process, so sessions only buffer here
+ * and replay everything through it at once in finalize.
+ *
+ * busy is set, with the GVL held, while finalize reads buf without it;
+ * add and clear refuse to touch the buffer until it is cleared again.
+ */
+typedef struct enrollment {
+	DPFJ_FMD_FORMAT format;
+
+	unsigned char *buf;
+	size_t buf_len;
+	size_t buf_capa;
+
+	enrollment_scan *scans;
+	unsigned int scan_cnt;
+	unsigned int scan_capa;
+
+	int busy;
+} enrollment;
+
+extern VALUE rb_cEnrollmentSession;
+
+void Init_enrollment();
+
+#endif
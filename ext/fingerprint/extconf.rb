@@ -13,7 +13,8 @@ dir_config('', library_dir, library_dir)
 have_library('dpfj') or raise
 have_library('dpfpdd') or raise
 have_library('stdc++') or raise
+have_library('pthread') or raise
 
-$objs = ['fingerprint.o', 'compare/compare.o']
+$objs = ['buffer.o', 'cache.o', 'capture.o', 'enrollment.o', 'extract.o', 'fingerprint.o', 'gallery.o', 'index.o', 'loader.o', 'minutiae.o', 'pool.o', 'reader.o', 'snapshot.o', 'stats.o', 'store.o', 'synthetic.o', 'template.o', 'compare/compare.o']
 
 create_makefile('keyme/fingerprint')
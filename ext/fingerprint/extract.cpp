@@ -0,0 +1,262 @@
+#include <stdlib.h>
+
+#include "buffer.h"
+#include "extract.h"
+#include "stats.h"
+
+/*
+ * Every extraction writes into a pooled MAX_FMD_SIZE buffer taken for the
+ * call. dpfj treats fmd_size == 0 as a request to run the whole
+ * extraction just to report the size, so the buffer is always offered at
+ * full size instead. It is not per native thread: with M:N threads the
+ * thread that releases the GVL need not be the one that copies the FMD
+ * out afterwards.
+ */
+typedef struct extract_args {
+	void *(*func)(void*);
+	const char *call;
+	const unsigned char *image;
+	unsigned int image_size;
+	unsigned int width;
+	unsigned int height;
+	unsigned int dpi;
+	DPFJ_FINGER_POSITION position;
+	unsigned int cbeff_id;
+	DPFJ_FID_FORMAT fid_format;
+	DPFJ_FMD_FORMAT format;
+	unsigned char *fmd;
+	unsigned int fmd_size;
+	int rc;
+} extract_args;
+
+static void *extract_raw_without_gvl(void *ptr) {
+	extract_args *args = (extract_args*) ptr;
+	uint64_t start = stats_start();
+
+	args->fmd_size = MAX_FMD_SIZE;
+	args->rc = dpfj_create_fmd_from_raw(
+		args->image, args->image_size,
+		args->width, args->height, args->dpi,
+		args->position, args->cbeff_id,
+		args->format, args->fmd, &args->fmd_size
+	);
+	stats_since(STATS_EXTRACT, start);
+
+	return NULL;
+}
+
+static void *extract_fid_without_gvl(void *ptr) {
+	extract_args *args = (extract_args*) ptr;
+	uint64_t start = stats_start();
+
+	args->fmd_size = MAX_FMD_SIZE;
+	args->rc = dpfj_create_fmd_from_fid(
+		args->fid_format, args->image, args->image_size,
+		args->format, args->fmd, &args->fmd_size
+	);
+	stats_since(STATS_EXTRACT, start);
+
+	return NULL;
+}
+
+static VALUE extract_body(VALUE ptr) {
+	extract_args *args = (extract_args*) ptr;
+
+	stats_without_gvl(args->func, args, NULL, NULL);
+	check_dpfj(args->rc, args->call);
+
+	return rb_obj_freeze(rb_str_new((char*) args->fmd, args->fmd_size));
+}
+
+static VALUE extract_release(VALUE ptr) {
+	extract_args *args = (extract_args*) ptr;
+
+	buffer_put(args->fmd);
+	buffer_account();
+
+	return Qnil;
+}
+
+/* Runs func on a pooled buffer, handed back whatever raises. */
+static VALUE extract_run(extract_args *args, void *(*func)(void*), const char *call) {
+	args->func = func;
+	args->call = call;
+	args->fmd = (unsigned char*) buffer_get(MAX_FMD_SIZE);
+	if(!args->fmd) {
+		rb_raise(rb_eNoMemError, "failed to allocate memory");
+	}
+
+	return rb_ensure(extract_body, (VALUE) args, extract_release, (VALUE) args);
+}
+
+/*
+ * KeyMe::Fingerprint.extract_raw(image, width, height, dpi:, position:, cbeff_id:, format:)
+ *
+ * Extracts an FMD from an 8-bit, unpadded raw pixel buffer. Returns it as
+ * a frozen binary String.
+ */
+VALUE extract_raw_wrapper(int argc, VALUE *argv, VALUE self) {
+	VALUE image, width, height, opts, pinned, result;
+	ID keys[4];
+	VALUE values[4];
+	extract_args args;
+
+	rb_scan_args(argc, argv, "3:", &image, &width, &height, &opts);
+
+	keys[0] = rb_intern("dpi");
+	keys[1] = rb_intern("position");
+	keys[2] = rb_intern("cbeff_id");
+	keys[3] = rb_intern("format");
+	rb_get_kwargs(opts, keys, 0, 4, values);
+
+	args.width = NUM2UINT(width);
+	args.height = NUM2UINT(height);
+	args.dpi = values[0] == Qundef ? 500 : NUM2UINT(values[0]);
+	args.position = values[1] == Qundef ? DPFJ_POSITION_UNKNOWN : NUM2INT(values[1]);
+	args.cbeff_id = values[2] == Qundef ? 0 : NUM2UINT(values[2]);
+	args.format = values[3] == Qundef ? DEFAULT_FMD_FORMAT : NUM2INT(values[3]);
+
+	pinned = print_pin(image, (unsigned char**) &args.image, &args.image_size);
+
+	result = extract_run(&args, extract_raw_without_gvl, "dpfj_create_fmd_from_raw");
+
+	RB_GC_GUARD(pinned);
+
+	return result;
+}
+
+/*
+ * KeyMe::Fingerprint.extract_fid(fid, fid_format:, format:)
+ *
+ * Extracts an FMD from an ANSI 381 or ISO 19794-4 image record.
+ */
+VALUE extract_fid_wrapper(int argc, VALUE *argv, VALUE self) {
+	VALUE fid, opts, pinned, result;
+	ID keys[2];
+	VALUE values[2];
+	extract_args args;
+
+	rb_scan_args(argc, argv, "1:", &fid, &opts);
+
+	keys[0] = rb_intern("fid_format");
+	keys[1] = rb_intern("format");
+	rb_get_kwargs(opts, keys, 0, 2, values);
+
+	args.fid_format = values[0] == Qundef ? DPFJ_FID_ANSI_381_2004 : NUM2INT(values[0]);
+	args.format = values[1] == Qundef ? DEFAULT_FMD_FORMAT : NUM2INT(values[1]);
+
+	pinned = print_pin(fid, (unsigned char**) &args.image, &args.image_size);
+
+	result = extract_run(&args, extract_fid_without_gvl, "dpfj_create_fmd_from_fid");
+
+	RB_GC_GUARD(pinned);
+
+	return result;
+}
+
+typedef struct convert_args {
+	DPFJ_FMD_FORMAT from;
+	unsigned char *fmd;
+	unsigned int fmd_size;
+	DPFJ_FMD_FORMAT to;
+	unsigned char *out;
+	unsigned int out_size;
+	int rc;
+} convert_args;
+
+/*
+ * Single-view FMDs always fit the MAX_FMD_SIZE buffer. A larger
+ * multi-view one swaps it for a pooled buffer of the size dpfj reports
+ * back, so the conversion runs at most twice and only in that case.
+ */
+static void *convert_without_gvl(void *ptr) {
+	convert_args *args = (convert_args*) ptr;
+
+	args->out_size = MAX_FMD_SIZE;
+	args->rc = dpfj_fmd_convert(
+		args->from, args->fmd, args->fmd_size,
+		args->to, args->out, &args->out_size
+	);
+
+	if(args->rc == DPFJ_E_MORE_DATA) {
+		unsigned char *bigger = (unsigned char*) buffer_get(args->out_size);
+
+		if(!bigger) {
+			args->rc = DPFJ_E_FAILURE;
+			return NULL;
+		}
+		buffer_put(args->out);
+		args->out = bigger;
+		args->rc = dpfj_fmd_convert(
+			args->from, args->fmd, args->fmd_size,
+			args->to, args->out, &args->out_size
+		);
+	}
+
+	return NULL;
+}
+
+static VALUE convert_body(VALUE ptr) {
+	convert_args *args = (convert_args*) ptr;
+
+	stats_without_gvl(convert_without_gvl, args, NULL, NULL);
+	check_dpfj(args->rc, "dpfj_fmd_convert");
+
+	return rb_obj_freeze(rb_str_new((char*) args->out, args->out_size));
+}
+
+static VALUE convert_release(VALUE ptr) {
+	convert_args *args = (convert_args*) ptr;
+
+	buffer_put(args->out);
+	buffer_account();
+
+	return Qnil;
+}
+
+/*
+ * KeyMe::Fingerprint.convert(fmd, from, to)
+ */
+VALUE convert_wrapper(VALUE self, VALUE fmd, VALUE from, VALUE to) {
+	VALUE pinned, result;
+	convert_args args;
+
+	args.from = NUM2INT(from);
+	args.to = NUM2INT(to);
+
+	pinned = print_pin(fmd, &args.fmd, &args.fmd_size);
+
+	args.out = (unsigned char*) buffer_get(MAX_FMD_SIZE);
+	if(!args.out) {
+		rb_raise(rb_eNoMemError, "failed to allocate memory");
+	}
+	result = rb_ensure(convert_body, (VALUE) &args, convert_release, (VALUE) &args);
+
+	RB_GC_GUARD(pinned);
+
+	return result;
+}
+
+void Init_extract() {
+	rb_define_const(rb_mFingerprint, "FID_ANSI_381_2004", INT2NUM(DPFJ_FID_ANSI_381_2004));
+	rb_define_const(rb_mFingerprint, "FID_ISO_19794_4_2005", INT2NUM(DPFJ_FID_ISO_19794_4_2005));
+
+	rb_define_singleton_method(
+		rb_mFingerprint,
+		"extract_raw",
+		RUBY_METHOD_FUNC(extract_raw_wrapper),
+		-1
+	);
+	rb_define_singleton_method(
+		rb_mFingerprint,
+		"extract_fid",
+		RUBY_METHOD_FUNC(extract_fid_wrapper),
+		-1
+	);
+	rb_define_singleton_method(
+		rb_mFingerprint,
+		"convert",
+		RUBY_METHOD_FUNC(convert_wrapper),
+		3
+	);
+}
@@ -0,0 +1,8 @@
+#ifndef EXTRACT_H
+#define EXTRACT_H
+
+#include "fingerprint.h"
+
+void Init_extract();
+
+#endif
@@ -1,57 +1,980 @@
+#include <limits.h>
 #include <stdio.h>
+#include <string.h>
 
 #include "ruby.h"
 #include "compare/compare.h"
+#include "buffer.h"
+#include "cache.h"
+#include "capture.h"
+#include "enrollment.h"
+#include "extract.h"
+#include "fingerprint.h"
+#include "gallery.h"
+#include "loader.h"
+#include "minutiae.h"
+#include "pool.h"
+#include "reader.h"
+#include "snapshot.h"
+#include "stats.h"
+#include "store.h"
+#include "synthetic.h"
+#include "template.h"
 
-VALUE verify_user_wrapper(VALUE self, VALUE db_print, VALUE check_print) {
+VALUE rb_mKeyMe;
+VALUE rb_mFingerprint;
+VALUE rb_eFingerprintError;
+VALUE rb_sCandidate;
+
+void check_dpfj(int rc, const char *call) {
+	if(rc != DPFJ_SUCCESS) {
+		rb_raise(rb_eFingerprintError, "%s failed (0x%08x)", call, rc);
+	}
+}
+
+/*
+ * Prints are passed around as frozen binary Strings or as Templates. The
+ * matcher reads straight out of the String's or Template's buffer;
+ * nothing is copied.
+ */
+void print_data(VALUE print, unsigned char **data, unsigned int *len) {
+	if(is_template(print)) {
+		fmd_template *t = get_template(print);
+
+		*data = t->data;
+		*len = t->len;
+		return;
+	}
+
+	Check_Type(print, T_STRING);
+
+	*data = (unsigned char*) RSTRING_PTR(print);
+	*len = RSTRING_LEN(print);
+}
+
+/*
+ * Like print_data, but for buffers that are read with the GVL released.
+ * Returns a frozen String sharing print's buffer, so another thread
+ * mutating print cannot move the bytes out from under the matcher, or a
+ * Template itself, whose bytes never change. The caller keeps the
+ * returned VALUE on its stack for the duration.
+ */
+VALUE print_pin(VALUE print, unsigned char **data, unsigned int *len) {
+	VALUE pinned;
+
+	if(is_template(print)) {
+		print_data(print, data, len);
+		return print;
+	}
+
+	Check_Type(print, T_STRING);
+
+	pinned = rb_str_new_frozen(print);
+	print_data(pinned, data, len);
+
+	return pinned;
+}
+
+/*
+ * Copies an Array of Integers, or a String or Template, into a pooled
+ * buffer. *data is set before anything can raise, so the caller's ensure
+ * can always put it back.
+ */
+static void print_from_array(VALUE array, unsigned char **data, unsigned int *len) {
+	uint64_t start = stats_start();
+
+	if(is_template(array) || RB_TYPE_P(array, T_STRING)) {
+		unsigned char *src;
+
+		print_data(array, &src, len);
+		*data = (unsigned char*) buffer_get(*len ? *len : 1);
+		if(!*data) {
+			rb_raise(rb_eNoMemError, "failed to allocate memory");
+		}
+		memcpy(*data, src, *len);
+		return;
+	}
+
+	Check_Type(array, T_ARRAY);
+
+	*len = RARRAY_LEN(array);
+	*data = (unsigned char*) buffer_get(*len ? *len : 1);
+	if(!*data) {
+		rb_raise(rb_eNoMemError, "failed to allocate memory");
+	}
+
+	for(unsigned int i = 0; i < *len; i++) {
+		(*data)[i] = NUM2UINT(rb_ary_entry(array, i));
+	}
+
+	stats_since(STATS_MARSHAL, start);
+	stats_count(STATS_BYTES_COPIED, *len);
+}
+
+typedef struct verify_args {
+	unsigned char *db;
+	unsigned int db_len;
+	unsigned char *check;
+	unsigned int check_len;
 	bool result;
-	unsigned char *db, *check;
-	unsigned int db_len, check_len;
+} verify_args;
+
+static void *verify_without_gvl(void *ptr) {
+	verify_args *args = (verify_args*) ptr;
+	uint64_t start = stats_start();
 
-	Check_Type(db_print, T_ARRAY);
-	Check_Type(check_print, T_ARRAY);
+	args->result = VerifyUser(args->db, args->db_len, args->check, args->check_len);
+	stats_since(STATS_MATCH, start);
 
-	db_len = RARRAY_LEN(db_print);
-	check_len = RARRAY_LEN(check_print);
+	return NULL;
+}
 
-	db = (unsigned char*) malloc(db_len);
-	check = (unsigned char*) malloc(check_len);
+/* Runs VerifyUser over buffers that stay put while the GVL is released. */
+static VALUE verify_data(verify_args *args) {
+	cache_key key;
+	unsigned int cached;
 
-	for(unsigned int i = 0; i < db_len; i++) {
-		db[i] = NUM2UINT(rb_ary_entry(db_print, i));
+	cache_key_init(&key, CACHE_VERIFY_USER, DEFAULT_FMD_FORMAT, args->db, args->db_len, 0, args->check, args->check_len, 0);
+	if(cache_lookup(&key, &cached)) {
+		return cached ? Qtrue : Qfalse;
 	}
-	for(unsigned int i = 0; i < check_len; i++) {
-		check[i] = NUM2UINT(rb_ary_entry(check_print, i));
+
+	stats_without_gvl(verify_without_gvl, args, NULL, NULL);
+	cache_store(&key, args->result);
+
+	return args->result ? Qtrue : Qfalse;
+}
+
+static VALUE verify_prints(VALUE db_print, VALUE check_print) {
+	VALUE db_pin, check_pin, result;
+	verify_args args;
+
+	db_pin = print_pin(db_print, &args.db, &args.db_len);
+	check_pin = print_pin(check_print, &args.check, &args.check_len);
+
+	result = verify_data(&args);
+
+	RB_GC_GUARD(db_pin);
+	RB_GC_GUARD(check_pin);
+
+	return result;
+}
+
+typedef struct compare_args {
+	DPFJ_FMD_FORMAT format;
+	unsigned char *fmd1;
+	unsigned int fmd1_len;
+	unsigned int view1;
+	unsigned char *fmd2;
+	unsigned int fmd2_len;
+	unsigned int view2;
+	unsigned int score;
+	int rc;
+} compare_args;
+
+static void *compare_without_gvl(void *ptr) {
+	compare_args *args = (compare_args*) ptr;
+	uint64_t start = stats_start();
+
+	args->rc = dpfj_compare(
+		args->format, args->fmd1, args->fmd1_len, args->view1,
+		args->format, args->fmd2, args->fmd2_len, args->view2,
+		&args->score
+	);
+	stats_since(STATS_MATCH, start);
+
+	return NULL;
+}
+
+static unsigned int compare_prints(VALUE fmd1, unsigned int view1, VALUE fmd2, unsigned int view2, DPFJ_FMD_FORMAT format) {
+	VALUE fmd1_pin, fmd2_pin;
+	compare_args args;
+	cache_key key;
+
+	args.format = format;
+	args.view1 = view1;
+	args.view2 = view2;
+	fmd1_pin = print_pin(fmd1, &args.fmd1, &args.fmd1_len);
+	fmd2_pin = print_pin(fmd2, &args.fmd2, &args.fmd2_len);
+
+	cache_key_init(&key, CACHE_COMPARE, format, args.fmd1, args.fmd1_len, view1, args.fmd2, args.fmd2_len, view2);
+	if(!cache_lookup(&key, &args.score)) {
+		stats_without_gvl(compare_without_gvl, &args, NULL, NULL);
+		check_dpfj(args.rc, "dpfj_compare");
+		cache_store(&key, args.score);
 	}
 
-	result = VerifyUser(db, db_len, check, check_len);
+	/* The cache key points into the pinned prints until it is stored. */
+	RB_GC_GUARD(fmd1_pin);
+	RB_GC_GUARD(fmd2_pin);
 
-	free(db);
-	free(check);
+	return args.score;
+}
+
+/*
+ * Converts a false match rate, such as 1e-5, into a dissimilarity score
+ * threshold. Scores are normalised so that DPFJ_PROBABILITY_ONE means a
+ * probability of one.
+ */
+unsigned int fmr_threshold(VALUE fmr) {
+	double rate = NUM2DBL(fmr);
+
+	if(!(rate > 0 && rate <= 1)) {
+		rb_raise(rb_eArgError, "false match rate must be in (0, 1]");
+	}
 
-	return result ? Qtrue : Qfalse;
+	return (unsigned int) (rate * DPFJ_PROBABILITY_ONE);
 }
 
-VALUE load_print_wrapper(VALUE self, VALUE path) {
-	VALUE result;
+/*
+ * KeyMe::Fingerprint.verify(db_print, check_print, threshold:, fmr:, format:)
+ *
+ * Without options, defers to VerifyUser and its built-in threshold. With
+ * threshold: (a raw score) or fmr: (a false match rate), compares the
+ * first views with dpfj_compare and matches below that threshold.
+ */
+VALUE verify_wrapper(int argc, VALUE *argv, VALUE self) {
+	VALUE db_print, check_print, opts;
+	ID keys[3];
+	VALUE values[3];
+	unsigned int threshold;
+	DPFJ_FMD_FORMAT format;
+
+	rb_scan_args(argc, argv, "2:", &db_print, &check_print, &opts);
+
+	keys[0] = rb_intern("threshold");
+	keys[1] = rb_intern("fmr");
+	keys[2] = rb_intern("format");
+	rb_get_kwargs(opts, keys, 0, 3, values);
+
+	if(values[0] == Qundef && values[1] == Qundef) {
+		return verify_prints(db_print, check_print);
+	}
+
+	threshold = values[0] != Qundef ? NUM2UINT(values[0]) : fmr_threshold(values[1]);
+	format = values[2] == Qundef ? DEFAULT_FMD_FORMAT : NUM2INT(values[2]);
+
+	return compare_prints(db_print, 0, check_print, 0, format) < threshold ? Qtrue : Qfalse;
+}
+
+/*
+ * KeyMe::Fingerprint.compare(fmd1, view1, fmd2, view2, format:)
+ *
+ * Returns the dpfj_compare dissimilarity score: 0 for a perfect match,
+ * approaching PROBABILITY_ONE for no match. Lets callers cascade cheap
+ * checks and stop as soon as the score settles the decision.
+ */
+VALUE compare_wrapper(int argc, VALUE *argv, VALUE self) {
+	VALUE fmd1, view1, fmd2, view2, opts;
+	ID key = rb_intern("format");
+	VALUE format;
+
+	rb_scan_args(argc, argv, "4:", &fmd1, &view1, &fmd2, &view2, &opts);
+	rb_get_kwargs(opts, &key, 0, 1, &format);
+
+	return UINT2NUM(compare_prints(
+		fmd1, NUM2UINT(view1),
+		fmd2, NUM2UINT(view2),
+		format == Qundef ? DEFAULT_FMD_FORMAT : NUM2INT(format)
+	));
+}
+
+/*
+ * KeyMe::Fingerprint.threshold(fmr)
+ */
+VALUE threshold_wrapper(VALUE self, VALUE fmr) {
+	return UINT2NUM(fmr_threshold(fmr));
+}
+
+typedef struct load_args {
+	const char *path;
 	unsigned char *print;
-	unsigned int printSize;
+	unsigned int size;
+	int done;
+} load_args;
+
+static void *load_without_gvl(void *ptr) {
+	load_args *args = (load_args*) ptr;
+
+	LoadPrint(args->path, &args->print, &args->size);
+	args->done = 1;
+
+	return NULL;
+}
+
+/*
+ * Reads the file at args->path into a buffer LoadPrint mallocs. Nothing
+ * is raised here, so the buffer is never lost to an interrupt; the
+ * caller takes it over and only then checks for interrupts.
+ */
+static void load_file(load_args *args) {
+	args->print = NULL;
+	args->size = 0;
+	args->done = 0;
+	do {
+		stats_without_gvl2(load_without_gvl, args, NULL, NULL);
+		if(!args->done) {
+			rb_thread_check_ints();
+		}
+	} while(!args->done);
+}
+
+VALUE read_print_wrapper(VALUE self, VALUE path) {
+	VALUE result;
+	load_args args;
+
+	path = rb_str_new_frozen(StringValue(path));
+	args.path = StringValueCStr(path);
+
+	load_file(&args);
+
+	result = rb_str_new((char*) args.print, args.size);
+
+	free(args.print);
+	rb_thread_check_ints();
+
+	RB_GC_GUARD(path);
+
+	return rb_obj_freeze(result);
+}
+
+/*
+ * Copies an Array of prints into one pooled buffer and lays set out over
+ * it, tables first, so the prints can be read without the GVL. Nothing
+ * may raise between this and fmd_set_release, which hands the buffer
+ * back.
+ */
+void fmd_set_copy(VALUE prints, DPFJ_FMD_FORMAT format, fmd_set *set) {
+	unsigned char *arena, *data;
+	unsigned int len;
+	size_t total = 0, tables;
+	uint64_t start = stats_start();
+
+	set->format = format;
+	set->cnt = RARRAY_LEN(prints);
+	set->ids = NULL;
+
+	for(unsigned int i = 0; i < set->cnt; i++) {
+		print_data(RARRAY_AREF(prints, i), &data, &len);
+		total += len;
+	}
+
+	tables = set->cnt * (sizeof(unsigned char*) + sizeof(unsigned int));
+	set->fmds = (unsigned char**) buffer_get(tables + total + 1);
+	if(!set->fmds) {
+		rb_raise(rb_eNoMemError, "failed to allocate memory");
+	}
+	set->fmds_size = (unsigned int*) (set->fmds + set->cnt);
+	arena = (unsigned char*) set->fmds + tables;
+
+	for(unsigned int i = 0; i < set->cnt; i++) {
+		print_data(RARRAY_AREF(prints, i), &data, &len);
+		memcpy(arena, data, len);
+		set->fmds[i] = arena;
+		set->fmds_size[i] = len;
+		arena += len;
+	}
+
+	stats_since(STATS_MARSHAL, start);
+	stats_count(STATS_BYTES_COPIED, total);
+}
+
+void fmd_set_release(fmd_set *set) {
+	buffer_put(set->fmds);
+	set->fmds = NULL;
+	buffer_account();
+}
+
+/*
+ * Searches are split into fixed-size shards that run on the thread pool.
+ * The shard layout depends only on the gallery size, so the ranking is
+ * the same whatever the thread count, one thread included.
+ */
+#define IDENTIFY_SHARD_SIZE 1024
+
+typedef struct identify_hit {
+	unsigned int score;
+	unsigned int fmd_idx;
+	unsigned int view_idx;
+} identify_hit;
+
+typedef struct identify_args {
+	unsigned char *probe;
+	unsigned int probe_len;
+	gallery *g;
+	store *st;
+	fmd_set set;
+	unsigned int threshold;
+	unsigned int max_candidates;
+	double prefilter;
+	unsigned int candidate_cnt;
+	DPFJ_CANDIDATE *candidates;
+	unsigned int *scores;
+	VALUE prints;
+	int stale;
+	int closed;
+	int rc;
+	const char *call;
+
+	unsigned int shard_cnt;
+	unsigned int *shard_hit_cnt;
+	DPFJ_CANDIDATE *shard_candidates;
+	identify_hit *shard_hits;
+} identify_args;
+
+/*
+ * Runs dpfj_identify over one shard. DPFJ_CANDIDATE carries no score, so
+ * the shard's few hits are re-scored with dpfj_compare for the merge.
+ */
+static void identify_shard(void *ptr, unsigned int shard) {
+	identify_args *args = (identify_args*) ptr;
+	fmd_set *set = &args->set;
+	unsigned int start = shard * IDENTIFY_SHARD_SIZE;
+	unsigned int cnt = set->cnt - start < IDENTIFY_SHARD_SIZE ? set->cnt - start : IDENTIFY_SHARD_SIZE;
+	unsigned int *hit_cnt = &args->shard_hit_cnt[shard];
+	DPFJ_CANDIDATE *candidates = args->shard_candidates + (size_t) shard * args->max_candidates;
+	identify_hit *hits = args->shard_hits + (size_t) shard * args->max_candidates;
+	uint64_t started = stats_start();
+	int rc;
+
+	for(unsigned int i = 0; i < args->max_candidates; i++) {
+		candidates[i].size = sizeof(DPFJ_CANDIDATE);
+	}
+
+	*hit_cnt = args->max_candidates;
+	rc = dpfj_identify(
+		set->format, args->probe, args->probe_len, 0,
+		set->format, cnt, set->fmds + start, set->fmds_size + start,
+		args->threshold, hit_cnt, candidates
+	);
+	if(rc != DPFJ_SUCCESS) {
+		*hit_cnt = 0;
+		args->rc = rc;
+		args->call = "dpfj_identify";
+		return;
+	}
+
+	for(unsigned int i = 0; i < *hit_cnt; i++) {
+		unsigned int idx = start + candidates[i].fmd_idx;
+
+		rc = dpfj_compare(
+			set->format, args->probe, args->probe_len, 0,
+			set->format, set->fmds[idx], set->fmds_size[idx], candidates[i].view_idx,
+			&hits[i].score
+		);
+		if(rc != DPFJ_SUCCESS) {
+			*hit_cnt = 0;
+			args->rc = rc;
+			args->call = "dpfj_compare";
+			return;
+		}
+		hits[i].fmd_idx = idx;
+		hits[i].view_idx = candidates[i].view_idx;
+	}
+
+	stats_since(STATS_MATCH, started);
+}
+
+static int identify_hit_cmp(const void *a, const void *b) {
+	const identify_hit *x = (const identify_hit*) a;
+	const identify_hit *y = (const identify_hit*) b;
+
+	if(x->score != y->score) {
+		return x->score < y->score ? -1 : 1;
+	}
+	if(x->fmd_idx != y->fmd_idx) {
+		return x->fmd_idx < y->fmd_idx ? -1 : 1;
+	}
+	return x->view_idx < y->view_idx ? -1 : x->view_idx > y->view_idx;
+}
+
+/*
+ * Runs every shard of set, then merges the per-shard top candidates by
+ * score, breaking ties by position in set.
+ */
+static void identify_search(identify_args *args) {
+	fmd_set *set = &args->set;
+	unsigned int k = args->max_candidates, hit_cnt = 0;
+
+	args->candidate_cnt = 0;
+	if(set->cnt == 0) {
+		return;
+	}
+
+	args->shard_cnt = (set->cnt + IDENTIFY_SHARD_SIZE - 1) / IDENTIFY_SHARD_SIZE;
+	args->shard_hit_cnt = (unsigned int*) buffer_get(args->shard_cnt * sizeof(unsigned int));
+	args->shard_candidates = (DPFJ_CANDIDATE*) buffer_get((size_t) args->shard_cnt * k * sizeof(DPFJ_CANDIDATE));
+	args->shard_hits = (identify_hit*) buffer_get((size_t) args->shard_cnt * k * sizeof(identify_hit));
+
+	if(!args->shard_hit_cnt || !args->shard_candidates || !args->shard_hits) {
+		args->rc = DPFJ_E_FAILURE;
+		args->call = "malloc";
+	} else {
+		pool_run(args->shard_cnt, identify_shard, args);
+	}
+
+	if(args->rc == DPFJ_SUCCESS) {
+		identify_hit *hits = args->shard_hits;
+
+		/* Pack every shard's hits to the front, then rank them. */
+		for(unsigned int i = 0; i < args->shard_cnt; i++) {
+			memmove(hits + hit_cnt, hits + (size_t) i * k, args->shard_hit_cnt[i] * sizeof(identify_hit));
+			hit_cnt += args->shard_hit_cnt[i];
+		}
+		qsort(hits, hit_cnt, sizeof(identify_hit), identify_hit_cmp);
+
+		args->candidate_cnt = hit_cnt < k ? hit_cnt : k;
+		for(unsigned int i = 0; i < args->candidate_cnt; i++) {
+			args->candidates[i].fmd_idx = set->ids ? set->ids[hits[i].fmd_idx] : hits[i].fmd_idx;
+			args->candidates[i].view_idx = hits[i].view_idx;
+			args->scores[i] = hits[i].score;
+		}
+	}
+
+	buffer_put(args->shard_hit_cnt);
+	buffer_put(args->shard_candidates);
+	buffer_put(args->shard_hits);
+}
+
+/*
+ * Narrows a Gallery search to the prints its index ranks best for the
+ * probe. A probe the index cannot describe is searched in full. Every
+ * audit_every-th search is rerun in full and the full result kept, to
+ * measure how often the shortlist held the true best match.
+ */
+static void identify_prefiltered(identify_args *args) {
+	fmd_index *idx = &args->g->index;
+	fmd_set full = args->set;
+	view_descriptor probe;
+	unsigned long long n;
+	unsigned int audit_every, best = 0;
+	int found;
+
+	if(!index_describe_probe(full.format, args->probe, args->probe_len, &probe)) {
+		identify_search(args);
+		return;
+	}
+	if(!index_shortlist(args->g, &probe, args->prefilter, &args->set)) {
+		args->set = full;
+		args->rc = DPFJ_E_FAILURE;
+		args->call = "malloc";
+		return;
+	}
+	n = __atomic_add_fetch(&idx->searches, 1, __ATOMIC_RELAXED);
+
+	identify_search(args);
 
-	Check_Type(path, T_STRING);
-	LoadPrint(RSTRING_PTR(path), &print, &printSize);
+	buffer_put(args->set.fmds);
+	buffer_put(args->set.fmds_size);
+	buffer_put(args->set.ids);
+	args->set = full;
 
-	result = rb_ary_new();
-	for(unsigned int i = 0; i < printSize; i++) {
-		rb_ary_push(result, UINT2NUM(print[i]));
+	audit_every = __atomic_load_n(&idx->audit_every, __ATOMIC_RELAXED);
+	if(args->rc != DPFJ_SUCCESS || audit_every == 0 || n % audit_every) {
+		return;
 	}
 
-	free(print);
+	found = args->candidate_cnt > 0;
+	if(found) {
+		best = args->candidates[0].fmd_idx;
+	}
+	identify_search(args);
+	if(args->rc == DPFJ_SUCCESS && args->candidate_cnt > 0) {
+		__atomic_fetch_add(&idx->audited, 1, __ATOMIC_RELAXED);
+		if(found && best == args->candidates[0].fmd_idx) {
+			__atomic_fetch_add(&idx->audit_hits, 1, __ATOMIC_RELAXED);
+		}
+	}
+}
+
+/*
+ * Searches the Gallery, Store or Array tables. When searching a Gallery
+ * or Store its read lock is held throughout. If a Gallery's tables need a
+ * rebuild first, nothing is run and stale is set; likewise closed for a
+ * closed Store.
+ */
+static void *identify_without_gvl(void *ptr) {
+	identify_args *args = (identify_args*) ptr;
+
+	if(args->g && !gallery_read_lock(args->g, &args->set)) {
+		args->stale = 1;
+		return NULL;
+	}
+	if(args->st && !store_read_lock(args->st, &args->set)) {
+		args->closed = 1;
+		return NULL;
+	}
+
+	if(args->g && args->prefilter < 1) {
+		identify_prefiltered(args);
+	} else {
+		identify_search(args);
+	}
+
+	if(args->g) {
+		gallery_read_unlock(args->g);
+	}
+	if(args->st) {
+		store_read_unlock(args->st);
+	}
+
+	return NULL;
+}
+
+/*
+ * Runs the search, rebuilding a Gallery's tables first whenever a writer
+ * left them stale. An Array gallery is copied into its scratch buffer
+ * here, so identify_release can hand it back whatever raises.
+ */
+static VALUE identify_body(VALUE ptr) {
+	identify_args *args = (identify_args*) ptr;
+
+	if(!args->g && !args->st) {
+		fmd_set_copy(args->prints, args->set.format, &args->set);
+	}
+
+	do {
+		if(args->stale) {
+			gallery_rebuild(args->g);
+			args->stale = 0;
+		}
+		stats_without_gvl(identify_without_gvl, args, NULL, NULL);
+	} while(args->stale);
+
+	return Qnil;
+}
+
+static VALUE identify_release(VALUE ptr) {
+	identify_args *args = (identify_args*) ptr;
+
+	if(!args->g && !args->st) {
+		fmd_set_release(&args->set);
+	} else {
+		buffer_account();
+	}
+
+	return Qnil;
+}
+
+/*
+ * KeyMe::Fingerprint.identify(probe, gallery, threshold:, max_candidates:, format:, prefilter:)
+ *
+ * Searches every view of every print in gallery for the first view of
+ * probe in a single native call, with the GVL released, spread across
+ * KeyMe::Fingerprint.threads threads. gallery is a Gallery or a Store,
+ * whose tables are searched in place, or an Array of print Strings, which
+ * are first copied into one scratch buffer. Candidate#fmd_index is the
+ * Gallery id, Store record index or Array index respectively. format only
+ * applies to Arrays; Galleries and Stores know their own.
+ *
+ * prefilter, a fraction in (0, 1], only matches the probe against that
+ * share of a Gallery's prints, the ones its minutiae index ranks closest.
+ * Lower is faster and more likely to miss; see Gallery#prefilter_stats.
+ */
+VALUE identify_wrapper(int argc, VALUE *argv, VALUE self) {
+	VALUE probe, gallery_v, opts, result, probe_pin;
+	VALUE candidates_v, scores_v;
+	ID keys[4];
+	VALUE values[4];
+	identify_args args;
+
+	rb_scan_args(argc, argv, "2:", &probe, &gallery_v, &opts);
+
+	keys[0] = rb_intern("threshold");
+	keys[1] = rb_intern("max_candidates");
+	keys[2] = rb_intern("format");
+	keys[3] = rb_intern("prefilter");
+	rb_get_kwargs(opts, keys, 0, 4, values);
+
+	args.threshold = values[0] == Qundef ? DEFAULT_THRESHOLD : NUM2UINT(values[0]);
+	args.max_candidates = values[1] == Qundef ? DEFAULT_MAX_CANDIDATES : NUM2UINT(values[1]);
+	args.prefilter = values[3] == Qundef ? 1.0 : NUM2DBL(values[3]);
+	if(!(args.prefilter > 0 && args.prefilter <= 1)) {
+		rb_raise(rb_eArgError, "prefilter must be in (0, 1]");
+	}
+	if(args.prefilter < 1 && !is_gallery(gallery_v)) {
+		rb_raise(rb_eArgError, "prefilter needs a Gallery");
+	}
+	if(args.max_candidates == 0) {
+		return rb_ary_new();
+	}
+	args.stale = 0;
+	args.closed = 0;
+	args.rc = DPFJ_SUCCESS;
+	args.g = NULL;
+	args.st = NULL;
+
+	probe_pin = print_pin(probe, &args.probe, &args.probe_len);
+	args.set.fmds = NULL;
+
+	if(is_gallery(gallery_v)) {
+		args.g = get_gallery(gallery_v);
+		snapshot_follow(args.g);
+		if(args.g->live_cnt == 0) {
+			return rb_ary_new();
+		}
+	} else if(is_store(gallery_v)) {
+		args.st = get_store(gallery_v);
+		if(args.st->cnt == 0 && args.st->map) {
+			return rb_ary_new();
+		}
+	} else {
+		Check_Type(gallery_v, T_ARRAY);
+		if(RARRAY_LEN(gallery_v) == 0) {
+			return rb_ary_new();
+		}
+		args.set.format = values[2] == Qundef ? DEFAULT_FMD_FORMAT : NUM2INT(values[2]);
+	}
+
+	args.candidates = ALLOCV_N(DPFJ_CANDIDATE, candidates_v, args.max_candidates);
+	args.scores = ALLOCV_N(unsigned int, scores_v, args.max_candidates);
+	args.prints = gallery_v;
+	rb_ensure(identify_body, (VALUE) &args, identify_release, (VALUE) &args);
+
+	if(args.closed) {
+		rb_raise(rb_eFingerprintError, "template store is closed");
+	}
+	check_dpfj(args.rc, args.call);
+
+	result = rb_ary_new_capa(args.candidate_cnt);
+	for(unsigned int i = 0; i < args.candidate_cnt; i++) {
+		rb_ary_push(result, rb_struct_new(
+			rb_sCandidate,
+			UINT2NUM(args.candidates[i].fmd_idx),
+			UINT2NUM(args.candidates[i].view_idx),
+			UINT2NUM(args.scores[i])
+		));
+	}
+
+	ALLOCV_END(candidates_v);
+	ALLOCV_END(scores_v);
+
+	RB_GC_GUARD(probe_pin);
+	RB_GC_GUARD(gallery_v);
 
 	return result;
 }
 
-VALUE rb_mKeyMe;
-VALUE rb_mFingerprint;
+#define BATCH_CHUNK 64
+
+typedef struct batch_args {
+	DPFJ_FMD_FORMAT format;
+	unsigned int pair_cnt;
+	unsigned char **fmds;
+	unsigned int *fmds_size;
+	unsigned int threshold;
+	int scores;
+	unsigned char *out;
+} batch_args;
+
+/*
+ * Compares one chunk of pairs. A pair the matcher rejects scores as
+ * UINT_MAX, a certain non-match, rather than failing the whole batch.
+ */
+static void batch_chunk(void *ptr, unsigned int chunk) {
+	batch_args *args = (batch_args*) ptr;
+	unsigned int start = chunk * BATCH_CHUNK;
+	unsigned int end = start + BATCH_CHUNK < args->pair_cnt ? start + BATCH_CHUNK : args->pair_cnt;
+
+	for(unsigned int i = start; i < end; i++) {
+		unsigned int score;
+		uint64_t started = stats_start();
+		int rc = dpfj_compare(
+			args->format, args->fmds[2 * i], args->fmds_size[2 * i], 0,
+			args->format, args->fmds[2 * i + 1], args->fmds_size[2 * i + 1], 0,
+			&score
+		);
+
+		stats_since(STATS_MATCH, started);
+
+		if(rc != DPFJ_SUCCESS) {
+			score = UINT_MAX;
+		}
+		if(args->scores) {
+			memcpy(args->out + (size_t) i * sizeof(unsigned int), &score, sizeof(unsigned int));
+		} else {
+			args->out[i] = score < args->threshold;
+		}
+	}
+}
+
+static void *batch_without_gvl(void *ptr) {
+	batch_args *args = (batch_args*) ptr;
+
+	pool_run((args->pair_cnt + BATCH_CHUNK - 1) / BATCH_CHUNK, batch_chunk, args);
+
+	return NULL;
+}
+
+static VALUE batch_body(VALUE ptr) {
+	stats_without_gvl(batch_without_gvl, (void*) ptr, NULL, NULL);
+
+	return Qnil;
+}
+
+static VALUE batch_release(VALUE ptr) {
+	batch_args *args = (batch_args*) ptr;
+
+	buffer_put(args->fmds);
+	buffer_account();
+
+	return Qnil;
+}
+
+/*
+ * KeyMe::Fingerprint.verify_batch(pairs, threshold:, scores:, format:)
+ *
+ * pairs is an Array of [db_print, check_print] Strings. Every pair is
+ * compared in one native call on the thread pool, with the GVL released.
+ * Returns a frozen binary String with one byte per pair, 1 for a match
+ * below threshold; or, with scores: true, one native-endian 32-bit
+ * dissimilarity score per pair (unpack with 'L*').
+ */
+VALUE verify_batch_wrapper(int argc, VALUE *argv, VALUE self) {
+	VALUE pairs, opts, result;
+	ID keys[3];
+	VALUE values[3];
+	batch_args args;
+	unsigned char *arena, *data;
+	unsigned int len;
+	size_t total = 0, tables;
+	uint64_t start;
+
+	rb_scan_args(argc, argv, "1:", &pairs, &opts);
+
+	keys[0] = rb_intern("threshold");
+	keys[1] = rb_intern("scores");
+	keys[2] = rb_intern("format");
+	rb_get_kwargs(opts, keys, 0, 3, values);
+
+	args.threshold = values[0] == Qundef ? DEFAULT_THRESHOLD : NUM2UINT(values[0]);
+	args.scores = values[1] != Qundef && RTEST(values[1]);
+	args.format = values[2] == Qundef ? DEFAULT_FMD_FORMAT : NUM2INT(values[2]);
+
+	Check_Type(pairs, T_ARRAY);
+	args.pair_cnt = RARRAY_LEN(pairs);
+
+	for(unsigned int i = 0; i < args.pair_cnt; i++) {
+		VALUE pair = RARRAY_AREF(pairs, i);
+
+		Check_Type(pair, T_ARRAY);
+		if(RARRAY_LEN(pair) != 2) {
+			rb_raise(rb_eArgError, "pair %u is not [db_print, check_print]", i);
+		}
+		for(int j = 0; j < 2; j++) {
+			print_data(RARRAY_AREF(pair, j), &data, &len);
+			total += len;
+		}
+	}
+
+	start = stats_start();
+	result = rb_str_new(NULL, (long) args.pair_cnt * (args.scores ? sizeof(unsigned int) : 1));
+	args.out = (unsigned char*) RSTRING_PTR(result);
+
+	tables = 2 * (size_t) args.pair_cnt * (sizeof(unsigned char*) + sizeof(unsigned int));
+	args.fmds = (unsigned char**) buffer_get(tables + total + 1);
+	if(!args.fmds) {
+		rb_raise(rb_eNoMemError, "failed to allocate memory");
+	}
+	args.fmds_size = (unsigned int*) (args.fmds + 2 * (size_t) args.pair_cnt);
+	arena = (unsigned char*) args.fmds + tables;
+
+	for(unsigned int i = 0; i < args.pair_cnt; i++) {
+		VALUE pair = RARRAY_AREF(pairs, i);
+
+		for(int j = 0; j < 2; j++) {
+			print_data(RARRAY_AREF(pair, j), &data, &len);
+			memcpy(arena, data, len);
+			args.fmds[2 * i + j] = arena;
+			args.fmds_size[2 * i + j] = len;
+			arena += len;
+		}
+	}
+
+	stats_since(STATS_MARSHAL, start);
+	stats_count(STATS_BYTES_COPIED, total);
+	stats_count(STATS_ALLOCATIONS, 1);
+
+	rb_ensure(batch_body, (VALUE) &args, batch_release, (VALUE) &args);
+
+	RB_GC_GUARD(pairs);
+
+	return rb_obj_freeze(result);
+}
+
+/* Array-of-Integers API, kept for compatibility. */
+
+typedef struct verify_user_args {
+	VALUE db_print;
+	VALUE check_print;
+	verify_args verify;
+} verify_user_args;
+
+static VALUE verify_user_body(VALUE ptr) {
+	verify_user_args *args = (verify_user_args*) ptr;
+
+	print_from_array(args->db_print, &args->verify.db, &args->verify.db_len);
+	print_from_array(args->check_print, &args->verify.check, &args->verify.check_len);
+
+	return verify_data(&args->verify);
+}
+
+static VALUE verify_user_ensure(VALUE ptr) {
+	verify_user_args *args = (verify_user_args*) ptr;
+
+	buffer_put(args->verify.db);
+	buffer_put(args->verify.check);
+	buffer_account();
+
+	return Qnil;
+}
+
+/*
+ * The prints are copied into pooled buffers rather than Strings, so a
+ * steady stream of calls allocates nothing on the heap.
+ */
+VALUE verify_user_wrapper(VALUE self, VALUE db_print, VALUE check_print) {
+	verify_user_args args;
+
+	args.db_print = db_print;
+	args.check_print = check_print;
+	args.verify.db = NULL;
+	args.verify.check = NULL;
+
+	return rb_ensure(verify_user_body, (VALUE) &args, verify_user_ensure, (VALUE) &args);
+}
+
+/*
+ * KeyMe::Fingerprint.load_print(path, format: FMD_ANSI_378_2004)
+ *
+ * Returns a Template that takes over the buffer LoadPrint read the file
+ * into, copying nothing. Its headers are parsed only if asked for, and
+ * to_a gives the Array of Integers this used to return.
+ */
+VALUE load_print_wrapper(int argc, VALUE *argv, VALUE self) {
+	VALUE path, opts, result;
+	ID keys[1];
+	VALUE values[1];
+	DPFJ_FMD_FORMAT format;
+	load_args args;
+
+	rb_scan_args(argc, argv, "1:", &path, &opts);
+
+	keys[0] = rb_intern("format");
+	rb_get_kwargs(opts, keys, 0, 1, values);
+	format = values[0] == Qundef ? DEFAULT_FMD_FORMAT : NUM2INT(values[0]);
+
+	path = rb_str_new_frozen(StringValue(path));
+	args.path = StringValueCStr(path);
+
+	load_file(&args);
+	result = template_wrap(format, args.print, args.size);
+	rb_thread_check_ints();
+
+	RB_GC_GUARD(path);
+
+	return result;
+}
 
 extern "C" {
 	void Init_fingerprint() {
@@ -61,6 +984,61 @@ extern "C" {
 			"Fingerprint"
 		);
 
+		rb_eFingerprintError = rb_define_class_under(
+			rb_mFingerprint,
+			"Error",
+			rb_eStandardError
+		);
+		rb_sCandidate = rb_struct_define_under(
+			rb_mFingerprint,
+			"Candidate",
+			"fmd_index",
+			"view_index",
+			"score",
+			NULL
+		);
+
+		rb_define_const(rb_mFingerprint, "FMD_ANSI_378_2004", INT2NUM(DPFJ_FMD_ANSI_378_2004));
+		rb_define_const(rb_mFingerprint, "FMD_ISO_19794_2_2005", INT2NUM(DPFJ_FMD_ISO_19794_2_2005));
+		rb_define_const(rb_mFingerprint, "PROBABILITY_ONE", UINT2NUM(DPFJ_PROBABILITY_ONE));
+		rb_define_const(rb_mFingerprint, "DEFAULT_THRESHOLD", UINT2NUM(DEFAULT_THRESHOLD));
+
+		rb_define_singleton_method(
+			rb_mFingerprint,
+			"verify",
+			RUBY_METHOD_FUNC(verify_wrapper),
+			-1
+		);
+		rb_define_singleton_method(
+			rb_mFingerprint,
+			"compare",
+			RUBY_METHOD_FUNC(compare_wrapper),
+			-1
+		);
+		rb_define_singleton_method(
+			rb_mFingerprint,
+			"threshold",
+			RUBY_METHOD_FUNC(threshold_wrapper),
+			1
+		);
+		rb_define_singleton_method(
+			rb_mFingerprint,
+			"read_print",
+			RUBY_METHOD_FUNC(read_print_wrapper),
+			1
+		);
+		rb_define_singleton_method(
+			rb_mFingerprint,
+			"identify",
+			RUBY_METHOD_FUNC(identify_wrapper),
+			-1
+		);
+		rb_define_singleton_method(
+			rb_mFingerprint,
+			"verify_batch",
+			RUBY_METHOD_FUNC(verify_batch_wrapper),
+			-1
+		);
 		rb_define_singleton_method(
 			rb_mFingerprint,
 			"verify_user",
@@ -71,7 +1049,23 @@ extern "C" {
 			rb_mFingerprint,
 			"load_print",
 			RUBY_METHOD_FUNC(load_print_wrapper),
-			1
+			-1
 		);
+
+		Init_buffer();
+		Init_cache();
+		Init_capture();
+		Init_enrollment();
+		Init_extract();
+		Init_gallery();
+		Init_loader();
+		Init_minutiae();
+		Init_pool();
+		Init_reader();
+		Init_snapshot();
+		Init_stats();
+		Init_store();
+		Init_synthetic();
+		Init_template();
 	}
 }
@@ -0,0 +1,37 @@
+#ifndef FINGERPRINT_H
+#define FINGERPRINT_H
+
+#include "ruby.h"
+#include "ruby/thread.h"
+#include "u_are_u/dpfj.h"
+
+#define DEFAULT_FMD_FORMAT DPFJ_FMD_ANSI_378_2004
+#define DEFAULT_THRESHOLD (DPFJ_PROBABILITY_ONE / 100000)
+#define DEFAULT_MAX_CANDIDATES 10
+
+extern VALUE rb_mKeyMe;
+extern VALUE rb_mFingerprint;
+extern VALUE rb_eFingerprintError;
+extern VALUE rb_sCandidate;
+
+/*
+ * A set of FMDs laid out the way dpfj_identify wants them. ids maps a
+ * position in the tables back to the caller's identifier for that print;
+ * when NULL the position is the identifier.
+ */
+typedef struct fmd_set {
+	DPFJ_FMD_FORMAT format;
+	unsigned int cnt;
+	unsigned char **fmds;
+	unsigned int *fmds_size;
+	unsigned int *ids;
+} fmd_set;
+
+void check_dpfj(int rc, const char *call);
+void print_data(VALUE print, unsigned char **data, unsigned int *len);
+VALUE print_pin(VALUE print, unsigned char **data, unsigned int *len);
+unsigned int fmr_threshold(VALUE fmr);
+void fmd_set_copy(VALUE prints, DPFJ_FMD_FORMAT format, fmd_set *set);
+void fmd_set_release(fmd_set *set);
+
+#endif
@@ -0,0 +1,704 @@
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "gallery.h"
+#include "snapshot.h"
+#include "stats.h"
+
+#define ARENA_ALIGN 8
+#define ARENA_MIN_CAPA 4096
+#define COMPACT_MIN_DEAD 65536
+
+VALUE rb_cGallery;
+
+static size_t align_up(size_t n) {
+	return (n + ARENA_ALIGN - 1) & ~((size_t) ARENA_ALIGN - 1);
+}
+
+static void gallery_free(void *ptr) {
+	gallery *g = (gallery*) ptr;
+
+	snapshot_close(g);
+	pthread_rwlock_destroy(&g->lock);
+	xfree(g->arena);
+	free(g->minutiae);
+	if(g->map) {
+		munmap(g->map, g->map_len);
+	}
+	xfree(g->entries);
+	xfree(g->fmds);
+	xfree(g->fmds_size);
+	xfree(g->fmds_id);
+	index_free(&g->index);
+	xfree(g);
+}
+
+static size_t gallery_memsize(const void *ptr) {
+	const gallery *g = (const gallery*) ptr;
+
+	return sizeof(gallery) +
+	       g->arena_capa +
+	       g->minutiae_capa +
+	       g->entry_capa * sizeof(gallery_entry) +
+	       g->fmds_capa * (sizeof(unsigned char*) + 2 * sizeof(unsigned int)) +
+	       index_memsize(&g->index);
+}
+
+static const rb_data_type_t gallery_type = {
+	"KeyMe::Fingerprint::Gallery",
+	{ NULL, gallery_free, gallery_memsize, },
+	NULL, NULL,
+	RUBY_TYPED_FREE_IMMEDIATELY,
+};
+
+int is_gallery(VALUE obj) {
+	return rb_typeddata_is_kind_of(obj, &gallery_type);
+}
+
+gallery *get_gallery(VALUE obj) {
+	gallery *g;
+
+	TypedData_Get_Struct(obj, gallery, &gallery_type, g);
+
+	return g;
+}
+
+static void gallery_reserve_tables(gallery *g, unsigned int cnt) {
+	unsigned int capa = g->fmds_capa ? g->fmds_capa : 64;
+
+	if(cnt <= g->fmds_capa) {
+		return;
+	}
+	while(capa < cnt) {
+		capa *= 2;
+	}
+
+	REALLOC_N(g->fmds, unsigned char*, capa);
+	REALLOC_N(g->fmds_size, unsigned int, capa);
+	REALLOC_N(g->fmds_id, unsigned int, capa);
+	g->fmds_capa = capa;
+}
+
+static void gallery_rebuild_tables(gallery *g) {
+	unsigned int n = 0;
+
+	gallery_reserve_tables(g, g->live_cnt);
+
+	for(unsigned int id = 0; id < g->entry_cnt; id++) {
+		gallery_entry *e = &g->entries[id];
+
+		if(!e->live) {
+			continue;
+		}
+		g->fmds[n] = gallery_fmd(g, e);
+		g->fmds_size[n] = e->size;
+		g->fmds_id[n] = id;
+		n++;
+	}
+
+	g->dirty = 0;
+}
+
+typedef struct gallery_write_args {
+	gallery *g;
+	VALUE (*func)(VALUE);
+	VALUE arg;
+	int locked;
+} gallery_write_args;
+
+static void *gallery_write_lock_without_gvl(void *ptr) {
+	gallery_write_args *args = (gallery_write_args*) ptr;
+
+	pthread_rwlock_wrlock(&args->g->lock);
+	args->locked = 1;
+
+	return NULL;
+}
+
+/*
+ * Takes the lock inside the ensure, so an interrupt raised as the GVL is
+ * taken back, with the lock already held, still releases it.
+ */
+static VALUE gallery_write_body(VALUE ptr) {
+	gallery_write_args *args = (gallery_write_args*) ptr;
+
+	stats_without_gvl(gallery_write_lock_without_gvl, args, NULL, NULL);
+
+	return args->func(args->arg);
+}
+
+static VALUE gallery_write_unlock(VALUE ptr) {
+	gallery_write_args *args = (gallery_write_args*) ptr;
+
+	if(args->locked) {
+		pthread_rwlock_unlock(&args->g->lock);
+	}
+
+	return Qnil;
+}
+
+/*
+ * Runs func(arg) holding the write lock. The lock is waited for with the
+ * GVL released, since the searches holding it need no GVL to finish.
+ */
+VALUE gallery_write(gallery *g, VALUE (*func)(VALUE), VALUE arg) {
+	gallery_write_args args;
+
+	args.g = g;
+	args.func = func;
+	args.arg = arg;
+	args.locked = 0;
+
+	return rb_ensure(gallery_write_body, (VALUE) &args, gallery_write_unlock, (VALUE) &args);
+}
+
+static VALUE gallery_rebuild_locked(VALUE ptr) {
+	gallery *g = (gallery*) ptr;
+
+	if(g->dirty) {
+		gallery_rebuild_tables(g);
+	}
+
+	return Qnil;
+}
+
+void gallery_rebuild(gallery *g) {
+	gallery_write(g, gallery_rebuild_locked, (VALUE) g);
+}
+
+/*
+ * Called without the GVL. Returns 0, holding nothing, if the tables must
+ * be rebuilt with gallery_rebuild first.
+ */
+int gallery_read_lock(gallery *g, fmd_set *set) {
+	pthread_rwlock_rdlock(&g->lock);
+
+	if(g->dirty) {
+		pthread_rwlock_unlock(&g->lock);
+		return 0;
+	}
+
+	set->format = g->format;
+	set->cnt = g->live_cnt;
+	set->fmds = g->fmds;
+	set->fmds_size = g->fmds_size;
+	set->ids = g->fmds_id;
+
+	return 1;
+}
+
+void gallery_read_unlock(gallery *g) {
+	pthread_rwlock_unlock(&g->lock);
+}
+
+/*
+ * Slides every live print down over the dead space left by removals. Ids
+ * are unchanged; only their offsets move. Never called on a gallery with
+ * a snapshot mapped, whose prints cannot move.
+ */
+static void gallery_compact(gallery *g) {
+	size_t pos = 0, minutiae_pos = 0;
+
+	for(unsigned int id = 0; id < g->entry_cnt; id++) {
+		gallery_entry *e = &g->entries[id];
+
+		if(!e->live) {
+			continue;
+		}
+		if(e->offset != pos) {
+			memmove(g->arena + pos, g->arena + e->offset, e->size);
+			e->offset = pos;
+		}
+		if(e->minutiae != minutiae_pos) {
+			memmove(g->minutiae + minutiae_pos, g->minutiae + e->minutiae, e->minutiae_size);
+			e->minutiae = minutiae_pos;
+		}
+		pos += align_up(e->size);
+		minutiae_pos += e->minutiae_size;
+	}
+
+	g->arena_len = pos;
+	g->minutiae_len = minutiae_pos;
+	g->dead_bytes = 0;
+	g->dirty = 1;
+
+	index_prune(g);
+}
+
+static VALUE gallery_alloc(VALUE klass) {
+	gallery *g;
+	pthread_rwlockattr_t attr;
+	VALUE obj = TypedData_Make_Struct(klass, gallery, &gallery_type, g);
+
+	pthread_rwlockattr_init(&attr);
+#ifdef PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP
+	/* A steady stream of searches must not starve enrollment. */
+	pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+#endif
+	pthread_rwlock_init(&g->lock, &attr);
+	pthread_rwlockattr_destroy(&attr);
+
+	g->format = DEFAULT_FMD_FORMAT;
+	g->log.fd = -1;
+	g->log.lock_fd = -1;
+
+	return obj;
+}
+
+typedef struct gallery_format_args {
+	gallery *g;
+	DPFJ_FMD_FORMAT format;
+} gallery_format_args;
+
+static VALUE gallery_format_locked(VALUE ptr) {
+	gallery_format_args *args = (gallery_format_args*) ptr;
+
+	if(args->format != args->g->format && args->g->entry_cnt) {
+		rb_raise(rb_eFingerprintError, "cannot change the format of a gallery that has prints");
+	}
+	args->g->format = args->format;
+
+	return Qnil;
+}
+
+/*
+ * KeyMe::Fingerprint::Gallery.new(format = FMD_ANSI_378_2004)
+ *
+ * The format is only changed, here or by calling initialize again, while
+ * the gallery holds no prints.
+ */
+VALUE gallery_initialize(int argc, VALUE *argv, VALUE self) {
+	VALUE format;
+	gallery *g = get_gallery(self);
+	gallery_format_args args;
+
+	rb_scan_args(argc, argv, "01", &format);
+	if(!NIL_P(format)) {
+		args.g = g;
+		args.format = NUM2INT(format);
+		gallery_write(g, gallery_format_locked, (VALUE) &args);
+	}
+
+	return self;
+}
+
+/*
+ * The minutiae arena must stay MINUTIAE_ALIGN-aligned, which realloc does
+ * not promise, so it is moved by hand. Searches read it, but only under
+ * the read lock, so it may move freely here.
+ */
+static void gallery_reserve_minutiae(gallery *g, size_t need) {
+	size_t capa = g->minutiae_capa ? g->minutiae_capa : ARENA_MIN_CAPA;
+	void *minutiae;
+
+	if(need <= g->minutiae_capa) {
+		return;
+	}
+	while(capa < need) {
+		capa *= 2;
+	}
+
+	if(posix_memalign(&minutiae, MINUTIAE_ALIGN, capa) != 0) {
+		rb_memerror();
+	}
+	memcpy(minutiae, g->minutiae, g->minutiae_len);
+	free(g->minutiae);
+	g->minutiae = (unsigned char*) minutiae;
+	g->minutiae_capa = capa;
+}
+
+typedef struct gallery_add_args {
+	gallery *g;
+	unsigned char *data;
+	unsigned int len;
+	unsigned char *block;
+	size_t block_size;
+	unsigned int id;
+} gallery_add_args;
+
+static VALUE gallery_add_locked(VALUE ptr) {
+	gallery_add_args *args = (gallery_add_args*) ptr;
+	gallery *g = args->g;
+	gallery_entry *e;
+	size_t need = g->arena_len + align_up(args->len);
+
+	gallery_reserve_minutiae(g, g->minutiae_len + args->block_size);
+
+	if(need > g->arena_capa) {
+		size_t capa = g->arena_capa ? g->arena_capa : ARENA_MIN_CAPA;
+
+		while(capa < need) {
+			capa *= 2;
+		}
+		REALLOC_N(g->arena, unsigned char, capa);
+		g->arena_capa = capa;
+		g->dirty = 1;
+	}
+
+	if(g->entry_cnt == g->entry_capa) {
+		g->entry_capa = g->entry_capa ? g->entry_capa * 2 : 64;
+		REALLOC_N(g->entries, gallery_entry, g->entry_capa);
+	}
+	if(!g->dirty) {
+		gallery_reserve_tables(g, g->live_cnt + 1);
+	}
+	if(g->log.fd >= 0 || g->log.follow) {
+		snapshot_log_add(g, g->entry_cnt, args->data, args->len);
+	}
+
+	args->id = g->entry_cnt++;
+	e = &g->entries[args->id];
+	e->offset = g->arena_len;
+	e->size = args->len;
+	e->live = 1;
+	e->mapped = 0;
+
+	memcpy(g->arena + e->offset, args->data, args->len);
+	g->arena_len = need;
+
+	e->minutiae = g->minutiae_len;
+	e->minutiae_size = args->block_size;
+	memcpy(g->minutiae + e->minutiae, args->block, args->block_size);
+	g->minutiae_len += args->block_size;
+
+	if(!g->dirty) {
+		g->fmds[g->live_cnt] = g->arena + e->offset;
+		g->fmds_size[g->live_cnt] = args->len;
+		g->fmds_id[g->live_cnt] = args->id;
+	}
+	g->live_cnt++;
+
+	index_add(g, args->id);
+
+	return Qnil;
+}
+
+/*
+ * Copies an FMD into the arena and returns its id. It is validated and
+ * decoded before the write lock is taken, so searches are only held up for
+ * the copies; malformed FMDs raise. data must stay put until it returns.
+ */
+unsigned int gallery_insert(gallery *g, const unsigned char *data, unsigned int len) {
+	VALUE scratch;
+	gallery_add_args args;
+	int rc;
+
+	args.g = g;
+	args.data = (unsigned char*) data;
+	args.len = len;
+
+	rc = minutiae_check(g->format, data, len, &args.block_size);
+	if(rc != MINUTIAE_OK) {
+		rb_raise(rb_eFingerprintError, "malformed FMD (%s)", minutiae_error_name(rc));
+	}
+	args.block = (unsigned char*) ALLOCV(scratch, args.block_size + MINUTIAE_ALIGN);
+	args.block = (unsigned char*) (((uintptr_t) args.block + MINUTIAE_ALIGN - 1) & ~((uintptr_t) MINUTIAE_ALIGN - 1));
+	rc = minutiae_decode(g->format, data, len, args.block);
+	if(rc != MINUTIAE_OK) {
+		ALLOCV_END(scratch);
+		rb_raise(rb_eFingerprintError, "malformed FMD (%s)", minutiae_error_name(rc));
+	}
+
+	gallery_write(g, gallery_add_locked, (VALUE) &args);
+	ALLOCV_END(scratch);
+
+	return args.id;
+}
+
+typedef struct gallery_insert_many_args {
+	gallery *g;
+	gallery_decoded *prints;
+	unsigned int cnt;
+} gallery_insert_many_args;
+
+static VALUE gallery_insert_many_locked(VALUE ptr) {
+	gallery_insert_many_args *args = (gallery_insert_many_args*) ptr;
+	gallery_add_args add;
+
+	add.g = args->g;
+	for(unsigned int i = 0; i < args->cnt; i++) {
+		add.data = (unsigned char*) args->prints[i].data;
+		add.len = args->prints[i].len;
+		add.block = (unsigned char*) args->prints[i].block;
+		add.block_size = args->prints[i].block_size;
+		gallery_add_locked((VALUE) &add);
+		args->prints[i].id = add.id;
+	}
+
+	return Qnil;
+}
+
+/*
+ * Like gallery_insert for prints already decoded by minutiae_decode, which
+ * is what vouches for them: all of them go in under one write lock.
+ */
+void gallery_insert_many(gallery *g, gallery_decoded *prints, unsigned int cnt) {
+	gallery_insert_many_args args;
+
+	args.g = g;
+	args.prints = prints;
+	args.cnt = cnt;
+
+	gallery_write(g, gallery_insert_many_locked, (VALUE) &args);
+}
+
+/*
+ * Copies print into the arena and returns its id; see gallery_insert.
+ */
+VALUE gallery_add(VALUE self, VALUE print) {
+	gallery *g = get_gallery(self);
+	VALUE pinned;
+	unsigned char *data;
+	unsigned int len, id;
+
+	pinned = print_pin(print, &data, &len);
+	id = gallery_insert(g, data, len);
+
+	RB_GC_GUARD(pinned);
+
+	return UINT2NUM(id);
+}
+
+typedef struct gallery_remove_args {
+	gallery *g;
+	unsigned int id;
+} gallery_remove_args;
+
+static VALUE gallery_remove_locked(VALUE ptr) {
+	gallery_remove_args *args = (gallery_remove_args*) ptr;
+	gallery *g = args->g;
+	gallery_entry *e;
+
+	if(args->id >= g->entry_cnt || !g->entries[args->id].live) {
+		return Qfalse;
+	}
+	if(g->log.fd >= 0 || g->log.follow) {
+		snapshot_log_remove(g, args->id);
+	}
+
+	e = &g->entries[args->id];
+	e->live = 0;
+	g->live_cnt--;
+	g->dead_bytes += align_up(e->size);
+	g->dirty = 1;
+
+	if(g->dead_bytes >= COMPACT_MIN_DEAD && g->dead_bytes * 2 > g->arena_len + g->map_arena_len && !g->map) {
+		gallery_compact(g);
+	}
+
+	return Qtrue;
+}
+
+/*
+ * Tombstones the print with the given id, returning 0 if there is none.
+ * The arena is compacted once more than half of it is dead, unless a
+ * snapshot is mapped.
+ */
+int gallery_delete(gallery *g, unsigned int id) {
+	gallery_remove_args args;
+
+	args.g = g;
+	args.id = id;
+
+	return RTEST(gallery_write(g, gallery_remove_locked, (VALUE) &args));
+}
+
+VALUE gallery_remove(VALUE self, VALUE id) {
+	return gallery_delete(get_gallery(self), NUM2UINT(id)) ? Qtrue : Qfalse;
+}
+
+/*
+ * The decoded minutiae of the print with the given id, as returned by
+ * KeyMe::Fingerprint.minutiae, or nil if it is gone.
+ */
+VALUE gallery_minutiae(VALUE self, VALUE id_v) {
+	gallery *g = get_gallery(self);
+	unsigned int id = NUM2UINT(id_v);
+	gallery_entry *e;
+
+	if(id >= g->entry_cnt || !g->entries[id].live) {
+		return Qnil;
+	}
+
+	e = &g->entries[id];
+
+	return minutiae_to_ruby(gallery_block(g, e));
+}
+
+VALUE gallery_aref(VALUE self, VALUE id_v) {
+	gallery *g = get_gallery(self);
+	unsigned int id = NUM2UINT(id_v);
+	gallery_entry *e;
+
+	if(id >= g->entry_cnt || !g->entries[id].live) {
+		return Qnil;
+	}
+
+	e = &g->entries[id];
+
+	return rb_obj_freeze(rb_str_new((char*) gallery_fmd(g, e), e->size));
+}
+
+/*
+ * Trades everything but the lock, the log and the prefilter settings and
+ * counters with other. Called holding g's write lock; other must not be
+ * shared.
+ */
+void gallery_swap(gallery *g, gallery *other) {
+	gallery tmp;
+	fmd_index idx = g->index;
+
+	memcpy(&tmp, other, sizeof(tmp));
+
+	other->format = g->format;
+	other->arena = g->arena;
+	other->arena_len = g->arena_len;
+	other->arena_capa = g->arena_capa;
+	other->dead_bytes = g->dead_bytes;
+	other->minutiae = g->minutiae;
+	other->minutiae_len = g->minutiae_len;
+	other->minutiae_capa = g->minutiae_capa;
+	other->entries = g->entries;
+	other->entry_cnt = g->entry_cnt;
+	other->entry_capa = g->entry_capa;
+	other->live_cnt = g->live_cnt;
+	other->fmds = g->fmds;
+	other->fmds_size = g->fmds_size;
+	other->fmds_id = g->fmds_id;
+	other->fmds_capa = g->fmds_capa;
+	other->dirty = g->dirty;
+	other->index = g->index;
+	other->map = g->map;
+	other->map_len = g->map_len;
+	other->map_arena = g->map_arena;
+	other->map_arena_len = g->map_arena_len;
+	other->map_minutiae = g->map_minutiae;
+
+	g->format = tmp.format;
+	g->arena = tmp.arena;
+	g->arena_len = tmp.arena_len;
+	g->arena_capa = tmp.arena_capa;
+	g->dead_bytes = tmp.dead_bytes;
+	g->minutiae = tmp.minutiae;
+	g->minutiae_len = tmp.minutiae_len;
+	g->minutiae_capa = tmp.minutiae_capa;
+	g->entries = tmp.entries;
+	g->entry_cnt = tmp.entry_cnt;
+	g->entry_capa = tmp.entry_capa;
+	g->live_cnt = tmp.live_cnt;
+	g->fmds = tmp.fmds;
+	g->fmds_size = tmp.fmds_size;
+	g->fmds_id = tmp.fmds_id;
+	g->fmds_capa = tmp.fmds_capa;
+	g->dirty = tmp.dirty;
+	g->index = tmp.index;
+	g->map = tmp.map;
+	g->map_len = tmp.map_len;
+	g->map_arena = tmp.map_arena;
+	g->map_arena_len = tmp.map_arena_len;
+	g->map_minutiae = tmp.map_minutiae;
+
+	g->index.audit_every = idx.audit_every;
+	g->index.searches = idx.searches;
+	g->index.scanned = idx.scanned;
+	g->index.shortlisted = idx.shortlisted;
+	g->index.audited = idx.audited;
+	g->index.audit_hits = idx.audit_hits;
+}
+
+static VALUE gallery_compact_locked(VALUE ptr) {
+	gallery_compact((gallery*) ptr);
+
+	return Qnil;
+}
+
+/*
+ * Reclaims the space of removed prints. A gallery with a snapshot mapped,
+ * including every follower, is left as it is: its prints are reclaimed by
+ * the next checkpoint instead.
+ */
+VALUE gallery_compact_wrapper(VALUE self) {
+	gallery *g = get_gallery(self);
+
+	if(g->map || g->log.follow) {
+		return self;
+	}
+	gallery_write(g, gallery_compact_locked, (VALUE) g);
+
+	return self;
+}
+
+VALUE gallery_size(VALUE self) {
+	return UINT2NUM(get_gallery(self)->live_cnt);
+}
+
+VALUE gallery_bytesize(VALUE self) {
+	gallery *g = get_gallery(self);
+
+	return SIZET2NUM(g->arena_len + g->map_arena_len);
+}
+
+VALUE gallery_format(VALUE self) {
+	return INT2NUM(get_gallery(self)->format);
+}
+
+/*
+ * Every nth pre-filtered identify on this gallery also runs in full, and
+ * the two best candidates are compared to measure the pre-filter's hit
+ * rate. The full search's result is the one returned. 0, the default,
+ * never audits.
+ */
+VALUE gallery_set_prefilter_audit(VALUE self, VALUE n) {
+	get_gallery(self)->index.audit_every = NUM2UINT(n);
+
+	return n;
+}
+
+VALUE gallery_prefilter_audit(VALUE self) {
+	return UINT2NUM(get_gallery(self)->index.audit_every);
+}
+
+/*
+ * Counters for pre-filtered identifies: searches run, descriptors scored,
+ * prints passed on to the matcher, audits whose full search found a match
+ * and how many of those the pre-filter also ranked first. hit_rate is the
+ * last two's ratio, or nil before any such audit.
+ */
+VALUE gallery_prefilter_stats(VALUE self) {
+	fmd_index *idx = &get_gallery(self)->index;
+	unsigned long long audited = __atomic_load_n(&idx->audited, __ATOMIC_RELAXED);
+	unsigned long long audit_hits = __atomic_load_n(&idx->audit_hits, __ATOMIC_RELAXED);
+	VALUE stats = rb_hash_new();
+
+	rb_hash_aset(stats, ID2SYM(rb_intern("searches")), ULL2NUM(__atomic_load_n(&idx->searches, __ATOMIC_RELAXED)));
+	rb_hash_aset(stats, ID2SYM(rb_intern("scanned")), ULL2NUM(__atomic_load_n(&idx->scanned, __ATOMIC_RELAXED)));
+	rb_hash_aset(stats, ID2SYM(rb_intern("shortlisted")), ULL2NUM(__atomic_load_n(&idx->shortlisted, __ATOMIC_RELAXED)));
+	rb_hash_aset(stats, ID2SYM(rb_intern("audited")), ULL2NUM(audited));
+	rb_hash_aset(stats, ID2SYM(rb_intern("audit_hits")), ULL2NUM(audit_hits));
+	rb_hash_aset(stats, ID2SYM(rb_intern("hit_rate")), audited ? DBL2NUM((double) audit_hits / audited) : Qnil);
+
+	return stats;
+}
+
+void Init_gallery() {
+	rb_cGallery = rb_define_class_under(
+		rb_mFingerprint,
+		"Gallery",
+		rb_cObject
+	);
+	rb_define_alloc_func(rb_cGallery, gallery_alloc);
+
+	rb_define_method(rb_cGallery, "initialize", RUBY_METHOD_FUNC(gallery_initialize), -1);
+	rb_define_method(rb_cGallery, "add", RUBY_METHOD_FUNC(gallery_add), 1);
+	rb_define_method(rb_cGallery, "remove", RUBY_METHOD_FUNC(gallery_remove), 1);
+	rb_define_method(rb_cGallery, "[]", RUBY_METHOD_FUNC(gallery_aref), 1);
+	rb_define_method(rb_cGallery, "minutiae", RUBY_METHOD_FUNC(gallery_minutiae), 1);
+	rb_define_method(rb_cGallery, "compact", RUBY_METHOD_FUNC(gallery_compact_wrapper), 0);
+	rb_define_method(rb_cGallery, "size", RUBY_METHOD_FUNC(gallery_size), 0);
+	rb_define_method(rb_cGallery, "bytesize", RUBY_METHOD_FUNC(gallery_bytesize), 0);
+	rb_define_method(rb_cGallery, "format", RUBY_METHOD_FUNC(gallery_format), 0);
+	rb_define_method(rb_cGallery, "prefilter_audit", RUBY_METHOD_FUNC(gallery_prefilter_audit), 0);
+	rb_define_method(rb_cGallery, "prefilter_audit=", RUBY_METHOD_FUNC(gallery_set_prefilter_audit), 1);
+	rb_define_method(rb_cGallery, "prefilter_stats", RUBY_METHOD_FUNC(gallery_prefilter_stats), 0);
+}
@@ -0,0 +1,131 @@
+#ifndef GALLERY_H
+#define GALLERY_H
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include "fingerprint.h"
+#include "index.h"
+#include "minutiae.h"
+
+/*
+ * offset and minutiae are into the snapshot's arenas if mapped is set, or
+ * else into the gallery's own.
+ */
+typedef struct gallery_entry {
+	size_t offset;
+	unsigned int size;
+	unsigned char live;
+	unsigned char mapped;
+	size_t minutiae;
+	size_t minutiae_size;
+} gallery_entry;
+
+/*
+ * The delta log of a Gallery opened with Gallery.open; see snapshot.h.
+ * fd is -1 for a gallery that logs nothing. A gallery loaded to follow
+ * one open elsewhere reads the same log instead, from size on, and the
+ * two share control.
+ */
+typedef struct gallery_log {
+	int fd;
+	int lock_fd;
+	int sync;
+	int busy;
+	int follow;
+	char *path;
+	uint64_t generation;
+	uint64_t snapshot_generation;
+	uint64_t size;
+	void *control;
+} gallery_log;
+
+/*
+ * Enrolled FMDs live back to back in one arena. Entries are indexed by the
+ * id handed out by add and are never reused; removing a print only marks
+ * its entry dead until the arena is compacted.
+ *
+ * fmds, fmds_size and fmds_id are the live prints in id order, ready to be
+ * handed to dpfj_identify. They are patched in place on add and rebuilt
+ * lazily after a remove or an arena move.
+ *
+ * Each print is also decoded once into a minutiae block, kept alongside in
+ * a second, MINUTIAE_ALIGN-aligned arena that moves with the first; add
+ * turns away prints that do not decode. index describes every view, for
+ * searches that pre-filter.
+ *
+ * A gallery loaded from a snapshot leaves the snapshot's prints where they
+ * are in map, read-only and shared with every process that has the file
+ * mapped. arena and minutiae then hold only the prints added since, and
+ * the gallery is not compacted until a checkpoint writes a new snapshot.
+ *
+ * Searches hold lock for reading with the GVL released. Every mutation
+ * takes it for writing, so the arena and tables never move under a search.
+ */
+typedef struct gallery {
+	DPFJ_FMD_FORMAT format;
+	pthread_rwlock_t lock;
+
+	unsigned char *arena;
+	size_t arena_len;
+	size_t arena_capa;
+	size_t dead_bytes;
+
+	unsigned char *minutiae;
+	size_t minutiae_len;
+	size_t minutiae_capa;
+
+	gallery_entry *entries;
+	unsigned int entry_cnt;
+	unsigned int entry_capa;
+	unsigned int live_cnt;
+
+	unsigned char **fmds;
+	unsigned int *fmds_size;
+	unsigned int *fmds_id;
+	unsigned int fmds_capa;
+	int dirty;
+
+	fmd_index index;
+
+	unsigned char *map;
+	size_t map_len;
+	unsigned char *map_arena;
+	size_t map_arena_len;
+	unsigned char *map_minutiae;
+	gallery_log log;
+} gallery;
+
+static inline unsigned char *gallery_fmd(const gallery *g, const gallery_entry *e) {
+	return (e->mapped ? g->map_arena : g->arena) + e->offset;
+}
+
+static inline unsigned char *gallery_block(const gallery *g, const gallery_entry *e) {
+	return (e->mapped ? g->map_minutiae : g->minutiae) + e->minutiae;
+}
+
+/* A print and its decoded minutiae block, for gallery_insert_many. */
+typedef struct gallery_decoded {
+	const unsigned char *data;
+	unsigned int len;
+	const unsigned char *block;
+	size_t block_size;
+	unsigned int id;
+} gallery_decoded;
+
+extern VALUE rb_cGallery;
+
+int is_gallery(VALUE obj);
+gallery *get_gallery(VALUE obj);
+unsigned int gallery_insert(gallery *g, const unsigned char *data, unsigned int len);
+void gallery_insert_many(gallery *g, gallery_decoded *prints, unsigned int cnt);
+int gallery_delete(gallery *g, unsigned int id);
+void gallery_swap(gallery *g, gallery *other);
+VALUE gallery_write(gallery *g, VALUE (*func)(VALUE), VALUE arg);
+void gallery_rebuild(gallery *g);
+int gallery_read_lock(gallery *g, fmd_set *set);
+void gallery_read_unlock(gallery *g);
+
+void Init_gallery();
+
+#endif
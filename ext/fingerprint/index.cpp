@@ -0,0 +1,378 @@
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "buffer.h"
+#include "gallery.h"
+#include "index.h"
+
+/* Triplet sides are bucketed this coarsely so small displacements agree. */
+#define INDEX_SIDE_STEP 14
+#define INDEX_SIDE_BINS 16
+#define INDEX_ANGLE_BINS 8
+
+/* Bands this close to the probe's are always scanned. */
+#define INDEX_BAND_SLACK 2
+
+/* Further bands are only scanned until this many views per wanted print are found. */
+#define INDEX_SCAN_FACTOR 4
+
+/* Below this quality a descriptor is too noisy to prune on. */
+#define INDEX_MIN_QUALITY 20
+
+static unsigned int index_band(unsigned int minutia_cnt) {
+	unsigned int band = minutia_cnt / 8;
+
+	return band < INDEX_BANDS ? band : INDEX_BANDS - 1;
+}
+
+static unsigned int index_isqrt(unsigned int n) {
+	unsigned int r = 0, bit = 1u << 30;
+
+	while(bit > n) {
+		bit >>= 2;
+	}
+	while(bit) {
+		if(n >= r + bit) {
+			n -= r + bit;
+			r = (r >> 1) + bit;
+		} else {
+			r >>= 1;
+		}
+		bit >>= 2;
+	}
+
+	return r;
+}
+
+static unsigned int index_side(int x0, int y0, int x1, int y1) {
+	unsigned int d = index_isqrt((x1 - x0) * (x1 - x0) + (y1 - y0) * (y1 - y0)) / INDEX_SIDE_STEP;
+
+	return d < INDEX_SIDE_BINS ? d : INDEX_SIDE_BINS - 1;
+}
+
+/* Fills d from one decoded view. */
+static void index_describe(const minutiae *m, unsigned int view, view_descriptor *d) {
+	const minutiae_view *v = &m->views[view];
+	const uint16_t *xs = m->x + v->first, *ys = m->y + v->first;
+	const uint8_t *as = m->angle + v->first;
+	unsigned int cnt = v->cnt;
+
+	memset(d, 0, sizeof(*d));
+	d->view = view;
+	d->position = v->position < INDEX_POSITIONS ? v->position : 0;
+	d->impression = v->impression;
+	d->quality = v->quality;
+	d->minutia_cnt = cnt;
+
+	for(unsigned int i = 0; cnt >= 3 && i < cnt; i++) {
+		unsigned int j = i, k = i, dj = UINT_MAX, dk = UINT_MAX;
+		unsigned int s0, s1, s2, t, turn, h;
+
+		for(unsigned int n = 0; n < cnt; n++) {
+			int dx = xs[n] - xs[i], dy = ys[n] - ys[i];
+			unsigned int dn = dx * dx + dy * dy;
+
+			if(n == i) {
+				continue;
+			}
+			if(dn < dj) {
+				k = j;
+				dk = dj;
+				j = n;
+				dj = dn;
+			} else if(dn < dk) {
+				k = n;
+				dk = dn;
+			}
+		}
+
+		s0 = index_side(xs[i], ys[i], xs[j], ys[j]);
+		s1 = index_side(xs[i], ys[i], xs[k], ys[k]);
+		s2 = index_side(xs[j], ys[j], xs[k], ys[k]);
+		if(s0 > s1) { t = s0; s0 = s1; s1 = t; }
+		if(s1 > s2) { t = s1; s1 = s2; s2 = t; }
+		if(s0 > s1) { t = s0; s0 = s1; s1 = t; }
+
+		/* How far the nearest neighbour's ridge turns from this one's. */
+		turn = ((as[j] - as[i]) & 0xff) * INDEX_ANGLE_BINS / 256;
+
+		h = (s0 | s1 << 4 | s2 << 8 | turn << 12) * 0x9e3779b1u;
+		h >>= 24;
+		d->sig[h >> 6] |= (uint64_t) 1 << (h & 63);
+	}
+}
+
+/*
+ * Describes the first view of a probe, decoding it first. Called without
+ * the GVL. Returns 0 if the probe is malformed or has no views.
+ */
+int index_describe_probe(DPFJ_FMD_FORMAT format, const unsigned char *fmd, unsigned int len, view_descriptor *d) {
+	size_t size;
+	void *buf;
+	unsigned char *block;
+	minutiae m;
+	int found;
+
+	if(minutiae_check(format, fmd, len, &size) != MINUTIAE_OK || !(buf = buffer_get(size + MINUTIAE_ALIGN))) {
+		return 0;
+	}
+	block = (unsigned char*) (((uintptr_t) buf + MINUTIAE_ALIGN - 1) & ~((uintptr_t) MINUTIAE_ALIGN - 1));
+	if(minutiae_decode(format, fmd, len, block) != MINUTIAE_OK) {
+		buffer_put(buf);
+		return 0;
+	}
+	minutiae_open(block, &m);
+
+	found = m.view_cnt > 0;
+	if(found) {
+		index_describe(&m, 0, d);
+	}
+	buffer_put(buf);
+
+	return found;
+}
+
+static void index_bucket_push(index_bucket *b, unsigned int slot) {
+	if(b->cnt == b->capa) {
+		b->capa = b->capa ? b->capa * 2 : 16;
+		REALLOC_N(b->slots, unsigned int, b->capa);
+	}
+	b->slots[b->cnt++] = slot;
+}
+
+/* Called holding the gallery's write lock, with the GVL. */
+void index_add(gallery *g, unsigned int id) {
+	fmd_index *idx = &g->index;
+	gallery_entry *e = &g->entries[id];
+	view_descriptor d;
+	minutiae m;
+
+	minutiae_open(gallery_block(g, e), &m);
+
+	for(unsigned int view = 0; view < m.view_cnt; view++) {
+		index_describe(&m, view, &d);
+		d.id = id;
+
+		if(idx->view_cnt == idx->view_capa) {
+			idx->view_capa = idx->view_capa ? idx->view_capa * 2 : 64;
+			REALLOC_N(idx->views, view_descriptor, idx->view_capa);
+		}
+		idx->views[idx->view_cnt] = d;
+		index_bucket_push(&idx->buckets[d.position * INDEX_BANDS + index_band(d.minutia_cnt)], idx->view_cnt);
+		idx->view_cnt++;
+	}
+}
+
+/* Drops the views of removed prints. Called holding the write lock. */
+void index_prune(gallery *g) {
+	fmd_index *idx = &g->index;
+	unsigned int n = 0;
+
+	for(unsigned int b = 0; b < INDEX_POSITIONS * INDEX_BANDS; b++) {
+		idx->buckets[b].cnt = 0;
+	}
+	for(unsigned int i = 0; i < idx->view_cnt; i++) {
+		view_descriptor *d = &idx->views[i];
+
+		if(!g->entries[d->id].live) {
+			continue;
+		}
+		idx->views[n] = *d;
+		index_bucket_push(&idx->buckets[d->position * INDEX_BANDS + index_band(d->minutia_cnt)], n);
+		n++;
+	}
+	idx->view_cnt = n;
+}
+
+/*
+ * Takes descriptors saved with a snapshot instead of describing every
+ * view again, keeping those of live prints. Called before the gallery is
+ * shared.
+ */
+void index_restore(gallery *g, const view_descriptor *views, unsigned int cnt) {
+	fmd_index *idx = &g->index;
+
+	for(unsigned int i = 0; i < cnt; i++) {
+		const view_descriptor *d = &views[i];
+
+		if(d->id >= g->entry_cnt || !g->entries[d->id].live || d->position >= INDEX_POSITIONS) {
+			continue;
+		}
+		if(idx->view_cnt == idx->view_capa) {
+			idx->view_capa = idx->view_capa ? idx->view_capa * 2 : 64;
+			REALLOC_N(idx->views, view_descriptor, idx->view_capa);
+		}
+		idx->views[idx->view_cnt] = *d;
+		index_bucket_push(&idx->buckets[d->position * INDEX_BANDS + index_band(d->minutia_cnt)], idx->view_cnt);
+		idx->view_cnt++;
+	}
+}
+
+void index_free(fmd_index *idx) {
+	xfree(idx->views);
+	for(unsigned int b = 0; b < INDEX_POSITIONS * INDEX_BANDS; b++) {
+		xfree(idx->buckets[b].slots);
+	}
+}
+
+size_t index_memsize(const fmd_index *idx) {
+	size_t size = idx->view_capa * sizeof(view_descriptor);
+
+	for(unsigned int b = 0; b < INDEX_POSITIONS * INDEX_BANDS; b++) {
+		size += idx->buckets[b].capa * sizeof(unsigned int);
+	}
+
+	return size;
+}
+
+typedef struct index_hit {
+	int score;
+	unsigned int id;
+} index_hit;
+
+static int index_score(const view_descriptor *probe, const view_descriptor *d) {
+	int common = 0, diff = (int) probe->minutia_cnt - (int) d->minutia_cnt;
+
+	if(d->quality < INDEX_MIN_QUALITY) {
+		return INT_MAX;
+	}
+	for(unsigned int w = 0; w < INDEX_SIG_WORDS; w++) {
+		common += __builtin_popcountll(probe->sig[w] & d->sig[w]);
+	}
+	if(diff < 0) {
+		diff = -diff;
+	}
+	/* Rolled and flat impressions of one finger differ in area anyway. */
+	if(probe->impression != d->impression) {
+		diff /= 2;
+	}
+
+	return common * 8 - diff;
+}
+
+static int index_hit_cmp(const void *a, const void *b) {
+	const index_hit *x = (const index_hit*) a;
+	const index_hit *y = (const index_hit*) b;
+
+	if(x->score != y->score) {
+		return x->score > y->score ? -1 : 1;
+	}
+	return x->id < y->id ? -1 : x->id > y->id;
+}
+
+static int index_id_cmp(const void *a, const void *b) {
+	unsigned int x = *(const unsigned int*) a, y = *(const unsigned int*) b;
+
+	return x < y ? -1 : x > y;
+}
+
+/*
+ * Scores the views in the probe's position buckets, nearest minutia bands
+ * first, and fills set with the prints behind the best fraction of them,
+ * in id order. Called holding the gallery's read lock, without the GVL.
+ * The tables in set come from buffer_get. Returns 0 if they could not.
+ */
+int index_shortlist(gallery *g, const view_descriptor *probe, double fraction, fmd_set *set) {
+	fmd_index *idx = &g->index;
+	unsigned int want, hit_cnt = 0, id_cnt = 0, probe_band = index_band(probe->minutia_cnt);
+	unsigned int positions[INDEX_POSITIONS], position_cnt = 0;
+	index_hit *hits;
+	unsigned int *ids;
+
+	want = (unsigned int) (fraction * g->live_cnt + 0.999999);
+	if(want < 1) {
+		want = 1;
+	}
+
+	/* Views of unknown position could be any finger and are always scanned. */
+	if(probe->position == 0) {
+		for(unsigned int p = 0; p < INDEX_POSITIONS; p++) {
+			positions[position_cnt++] = p;
+		}
+	} else {
+		positions[position_cnt++] = probe->position;
+		positions[position_cnt++] = 0;
+	}
+
+	hits = (index_hit*) buffer_get((idx->view_cnt ? idx->view_cnt : 1) * sizeof(index_hit));
+	if(!hits) {
+		return 0;
+	}
+
+	for(unsigned int dist = 0; dist < INDEX_BANDS; dist++) {
+		unsigned int bands[2], band_cnt = 0;
+
+		if(dist > INDEX_BAND_SLACK && hit_cnt >= (unsigned long long) want * INDEX_SCAN_FACTOR) {
+			break;
+		}
+		if(probe_band >= dist) {
+			bands[band_cnt++] = probe_band - dist;
+		}
+		if(dist > 0 && probe_band + dist < INDEX_BANDS) {
+			bands[band_cnt++] = probe_band + dist;
+		}
+
+		for(unsigned int b = 0; b < band_cnt; b++) {
+			for(unsigned int p = 0; p < position_cnt; p++) {
+				index_bucket *bucket = &idx->buckets[positions[p] * INDEX_BANDS + bands[b]];
+
+				for(unsigned int i = 0; i < bucket->cnt; i++) {
+					view_descriptor *d = &idx->views[bucket->slots[i]];
+
+					if(!g->entries[d->id].live) {
+						continue;
+					}
+					hits[hit_cnt].score = index_score(probe, d);
+					hits[hit_cnt].id = d->id;
+					hit_cnt++;
+				}
+			}
+		}
+	}
+
+	__atomic_fetch_add(&idx->scanned, hit_cnt, __ATOMIC_RELAXED);
+
+	qsort(hits, hit_cnt, sizeof(index_hit), index_hit_cmp);
+	if(hit_cnt > want) {
+		hit_cnt = want;
+	}
+
+	ids = (unsigned int*) buffer_get((hit_cnt ? hit_cnt : 1) * sizeof(unsigned int));
+	set->fmds = (unsigned char**) buffer_get((hit_cnt ? hit_cnt : 1) * sizeof(unsigned char*));
+	set->fmds_size = (unsigned int*) buffer_get((hit_cnt ? hit_cnt : 1) * sizeof(unsigned int));
+	if(!ids || !set->fmds || !set->fmds_size) {
+		buffer_put(hits);
+		buffer_put(ids);
+		buffer_put(set->fmds);
+		buffer_put(set->fmds_size);
+		return 0;
+	}
+
+	/* Several views of one print may have made the cut; search it once. */
+	for(unsigned int i = 0; i < hit_cnt; i++) {
+		ids[i] = hits[i].id;
+	}
+	buffer_put(hits);
+	qsort(ids, hit_cnt, sizeof(unsigned int), index_id_cmp);
+	for(unsigned int i = 0; i < hit_cnt; i++) {
+		gallery_entry *e;
+
+		if(id_cnt && ids[id_cnt - 1] == ids[i]) {
+			continue;
+		}
+		ids[id_cnt] = ids[i];
+		e = &g->entries[ids[id_cnt]];
+		set->fmds[id_cnt] = gallery_fmd(g, e);
+		set->fmds_size[id_cnt] = e->size;
+		id_cnt++;
+	}
+
+	set->format = g->format;
+	set->cnt = id_cnt;
+	set->ids = ids;
+
+	__atomic_fetch_add(&idx->shortlisted, id_cnt, __ATOMIC_RELAXED);
+
+	return 1;
+}
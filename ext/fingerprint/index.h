@@ -0,0 +1,66 @@
+#ifndef INDEX_H
+#define INDEX_H
+
+#include <stdint.h>
+
+#include "fingerprint.h"
+
+#define INDEX_SIG_WORDS 4
+#define INDEX_POSITIONS 11
+#define INDEX_BANDS 32
+
+/*
+ * What the pre-filter knows about one view of one print: enough to rank
+ * views against a probe without running the matcher. sig is a 256-bit set
+ * of hashed minutia triplets (each minutia with its two nearest
+ * neighbours), which survives rotation and small displacement.
+ */
+typedef struct view_descriptor {
+	unsigned int id;
+	unsigned char view;
+	unsigned char position;
+	unsigned char impression;
+	unsigned char quality;
+	unsigned int minutia_cnt;
+	uint64_t sig[INDEX_SIG_WORDS];
+} view_descriptor;
+
+typedef struct index_bucket {
+	unsigned int *slots;
+	unsigned int cnt;
+	unsigned int capa;
+} index_bucket;
+
+/*
+ * Descriptors of every view added to a Gallery, bucketed by finger
+ * position and a band of minutia counts. Views of removed prints linger
+ * until the gallery is compacted; searches skip them.
+ *
+ * The counters are bumped by searches holding the gallery's read lock, so
+ * they are only ever updated atomically.
+ */
+typedef struct fmd_index {
+	view_descriptor *views;
+	unsigned int view_cnt;
+	unsigned int view_capa;
+	index_bucket buckets[INDEX_POSITIONS * INDEX_BANDS];
+
+	unsigned int audit_every;
+	unsigned long long searches;
+	unsigned long long scanned;
+	unsigned long long shortlisted;
+	unsigned long long audited;
+	unsigned long long audit_hits;
+} fmd_index;
+
+struct gallery;
+
+int index_describe_probe(DPFJ_FMD_FORMAT format, const unsigned char *fmd, unsigned int len, view_descriptor *d);
+void index_add(struct gallery *g, unsigned int id);
+void index_prune(struct gallery *g);
+void index_restore(struct gallery *g, const view_descriptor *views, unsigned int cnt);
+void index_free(fmd_index *idx);
+size_t index_memsize(const fmd_index *idx);
+int index_shortlist(struct gallery *g, const view_descriptor *probe, double fraction, fmd_set *set);
+
+#endif
@@ -0,0 +1,283 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "buffer.h"
+#include "gallery.h"
+#include "loader.h"
+#include "minutiae.h"
+#include "pool.h"
+#include "stats.h"
+#include "template.h"
+
+/*
+ * Files are read LOAD_CHUNK at a time, so memory stays bounded and
+ * interrupts are seen between chunks, and handed to the pool LOAD_TASK
+ * at a time.
+ */
+#define LOAD_CHUNK 4096
+#define LOAD_TASK 16
+
+typedef struct load_file {
+	const char *path;
+	unsigned char *data;
+	unsigned int len;
+	void *block_buf;
+	unsigned char *block;
+	size_t block_size;
+	int err;
+	int code;
+} load_file;
+
+typedef struct load_batch {
+	DPFJ_FMD_FORMAT format;
+	int decode;
+	load_file *files;
+	unsigned int cnt;
+	unsigned int start;
+	unsigned int end;
+} load_batch;
+
+/*
+ * Reads one file whole with pread, then validates it, or, for a Gallery,
+ * decodes it, which validates it too. Sets err to an errno or code to a
+ * minutiae error and frees what it read if the file is no good.
+ */
+static void load_file_read(DPFJ_FMD_FORMAT format, int decode, load_file *f) {
+	struct stat st;
+	size_t done = 0;
+	int fd = open(f->path, O_RDONLY | O_CLOEXEC);
+
+	if(fd < 0) {
+		f->err = errno;
+		return;
+	}
+	if(fstat(fd, &st) != 0) {
+		f->err = errno;
+	} else if(S_ISDIR(st.st_mode)) {
+		f->err = EISDIR;
+	} else if(!S_ISREG(st.st_mode) || st.st_size > UINT_MAX) {
+		f->err = EINVAL;
+	} else if(!(f->data = (unsigned char*) malloc(st.st_size ? st.st_size : 1))) {
+		f->err = ENOMEM;
+	}
+
+	while(!f->err && done < (size_t) st.st_size) {
+		ssize_t n = pread(fd, f->data + done, st.st_size - done, done);
+
+		if(n < 0 && errno != EINTR) {
+			f->err = errno;
+		} else if(n == 0) {
+			break;
+		} else if(n > 0) {
+			done += n;
+		}
+	}
+	close(fd);
+	f->len = done;
+
+	if(!f->err && decode) {
+		f->code = minutiae_check(format, f->data, f->len, &f->block_size);
+		if(f->code == MINUTIAE_OK) {
+			f->block_buf = buffer_get(f->block_size + MINUTIAE_ALIGN);
+			if(!f->block_buf) {
+				f->err = ENOMEM;
+			} else {
+				f->block = (unsigned char*) (((uintptr_t) f->block_buf + MINUTIAE_ALIGN - 1) & ~((uintptr_t) MINUTIAE_ALIGN - 1));
+				f->code = minutiae_decode(format, f->data, f->len, f->block);
+			}
+		}
+	} else if(!f->err) {
+		f->code = minutiae_validate(format, f->data, f->len);
+	}
+
+	if(f->err || f->code != MINUTIAE_OK) {
+		free(f->data);
+		buffer_put(f->block_buf);
+		f->data = NULL;
+		f->block_buf = NULL;
+	}
+}
+
+static void load_task(void *ptr, unsigned int task) {
+	load_batch *b = (load_batch*) ptr;
+	unsigned int start = b->start + task * LOAD_TASK;
+	unsigned int end = start + LOAD_TASK < b->end ? start + LOAD_TASK : b->end;
+
+	for(unsigned int i = start; i < end; i++) {
+		load_file_read(b->format, b->decode, &b->files[i]);
+	}
+}
+
+static void *load_chunk_without_gvl(void *ptr) {
+	load_batch *b = (load_batch*) ptr;
+
+	pool_run((b->end - b->start + LOAD_TASK - 1) / LOAD_TASK, load_task, b);
+
+	return NULL;
+}
+
+typedef struct load_prints_args {
+	VALUE paths;
+	VALUE gallery;
+	VALUE loaded;
+	VALUE errors;
+	load_batch batch;
+	gallery_decoded *decoded;
+} load_prints_args;
+
+static VALUE load_prints_body(VALUE ptr) {
+	load_prints_args *args = (load_prints_args*) ptr;
+	load_batch *b = &args->batch;
+	gallery *g = NIL_P(args->gallery) ? NULL : get_gallery(args->gallery);
+
+	for(b->start = 0; b->start < b->cnt; b->start = b->end) {
+		unsigned int decoded_cnt = 0;
+
+		b->end = b->cnt - b->start < LOAD_CHUNK ? b->cnt : b->start + LOAD_CHUNK;
+		stats_without_gvl(load_chunk_without_gvl, b, NULL, NULL);
+
+		for(unsigned int i = b->start; i < b->end; i++) {
+			load_file *f = &b->files[i];
+			VALUE path = RARRAY_AREF(args->paths, i);
+
+			if(f->err) {
+				rb_hash_aset(args->errors, path, rb_str_new_cstr(strerror(f->err)));
+			} else if(f->code != MINUTIAE_OK) {
+				rb_hash_aset(args->errors, path, rb_sprintf("malformed FMD (%s)", minutiae_error_name(f->code)));
+			} else if(g) {
+				args->decoded[decoded_cnt].data = f->data;
+				args->decoded[decoded_cnt].len = f->len;
+				args->decoded[decoded_cnt].block = f->block;
+				args->decoded[decoded_cnt].block_size = f->block_size;
+				decoded_cnt++;
+			} else {
+				/* The Template takes the buffer over. */
+				VALUE t = template_wrap(b->format, f->data, f->len);
+
+				f->data = NULL;
+				rb_hash_aset(args->loaded, path, t);
+			}
+		}
+
+		if(g) {
+			gallery_insert_many(g, args->decoded, decoded_cnt);
+			decoded_cnt = 0;
+			for(unsigned int i = b->start; i < b->end; i++) {
+				load_file *f = &b->files[i];
+
+				if(f->data) {
+					rb_hash_aset(args->loaded, RARRAY_AREF(args->paths, i), UINT2NUM(args->decoded[decoded_cnt++].id));
+					free(f->data);
+					buffer_put(f->block_buf);
+					f->data = NULL;
+					f->block_buf = NULL;
+				}
+			}
+		}
+		buffer_account();
+	}
+
+	return rb_assoc_new(args->loaded, args->errors);
+}
+
+/* Frees whatever an interrupt or error left unclaimed. */
+static VALUE load_prints_ensure(VALUE ptr) {
+	load_prints_args *args = (load_prints_args*) ptr;
+
+	for(unsigned int i = 0; i < args->batch.cnt; i++) {
+		free(args->batch.files[i].data);
+		buffer_put(args->batch.files[i].block_buf);
+	}
+	xfree(args->batch.files);
+	xfree(args->decoded);
+	buffer_account();
+
+	return Qnil;
+}
+
+/*
+ * KeyMe::Fingerprint.load_prints(paths, gallery: nil, format: nil)
+ *
+ * Reads many print files at once on the thread pool, with the GVL
+ * released. paths is an Array of paths, a directory (every file in it)
+ * or a glob pattern. Every print is validated; with gallery:, prints go
+ * straight into the Gallery's arena, decoded on the pool, under a single
+ * write lock per chunk of files.
+ *
+ * Returns [loaded, errors]: loaded maps each good path to its Template,
+ * or to its Gallery id; errors maps each bad one to a message. A bad
+ * file does not stop the rest. format defaults to the Gallery's, or ANSI.
+ */
+VALUE load_prints_wrapper(int argc, VALUE *argv, VALUE self) {
+	VALUE paths, opts, list;
+	ID keys[2];
+	VALUE values[2];
+	load_prints_args args;
+
+	rb_scan_args(argc, argv, "1:", &paths, &opts);
+
+	keys[0] = rb_intern("gallery");
+	keys[1] = rb_intern("format");
+	rb_get_kwargs(opts, keys, 0, 2, values);
+
+	args.gallery = values[0] == Qundef ? Qnil : values[0];
+	if(!NIL_P(args.gallery) && !is_gallery(args.gallery)) {
+		rb_raise(rb_eTypeError, "gallery must be a KeyMe::Fingerprint::Gallery");
+	}
+	if(values[1] != Qundef && !NIL_P(values[1])) {
+		args.batch.format = NUM2INT(values[1]);
+	} else {
+		args.batch.format = NIL_P(args.gallery) ? DEFAULT_FMD_FORMAT : get_gallery(args.gallery)->format;
+	}
+	if(!NIL_P(args.gallery) && args.batch.format != get_gallery(args.gallery)->format) {
+		rb_raise(rb_eArgError, "gallery holds a different FMD format");
+	}
+
+	if(RB_TYPE_P(paths, T_STRING)) {
+		if(RTEST(rb_funcall(rb_cFile, rb_intern("directory?"), 1, paths))) {
+			paths = rb_funcall(rb_cFile, rb_intern("join"), 2, paths, rb_str_new_cstr("*"));
+		}
+		paths = rb_funcall(rb_cDir, rb_intern("glob"), 1, paths);
+	}
+	Check_Type(paths, T_ARRAY);
+
+	/* Frozen copies, so the C strings stay put without the GVL. */
+	list = rb_ary_new_capa(RARRAY_LEN(paths));
+	for(long i = 0; i < RARRAY_LEN(paths); i++) {
+		VALUE path = RARRAY_AREF(paths, i);
+
+		rb_ary_push(list, rb_str_new_frozen(rb_get_path(path)));
+	}
+
+	args.paths = list;
+	args.loaded = rb_hash_new();
+	args.errors = rb_hash_new();
+	args.batch.decode = !NIL_P(args.gallery);
+	args.batch.cnt = RARRAY_LEN(list);
+	args.batch.files = ZALLOC_N(load_file, args.batch.cnt ? args.batch.cnt : 1);
+	args.decoded = NULL;
+	for(unsigned int i = 0; i < args.batch.cnt; i++) {
+		VALUE path = RARRAY_AREF(list, i);
+
+		args.batch.files[i].path = StringValueCStr(path);
+	}
+	if(args.batch.decode) {
+		args.decoded = ALLOC_N(gallery_decoded, args.batch.cnt < LOAD_CHUNK ? (args.batch.cnt ? args.batch.cnt : 1) : LOAD_CHUNK);
+	}
+
+	return rb_ensure(load_prints_body, (VALUE) &args, load_prints_ensure, (VALUE) &args);
+}
+
+void Init_loader() {
+	rb_define_singleton_method(
+		rb_mFingerprint,
+		"load_prints",
+		RUBY_METHOD_FUNC(load_prints_wrapper),
+		-1
+	);
+}
@@ -0,0 +1,8 @@
+#ifndef LOADER_H
+#define LOADER_H
+
+#include "fingerprint.h"
+
+void Init_loader();
+
+#endif
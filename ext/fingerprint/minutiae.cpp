@@ -0,0 +1,660 @@
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define MINUTIAE_X86 1
+#endif
+
+#include "minutiae.h"
+#include "pool.h"
+#include "stats.h"
+#include "store.h"
+#include "template.h"
+
+/* Prints per pool task when validating in bulk. */
+#define VALIDATE_CHUNK 1024
+
+static const char *minutiae_errors[MINUTIAE_ERROR_CNT] = {
+	"ok",
+	"format",
+	"header",
+	"magic",
+	"record_length",
+	"view_header",
+	"minutiae",
+	"ext_block",
+	"trailing",
+	"minutia_type",
+	"minutia_angle",
+	"minutia_position",
+};
+
+const char *minutiae_error_name(int code) {
+	return code >= 0 && code < MINUTIAE_ERROR_CNT ? minutiae_errors[code] : "unknown";
+}
+
+static size_t minutiae_align(size_t n) {
+	return (n + MINUTIAE_ALIGN - 1) & ~((size_t) MINUTIAE_ALIGN - 1);
+}
+
+/* What every minutia of a record is checked against. */
+typedef struct minutiae_limits {
+	int ansi;
+	unsigned int width;
+	unsigned int height;
+} minutiae_limits;
+
+/*
+ * Reads the record header: where the first view starts, the record
+ * length, the view count and the limits. Returns an error code.
+ */
+static int minutiae_record(DPFJ_FMD_FORMAT format, const unsigned char *fmd, unsigned int len, unsigned int *header, unsigned int *record_length, unsigned int *view_cnt, minutiae_limits *limits) {
+	if(format == DPFJ_FMD_ANSI_378_2004) {
+		if(len < DPFJ_FMD_ANSI_378_2004_RECORD_HEADER_LENGTH) {
+			return MINUTIAE_E_HEADER;
+		}
+		*header = DPFJ_FMD_ANSI_378_2004_RECORD_HEADER_LENGTH;
+		*record_length = read_be16(fmd + 8);
+		if(*record_length == 0) {
+			*header += 4;
+			if(len < *header) {
+				return MINUTIAE_E_HEADER;
+			}
+			*record_length = read_be32(fmd + 10);
+		}
+	} else if(format == DPFJ_FMD_ISO_19794_2_2005) {
+		if(len < DPFJ_FMD_ISO_19794_2_2005_RECORD_HEADER_LENGTH) {
+			return MINUTIAE_E_HEADER;
+		}
+		*header = DPFJ_FMD_ISO_19794_2_2005_RECORD_HEADER_LENGTH;
+		*record_length = read_be32(fmd + 8);
+	} else {
+		return MINUTIAE_E_FORMAT;
+	}
+
+	if(memcmp(fmd, "FMR", 4) != 0) {
+		return MINUTIAE_E_MAGIC;
+	}
+	if(*record_length > len || *record_length < *header) {
+		return MINUTIAE_E_RECORD_LENGTH;
+	}
+
+	/* Both formats end the header with width, height, resolutions, views. */
+	limits->ansi = format == DPFJ_FMD_ANSI_378_2004;
+	limits->width = read_be16(fmd + *header - 10);
+	limits->height = read_be16(fmd + *header - 8);
+	if(limits->width == 0 || limits->width > 0x4000) {
+		limits->width = 0x4000;
+	}
+	if(limits->height == 0 || limits->height > 0x4000) {
+		limits->height = 0x4000;
+	}
+	*view_cnt = fmd[*header - 2];
+
+	return MINUTIAE_OK;
+}
+
+/*
+ * Walks every view of fmd, bounds-checking each against the record
+ * length, and sets size to that of its decoded block. Returns an error
+ * code. The minutiae themselves are checked as they are unpacked.
+ */
+int minutiae_check(DPFJ_FMD_FORMAT format, const unsigned char *fmd, unsigned int len, size_t *size) {
+	unsigned int record_length, view_cnt, pos, total = 0;
+	minutiae_limits limits;
+	int rc;
+
+	rc = minutiae_record(format, fmd, len, &pos, &record_length, &view_cnt, &limits);
+	if(rc != MINUTIAE_OK) {
+		return rc;
+	}
+
+	for(unsigned int v = 0; v < view_cnt; v++) {
+		unsigned int cnt, end;
+
+		if(pos + DPFJ_FMD_ANSI_ISO_VIEW_HEADER_LENGTH > record_length) {
+			return MINUTIAE_E_VIEW_HEADER;
+		}
+		cnt = fmd[pos + 3];
+		end = pos + DPFJ_FMD_ANSI_ISO_VIEW_HEADER_LENGTH + cnt * DPFJ_FMD_ANSI_ISO_MINITIA_LENGTH;
+		if(end + 2 > record_length) {
+			return MINUTIAE_E_MINUTIAE;
+		}
+		end += 2 + read_be16(fmd + end);
+		if(end > record_length) {
+			return MINUTIAE_E_EXT_BLOCK;
+		}
+
+		total += cnt;
+		pos = end;
+	}
+	if(pos != record_length) {
+		return MINUTIAE_E_TRAILING;
+	}
+
+	*size = minutiae_align(sizeof(minutiae_header) + view_cnt * sizeof(minutiae_view)) +
+	        minutiae_align(total) * (2 * sizeof(uint16_t) + 3 * sizeof(uint8_t));
+
+	return MINUTIAE_OK;
+}
+
+/*
+ * Unpacks cnt 6-byte minutia records from m into the arrays: x and y
+ * byte-swapped and masked to 14 bits, the angle rescaled to 256 steps,
+ * and the type from the top bits of x. Returns an error code for the
+ * first minutia that is of the reserved type, has an ANSI angle past 179
+ * or lies outside the image.
+ */
+typedef int (*minutiae_unpack_func)(const unsigned char *m, unsigned int cnt, const minutiae_limits *limits, uint16_t *x, uint16_t *y, uint8_t *angle, uint8_t *type, uint8_t *quality);
+
+static int minutiae_unpack_scalar(const unsigned char *m, unsigned int cnt, const minutiae_limits *limits, uint16_t *x, uint16_t *y, uint8_t *angle, uint8_t *type, uint8_t *quality) {
+	for(unsigned int i = 0; i < cnt; i++, m += DPFJ_FMD_ANSI_ISO_MINITIA_LENGTH) {
+		x[i] = read_be16(m) & 0x3fff;
+		y[i] = read_be16(m + 2) & 0x3fff;
+		type[i] = m[0] >> 6;
+		quality[i] = m[5];
+
+		if(type[i] == 3) {
+			return MINUTIAE_E_TYPE;
+		}
+		if(limits->ansi && m[4] >= 180) {
+			return MINUTIAE_E_ANGLE;
+		}
+		if(x[i] >= limits->width || y[i] >= limits->height) {
+			return MINUTIAE_E_POSITION;
+		}
+		angle[i] = limits->ansi ? (m[4] * 256 + 90) / 180 : m[4];
+	}
+
+	return MINUTIAE_OK;
+}
+
+#ifdef MINUTIAE_X86
+/*
+ * The vector unpackers gather fields out of records with byte shuffles:
+ * two 16-byte loads 12 bytes apart cover four records. Each load reads 4
+ * bytes past the records it uses, so the loop only runs while another
+ * record follows. The scalar code takes the remainder, and also any group
+ * that fails a check, so that the error reported is the first one.
+ */
+#define MINUTIAE_SHUFFLE_WORDS_LO 1, 0, 7, 6, -1, -1, -1, -1, 3, 2, 9, 8, -1, -1, -1, -1
+#define MINUTIAE_SHUFFLE_WORDS_HI -1, -1, -1, -1, 1, 0, 7, 6, -1, -1, -1, -1, 3, 2, 9, 8
+#define MINUTIAE_SHUFFLE_BYTES_LO 4, 10, -1, -1, 5, 11, -1, -1, 0, 6, -1, -1, -1, -1, -1, -1
+#define MINUTIAE_SHUFFLE_BYTES_HI -1, -1, 4, 10, -1, -1, 5, 11, -1, -1, 0, 6, -1, -1, -1, -1
+
+/* (a * 256 + 90) / 180 as a mulhi and a shift; exact for a below 256. */
+#define MINUTIAE_ANSI_ANGLE_MUL 46604
+#define MINUTIAE_ANSI_ANGLE_SHIFT 7
+
+__attribute__((target("sse4.1,ssse3")))
+static inline __m128i minutiae_ansi_angles(__m128i a) {
+	a = _mm_unpacklo_epi8(a, _mm_setzero_si128());
+	a = _mm_add_epi16(_mm_slli_epi16(a, 8), _mm_set1_epi16(90));
+	a = _mm_srli_epi16(_mm_mulhi_epu16(a, _mm_set1_epi16((short) MINUTIAE_ANSI_ANGLE_MUL)), MINUTIAE_ANSI_ANGLE_SHIFT);
+
+	return _mm_packus_epi16(a, a);
+}
+
+__attribute__((target("sse4.1,ssse3")))
+static int minutiae_unpack_sse4(const unsigned char *m, unsigned int cnt, const minutiae_limits *limits, uint16_t *x, uint16_t *y, uint8_t *angle, uint8_t *type, uint8_t *quality) {
+	const __m128i words_lo = _mm_setr_epi8(MINUTIAE_SHUFFLE_WORDS_LO);
+	const __m128i words_hi = _mm_setr_epi8(MINUTIAE_SHUFFLE_WORDS_HI);
+	const __m128i bytes_lo = _mm_setr_epi8(MINUTIAE_SHUFFLE_BYTES_LO);
+	const __m128i bytes_hi = _mm_setr_epi8(MINUTIAE_SHUFFLE_BYTES_HI);
+	const __m128i coord = _mm_set1_epi16(0x3fff);
+	const __m128i bounds = _mm_setr_epi16(
+		limits->width, limits->width, limits->width, limits->width,
+		limits->height, limits->height, limits->height, limits->height
+	);
+	const __m128i three = _mm_set1_epi8(3);
+	const __m128i type_lanes = _mm_setr_epi32(0, 0, -1, 0);
+	const __m128i angle_lanes = _mm_setr_epi32(limits->ansi ? -1 : 0, 0, 0, 0);
+	const __m128i angle_max = _mm_set1_epi8((char) 180);
+	unsigned int i = 0;
+
+	for(; i + 5 <= cnt; i += 4, m += 4 * DPFJ_FMD_ANSI_ISO_MINITIA_LENGTH) {
+		__m128i lo = _mm_loadu_si128((const __m128i*) m);
+		__m128i hi = _mm_loadu_si128((const __m128i*) (m + 12));
+		__m128i xy = _mm_and_si128(_mm_or_si128(_mm_shuffle_epi8(lo, words_lo), _mm_shuffle_epi8(hi, words_hi)), coord);
+		__m128i b = _mm_or_si128(_mm_shuffle_epi8(lo, bytes_lo), _mm_shuffle_epi8(hi, bytes_hi));
+		__m128i t = _mm_and_si128(_mm_srli_epi16(b, 6), three);
+		__m128i a = limits->ansi ? minutiae_ansi_angles(b) : b;
+		__m128i bad;
+		uint32_t word;
+
+		/* Bytes 0-3 are angles, 4-7 qualities, 8-11 types. */
+		bad = _mm_cmpeq_epi16(_mm_cmplt_epi16(xy, bounds), _mm_setzero_si128());
+		bad = _mm_or_si128(bad, _mm_and_si128(_mm_cmpeq_epi8(t, three), type_lanes));
+		bad = _mm_or_si128(bad, _mm_and_si128(_mm_cmpeq_epi8(_mm_max_epu8(b, angle_max), b), angle_lanes));
+		if(!_mm_testz_si128(bad, bad)) {
+			break;
+		}
+
+		_mm_storel_epi64((__m128i*) (x + i), xy);
+		_mm_storel_epi64((__m128i*) (y + i), _mm_srli_si128(xy, 8));
+		word = _mm_cvtsi128_si32(a);
+		memcpy(angle + i, &word, 4);
+		word = _mm_cvtsi128_si32(_mm_srli_si128(b, 4));
+		memcpy(quality + i, &word, 4);
+		word = _mm_cvtsi128_si32(_mm_srli_si128(t, 8));
+		memcpy(type + i, &word, 4);
+	}
+
+	return minutiae_unpack_scalar(m, cnt - i, limits, x + i, y + i, angle + i, type + i, quality + i);
+}
+
+/*
+ * The same shuffles on both 128-bit lanes, the second lane four records
+ * on, then cross-lane permutes to bring each field's eight values
+ * together.
+ */
+__attribute__((target("avx2")))
+static int minutiae_unpack_avx2(const unsigned char *m, unsigned int cnt, const minutiae_limits *limits, uint16_t *x, uint16_t *y, uint8_t *angle, uint8_t *type, uint8_t *quality) {
+	const __m256i words_lo = _mm256_setr_epi8(MINUTIAE_SHUFFLE_WORDS_LO, MINUTIAE_SHUFFLE_WORDS_LO);
+	const __m256i words_hi = _mm256_setr_epi8(MINUTIAE_SHUFFLE_WORDS_HI, MINUTIAE_SHUFFLE_WORDS_HI);
+	const __m256i bytes_lo = _mm256_setr_epi8(MINUTIAE_SHUFFLE_BYTES_LO, MINUTIAE_SHUFFLE_BYTES_LO);
+	const __m256i bytes_hi = _mm256_setr_epi8(MINUTIAE_SHUFFLE_BYTES_HI, MINUTIAE_SHUFFLE_BYTES_HI);
+	const __m256i coord = _mm256_set1_epi16(0x3fff);
+	const __m256i bounds = _mm256_setr_epi16(
+		limits->width, limits->width, limits->width, limits->width,
+		limits->height, limits->height, limits->height, limits->height,
+		limits->width, limits->width, limits->width, limits->width,
+		limits->height, limits->height, limits->height, limits->height
+	);
+	const __m256i gather = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+	const __m256i three = _mm256_set1_epi8(3);
+	const __m256i type_lanes = _mm256_setr_epi64x(0, 0, -1, 0);
+	const __m256i angle_lanes = _mm256_setr_epi64x(limits->ansi ? -1 : 0, 0, 0, 0);
+	const __m256i angle_max = _mm256_set1_epi8((char) 180);
+	unsigned int i = 0;
+
+	for(; i + 9 <= cnt; i += 8, m += 8 * DPFJ_FMD_ANSI_ISO_MINITIA_LENGTH) {
+		__m256i lo = _mm256_loadu2_m128i((const __m128i*) (m + 24), (const __m128i*) m);
+		__m256i hi = _mm256_loadu2_m128i((const __m128i*) (m + 36), (const __m128i*) (m + 12));
+		__m256i xy = _mm256_and_si256(_mm256_or_si256(_mm256_shuffle_epi8(lo, words_lo), _mm256_shuffle_epi8(hi, words_hi)), coord);
+		__m256i b = _mm256_or_si256(_mm256_shuffle_epi8(lo, bytes_lo), _mm256_shuffle_epi8(hi, bytes_hi));
+		__m256i t, bad;
+		__m128i a;
+
+		bad = _mm256_cmpeq_epi16(_mm256_cmpgt_epi16(bounds, xy), _mm256_setzero_si256());
+
+		/* Eight xs then eight ys; eight angles, qualities, then types. */
+		xy = _mm256_permute4x64_epi64(xy, _MM_SHUFFLE(3, 1, 2, 0));
+		b = _mm256_permutevar8x32_epi32(b, gather);
+		t = _mm256_and_si256(_mm256_srli_epi16(b, 6), three);
+
+		bad = _mm256_or_si256(bad, _mm256_and_si256(_mm256_cmpeq_epi8(t, three), type_lanes));
+		bad = _mm256_or_si256(bad, _mm256_and_si256(_mm256_cmpeq_epi8(_mm256_max_epu8(b, angle_max), b), angle_lanes));
+		if(!_mm256_testz_si256(bad, bad)) {
+			break;
+		}
+
+		a = _mm256_castsi256_si128(b);
+		if(limits->ansi) {
+			a = minutiae_ansi_angles(a);
+		}
+
+		_mm_storeu_si128((__m128i*) (x + i), _mm256_castsi256_si128(xy));
+		_mm_storeu_si128((__m128i*) (y + i), _mm256_extracti128_si256(xy, 1));
+		_mm_storel_epi64((__m128i*) (angle + i), a);
+		_mm_storel_epi64((__m128i*) (quality + i), _mm_srli_si128(_mm256_castsi256_si128(b), 8));
+		_mm_storel_epi64((__m128i*) (type + i), _mm256_extracti128_si256(t, 1));
+	}
+
+	return minutiae_unpack_scalar(m, cnt - i, limits, x + i, y + i, angle + i, type + i, quality + i);
+}
+#endif
+
+/* Picked once at load time by what the CPU supports. */
+static minutiae_unpack_func minutiae_unpack = minutiae_unpack_scalar;
+static const char *minutiae_unpacker = "scalar";
+
+static void minutiae_layout(unsigned char *block, uint16_t **x, uint16_t **y, uint8_t **angle, uint8_t **type, uint8_t **quality) {
+	minutiae_header *h = (minutiae_header*) block;
+	unsigned char *p = block + minutiae_align(sizeof(minutiae_header) + h->view_cnt * sizeof(minutiae_view));
+
+	*x = (uint16_t*) p;
+	p += h->stride * sizeof(uint16_t);
+	*y = (uint16_t*) p;
+	p += h->stride * sizeof(uint16_t);
+	*angle = p;
+	p += h->stride;
+	*type = p;
+	p += h->stride;
+	*quality = p;
+}
+
+/*
+ * Decodes fmd into block, which must be MINUTIAE_ALIGN-aligned and as
+ * long as minutiae_check said; minutiae_check must have accepted fmd.
+ * Returns an error code for the first bad minutia, if any.
+ */
+int minutiae_decode(DPFJ_FMD_FORMAT format, const unsigned char *fmd, unsigned int len, unsigned char *block) {
+	minutiae_header *h = (minutiae_header*) block;
+	minutiae_view *views = (minutiae_view*) (block + sizeof(minutiae_header));
+	unsigned int header, record_length, view_cnt, pos;
+	minutiae_limits limits;
+	uint16_t *x, *y;
+	uint8_t *angle, *type, *quality;
+
+	minutiae_record(format, fmd, len, &header, &record_length, &view_cnt, &limits);
+
+	memset(block, 0, minutiae_align(sizeof(minutiae_header) + view_cnt * sizeof(minutiae_view)));
+	h->view_cnt = view_cnt;
+	h->minutia_cnt = 0;
+	pos = header;
+	for(unsigned int v = 0; v < view_cnt; v++) {
+		minutiae_view *view = &views[v];
+
+		view->first = h->minutia_cnt;
+		view->cnt = fmd[pos + 3];
+		view->offset = pos;
+		view->position = fmd[pos];
+		view->number = fmd[pos + 1] >> 4;
+		view->impression = fmd[pos + 1] & 0x0f;
+		view->quality = fmd[pos + 2];
+
+		h->minutia_cnt += view->cnt;
+		pos += DPFJ_FMD_ANSI_ISO_VIEW_HEADER_LENGTH + view->cnt * DPFJ_FMD_ANSI_ISO_MINITIA_LENGTH;
+		pos += 2 + read_be16(fmd + pos);
+	}
+	h->stride = minutiae_align(h->minutia_cnt);
+	h->size = minutiae_align(sizeof(minutiae_header) + view_cnt * sizeof(minutiae_view)) +
+	          h->stride * (2 * sizeof(uint16_t) + 3 * sizeof(uint8_t));
+
+	minutiae_layout(block, &x, &y, &angle, &type, &quality);
+	memset(x, 0, h->stride * (2 * sizeof(uint16_t) + 3 * sizeof(uint8_t)));
+
+	for(unsigned int v = 0; v < view_cnt; v++) {
+		minutiae_view *view = &views[v];
+		int rc = minutiae_unpack(
+			fmd + view->offset + DPFJ_FMD_ANSI_ISO_VIEW_HEADER_LENGTH, view->cnt, &limits,
+			x + view->first, y + view->first, angle + view->first, type + view->first, quality + view->first
+		);
+
+		if(rc != MINUTIAE_OK) {
+			return rc;
+		}
+	}
+
+	return MINUTIAE_OK;
+}
+
+/*
+ * Runs every check minutiae_check and minutiae_decode would, unpacking
+ * each view into per-thread scratch instead of a block.
+ */
+int minutiae_validate(DPFJ_FMD_FORMAT format, const unsigned char *fmd, unsigned int len) {
+	static __thread uint16_t x[256] __attribute__((aligned(MINUTIAE_ALIGN)));
+	static __thread uint16_t y[256] __attribute__((aligned(MINUTIAE_ALIGN)));
+	static __thread uint8_t angle[256], type[256], quality[256];
+	unsigned int header, record_length, view_cnt, pos;
+	minutiae_limits limits;
+	size_t size;
+	int rc;
+
+	rc = minutiae_check(format, fmd, len, &size);
+	if(rc != MINUTIAE_OK) {
+		return rc;
+	}
+
+	minutiae_record(format, fmd, len, &header, &record_length, &view_cnt, &limits);
+	pos = header;
+	for(unsigned int v = 0; v < view_cnt; v++) {
+		unsigned int cnt = fmd[pos + 3];
+
+		rc = minutiae_unpack(fmd + pos + DPFJ_FMD_ANSI_ISO_VIEW_HEADER_LENGTH, cnt, &limits, x, y, angle, type, quality);
+		if(rc != MINUTIAE_OK) {
+			return rc;
+		}
+		pos += DPFJ_FMD_ANSI_ISO_VIEW_HEADER_LENGTH + cnt * DPFJ_FMD_ANSI_ISO_MINITIA_LENGTH;
+		pos += 2 + read_be16(fmd + pos);
+	}
+
+	return MINUTIAE_OK;
+}
+
+void minutiae_open(const unsigned char *block, minutiae *m) {
+	const minutiae_header *h = (const minutiae_header*) block;
+	uint16_t *x, *y;
+	uint8_t *angle, *type, *quality;
+
+	minutiae_layout((unsigned char*) block, &x, &y, &angle, &type, &quality);
+
+	m->view_cnt = h->view_cnt;
+	m->minutia_cnt = h->minutia_cnt;
+	m->views = (const minutiae_view*) (block + sizeof(minutiae_header));
+	m->x = x;
+	m->y = y;
+	m->angle = angle;
+	m->type = type;
+	m->quality = quality;
+}
+
+/*
+ * One Hash per view: position, number, impression and quality, and the
+ * view's minutiae as parallel Arrays under :minutiae. Angles are in
+ * degrees.
+ */
+VALUE minutiae_to_ruby(const unsigned char *block) {
+	minutiae m;
+	VALUE result;
+
+	minutiae_open(block, &m);
+	result = rb_ary_new_capa(m.view_cnt);
+
+	for(unsigned int v = 0; v < m.view_cnt; v++) {
+		const minutiae_view *view = &m.views[v];
+		VALUE hash = rb_hash_new(), points = rb_hash_new();
+		VALUE x = rb_ary_new_capa(view->cnt), y = rb_ary_new_capa(view->cnt);
+		VALUE angle = rb_ary_new_capa(view->cnt), type = rb_ary_new_capa(view->cnt);
+		VALUE quality = rb_ary_new_capa(view->cnt);
+
+		for(unsigned int i = view->first; i < view->first + view->cnt; i++) {
+			rb_ary_push(x, UINT2NUM(m.x[i]));
+			rb_ary_push(y, UINT2NUM(m.y[i]));
+			rb_ary_push(angle, DBL2NUM(m.angle[i] * 360.0 / 256));
+			rb_ary_push(type, UINT2NUM(m.type[i]));
+			rb_ary_push(quality, UINT2NUM(m.quality[i]));
+		}
+
+		rb_hash_aset(points, ID2SYM(rb_intern("x")), x);
+		rb_hash_aset(points, ID2SYM(rb_intern("y")), y);
+		rb_hash_aset(points, ID2SYM(rb_intern("angle")), angle);
+		rb_hash_aset(points, ID2SYM(rb_intern("type")), type);
+		rb_hash_aset(points, ID2SYM(rb_intern("quality")), quality);
+
+		rb_hash_aset(hash, ID2SYM(rb_intern("position")), UINT2NUM(view->position));
+		rb_hash_aset(hash, ID2SYM(rb_intern("number")), UINT2NUM(view->number));
+		rb_hash_aset(hash, ID2SYM(rb_intern("impression")), UINT2NUM(view->impression));
+		rb_hash_aset(hash, ID2SYM(rb_intern("quality")), UINT2NUM(view->quality));
+		rb_hash_aset(hash, ID2SYM(rb_intern("minutiae")), points);
+		rb_ary_push(result, hash);
+	}
+
+	return result;
+}
+
+static VALUE minutiae_error_sym(int code) {
+	return ID2SYM(rb_intern(minutiae_error_name(code)));
+}
+
+/*
+ * KeyMe::Fingerprint.minutiae(fmd, format: FMD_ANSI_378_2004)
+ *
+ * Decodes fmd; see minutiae_to_ruby.
+ */
+VALUE minutiae_wrapper(int argc, VALUE *argv, VALUE self) {
+	VALUE fmd, opts, scratch, result;
+	ID keys[1];
+	VALUE values[1];
+	DPFJ_FMD_FORMAT format;
+	unsigned char *data, *block;
+	unsigned int len;
+	size_t size;
+	int rc;
+
+	rb_scan_args(argc, argv, "1:", &fmd, &opts);
+
+	keys[0] = rb_intern("format");
+	rb_get_kwargs(opts, keys, 0, 1, values);
+	format = values[0] == Qundef ? DEFAULT_FMD_FORMAT : NUM2INT(values[0]);
+
+	print_data(fmd, &data, &len);
+	rc = minutiae_check(format, data, len, &size);
+	if(rc != MINUTIAE_OK) {
+		rb_raise(rb_eFingerprintError, "malformed FMD (%s)", minutiae_error_name(rc));
+	}
+
+	block = (unsigned char*) ALLOCV(scratch, size + MINUTIAE_ALIGN);
+	block = (unsigned char*) (((uintptr_t) block + MINUTIAE_ALIGN - 1) & ~((uintptr_t) MINUTIAE_ALIGN - 1));
+	rc = minutiae_decode(format, data, len, block);
+	if(rc != MINUTIAE_OK) {
+		ALLOCV_END(scratch);
+		rb_raise(rb_eFingerprintError, "malformed FMD (%s)", minutiae_error_name(rc));
+	}
+
+	result = minutiae_to_ruby(block);
+	ALLOCV_END(scratch);
+
+	return result;
+}
+
+typedef struct validate_args {
+	store *st;
+	fmd_set set;
+	int *codes;
+	int closed;
+} validate_args;
+
+static void validate_chunk(void *ptr, unsigned int chunk) {
+	validate_args *args = (validate_args*) ptr;
+	unsigned int start = chunk * VALIDATE_CHUNK;
+	unsigned int end = args->set.cnt - start < VALIDATE_CHUNK ? args->set.cnt : start + VALIDATE_CHUNK;
+
+	for(unsigned int i = start; i < end; i++) {
+		args->codes[i] = minutiae_validate(args->set.format, args->set.fmds[i], args->set.fmds_size[i]);
+	}
+}
+
+static void *validate_without_gvl(void *ptr) {
+	validate_args *args = (validate_args*) ptr;
+
+	pool_run((args->set.cnt + VALIDATE_CHUNK - 1) / VALIDATE_CHUNK, validate_chunk, args);
+
+	return NULL;
+}
+
+static void *validate_store_without_gvl(void *ptr) {
+	validate_args *args = (validate_args*) ptr;
+
+	if(!store_read_lock(args->st, &args->set)) {
+		args->closed = 1;
+		return NULL;
+	}
+	validate_without_gvl(args);
+	store_read_unlock(args->st);
+
+	return NULL;
+}
+
+/*
+ * KeyMe::Fingerprint.validate(prints, format: FMD_ANSI_378_2004)
+ *
+ * Checks record structure and every minutia. For a single print String,
+ * returns nil if it is sound or a Symbol naming what is wrong with it.
+ * For an Array of prints or a Store, which are checked on the thread pool
+ * with the GVL released, returns a Hash of the index of each bad print to
+ * such a Symbol. Stores know their own format.
+ */
+VALUE minutiae_validate_wrapper(int argc, VALUE *argv, VALUE self) {
+	VALUE prints, opts, codes_v, result;
+	ID keys[1];
+	VALUE values[1];
+	DPFJ_FMD_FORMAT format;
+	validate_args args;
+
+	rb_scan_args(argc, argv, "1:", &prints, &opts);
+
+	keys[0] = rb_intern("format");
+	rb_get_kwargs(opts, keys, 0, 1, values);
+	format = values[0] == Qundef ? DEFAULT_FMD_FORMAT : NUM2INT(values[0]);
+
+	if(RB_TYPE_P(prints, T_STRING) || is_template(prints)) {
+		unsigned char *data;
+		unsigned int len;
+		int rc;
+
+		print_data(prints, &data, &len);
+		rc = minutiae_validate(format, data, len);
+
+		return rc == MINUTIAE_OK ? Qnil : minutiae_error_sym(rc);
+	}
+
+	args.st = NULL;
+	args.closed = 0;
+	result = rb_hash_new();
+
+	if(is_store(prints)) {
+		args.st = get_store(prints);
+		args.set.cnt = args.st->cnt;
+	} else {
+		Check_Type(prints, T_ARRAY);
+		args.set.cnt = RARRAY_LEN(prints);
+	}
+
+	args.codes = ALLOCV_N(int, codes_v, args.set.cnt ? args.set.cnt : 1);
+	if(!args.st) {
+		fmd_set_copy(prints, format, &args.set);
+	}
+	stats_without_gvl(args.st ? validate_store_without_gvl : validate_without_gvl, &args, NULL, NULL);
+	if(!args.st) {
+		fmd_set_release(&args.set);
+	}
+
+	if(args.closed) {
+		ALLOCV_END(codes_v);
+		rb_raise(rb_eFingerprintError, "template store is closed");
+	}
+
+	for(unsigned int i = 0; i < args.set.cnt; i++) {
+		if(args.codes[i] != MINUTIAE_OK) {
+			rb_hash_aset(result, UINT2NUM(i), minutiae_error_sym(args.codes[i]));
+		}
+	}
+	ALLOCV_END(codes_v);
+
+	RB_GC_GUARD(prints);
+
+	return result;
+}
+
+void Init_minutiae() {
+#ifdef MINUTIAE_X86
+	__builtin_cpu_init();
+	if(__builtin_cpu_supports("avx2")) {
+		minutiae_unpack = minutiae_unpack_avx2;
+		minutiae_unpacker = "avx2";
+	} else if(__builtin_cpu_supports("sse4.1") && __builtin_cpu_supports("ssse3")) {
+		minutiae_unpack = minutiae_unpack_sse4;
+		minutiae_unpacker = "sse4.1";
+	}
+#endif
+
+	/* Which minutia unpacker this CPU got: avx2, sse4.1 or scalar. */
+	rb_define_const(rb_mFingerprint, "MINUTIAE_UNPACKER", rb_obj_freeze(rb_str_new_cstr(minutiae_unpacker)));
+
+	rb_define_singleton_method(
+		rb_mFingerprint,
+		"minutiae",
+		RUBY_METHOD_FUNC(minutiae_wrapper),
+		-1
+	);
+	rb_define_singleton_method(
+		rb_mFingerprint,
+		"validate",
+		RUBY_METHOD_FUNC(minutiae_validate_wrapper),
+		-1
+	);
+}
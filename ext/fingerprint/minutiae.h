@@ -0,0 +1,79 @@
+#ifndef MINUTIAE_H
+#define MINUTIAE_H
+
+#include <stdint.h>
+
+#include "fingerprint.h"
+
+#define MINUTIAE_ALIGN 32
+
+/* Why a record was rejected; see minutiae_error_name. */
+enum {
+	MINUTIAE_OK,
+	MINUTIAE_E_FORMAT,
+	MINUTIAE_E_HEADER,
+	MINUTIAE_E_MAGIC,
+	MINUTIAE_E_RECORD_LENGTH,
+	MINUTIAE_E_VIEW_HEADER,
+	MINUTIAE_E_MINUTIAE,
+	MINUTIAE_E_EXT_BLOCK,
+	MINUTIAE_E_TRAILING,
+	MINUTIAE_E_TYPE,
+	MINUTIAE_E_ANGLE,
+	MINUTIAE_E_POSITION,
+	MINUTIAE_ERROR_CNT
+};
+
+/*
+ * An FMD decoded once into a self-contained block:
+ *
+ *   header    minutiae_header
+ *   views     one minutiae_view per view
+ *   x, y      uint16_t[stride] each
+ *   angle     uint8_t[stride], 256 steps to the circle whatever the format
+ *   type      uint8_t[stride]
+ *   quality   uint8_t[stride]
+ *
+ * Every array starts on a MINUTIAE_ALIGN boundary, as does the block, and
+ * stride is the total minutia count rounded up to MINUTIAE_ALIGN. A view's
+ * minutiae are the stretch [first, first + cnt) of each array.
+ */
+typedef struct minutiae_header {
+	uint32_t size;
+	uint32_t view_cnt;
+	uint32_t minutia_cnt;
+	uint32_t stride;
+} minutiae_header;
+
+typedef struct minutiae_view {
+	uint32_t first;
+	uint32_t cnt;
+	uint32_t offset;
+	uint8_t position;
+	uint8_t number;
+	uint8_t impression;
+	uint8_t quality;
+} minutiae_view;
+
+/* Pointers into a decoded block; see minutiae_open. */
+typedef struct minutiae {
+	unsigned int view_cnt;
+	unsigned int minutia_cnt;
+	const minutiae_view *views;
+	const uint16_t *x;
+	const uint16_t *y;
+	const uint8_t *angle;
+	const uint8_t *type;
+	const uint8_t *quality;
+} minutiae;
+
+int minutiae_check(DPFJ_FMD_FORMAT format, const unsigned char *fmd, unsigned int len, size_t *size);
+int minutiae_decode(DPFJ_FMD_FORMAT format, const unsigned char *fmd, unsigned int len, unsigned char *block);
+int minutiae_validate(DPFJ_FMD_FORMAT format, const unsigned char *fmd, unsigned int len);
+void minutiae_open(const unsigned char *block, minutiae *m);
+const char *minutiae_error_name(int code);
+VALUE minutiae_to_ruby(const unsigned char *block);
+
+void Init_minutiae();
+
+#endif
@@ -0,0 +1,288 @@
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "pool.h"
+
+#define POOL_MAX_THREADS 256
+
+/*
+ * Each participant in a job owns one queue: a range of task indices it
+ * takes from the front of. A participant whose queue runs dry steals the
+ * back half of someone else's. The caller owns queue 0 and worker n owns
+ * queue n; workers beyond the job's queue count sit it out.
+ */
+typedef struct pool_queue {
+	pthread_mutex_t lock;
+	unsigned int lo;
+	unsigned int hi;
+} pool_queue;
+
+typedef struct pool_job {
+	pool_task task;
+	void *arg;
+	pool_queue *queues;
+	unsigned int queue_cnt;
+	unsigned int pending;
+	unsigned int users;
+	int drained;
+	struct pool_job *next;
+} pool_job;
+
+/*
+ * pool_lock guards everything below, and each job's pending/users/drained.
+ * pool_alive[n] is set while worker n runs. A worker decides to exit and
+ * clears its flag without dropping the lock, so a shrink then regrow
+ * starts only the ids that are really gone and never runs two workers on
+ * one queue.
+ */
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_wake = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t pool_done = PTHREAD_COND_INITIALIZER;
+static pool_job *pool_jobs;
+static unsigned int pool_target = 1;
+static unsigned char pool_alive[POOL_MAX_THREADS];
+
+static int pool_pop(pool_queue *q, unsigned int *index) {
+	int found = 0;
+
+	pthread_mutex_lock(&q->lock);
+	if(q->lo < q->hi) {
+		*index = q->lo++;
+		found = 1;
+	}
+	pthread_mutex_unlock(&q->lock);
+
+	return found;
+}
+
+static int pool_steal(pool_job *job, unsigned int slot) {
+	pool_queue *own = &job->queues[slot];
+
+	for(unsigned int i = 1; i < job->queue_cnt; i++) {
+		pool_queue *victim = &job->queues[(slot + i) % job->queue_cnt];
+		unsigned int lo = 0, hi = 0;
+
+		pthread_mutex_lock(&victim->lock);
+		if(victim->lo < victim->hi) {
+			hi = victim->hi;
+			lo = hi - (hi - victim->lo + 1) / 2;
+			victim->hi = lo;
+		}
+		pthread_mutex_unlock(&victim->lock);
+
+		if(lo < hi) {
+			pthread_mutex_lock(&own->lock);
+			own->lo = lo;
+			own->hi = hi;
+			pthread_mutex_unlock(&own->lock);
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+/* Runs tasks until none are left to take. Returns how many it ran. */
+static unsigned int pool_work(pool_job *job, unsigned int slot) {
+	unsigned int index, done = 0;
+
+	for(;;) {
+		if(pool_pop(&job->queues[slot], &index)) {
+			job->task(job->arg, index);
+			done++;
+		} else if(!pool_steal(job, slot)) {
+			break;
+		}
+	}
+
+	return done;
+}
+
+static void pool_finish(pool_job *job, unsigned int done) {
+	job->pending -= done;
+	job->drained = 1;
+	if(job->pending == 0 && job->users == 0) {
+		pthread_cond_broadcast(&pool_done);
+	}
+}
+
+static void *pool_worker(void *ptr) {
+	unsigned int id = (unsigned int) (uintptr_t) ptr;
+
+	pthread_mutex_lock(&pool_lock);
+	while(id < pool_target) {
+		pool_job *job = pool_jobs;
+		unsigned int done;
+
+		while(job && (job->drained || id >= job->queue_cnt)) {
+			job = job->next;
+		}
+		if(!job) {
+			pthread_cond_wait(&pool_wake, &pool_lock);
+			continue;
+		}
+
+		job->users++;
+		pthread_mutex_unlock(&pool_lock);
+
+		done = pool_work(job, id);
+
+		pthread_mutex_lock(&pool_lock);
+		job->users--;
+		pool_finish(job, done);
+	}
+	pool_alive[id] = 0;
+	pthread_mutex_unlock(&pool_lock);
+
+	return NULL;
+}
+
+/* Called with pool_lock held. Workers never see signals meant for Ruby. */
+static void pool_spawn() {
+	sigset_t all, old;
+	pthread_attr_t attr;
+
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+	for(unsigned int id = 1; id < pool_target; id++) {
+		pthread_t thread;
+
+		if(pool_alive[id]) {
+			continue;
+		}
+		if(pthread_create(&thread, &attr, pool_worker, (void*) (uintptr_t) id) != 0) {
+			break;
+		}
+		pool_alive[id] = 1;
+	}
+
+	pthread_attr_destroy(&attr);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+void pool_run(unsigned int task_cnt, pool_task task, void *arg) {
+	pool_job job, **link;
+	unsigned int done;
+
+	pthread_mutex_lock(&pool_lock);
+	job.queue_cnt = pool_target < task_cnt ? pool_target : task_cnt;
+	job.queues = NULL;
+	if(job.queue_cnt > 1) {
+		job.queues = (pool_queue*) malloc(job.queue_cnt * sizeof(pool_queue));
+	}
+	/* Out of memory runs the tasks here too, just without help. */
+	if(!job.queues) {
+		pthread_mutex_unlock(&pool_lock);
+		for(unsigned int i = 0; i < task_cnt; i++) {
+			task(arg, i);
+		}
+		return;
+	}
+	pool_spawn();
+	pthread_mutex_unlock(&pool_lock);
+
+	job.task = task;
+	job.arg = arg;
+	job.pending = task_cnt;
+	job.users = 0;
+	job.drained = 0;
+	job.next = NULL;
+	for(unsigned int i = 0; i < job.queue_cnt; i++) {
+		pthread_mutex_init(&job.queues[i].lock, NULL);
+		job.queues[i].lo = (unsigned long long) task_cnt * i / job.queue_cnt;
+		job.queues[i].hi = (unsigned long long) task_cnt * (i + 1) / job.queue_cnt;
+	}
+
+	pthread_mutex_lock(&pool_lock);
+	for(link = &pool_jobs; *link; link = &(*link)->next);
+	*link = &job;
+	pthread_cond_broadcast(&pool_wake);
+	pthread_mutex_unlock(&pool_lock);
+
+	done = pool_work(&job, 0);
+
+	pthread_mutex_lock(&pool_lock);
+	pool_finish(&job, done);
+	while(job.pending || job.users) {
+		pthread_cond_wait(&pool_done, &pool_lock);
+	}
+	for(link = &pool_jobs; *link != &job; link = &(*link)->next);
+	*link = job.next;
+	pthread_mutex_unlock(&pool_lock);
+
+	for(unsigned int i = 0; i < job.queue_cnt; i++) {
+		pthread_mutex_destroy(&job.queues[i].lock);
+	}
+	free(job.queues);
+}
+
+unsigned int pool_threads() {
+	unsigned int n;
+
+	pthread_mutex_lock(&pool_lock);
+	n = pool_target;
+	pthread_mutex_unlock(&pool_lock);
+
+	return n;
+}
+
+/* Only the forking thread survives a fork; start the pool over. */
+static void pool_atfork_child() {
+	pthread_mutex_init(&pool_lock, NULL);
+	pthread_cond_init(&pool_wake, NULL);
+	pthread_cond_init(&pool_done, NULL);
+	pool_jobs = NULL;
+	memset(pool_alive, 0, sizeof(pool_alive));
+}
+
+VALUE pool_threads_wrapper(VALUE self) {
+	return UINT2NUM(pool_threads());
+}
+
+/*
+ * KeyMe::Fingerprint.threads = n
+ *
+ * Number of threads, the caller's included, that native searches are
+ * spread over. Defaults to the number of online CPUs.
+ */
+VALUE pool_set_threads_wrapper(VALUE self, VALUE n) {
+	unsigned int target = NUM2UINT(n);
+
+	if(target < 1 || target > POOL_MAX_THREADS) {
+		rb_raise(rb_eArgError, "threads must be between 1 and %d", POOL_MAX_THREADS);
+	}
+
+	pthread_mutex_lock(&pool_lock);
+	pool_target = target;
+	pthread_cond_broadcast(&pool_wake);
+	pthread_mutex_unlock(&pool_lock);
+
+	return n;
+}
+
+void Init_pool() {
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+	pool_target = cpus < 1 ? 1 : cpus > POOL_MAX_THREADS ? POOL_MAX_THREADS : cpus;
+	pthread_atfork(NULL, NULL, pool_atfork_child);
+
+	rb_define_singleton_method(
+		rb_mFingerprint,
+		"threads",
+		RUBY_METHOD_FUNC(pool_threads_wrapper),
+		0
+	);
+	rb_define_singleton_method(
+		rb_mFingerprint,
+		"threads=",
+		RUBY_METHOD_FUNC(pool_set_threads_wrapper),
+		1
+	);
+}
@@ -0,0 +1,20 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include "fingerprint.h"
+
+typedef void (*pool_task)(void *arg, unsigned int index);
+
+/*
+ * Runs task(arg, i) for every i below task_cnt on the extension's worker
+ * threads and returns once all of them have finished. The calling thread
+ * works too. Must be called with the GVL released; tasks must not touch
+ * Ruby objects.
+ */
+void pool_run(unsigned int task_cnt, pool_task task, void *arg);
+
+unsigned int pool_threads();
+
+void Init_pool();
+
+#endif
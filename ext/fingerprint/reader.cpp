@@ -0,0 +1,1149 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "reader.h"
+#include "stats.h"
+
+#define DEFAULT_STATUS_TTL 1.0
+
+VALUE rb_cReader;
+
+/* dpfpdd readers */
+
+static int dpfpdd_reader_capture(reader *r, DPFPDD_CAPTURE_PARAM *param, unsigned int timeout, DPFPDD_CAPTURE_RESULT *result, unsigned int *size, unsigned char *data) {
+	return dpfpdd_capture(r->dev, param, timeout, result, size, data);
+}
+
+static int dpfpdd_reader_cancel(reader *r) {
+	return dpfpdd_cancel(r->dev);
+}
+
+static int dpfpdd_reader_start_stream(reader *r) {
+	return dpfpdd_start_stream(r->dev);
+}
+
+static int dpfpdd_reader_stop_stream(reader *r) {
+	return dpfpdd_stop_stream(r->dev);
+}
+
+static int dpfpdd_reader_get_stream_image(reader *r, DPFPDD_CAPTURE_PARAM *param, DPFPDD_CAPTURE_RESULT *result, unsigned int *size, unsigned char *data) {
+	return dpfpdd_get_stream_image(r->dev, param, result, size, data);
+}
+
+static int dpfpdd_reader_close(reader *r) {
+	return dpfpdd_close(r->dev);
+}
+
+static int dpfpdd_reader_status(reader *r, DPFPDD_DEV_STATUS *status) {
+	return dpfpdd_get_device_status(r->dev, status);
+}
+
+static int dpfpdd_reader_capabilities(reader *r, DPFPDD_DEV_CAPS *caps) {
+	return dpfpdd_get_device_capabilities(r->dev, caps);
+}
+
+static int dpfpdd_reader_reset(reader *r) {
+	return dpfpdd_reset(r->dev);
+}
+
+static int dpfpdd_reader_calibrate(reader *r) {
+	return dpfpdd_calibrate(r->dev);
+}
+
+static const reader_ops dpfpdd_reader_ops = {
+	dpfpdd_reader_capture,
+	dpfpdd_reader_cancel,
+	dpfpdd_reader_start_stream,
+	dpfpdd_reader_stop_stream,
+	dpfpdd_reader_get_stream_image,
+	dpfpdd_reader_close,
+	dpfpdd_reader_status,
+	dpfpdd_reader_capabilities,
+	dpfpdd_reader_reset,
+	dpfpdd_reader_calibrate,
+};
+
+/* Fake readers */
+
+/*
+ * Sleeps for ns unless cancelled first. Returns 0 if cancelled. Called
+ * with f->lock held.
+ */
+static int fake_reader_wait(fake_reader *f, unsigned long long ns) {
+	struct timespec deadline;
+	int canceled;
+
+	clock_gettime(CLOCK_MONOTONIC, &deadline);
+	deadline.tv_sec += ns / 1000000000ull;
+	deadline.tv_nsec += ns % 1000000000ull;
+	if(deadline.tv_nsec >= 1000000000) {
+		deadline.tv_sec++;
+		deadline.tv_nsec -= 1000000000;
+	}
+
+	f->canceled = 0;
+	f->waiting = 1;
+	while(!f->canceled) {
+		if(pthread_cond_timedwait(&f->wake, &f->lock, &deadline) == ETIMEDOUT) {
+			break;
+		}
+	}
+	canceled = f->canceled;
+	f->waiting = 0;
+
+	return !canceled;
+}
+
+/*
+ * Hands out the next frame after the interval, the way dpfpdd fills in a
+ * capture: a timeout or cancel is a successful call with that quality.
+ * A buffer too small for the largest frame is turned away up front.
+ */
+static int fake_reader_frame(reader *r, DPFPDD_CAPTURE_PARAM *param, unsigned int timeout, DPFPDD_CAPTURE_RESULT *result, unsigned int *size, unsigned char *data) {
+	fake_reader *f = &r->fake;
+	reader_frame *frame;
+	unsigned long long wait = f->interval_ns;
+	int timed_out = 0;
+
+	if(param->image_fmt != DPFPDD_IMG_FMT_PIXEL_BUFFER) {
+		return DPFPDD_E_INVALID_PARAMETER;
+	}
+
+	pthread_mutex_lock(&f->lock);
+	frame = &f->frames[f->next];
+	if(*size < f->max_size) {
+		*size = f->max_size;
+		pthread_mutex_unlock(&f->lock);
+		return DPFPDD_E_MORE_DATA;
+	}
+	if(timeout != (unsigned int) -1 && (unsigned long long) timeout * 1000000 < wait) {
+		wait = (unsigned long long) timeout * 1000000;
+		timed_out = 1;
+	}
+
+	memset(result, 0, sizeof(*result));
+	result->size = sizeof(*result);
+	if(!fake_reader_wait(f, wait)) {
+		result->quality = DPFPDD_QUALITY_CANCELED;
+	} else if(timed_out) {
+		result->quality = DPFPDD_QUALITY_TIMED_OUT;
+	} else {
+		memcpy(data, frame->image, frame->size);
+		*size = frame->size;
+		result->success = frame->quality == DPFPDD_QUALITY_GOOD;
+		result->quality = frame->quality;
+		result->score = frame->score;
+		result->info.size = sizeof(result->info);
+		result->info.width = frame->width;
+		result->info.height = frame->height;
+		result->info.res = frame->res;
+		result->info.bpp = 8;
+		f->next = (f->next + 1) % f->frame_cnt;
+	}
+	pthread_mutex_unlock(&f->lock);
+
+	return DPFPDD_SUCCESS;
+}
+
+static int fake_reader_capture(reader *r, DPFPDD_CAPTURE_PARAM *param, unsigned int timeout, DPFPDD_CAPTURE_RESULT *result, unsigned int *size, unsigned char *data) {
+	if(r->fake.streaming) {
+		return DPFPDD_E_DEVICE_BUSY;
+	}
+
+	return fake_reader_frame(r, param, timeout, result, size, data);
+}
+
+static int fake_reader_cancel(reader *r) {
+	fake_reader *f = &r->fake;
+
+	pthread_mutex_lock(&f->lock);
+	if(f->waiting) {
+		f->canceled = 1;
+		pthread_cond_broadcast(&f->wake);
+	}
+	pthread_mutex_unlock(&f->lock);
+
+	return DPFPDD_SUCCESS;
+}
+
+static int fake_reader_start_stream(reader *r) {
+	r->fake.streaming = 1;
+
+	return DPFPDD_SUCCESS;
+}
+
+static int fake_reader_stop_stream(reader *r) {
+	r->fake.streaming = 0;
+
+	return DPFPDD_SUCCESS;
+}
+
+static int fake_reader_get_stream_image(reader *r, DPFPDD_CAPTURE_PARAM *param, DPFPDD_CAPTURE_RESULT *result, unsigned int *size, unsigned char *data) {
+	if(!r->fake.streaming) {
+		return DPFPDD_E_FAILURE;
+	}
+
+	return fake_reader_frame(r, param, (unsigned int) -1, result, size, data);
+}
+
+static int fake_reader_close(reader *r) {
+	return DPFPDD_SUCCESS;
+}
+
+static int fake_reader_status(reader *r, DPFPDD_DEV_STATUS *status) {
+	status->size = sizeof(*status);
+	status->status = r->fake.streaming ? DPFPDD_STATUS_BUSY : r->fake.status;
+	status->finger_detected = 0;
+
+	return DPFPDD_SUCCESS;
+}
+
+/* Can capture and stream, and calibrate, at the resolutions of its frames. */
+static int fake_reader_capabilities(reader *r, DPFPDD_DEV_CAPS *caps) {
+	fake_reader *f = &r->fake;
+	unsigned int res[32], res_cnt = 0, need;
+
+	for(unsigned int i = 0; i < f->frame_cnt && res_cnt < 32; i++) {
+		unsigned int j = 0;
+
+		while(j < res_cnt && res[j] != f->frames[i].res) {
+			j++;
+		}
+		if(j == res_cnt) {
+			res[res_cnt++] = f->frames[i].res;
+		}
+	}
+
+	need = sizeof(DPFPDD_DEV_CAPS) + (res_cnt - 1) * sizeof(unsigned int);
+	if(caps->size < need) {
+		caps->size = need;
+		return DPFPDD_E_MORE_DATA;
+	}
+
+	memset(caps, 0, need);
+	caps->size = need;
+	caps->can_capture_image = 1;
+	caps->can_stream_image = 1;
+	caps->has_calibration = 1;
+	caps->resolution_cnt = res_cnt;
+	memcpy(caps->resolutions, res, res_cnt * sizeof(unsigned int));
+
+	return DPFPDD_SUCCESS;
+}
+
+static int fake_reader_reset(reader *r) {
+	r->fake.status = DPFPDD_STATUS_READY;
+
+	return DPFPDD_SUCCESS;
+}
+
+static int fake_reader_calibrate(reader *r) {
+	r->fake.status = DPFPDD_STATUS_READY;
+
+	return DPFPDD_SUCCESS;
+}
+
+static const reader_ops fake_reader_ops = {
+	fake_reader_capture,
+	fake_reader_cancel,
+	fake_reader_start_stream,
+	fake_reader_stop_stream,
+	fake_reader_get_stream_image,
+	fake_reader_close,
+	fake_reader_status,
+	fake_reader_capabilities,
+	fake_reader_reset,
+	fake_reader_calibrate,
+};
+
+/* Status and capabilities */
+
+double reader_now() {
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+/*
+ * Reads the capabilities and learns how big an image is at the largest
+ * resolution by offering a capture an empty buffer: dpfpdd answers
+ * DPFPDD_E_MORE_DATA with the size before it waits for a finger. A reader
+ * that will not say is left to size its buffers on the first frame.
+ * Called without the GVL. Returns a dpfpdd code, naming the call that
+ * failed in *call.
+ */
+static int reader_prepare(reader *r, const char **call) {
+	DPFPDD_CAPTURE_PARAM param;
+	DPFPDD_CAPTURE_RESULT result;
+	unsigned char probe;
+	unsigned int size = 0;
+	int rc;
+
+	r->caps = (DPFPDD_DEV_CAPS*) malloc(sizeof(DPFPDD_DEV_CAPS));
+	if(!r->caps) {
+		*call = "malloc";
+		return DPFPDD_E_FAILURE;
+	}
+	r->caps->size = sizeof(DPFPDD_DEV_CAPS);
+	rc = r->ops->capabilities(r, r->caps);
+	if(rc == DPFPDD_E_MORE_DATA) {
+		DPFPDD_DEV_CAPS *caps = (DPFPDD_DEV_CAPS*) realloc(r->caps, r->caps->size);
+
+		if(!caps) {
+			*call = "malloc";
+			return DPFPDD_E_FAILURE;
+		}
+		r->caps = caps;
+		rc = r->ops->capabilities(r, r->caps);
+	}
+	if(rc != DPFPDD_SUCCESS) {
+		*call = "dpfpdd_get_device_capabilities";
+		return rc;
+	}
+
+	r->max_res = DEFAULT_READER_DPI;
+	for(unsigned int i = 0; i < r->caps->resolution_cnt; i++) {
+		if(i == 0 || r->caps->resolutions[i] > r->max_res) {
+			r->max_res = r->caps->resolutions[i];
+		}
+	}
+
+	param.size = sizeof(param);
+	param.image_fmt = DPFPDD_IMG_FMT_PIXEL_BUFFER;
+	param.image_proc = DPFPDD_IMG_PROC_NONE;
+	param.image_res = r->max_res;
+	result.size = sizeof(result);
+	if(r->caps->can_capture_image && r->ops->capture(r, &param, 0, &result, &size, &probe) == DPFPDD_E_MORE_DATA) {
+		r->image_size = size;
+		r->image = (unsigned char*) malloc(size);
+		if(!r->image) {
+			*call = "malloc";
+			return DPFPDD_E_FAILURE;
+		}
+	}
+
+	return DPFPDD_SUCCESS;
+}
+
+/*
+ * Re-reads the status into the cache if it is older than status_ttl.
+ * Called without the GVL by the reader's owner, and by Reader#status.
+ * The reading goes into a buffer of its own that is swapped in under
+ * lock once it succeeds, so status is never NULL or half written while
+ * the lock is dropped, and concurrent refreshes each free what they
+ * replace.
+ */
+static int reader_refresh(reader *r, const char **call) {
+	DPFPDD_DEV_STATUS *status, *old;
+	unsigned int size = sizeof(DPFPDD_DEV_STATUS);
+	int rc;
+
+	pthread_mutex_lock(&r->lock);
+	if(r->status && reader_now() - r->status_at < r->status_ttl) {
+		pthread_mutex_unlock(&r->lock);
+		return DPFPDD_SUCCESS;
+	}
+	if(r->status && r->status->size > size) {
+		size = r->status->size;
+	}
+	pthread_mutex_unlock(&r->lock);
+
+	status = (DPFPDD_DEV_STATUS*) malloc(size);
+	if(!status) {
+		*call = "malloc";
+		return DPFPDD_E_FAILURE;
+	}
+	status->size = size;
+	rc = r->ops->status(r, status);
+	if(rc == DPFPDD_E_MORE_DATA) {
+		DPFPDD_DEV_STATUS *bigger = (DPFPDD_DEV_STATUS*) realloc(status, status->size);
+
+		if(bigger) {
+			status = bigger;
+			rc = r->ops->status(r, status);
+		} else {
+			rc = DPFPDD_E_FAILURE;
+		}
+	}
+
+	pthread_mutex_lock(&r->lock);
+	if(rc == DPFPDD_SUCCESS) {
+		old = r->status;
+		r->status = status;
+		r->status_at = reader_now();
+	} else {
+		old = status;
+		r->status_at = 0;
+	}
+	r->status_reads++;
+	pthread_mutex_unlock(&r->lock);
+
+	free(old);
+
+	if(rc != DPFPDD_SUCCESS) {
+		*call = "dpfpdd_get_device_status";
+	}
+
+	return rc;
+}
+
+/*
+ * Makes sure the reader can capture: a reader asking for calibration is
+ * calibrated and one that has failed is reset, and the status re-read.
+ * Called without the GVL by the reader's owner before it captures.
+ */
+int reader_ready(reader *r, const char **call) {
+	DPFPDD_STATUS status;
+	int rc = reader_refresh(r, call);
+
+	if(rc != DPFPDD_SUCCESS) {
+		return rc;
+	}
+
+	pthread_mutex_lock(&r->lock);
+	status = r->status->status;
+	pthread_mutex_unlock(&r->lock);
+
+	if(status == DPFPDD_STATUS_NEED_CALIBRATION || status == DPFPDD_STATUS_FAILURE) {
+		if(status == DPFPDD_STATUS_NEED_CALIBRATION) {
+			rc = r->ops->calibrate(r);
+			*call = "dpfpdd_calibrate";
+		} else {
+			rc = r->ops->reset(r);
+			*call = "dpfpdd_reset";
+		}
+
+		pthread_mutex_lock(&r->lock);
+		if(status == DPFPDD_STATUS_NEED_CALIBRATION) {
+			r->calibrations++;
+		} else {
+			r->resets++;
+		}
+		r->status_at = 0;
+		pthread_mutex_unlock(&r->lock);
+
+		if(rc != DPFPDD_SUCCESS) {
+			return rc;
+		}
+		rc = reader_refresh(r, call);
+		if(rc != DPFPDD_SUCCESS) {
+			return rc;
+		}
+
+		pthread_mutex_lock(&r->lock);
+		status = r->status->status;
+		pthread_mutex_unlock(&r->lock);
+	}
+
+	if(status == DPFPDD_STATUS_FAILURE) {
+		*call = "dpfpdd_reset";
+		return DPFPDD_E_DEVICE_FAILURE;
+	}
+
+	return DPFPDD_SUCCESS;
+}
+
+typedef struct reader_args {
+	reader *r;
+	const char *call;
+	int rc;
+} reader_args;
+
+static void *prepare_without_gvl(void *ptr) {
+	reader_args *args = (reader_args*) ptr;
+
+	args->rc = reader_prepare(args->r, &args->call);
+
+	return NULL;
+}
+
+static void *refresh_without_gvl(void *ptr) {
+	reader_args *args = (reader_args*) ptr;
+
+	args->rc = reader_refresh(args->r, &args->call);
+
+	return NULL;
+}
+
+/* Ruby objects */
+
+void reader_retain(reader *r) {
+	__atomic_fetch_add(&r->refs, 1, __ATOMIC_RELAXED);
+}
+
+void reader_release(reader *r) {
+	if(!r || __atomic_sub_fetch(&r->refs, 1, __ATOMIC_ACQ_REL) != 0) {
+		return;
+	}
+
+	if(!r->closed) {
+		r->ops->close(r);
+	}
+	for(unsigned int i = 0; i < r->fake.frame_cnt; i++) {
+		xfree(r->fake.frames[i].image);
+	}
+	xfree(r->fake.frames);
+	free(r->caps);
+	free(r->image);
+	free(r->status);
+	pthread_mutex_destroy(&r->fake.lock);
+	pthread_cond_destroy(&r->fake.wake);
+	pthread_mutex_destroy(&r->lock);
+	xfree(r);
+}
+
+static void reader_free(void *ptr) {
+	reader_release((reader*) ptr);
+}
+
+static size_t reader_memsize(const void *ptr) {
+	const reader *r = (const reader*) ptr;
+	size_t size = sizeof(reader);
+
+	if(r) {
+		size += r->image_size;
+		size += r->fake.frame_cnt * sizeof(reader_frame);
+		for(unsigned int i = 0; i < r->fake.frame_cnt; i++) {
+			size += r->fake.frames[i].size;
+		}
+	}
+
+	return size;
+}
+
+static const rb_data_type_t reader_type = {
+	"KeyMe::Fingerprint::Reader",
+	{ NULL, reader_free, reader_memsize, },
+	NULL, NULL,
+	RUBY_TYPED_FREE_IMMEDIATELY,
+};
+
+int is_reader(VALUE obj) {
+	return rb_typeddata_is_kind_of(obj, &reader_type);
+}
+
+/* Raises unless obj is an open Reader. */
+reader *get_reader(VALUE obj) {
+	reader *r = (reader*) rb_check_typeddata(obj, &reader_type);
+
+	if(!r || r->closed) {
+		rb_raise(rb_eFingerprintError, "reader is closed");
+	}
+
+	return r;
+}
+
+/*
+ * Hands r to a pipeline for its exclusive use, with a reference of its
+ * own. Raises if another pipeline has it.
+ */
+reader *reader_claim(VALUE obj) {
+	reader *r = get_reader(obj);
+
+	if(r->in_use) {
+		rb_raise(rb_eFingerprintError, "reader is in use");
+	}
+	r->in_use = 1;
+	reader_retain(r);
+
+	return r;
+}
+
+void reader_unclaim(reader *r) {
+	r->in_use = 0;
+	reader_release(r);
+}
+
+static reader *reader_new(const reader_ops *ops) {
+	reader *r = ZALLOC(reader);
+	pthread_condattr_t attr;
+
+	r->ops = ops;
+	r->refs = 1;
+	r->status_ttl = DEFAULT_STATUS_TTL;
+	pthread_mutex_init(&r->lock, NULL);
+	pthread_mutex_init(&r->fake.lock, NULL);
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&r->fake.wake, &attr);
+	pthread_condattr_destroy(&attr);
+
+	return r;
+}
+
+static VALUE reader_alloc(VALUE klass) {
+	return TypedData_Wrap_Struct(klass, &reader_type, NULL);
+}
+
+/* Reads r's capabilities and sizes its buffer; see reader_prepare. */
+static void reader_prepare_or_raise(reader *r) {
+	reader_args args;
+
+	args.r = r;
+	args.call = NULL;
+	stats_without_gvl(prepare_without_gvl, &args, NULL, NULL);
+	check_dpfj(args.rc, args.call);
+}
+
+/* dpfpdd wants one dpfpdd_init per process before anything else. */
+static void reader_library_init() {
+	static int initialized;
+
+	if(!initialized) {
+		check_dpfj(dpfpdd_init(), "dpfpdd_init");
+		initialized = 1;
+	}
+}
+
+typedef struct query_args {
+	unsigned int cnt;
+	DPFPDD_DEV_INFO *infos;
+	int rc;
+} query_args;
+
+static void *query_without_gvl(void *ptr) {
+	query_args *args = (query_args*) ptr;
+
+	for(;;) {
+		unsigned int capa = args->cnt;
+
+		for(unsigned int i = 0; i < capa; i++) {
+			args->infos[i].size = sizeof(DPFPDD_DEV_INFO);
+		}
+		args->rc = dpfpdd_query_devices(&args->cnt, args->infos);
+		if(args->rc != DPFPDD_E_MORE_DATA) {
+			break;
+		}
+
+		free(args->infos);
+		args->infos = (DPFPDD_DEV_INFO*) malloc(args->cnt * sizeof(DPFPDD_DEV_INFO));
+		if(!args->infos) {
+			args->rc = DPFPDD_E_FAILURE;
+			args->cnt = 0;
+			break;
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * KeyMe::Fingerprint::Reader.devices
+ *
+ * Every connected reader, as Hashes of name, vendor, product, serial,
+ * vendor_id and product_id. A name opens its reader.
+ */
+VALUE reader_devices(VALUE klass) {
+	query_args args;
+	VALUE result;
+
+	reader_library_init();
+
+	args.cnt = 0;
+	args.infos = NULL;
+	stats_without_gvl(query_without_gvl, &args, NULL, NULL);
+	if(args.rc != DPFPDD_SUCCESS) {
+		free(args.infos);
+		check_dpfj(args.rc, "dpfpdd_query_devices");
+	}
+
+	result = rb_ary_new_capa(args.cnt);
+	for(unsigned int i = 0; i < args.cnt; i++) {
+		DPFPDD_DEV_INFO *info = &args.infos[i];
+		VALUE device = rb_hash_new();
+
+		rb_hash_aset(device, ID2SYM(rb_intern("name")), rb_str_new_cstr(info->name));
+		rb_hash_aset(device, ID2SYM(rb_intern("vendor")), rb_str_new_cstr(info->descr.vendor_name));
+		rb_hash_aset(device, ID2SYM(rb_intern("product")), rb_str_new_cstr(info->descr.product_name));
+		rb_hash_aset(device, ID2SYM(rb_intern("serial")), rb_str_new_cstr(info->descr.serial_num));
+		rb_hash_aset(device, ID2SYM(rb_intern("vendor_id")), UINT2NUM(info->id.vendor_id));
+		rb_hash_aset(device, ID2SYM(rb_intern("product_id")), UINT2NUM(info->id.product_id));
+		rb_ary_push(result, device);
+	}
+	free(args.infos);
+
+	return result;
+}
+
+typedef struct open_args {
+	char *name;
+	DPFPDD_DEV dev;
+	int rc;
+	int done;
+} open_args;
+
+static void *open_without_gvl(void *ptr) {
+	open_args *args = (open_args*) ptr;
+
+	args->rc = dpfpdd_open(args->name, &args->dev);
+	args->done = 1;
+
+	return NULL;
+}
+
+/*
+ * KeyMe::Fingerprint::Reader.new(name = nil)
+ *
+ * Opens the named reader, or the first one connected, and reads its
+ * capabilities.
+ */
+VALUE reader_initialize(int argc, VALUE *argv, VALUE self) {
+	VALUE name;
+	open_args args;
+	reader *r;
+
+	rb_scan_args(argc, argv, "01", &name);
+	if(DATA_PTR(self)) {
+		rb_raise(rb_eFingerprintError, "reader is already open");
+	}
+
+	reader_library_init();
+
+	if(NIL_P(name)) {
+		VALUE devices = reader_devices(rb_cReader);
+
+		if(RARRAY_LEN(devices) == 0) {
+			rb_raise(rb_eFingerprintError, "no fingerprint readers connected");
+		}
+		name = rb_hash_aref(rb_ary_entry(devices, 0), ID2SYM(rb_intern("name")));
+	}
+	StringValueCStr(name);
+	if(RSTRING_LEN(name) >= MAX_DEVICE_NAME_LENGTH) {
+		rb_raise(rb_eArgError, "reader name too long");
+	}
+
+	/*
+	 * r is owned by self, closed, before the device is opened, and the
+	 * _gvl2 call leaves interrupts to us, so an open handle always has
+	 * somewhere to be closed from.
+	 */
+	r = reader_new(&dpfpdd_reader_ops);
+	memcpy(r->name, RSTRING_PTR(name), RSTRING_LEN(name) + 1);
+	r->closed = 1;
+	DATA_PTR(self) = r;
+
+	args.name = r->name;
+	args.dev = NULL;
+	args.done = 0;
+	do {
+		stats_without_gvl2(open_without_gvl, &args, NULL, NULL);
+		if(!args.done) {
+			rb_thread_check_ints();
+		}
+	} while(!args.done);
+	if(args.rc != DPFPDD_SUCCESS) {
+		check_dpfj(args.rc, "dpfpdd_open");
+	}
+	r->dev = args.dev;
+	r->closed = 0;
+	rb_thread_check_ints();
+
+	reader_prepare_or_raise(r);
+
+	return self;
+}
+
+static unsigned int frame_uint(VALUE frame, const char *key, unsigned int missing) {
+	VALUE value = rb_hash_lookup2(frame, ID2SYM(rb_intern(key)), Qundef);
+
+	return value == Qundef ? missing : NUM2UINT(value);
+}
+
+/*
+ * KeyMe::Fingerprint::Reader.fake(frames, interval: 0.05, status: STATUS_READY)
+ *
+ * A reader that needs no hardware. It captures frames in turn, over and
+ * over, one every interval seconds. Each frame is a Hash of an 8-bit raw
+ * image, width and height, and optionally dpi (500), score (0) and quality
+ * (QUALITY_GOOD). It reports status until it is reset or calibrated.
+ */
+VALUE reader_fake(int argc, VALUE *argv, VALUE klass) {
+	VALUE frames, opts, obj;
+	ID keys[2];
+	VALUE values[2];
+	reader *r;
+	fake_reader *f;
+	double interval;
+	long cnt;
+
+	rb_scan_args(argc, argv, "1:", &frames, &opts);
+	Check_Type(frames, T_ARRAY);
+
+	keys[0] = rb_intern("interval");
+	keys[1] = rb_intern("status");
+	rb_get_kwargs(opts, keys, 0, 2, values);
+	interval = values[0] == Qundef ? 0.05 : NUM2DBL(values[0]);
+	if(interval < 0) {
+		rb_raise(rb_eArgError, "interval must not be negative");
+	}
+
+	cnt = RARRAY_LEN(frames);
+	if(cnt == 0) {
+		rb_raise(rb_eArgError, "a fake reader needs at least one frame");
+	}
+
+	obj = reader_alloc(klass);
+	r = reader_new(&fake_reader_ops);
+	DATA_PTR(obj) = r;
+	snprintf(r->name, sizeof(r->name), "fake");
+
+	f = &r->fake;
+	f->interval_ns = (unsigned long long) (interval * 1e9);
+	f->status = values[1] == Qundef ? DPFPDD_STATUS_READY : NUM2UINT(values[1]);
+	f->frames = ZALLOC_N(reader_frame, cnt);
+	for(long i = 0; i < cnt; i++) {
+		VALUE frame = rb_ary_entry(frames, i);
+		reader_frame *fr = &f->frames[i];
+		VALUE image;
+
+		Check_Type(frame, T_HASH);
+		image = rb_hash_aref(frame, ID2SYM(rb_intern("image")));
+		Check_Type(image, T_STRING);
+
+		fr->width = frame_uint(frame, "width", 0);
+		fr->height = frame_uint(frame, "height", 0);
+		fr->res = frame_uint(frame, "dpi", DEFAULT_READER_DPI);
+		fr->score = frame_uint(frame, "score", 0);
+		fr->quality = frame_uint(frame, "quality", DPFPDD_QUALITY_GOOD);
+		if((unsigned long long) fr->width * fr->height != (unsigned long long) RSTRING_LEN(image)) {
+			rb_raise(rb_eArgError, "frame %ld is not width * height bytes", i);
+		}
+
+		fr->size = RSTRING_LEN(image);
+		fr->image = ALLOC_N(unsigned char, fr->size);
+		memcpy(fr->image, RSTRING_PTR(image), fr->size);
+		f->frame_cnt++;
+		if(fr->size > f->max_size) {
+			f->max_size = fr->size;
+		}
+	}
+
+	reader_prepare_or_raise(r);
+
+	return obj;
+}
+
+VALUE reader_name(VALUE self) {
+	return rb_str_new_cstr(get_reader(self)->name);
+}
+
+VALUE reader_fake_p(VALUE self) {
+	return get_reader(self)->ops == &fake_reader_ops ? Qtrue : Qfalse;
+}
+
+VALUE reader_closed_p(VALUE self) {
+	reader *r = (reader*) rb_check_typeddata(self, &reader_type);
+
+	return !r || r->closed ? Qtrue : Qfalse;
+}
+
+/*
+ * Releases the reader. Raises while a capture pipeline is using it.
+ */
+VALUE reader_close(VALUE self) {
+	reader *r = (reader*) rb_check_typeddata(self, &reader_type);
+
+	if(!r || r->closed) {
+		return Qnil;
+	}
+	if(r->in_use) {
+		rb_raise(rb_eFingerprintError, "reader is in use");
+	}
+
+	r->closed = 1;
+	check_dpfj(r->ops->close(r), "dpfpdd_close");
+
+	return Qnil;
+}
+
+static VALUE caps_flag(int flag) {
+	return flag ? Qtrue : Qfalse;
+}
+
+/*
+ * What the reader can do, as read when it was opened: a Hash of flags,
+ * the resolutions it captures at, and the size in bytes of an image at
+ * the largest of them (nil if the reader would not say).
+ */
+VALUE reader_capabilities(VALUE self) {
+	reader *r = get_reader(self);
+	DPFPDD_DEV_CAPS *caps = r->caps;
+	VALUE result = rb_hash_new(), resolutions;
+
+	rb_hash_aset(result, ID2SYM(rb_intern("capture")), caps_flag(caps->can_capture_image));
+	rb_hash_aset(result, ID2SYM(rb_intern("stream")), caps_flag(caps->can_stream_image));
+	rb_hash_aset(result, ID2SYM(rb_intern("extract")), caps_flag(caps->can_extract_features));
+	rb_hash_aset(result, ID2SYM(rb_intern("match")), caps_flag(caps->can_match));
+	rb_hash_aset(result, ID2SYM(rb_intern("identify")), caps_flag(caps->can_identify));
+	rb_hash_aset(result, ID2SYM(rb_intern("storage")), caps_flag(caps->has_fp_storage));
+	rb_hash_aset(result, ID2SYM(rb_intern("calibration")), caps_flag(caps->has_calibration));
+	rb_hash_aset(result, ID2SYM(rb_intern("power_management")), caps_flag(caps->has_pwr_mgmt));
+	rb_hash_aset(result, ID2SYM(rb_intern("piv")), caps_flag(caps->piv_compliant));
+
+	resolutions = rb_ary_new_capa(caps->resolution_cnt);
+	for(unsigned int i = 0; i < caps->resolution_cnt; i++) {
+		rb_ary_push(resolutions, UINT2NUM(caps->resolutions[i]));
+	}
+	rb_hash_aset(result, ID2SYM(rb_intern("resolutions")), resolutions);
+	rb_hash_aset(result, ID2SYM(rb_intern("image_size")), r->image_size ? UINT2NUM(r->image_size) : Qnil);
+
+	return result;
+}
+
+static VALUE status_symbol(DPFPDD_STATUS status) {
+	switch(status) {
+	case DPFPDD_STATUS_READY:
+		return ID2SYM(rb_intern("ready"));
+	case DPFPDD_STATUS_BUSY:
+		return ID2SYM(rb_intern("busy"));
+	case DPFPDD_STATUS_NEED_CALIBRATION:
+		return ID2SYM(rb_intern("need_calibration"));
+	case DPFPDD_STATUS_FAILURE:
+		return ID2SYM(rb_intern("failure"));
+	}
+
+	return UINT2NUM(status);
+}
+
+/*
+ * The reader's status, as a Hash of status (:ready, :busy,
+ * :need_calibration or :failure), finger_detected, and the age in seconds
+ * of the reading. A reading younger than status_ttl is answered from the
+ * cache; while a capture pipeline owns the reader, the reader reports
+ * itself busy.
+ */
+VALUE reader_status(VALUE self) {
+	reader *r = get_reader(self);
+	VALUE result = rb_hash_new();
+	DPFPDD_STATUS status;
+	int finger_detected;
+	double age;
+
+	if(r->in_use) {
+		rb_hash_aset(result, ID2SYM(rb_intern("status")), status_symbol(DPFPDD_STATUS_BUSY));
+		rb_hash_aset(result, ID2SYM(rb_intern("finger_detected")), Qnil);
+		rb_hash_aset(result, ID2SYM(rb_intern("age")), DBL2NUM(0.0));
+		return result;
+	}
+
+	{
+		reader_args args;
+
+		args.r = r;
+		args.call = NULL;
+		stats_without_gvl(refresh_without_gvl, &args, NULL, NULL);
+		check_dpfj(args.rc, args.call);
+	}
+
+	pthread_mutex_lock(&r->lock);
+	status = r->status->status;
+	finger_detected = r->status->finger_detected;
+	age = reader_now() - r->status_at;
+	pthread_mutex_unlock(&r->lock);
+
+	rb_hash_aset(result, ID2SYM(rb_intern("status")), status_symbol(status));
+	rb_hash_aset(result, ID2SYM(rb_intern("finger_detected")), finger_detected ? Qtrue : Qfalse);
+	rb_hash_aset(result, ID2SYM(rb_intern("age")), DBL2NUM(age));
+
+	return result;
+}
+
+VALUE reader_status_ttl(VALUE self) {
+	return DBL2NUM(get_reader(self)->status_ttl);
+}
+
+VALUE reader_set_status_ttl(VALUE self, VALUE ttl) {
+	reader *r = get_reader(self);
+	double seconds = NUM2DBL(ttl);
+
+	if(seconds < 0) {
+		rb_raise(rb_eArgError, "status_ttl must not be negative");
+	}
+
+	pthread_mutex_lock(&r->lock);
+	r->status_ttl = seconds;
+	pthread_mutex_unlock(&r->lock);
+
+	return ttl;
+}
+
+typedef struct single_capture {
+	reader *r;
+	DPFPDD_CAPTURE_PARAM param;
+	DPFPDD_CAPTURE_RESULT result;
+	unsigned int timeout;
+	unsigned int size;
+	const char *call;
+	int rc;
+} single_capture;
+
+static void *single_capture_without_gvl(void *ptr) {
+	single_capture *c = (single_capture*) ptr;
+	uint64_t start;
+
+	c->rc = reader_ready(c->r, &c->call);
+	if(c->rc != DPFPDD_SUCCESS) {
+		return NULL;
+	}
+
+	c->size = c->r->image_size;
+	c->result.size = sizeof(c->result);
+	start = stats_start();
+	c->rc = c->r->ops->capture(c->r, &c->param, c->timeout, &c->result, &c->size, c->r->image);
+	stats_since(STATS_CAPTURE, start);
+	c->call = "dpfpdd_capture";
+
+	return NULL;
+}
+
+static void single_capture_ubf(void *ptr) {
+	single_capture *c = (single_capture*) ptr;
+
+	c->r->ops->cancel(c->r);
+}
+
+/*
+ * KeyMe::Fingerprint::Reader#capture(timeout: nil, dpi: 500)
+ *
+ * Captures one image into the buffer sized when the reader was opened,
+ * calibrating or resetting the reader first if its status asks for it.
+ * Waits for a finger for up to timeout seconds, or for ever. Returns a
+ * Hash of image, width, height, dpi, quality and score; image is nil
+ * unless a finger was captured.
+ */
+VALUE reader_capture(int argc, VALUE *argv, VALUE self) {
+	VALUE opts, result;
+	ID keys[2];
+	VALUE values[2];
+	single_capture c;
+	DPFPDD_QUALITY quality;
+
+	rb_scan_args(argc, argv, ":", &opts);
+	keys[0] = rb_intern("timeout");
+	keys[1] = rb_intern("dpi");
+	rb_get_kwargs(opts, keys, 0, 2, values);
+
+	memset(&c, 0, sizeof(c));
+	c.timeout = NIL_P(values[0]) || values[0] == Qundef ? (unsigned int) -1 : (unsigned int) (NUM2DBL(values[0]) * 1000);
+	c.param.size = sizeof(c.param);
+	c.param.image_fmt = DPFPDD_IMG_FMT_PIXEL_BUFFER;
+	c.param.image_proc = DPFPDD_IMG_PROC_NONE;
+	c.param.image_res = values[1] == Qundef ? DEFAULT_READER_DPI : NUM2UINT(values[1]);
+
+	c.r = reader_claim(self);
+	if(!c.r->image) {
+		reader_unclaim(c.r);
+		rb_raise(rb_eFingerprintError, "reader cannot capture images");
+	}
+
+	/* Not run at all if an interrupt is already pending; see capture_pop. */
+	c.result.quality = DPFPDD_QUALITY_CANCELED;
+	rb_thread_call_without_gvl2(single_capture_without_gvl, &c, single_capture_ubf, &c);
+	quality = c.result.quality;
+
+	pthread_mutex_lock(&c.r->lock);
+	c.r->captures++;
+	pthread_mutex_unlock(&c.r->lock);
+
+	result = rb_hash_new();
+	if(c.rc == DPFPDD_SUCCESS && quality != DPFPDD_QUALITY_CANCELED && quality != DPFPDD_QUALITY_TIMED_OUT) {
+		rb_hash_aset(result, ID2SYM(rb_intern("image")), rb_str_new((const char*) c.r->image, c.size));
+	} else {
+		rb_hash_aset(result, ID2SYM(rb_intern("image")), Qnil);
+	}
+	reader_unclaim(c.r);
+
+	rb_thread_check_ints();
+	check_dpfj(c.rc, c.call);
+
+	rb_hash_aset(result, ID2SYM(rb_intern("width")), UINT2NUM(c.result.info.width));
+	rb_hash_aset(result, ID2SYM(rb_intern("height")), UINT2NUM(c.result.info.height));
+	rb_hash_aset(result, ID2SYM(rb_intern("dpi")), UINT2NUM(c.result.info.res));
+	rb_hash_aset(result, ID2SYM(rb_intern("quality")), UINT2NUM(quality));
+	rb_hash_aset(result, ID2SYM(rb_intern("score")), UINT2NUM(c.result.score));
+
+	return result;
+}
+
+/*
+ * Counts of captures, status reads, resets and calibrations made through
+ * this reader.
+ */
+VALUE reader_stats(VALUE self) {
+	reader *r = get_reader(self);
+	unsigned long long counts[4];
+	VALUE result = rb_hash_new();
+
+	pthread_mutex_lock(&r->lock);
+	counts[0] = r->captures;
+	counts[1] = r->status_reads;
+	counts[2] = r->resets;
+	counts[3] = r->calibrations;
+	pthread_mutex_unlock(&r->lock);
+
+	rb_hash_aset(result, ID2SYM(rb_intern("captures")), ULL2NUM(counts[0]));
+	rb_hash_aset(result, ID2SYM(rb_intern("status_reads")), ULL2NUM(counts[1]));
+	rb_hash_aset(result, ID2SYM(rb_intern("resets")), ULL2NUM(counts[2]));
+	rb_hash_aset(result, ID2SYM(rb_intern("calibrations")), ULL2NUM(counts[3]));
+
+	return result;
+}
+
+void Init_reader() {
+	static const struct {
+		const char *name;
+		DPFPDD_QUALITY value;
+	} qualities[] = {
+		{ "QUALITY_GOOD", DPFPDD_QUALITY_GOOD },
+		{ "QUALITY_TIMED_OUT", DPFPDD_QUALITY_TIMED_OUT },
+		{ "QUALITY_CANCELED", DPFPDD_QUALITY_CANCELED },
+		{ "QUALITY_NO_FINGER", DPFPDD_QUALITY_NO_FINGER },
+		{ "QUALITY_FAKE_FINGER", DPFPDD_QUALITY_FAKE_FINGER },
+		{ "QUALITY_FINGER_OFF_CENTER", DPFPDD_QUALITY_FINGER_OFF_CENTER },
+		{ "QUALITY_SCAN_SKEWED", DPFPDD_QUALITY_SCAN_SKEWED },
+		{ "QUALITY_READER_DIRTY", DPFPDD_QUALITY_READER_DIRTY },
+	};
+	static const struct {
+		const char *name;
+		DPFPDD_STATUS value;
+	} statuses[] = {
+		{ "STATUS_READY", DPFPDD_STATUS_READY },
+		{ "STATUS_BUSY", DPFPDD_STATUS_BUSY },
+		{ "STATUS_NEED_CALIBRATION", DPFPDD_STATUS_NEED_CALIBRATION },
+		{ "STATUS_FAILURE", DPFPDD_STATUS_FAILURE },
+	};
+
+	rb_cReader = rb_define_class_under(
+		rb_mFingerprint,
+		"Reader",
+		rb_cObject
+	);
+	rb_define_alloc_func(rb_cReader, reader_alloc);
+
+	for(size_t i = 0; i < sizeof(qualities) / sizeof(qualities[0]); i++) {
+		rb_define_const(rb_cReader, qualities[i].name, UINT2NUM(qualities[i].value));
+	}
+	for(size_t i = 0; i < sizeof(statuses) / sizeof(statuses[0]); i++) {
+		rb_define_const(rb_cReader, statuses[i].name, UINT2NUM(statuses[i].value));
+	}
+
+	rb_define_singleton_method(rb_cReader, "devices", RUBY_METHOD_FUNC(reader_devices), 0);
+	rb_define_singleton_method(rb_cReader, "fake", RUBY_METHOD_FUNC(reader_fake), -1);
+
+	rb_define_method(rb_cReader, "initialize", RUBY_METHOD_FUNC(reader_initialize), -1);
+	rb_define_method(rb_cReader, "name", RUBY_METHOD_FUNC(reader_name), 0);
+	rb_define_method(rb_cReader, "fake?", RUBY_METHOD_FUNC(reader_fake_p), 0);
+	rb_define_method(rb_cReader, "closed?", RUBY_METHOD_FUNC(reader_closed_p), 0);
+	rb_define_method(rb_cReader, "close", RUBY_METHOD_FUNC(reader_close), 0);
+	rb_define_method(rb_cReader, "capabilities", RUBY_METHOD_FUNC(reader_capabilities), 0);
+	rb_define_method(rb_cReader, "status", RUBY_METHOD_FUNC(reader_status), 0);
+	rb_define_method(rb_cReader, "status_ttl", RUBY_METHOD_FUNC(reader_status_ttl), 0);
+	rb_define_method(rb_cReader, "status_ttl=", RUBY_METHOD_FUNC(reader_set_status_ttl), 1);
+	rb_define_method(rb_cReader, "capture", RUBY_METHOD_FUNC(reader_capture), -1);
+	rb_define_method(rb_cReader, "stats", RUBY_METHOD_FUNC(reader_stats), 0);
+}
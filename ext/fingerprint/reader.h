@@ -0,0 +1,112 @@
+#ifndef READER_H
+#define READER_H
+
+#include <pthread.h>
+
+#include "fingerprint.h"
+#include "u_are_u/dpfpdd.h"
+
+#define DEFAULT_READER_DPI 500
+
+typedef struct reader reader;
+
+/*
+ * What a reader can do, with dpfpdd's signatures and return codes. Every
+ * operation may block and is called without the GVL.
+ */
+typedef struct reader_ops {
+	int (*capture)(reader *r, DPFPDD_CAPTURE_PARAM *param, unsigned int timeout, DPFPDD_CAPTURE_RESULT *result, unsigned int *size, unsigned char *data);
+	int (*cancel)(reader *r);
+	int (*start_stream)(reader *r);
+	int (*stop_stream)(reader *r);
+	int (*get_stream_image)(reader *r, DPFPDD_CAPTURE_PARAM *param, DPFPDD_CAPTURE_RESULT *result, unsigned int *size, unsigned char *data);
+	int (*close)(reader *r);
+	int (*status)(reader *r, DPFPDD_DEV_STATUS *status);
+	int (*capabilities)(reader *r, DPFPDD_DEV_CAPS *caps);
+	int (*reset)(reader *r);
+	int (*calibrate)(reader *r);
+} reader_ops;
+
+typedef struct reader_frame {
+	unsigned char *image;
+	unsigned int size;
+	unsigned int width;
+	unsigned int height;
+	unsigned int res;
+	unsigned int score;
+	DPFPDD_QUALITY quality;
+} reader_frame;
+
+/*
+ * A reader with no hardware behind it, for tests: it hands out frames
+ * round-robin, one every interval_ns. cancel cuts the wait short. It
+ * reports status until a reset or calibration makes it ready.
+ */
+typedef struct fake_reader {
+	reader_frame *frames;
+	unsigned int frame_cnt;
+	unsigned int next;
+	unsigned int max_size;
+	unsigned long long interval_ns;
+	DPFPDD_STATUS status;
+
+	pthread_mutex_t lock;
+	pthread_cond_t wake;
+	int waiting;
+	int canceled;
+	int streaming;
+} fake_reader;
+
+/*
+ * An open reader. It is shared by the Reader object and whatever capture
+ * pipelines run on it, and freed with the last of them; refs is only
+ * touched atomically. in_use is set, with the GVL held, while a pipeline
+ * owns the reader; it cannot be closed or claimed again until then.
+ *
+ * caps is read once at open, and image_size is what one image takes at
+ * the largest resolution, so capture buffers are sized up front and a
+ * capture never comes back asking for more. image is Reader#capture's.
+ *
+ * lock guards the status cache and the counters. status is re-read once
+ * it is older than status_ttl seconds; a new reading replaces it whole,
+ * so once set it is never NULL.
+ */
+struct reader {
+	const reader_ops *ops;
+	DPFPDD_DEV dev;
+	char name[MAX_DEVICE_NAME_LENGTH];
+	fake_reader fake;
+
+	DPFPDD_DEV_CAPS *caps;
+	unsigned int max_res;
+	unsigned int image_size;
+	unsigned char *image;
+
+	pthread_mutex_t lock;
+	DPFPDD_DEV_STATUS *status;
+	double status_at;
+	double status_ttl;
+	unsigned long long captures;
+	unsigned long long status_reads;
+	unsigned long long resets;
+	unsigned long long calibrations;
+
+	unsigned int refs;
+	int in_use;
+	int closed;
+};
+
+extern VALUE rb_cReader;
+
+int is_reader(VALUE obj);
+reader *get_reader(VALUE obj);
+reader *reader_claim(VALUE obj);
+void reader_unclaim(reader *r);
+void reader_retain(reader *r);
+void reader_release(reader *r);
+int reader_ready(reader *r, const char **call);
+double reader_now();
+
+void Init_reader();
+
+#endif
@@ -0,0 +1,1277 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "buffer.h"
+#include "cache.h"
+#include "gallery.h"
+#include "snapshot.h"
+#include "stats.h"
+#include "store.h"
+
+/* Ids copied per hold of the read lock while a snapshot is written. */
+#define SNAPSHOT_CHUNK 1024
+
+/* Room for ".<generation>.log" or ".tmp" after the snapshot's path. */
+#define SNAPSHOT_NAME_EXTRA 32
+
+/* Times Gallery.load starts over when a checkpoint swaps files under it. */
+#define SNAPSHOT_LOAD_TRIES 5
+
+static size_t snapshot_align(size_t n, size_t align) {
+	return (n + align - 1) & ~(align - 1);
+}
+
+static void snapshot_log_name(char *buf, size_t size, const char *path, uint64_t generation) {
+	snprintf(buf, size, "%s.%llu.log", path, (unsigned long long) generation);
+}
+
+static int snapshot_pwrite(int fd, const void *data, size_t len, uint64_t offset) {
+	const unsigned char *p = (const unsigned char*) data;
+
+	while(len) {
+		ssize_t n = pwrite(fd, p, len, offset);
+
+		if(n < 0 && errno == EINTR) {
+			continue;
+		}
+		if(n < 0) {
+			return errno;
+		}
+		p += n;
+		len -= n;
+		offset += n;
+	}
+
+	return 0;
+}
+
+/* Control */
+
+/*
+ * Maps path.epoch shared, creating it if need be. A follower that may not
+ * write it maps it read-only. Returns NULL with errno set on failure.
+ */
+static snapshot_control *snapshot_control_map(const char *path, int writer) {
+	char *name = ALLOCA_N(char, strlen(path) + SNAPSHOT_NAME_EXTRA);
+	struct stat sb;
+	void *map;
+	int fd, writable = 1, err;
+
+	snprintf(name, strlen(path) + SNAPSHOT_NAME_EXTRA, "%s.epoch", path);
+	fd = open(name, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if(fd < 0 && !writer && (errno == EACCES || errno == EROFS)) {
+		writable = 0;
+		fd = open(name, O_RDONLY | O_CLOEXEC);
+	}
+	if(fd < 0) {
+		return NULL;
+	}
+	if(fstat(fd, &sb) != 0 ||
+	   ((size_t) sb.st_size < sizeof(snapshot_control) &&
+	    (!writable || ftruncate(fd, sizeof(snapshot_control)) != 0))) {
+		err = writable ? errno : EINVAL;
+		close(fd);
+		errno = err;
+		return NULL;
+	}
+
+	map = mmap(NULL, sizeof(snapshot_control), writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+	err = errno;
+	close(fd);
+	if(map == MAP_FAILED) {
+		errno = err;
+		return NULL;
+	}
+
+	return (snapshot_control*) map;
+}
+
+/* Tells followers where the log now ends. Called by the writer only. */
+static void snapshot_publish(gallery *g) {
+	snapshot_control *c = (snapshot_control*) g->log.control;
+	uint64_t seq;
+
+	if(!c) {
+		return;
+	}
+
+	seq = __atomic_load_n(&c->seq, __ATOMIC_RELAXED) | 1;
+	__atomic_store_n(&c->seq, seq, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	__atomic_store_n(&c->snapshot_generation, g->log.snapshot_generation, __ATOMIC_RELAXED);
+	__atomic_store_n(&c->log_generation, g->log.generation, __ATOMIC_RELAXED);
+	__atomic_store_n(&c->log_size, g->log.size, __ATOMIC_RELAXED);
+	__atomic_store_n(&c->seq, seq + 1, __ATOMIC_RELEASE);
+
+	if(memcmp(c->magic, SNAPSHOT_CONTROL_MAGIC, 8) != 0) {
+		memcpy(c->magic, SNAPSHOT_CONTROL_MAGIC, 8);
+	}
+}
+
+/*
+ * Reads what the writer last published. Returns 0, rather than wait, if
+ * it is in the middle of publishing or has never published.
+ */
+static int snapshot_observe(gallery *g, snapshot_control *out) {
+	snapshot_control *c = (snapshot_control*) g->log.control;
+	uint64_t seq;
+
+	if(!c || memcmp(c->magic, SNAPSHOT_CONTROL_MAGIC, 8) != 0) {
+		return 0;
+	}
+
+	seq = __atomic_load_n(&c->seq, __ATOMIC_ACQUIRE);
+	out->snapshot_generation = __atomic_load_n(&c->snapshot_generation, __ATOMIC_RELAXED);
+	out->log_generation = __atomic_load_n(&c->log_generation, __ATOMIC_RELAXED);
+	out->log_size = __atomic_load_n(&c->log_size, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+	return !(seq & 1) && __atomic_load_n(&c->seq, __ATOMIC_RELAXED) == seq;
+}
+
+/* Delta log */
+
+static int snapshot_writev(int fd, struct iovec *iov, int cnt) {
+	while(cnt) {
+		ssize_t n = writev(fd, iov, cnt);
+
+		if(n < 0 && errno == EINTR) {
+			continue;
+		}
+		if(n < 0) {
+			return errno;
+		}
+		while(cnt && (size_t) n >= iov->iov_len) {
+			n -= iov->iov_len;
+			iov++;
+			cnt--;
+		}
+		if(cnt) {
+			iov->iov_base = (char*) iov->iov_base + n;
+			iov->iov_len -= n;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Creates an empty log, replacing any left over with the same generation.
+ * Returns its descriptor, or -1 with errno set.
+ */
+static int snapshot_log_create(const char *name, DPFJ_FMD_FORMAT format, uint64_t generation, unsigned int base) {
+	unsigned char header[SNAPSHOT_LOG_HEADER_SIZE];
+	int fd, err;
+
+	fd = open(name, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+	if(fd < 0) {
+		return -1;
+	}
+
+	memset(header, 0, sizeof(header));
+	memcpy(header, SNAPSHOT_LOG_MAGIC, 8);
+	store_le32(SNAPSHOT_VERSION, header + 8);
+	store_le32((uint32_t) format, header + 12);
+	store_le64(generation, header + 16);
+	store_le32(base, header + 24);
+
+	err = snapshot_pwrite(fd, header, sizeof(header), 0);
+	if(!err && fsync(fd) != 0) {
+		err = errno;
+	}
+	if(err) {
+		close(fd);
+		unlink(name);
+		errno = err;
+		return -1;
+	}
+
+	return fd;
+}
+
+typedef struct snapshot_sync {
+	int fd;
+	int done;
+	int err;
+} snapshot_sync;
+
+static void *snapshot_fdatasync_without_gvl(void *ptr) {
+	snapshot_sync *sync = (snapshot_sync*) ptr;
+
+	sync->err = fdatasync(sync->fd) != 0 ? errno : 0;
+	sync->done = 1;
+
+	return NULL;
+}
+
+/*
+ * Syncs the log without ever raising for an interrupt: once the record
+ * is written the change must be made, so only fdatasync's own errors may
+ * stop it. An interrupt already pending is left for later and the sync
+ * run with the GVL held.
+ */
+static int snapshot_fdatasync(gallery_log *log) {
+	snapshot_sync sync;
+
+	sync.fd = log->fd;
+	sync.done = 0;
+	sync.err = 0;
+	stats_without_gvl2(snapshot_fdatasync_without_gvl, &sync, NULL, NULL);
+	if(!sync.done) {
+		snapshot_fdatasync_without_gvl(&sync);
+	}
+
+	return sync.err;
+}
+
+/*
+ * Appends one record, called holding the write lock before the change is
+ * made. A failed write is cut off again and raises, so the change is not
+ * made either.
+ */
+static void snapshot_log_append(gallery *g, unsigned int op, unsigned int id, const unsigned char *data, unsigned int len) {
+	unsigned char head[SNAPSHOT_LOG_RECORD_SIZE];
+	struct iovec iov[2];
+	char *name;
+	int err;
+
+	if(g->log.follow) {
+		/* Replaying what the writer logged is the only way to change it. */
+		if(!g->log.busy) {
+			rb_raise(rb_eFingerprintError, "gallery follows %s; change it where it is open", g->log.path);
+		}
+		return;
+	}
+
+	store_le32(len, head);
+	store_le32(op, head + 8);
+	store_le32(id, head + 12);
+	store_le32(crc32c(crc32c(0, head + 8, 8), data, len), head + 4);
+
+	iov[0].iov_base = head;
+	iov[0].iov_len = sizeof(head);
+	iov[1].iov_base = (void*) data;
+	iov[1].iov_len = len;
+
+	err = snapshot_writev(g->log.fd, iov, len ? 2 : 1);
+	if(!err && g->log.sync) {
+		err = snapshot_fdatasync(&g->log);
+	}
+	if(err) {
+		if(ftruncate(g->log.fd, g->log.size) != 0) {
+			/* The torn record is dropped when the log is next replayed. */
+		}
+		name = ALLOCA_N(char, strlen(g->log.path) + SNAPSHOT_NAME_EXTRA);
+		snapshot_log_name(name, strlen(g->log.path) + SNAPSHOT_NAME_EXTRA, g->log.path, g->log.generation);
+		rb_syserr_fail(err, name);
+	}
+
+	g->log.size += sizeof(head) + len;
+	snapshot_publish(g);
+}
+
+void snapshot_log_add(gallery *g, unsigned int id, const unsigned char *data, unsigned int len) {
+	snapshot_log_append(g, SNAPSHOT_LOG_ADD, id, data, len);
+}
+
+void snapshot_log_remove(gallery *g, unsigned int id) {
+	snapshot_log_append(g, SNAPSHOT_LOG_REMOVE, id, NULL, 0);
+}
+
+void snapshot_close(gallery *g) {
+	if(g->log.fd >= 0) {
+		close(g->log.fd);
+	}
+	if(g->log.lock_fd >= 0) {
+		close(g->log.lock_fd);
+	}
+	if(g->log.control) {
+		munmap(g->log.control, sizeof(snapshot_control));
+	}
+	xfree(g->log.path);
+	g->log.fd = -1;
+	g->log.lock_fd = -1;
+	g->log.follow = 0;
+	g->log.path = NULL;
+	g->log.control = NULL;
+}
+
+/*
+ * Replays the records of log generation from byte from up to to onto g.
+ * From the start, g must have exactly as many entries as the log's base.
+ * Returns 0 if there is no such log and -1 if it does not follow on from
+ * g; otherwise stores where its last whole record ends in end, and whether
+ * anything follows that, and returns 1.
+ */
+static int snapshot_replay(gallery *g, const char *path, uint64_t generation, uint64_t from, uint64_t to, uint64_t *end, int *torn) {
+	char *name = ALLOCA_N(char, strlen(path) + SNAPSHOT_NAME_EXTRA);
+	VALUE buf;
+	unsigned char *p;
+	struct stat sb;
+	size_t size, done = 0, pos;
+	int fd;
+
+	snapshot_log_name(name, strlen(path) + SNAPSHOT_NAME_EXTRA, path, generation);
+	fd = open(name, O_RDONLY | O_CLOEXEC);
+	if(fd < 0 && errno == ENOENT) {
+		return 0;
+	}
+	if(fd < 0) {
+		rb_sys_fail(name);
+	}
+	if(fstat(fd, &sb) != 0) {
+		int e = errno;
+
+		close(fd);
+		rb_syserr_fail(e, name);
+	}
+
+	size = (uint64_t) sb.st_size < to ? sb.st_size : to;
+	if(from > size) {
+		close(fd);
+		*end = from;
+		*torn = 0;
+		return 1;
+	}
+
+	/* p holds the log from byte from on. */
+	buf = rb_str_new(NULL, size - from);
+	p = (unsigned char*) RSTRING_PTR(buf);
+	while(from + done < size) {
+		ssize_t n = pread(fd, p + done, size - from - done, from + done);
+
+		if(n < 0 && errno == EINTR) {
+			continue;
+		}
+		if(n <= 0) {
+			int e = n < 0 ? errno : EIO;
+
+			close(fd);
+			rb_syserr_fail(e, name);
+		}
+		done += n;
+	}
+	close(fd);
+
+	if(from == 0) {
+		if(size < SNAPSHOT_LOG_HEADER_SIZE || memcmp(p, SNAPSHOT_LOG_MAGIC, 8) != 0) {
+			rb_raise(rb_eFingerprintError, "%s: not a gallery log", name);
+		}
+		if(load_le32(p + 8) != SNAPSHOT_VERSION) {
+			rb_raise(rb_eFingerprintError, "%s: unsupported gallery log version", name);
+		}
+		if((DPFJ_FMD_FORMAT) load_le32(p + 12) != g->format) {
+			rb_raise(rb_eFingerprintError, "%s: gallery log holds a different FMD format", name);
+		}
+		if(load_le64(p + 16) != generation || load_le32(p + 24) != g->entry_cnt) {
+			return -1;
+		}
+	}
+
+	for(pos = from ? from : SNAPSHOT_LOG_HEADER_SIZE; size - pos >= SNAPSHOT_LOG_RECORD_SIZE; ) {
+		const unsigned char *head = p + (pos - from), *data = head + SNAPSHOT_LOG_RECORD_SIZE;
+		uint32_t len = load_le32(head), op = load_le32(head + 8), id = load_le32(head + 12);
+
+		if(len > size - pos - SNAPSHOT_LOG_RECORD_SIZE ||
+		   crc32c(crc32c(0, head + 8, 8), data, len) != load_le32(head + 4)) {
+			break;
+		}
+
+		if(op == SNAPSHOT_LOG_ADD) {
+			if(id != g->entry_cnt) {
+				rb_raise(rb_eFingerprintError, "%s: corrupt gallery log (id %u out of order)", name, id);
+			}
+			gallery_insert(g, data, len);
+		} else if(op == SNAPSHOT_LOG_REMOVE) {
+			/* May already be gone from a snapshot written after it was logged. */
+			gallery_delete(g, id);
+		} else {
+			rb_raise(rb_eFingerprintError, "%s: corrupt gallery log (unknown record)", name);
+		}
+		pos += SNAPSHOT_LOG_RECORD_SIZE + len;
+	}
+
+	*end = pos;
+	*torn = pos != size;
+	RB_GC_GUARD(buf);
+
+	return 1;
+}
+
+/* Snapshot */
+
+static void snapshot_corrupt(VALUE path, const char *why) {
+	rb_raise(rb_eFingerprintError, "%s: corrupt gallery snapshot (%s)", StringValueCStr(path), why);
+}
+
+/*
+ * Maps the snapshot at path into g, which must be empty, and stores its
+ * generation. Only the header, entry table and view descriptors are read;
+ * the prints and their minutiae are paged in as searches touch them.
+ * Returns 0 if there is no snapshot.
+ */
+static int snapshot_map(gallery *g, VALUE path, int format_given, uint64_t *generation, struct stat *sb) {
+	const unsigned char *header, *entry;
+	uint64_t arena_offset, arena_len, minutiae_offset, minutiae_len, views_offset, entries_offset, file_size;
+	unsigned int entry_cnt, view_cnt;
+	uint32_t byte_order;
+	size_t live_bytes = 0;
+	DPFJ_FMD_FORMAT format;
+	void *map;
+	int fd;
+
+	fd = open(StringValueCStr(path), O_RDONLY | O_CLOEXEC);
+	if(fd < 0 && errno == ENOENT) {
+		return 0;
+	}
+	if(fd < 0) {
+		rb_sys_fail_str(path);
+	}
+	if(fstat(fd, sb) != 0) {
+		int e = errno;
+
+		close(fd);
+		rb_syserr_fail_str(e, path);
+	}
+	if((size_t) sb->st_size < SNAPSHOT_HEADER_SIZE) {
+		close(fd);
+		rb_raise(rb_eFingerprintError, "%s: not a gallery snapshot", StringValueCStr(path));
+	}
+
+	/* Never written through, so every process shares the page cache's copy. */
+	map = mmap(NULL, sb->st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if(map == MAP_FAILED) {
+		rb_sys_fail_str(path);
+	}
+	g->map = (unsigned char*) map;
+	g->map_len = sb->st_size;
+
+	header = g->map;
+	memcpy(&byte_order, header + 16, sizeof(byte_order));
+	if(memcmp(header, SNAPSHOT_MAGIC, 8) != 0) {
+		snapshot_corrupt(path, "bad magic");
+	}
+	if(load_le32(header + 8) != SNAPSHOT_VERSION) {
+		snapshot_corrupt(path, "unsupported version");
+	}
+	if(byte_order != SNAPSHOT_BYTE_ORDER || load_le32(header + 20) != sizeof(view_descriptor)) {
+		snapshot_corrupt(path, "written on a different architecture");
+	}
+
+	format = (DPFJ_FMD_FORMAT) load_le32(header + 12);
+	if(format_given && format != g->format) {
+		rb_raise(rb_eArgError, "gallery snapshot holds a different FMD format");
+	}
+	g->format = format;
+
+	*generation = load_le64(header + 24);
+	entry_cnt = load_le32(header + 32);
+	view_cnt = load_le32(header + 36);
+	arena_offset = load_le64(header + 40);
+	arena_len = load_le64(header + 48);
+	minutiae_offset = load_le64(header + 56);
+	minutiae_len = load_le64(header + 64);
+	views_offset = load_le64(header + 72);
+	entries_offset = load_le64(header + 80);
+	file_size = load_le64(header + 88);
+
+	if(file_size != g->map_len) {
+		snapshot_corrupt(path, "truncated");
+	}
+	if(arena_offset < SNAPSHOT_HEADER_SIZE || arena_offset % SNAPSHOT_ALIGN ||
+	   arena_offset > file_size || file_size - arena_offset < arena_len ||
+	   minutiae_offset < arena_offset + arena_len || minutiae_offset % SNAPSHOT_ALIGN ||
+	   minutiae_offset > file_size || file_size - minutiae_offset < minutiae_len ||
+	   views_offset < minutiae_offset + minutiae_len || views_offset % SNAPSHOT_ALIGN ||
+	   views_offset > file_size || (file_size - views_offset) / sizeof(view_descriptor) < view_cnt ||
+	   entries_offset < views_offset + (uint64_t) view_cnt * sizeof(view_descriptor) ||
+	   entries_offset > file_size || (file_size - entries_offset) / SNAPSHOT_ENTRY_SIZE < entry_cnt) {
+		snapshot_corrupt(path, "section out of bounds");
+	}
+
+	g->entry_capa = entry_cnt > 64 ? entry_cnt : 64;
+	g->entries = ALLOC_N(gallery_entry, g->entry_capa);
+
+	entry = g->map + entries_offset;
+	for(unsigned int id = 0; id < entry_cnt; id++, entry += SNAPSHOT_ENTRY_SIZE) {
+		gallery_entry *e = &g->entries[id];
+
+		e->offset = load_le64(entry);
+		e->size = load_le32(entry + 8);
+		e->live = load_le32(entry + 12) != 0;
+		e->mapped = 1;
+		e->minutiae = load_le64(entry + 16);
+		e->minutiae_size = load_le64(entry + 24);
+		g->entry_cnt++;
+
+		if(!e->live) {
+			continue;
+		}
+		if(e->offset % STORE_ALIGN || e->offset > arena_len || arena_len - e->offset < e->size ||
+		   e->minutiae % MINUTIAE_ALIGN || e->minutiae > minutiae_len ||
+		   minutiae_len - e->minutiae < e->minutiae_size) {
+			snapshot_corrupt(path, "record out of bounds");
+		}
+		live_bytes += snapshot_align(e->size, STORE_ALIGN);
+		g->live_cnt++;
+	}
+
+	g->map_arena = g->map + arena_offset;
+	g->map_arena_len = arena_len;
+	g->dead_bytes = arena_len - live_bytes;
+	g->map_minutiae = g->map + minutiae_offset;
+	g->dirty = 1;
+
+	index_restore(g, (const view_descriptor*) (g->map + views_offset), view_cnt);
+
+	return 1;
+}
+
+/*
+ * What a snapshot will hold, fixed under the write lock: the entry table
+ * as laid out in the file and the index. The prints themselves are copied
+ * afterwards, a chunk at a time under the read lock, so searches and
+ * enrollment carry on while the file is written. Prints removed in the
+ * meantime are written as dead; their removal is in the new log.
+ */
+typedef struct snapshot_writer {
+	gallery *g;
+	VALUE path;
+	const char *name;
+	char *tmp_name;
+	char *log_name;
+	int journal;
+	uint64_t generation;
+	uint64_t old_generation;
+	int old_fd;
+
+	unsigned int entry_cnt;
+	gallery_entry *entries;
+	view_descriptor *views;
+	unsigned int view_cnt;
+	size_t arena_len;
+	size_t minutiae_len;
+
+	int err;
+	const char *err_name;
+} snapshot_writer;
+
+/*
+ * Fixes the snapshot's contents and, for a checkpoint, starts the next
+ * log, so every change from here on goes to it.
+ */
+static VALUE snapshot_cut_locked(VALUE ptr) {
+	snapshot_writer *w = (snapshot_writer*) ptr;
+	gallery *g = w->g;
+	fmd_index *idx = &g->index;
+	size_t pos = 0, minutiae_pos = 0;
+
+	w->entry_cnt = g->entry_cnt;
+	w->entries = ALLOC_N(gallery_entry, w->entry_cnt ? w->entry_cnt : 1);
+	w->views = ALLOC_N(view_descriptor, idx->view_cnt ? idx->view_cnt : 1);
+
+	for(unsigned int id = 0; id < w->entry_cnt; id++) {
+		const gallery_entry *e = &g->entries[id];
+		gallery_entry *out = &w->entries[id];
+
+		memset(out, 0, sizeof(*out));
+		if(!e->live) {
+			continue;
+		}
+		out->live = 1;
+		out->offset = pos;
+		out->size = e->size;
+		out->minutiae = minutiae_pos;
+		out->minutiae_size = e->minutiae_size;
+		pos += snapshot_align(e->size, STORE_ALIGN);
+		minutiae_pos += e->minutiae_size;
+	}
+	w->arena_len = pos;
+	w->minutiae_len = minutiae_pos;
+
+	for(unsigned int i = 0; i < idx->view_cnt; i++) {
+		if(g->entries[idx->views[i].id].live) {
+			w->views[w->view_cnt++] = idx->views[i];
+		}
+	}
+
+	if(w->journal) {
+		int fd;
+
+		w->generation = g->log.generation + 1;
+		snapshot_log_name(w->log_name, strlen(w->name) + SNAPSHOT_NAME_EXTRA, w->name, w->generation);
+		fd = snapshot_log_create(w->log_name, g->format, w->generation, g->entry_cnt);
+		if(fd < 0) {
+			rb_sys_fail(w->log_name);
+		}
+		w->old_fd = g->log.fd;
+		w->old_generation = g->log.snapshot_generation;
+		g->log.fd = fd;
+		g->log.generation = w->generation;
+		g->log.size = SNAPSHOT_LOG_HEADER_SIZE;
+		snapshot_publish(g);
+	}
+
+	return Qnil;
+}
+
+typedef struct snapshot_run {
+	const unsigned char *src;
+	uint64_t dst;
+	size_t len;
+} snapshot_run;
+
+/* Batches copies that are contiguous both in memory and in the file. */
+static int snapshot_run_add(int fd, snapshot_run *run, const unsigned char *src, uint64_t dst, size_t len) {
+	int err = 0;
+
+	if(run->len && run->src + run->len == src && run->dst + run->len == dst) {
+		run->len += len;
+		return 0;
+	}
+	if(run->len) {
+		err = snapshot_pwrite(fd, run->src, run->len, run->dst);
+	}
+	run->src = src;
+	run->dst = dst;
+	run->len = len;
+
+	return err;
+}
+
+static int snapshot_run_flush(int fd, snapshot_run *run) {
+	int err = run->len ? snapshot_pwrite(fd, run->src, run->len, run->dst) : 0;
+
+	run->len = 0;
+
+	return err;
+}
+
+static int snapshot_write_file(snapshot_writer *w, int fd) {
+	gallery *g = w->g;
+	unsigned char header[SNAPSHOT_HEADER_SIZE];
+	unsigned char *table;
+	uint32_t byte_order = SNAPSHOT_BYTE_ORDER;
+	uint64_t arena_offset = SNAPSHOT_HEADER_SIZE;
+	uint64_t minutiae_offset = snapshot_align(arena_offset + w->arena_len, SNAPSHOT_ALIGN);
+	uint64_t views_offset = snapshot_align(minutiae_offset + w->minutiae_len, SNAPSHOT_ALIGN);
+	uint64_t entries_offset = snapshot_align(views_offset + (uint64_t) w->view_cnt * sizeof(view_descriptor), SNAPSHOT_ALIGN);
+	uint64_t file_size = entries_offset + (uint64_t) w->entry_cnt * SNAPSHOT_ENTRY_SIZE;
+	int err = 0;
+
+	for(unsigned int start = 0; !err && start < w->entry_cnt; start += SNAPSHOT_CHUNK) {
+		unsigned int end = w->entry_cnt - start < SNAPSHOT_CHUNK ? w->entry_cnt : start + SNAPSHOT_CHUNK;
+		snapshot_run arena = { NULL, 0, 0 }, minutiae = { NULL, 0, 0 };
+
+		pthread_rwlock_rdlock(&g->lock);
+		for(unsigned int id = start; !err && id < end; id++) {
+			const gallery_entry *e = &g->entries[id];
+			gallery_entry *out = &w->entries[id];
+
+			if(!out->live) {
+				continue;
+			}
+			if(!e->live) {
+				out->live = 0;
+				continue;
+			}
+			err = snapshot_run_add(fd, &arena, gallery_fmd(g, e), arena_offset + out->offset, snapshot_align(e->size, STORE_ALIGN));
+			if(!err) {
+				err = snapshot_run_add(fd, &minutiae, gallery_block(g, e), minutiae_offset + out->minutiae, e->minutiae_size);
+			}
+		}
+		if(!err) {
+			err = snapshot_run_flush(fd, &arena);
+		}
+		if(!err) {
+			err = snapshot_run_flush(fd, &minutiae);
+		}
+		pthread_rwlock_unlock(&g->lock);
+	}
+
+	if(!err) {
+		err = snapshot_pwrite(fd, w->views, (size_t) w->view_cnt * sizeof(view_descriptor), views_offset);
+	}
+
+	table = (unsigned char*) buffer_get(SNAPSHOT_CHUNK * SNAPSHOT_ENTRY_SIZE);
+	if(!table) {
+		err = err ? err : ENOMEM;
+	}
+	for(unsigned int start = 0; !err && start < w->entry_cnt; start += SNAPSHOT_CHUNK) {
+		unsigned int end = w->entry_cnt - start < SNAPSHOT_CHUNK ? w->entry_cnt : start + SNAPSHOT_CHUNK;
+		unsigned char *entry = table;
+
+		for(unsigned int id = start; id < end; id++, entry += SNAPSHOT_ENTRY_SIZE) {
+			const gallery_entry *out = &w->entries[id];
+
+			store_le64(out->offset, entry);
+			store_le32(out->size, entry + 8);
+			store_le32(out->live, entry + 12);
+			store_le64(out->minutiae, entry + 16);
+			store_le64(out->minutiae_size, entry + 24);
+		}
+		err = snapshot_pwrite(fd, table, entry - table, entries_offset + (uint64_t) start * SNAPSHOT_ENTRY_SIZE);
+	}
+	buffer_put(table);
+
+	memset(header, 0, sizeof(header));
+	memcpy(header, SNAPSHOT_MAGIC, 8);
+	store_le32(SNAPSHOT_VERSION, header + 8);
+	store_le32((uint32_t) g->format, header + 12);
+	memcpy(header + 16, &byte_order, sizeof(byte_order));
+	store_le32(sizeof(view_descriptor), header + 20);
+	store_le64(w->generation, header + 24);
+	store_le32(w->entry_cnt, header + 32);
+	store_le32(w->view_cnt, header + 36);
+	store_le64(arena_offset, header + 40);
+	store_le64(w->arena_len, header + 48);
+	store_le64(minutiae_offset, header + 56);
+	store_le64(w->minutiae_len, header + 64);
+	store_le64(views_offset, header + 72);
+	store_le64(entries_offset, header + 80);
+	store_le64(file_size, header + 88);
+
+	if(!err) {
+		err = snapshot_pwrite(fd, header, sizeof(header), 0);
+	}
+	if(!err && ftruncate(fd, file_size) != 0) {
+		err = errno;
+	}
+	if(!err && fsync(fd) != 0) {
+		err = errno;
+	}
+
+	return err;
+}
+
+/*
+ * Writes the snapshot to path.tmp and renames it into place, then drops
+ * the logs it has made redundant. Called without the GVL.
+ */
+static void *snapshot_write_without_gvl(void *ptr) {
+	snapshot_writer *w = (snapshot_writer*) ptr;
+	int fd;
+
+	fd = open(w->tmp_name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if(fd < 0) {
+		w->err = errno;
+		w->err_name = w->tmp_name;
+		return NULL;
+	}
+
+	w->err = snapshot_write_file(w, fd);
+	if(close(fd) != 0 && !w->err) {
+		w->err = errno;
+	}
+	if(w->err) {
+		w->err_name = w->tmp_name;
+		unlink(w->tmp_name);
+		return NULL;
+	}
+
+	if(rename(w->tmp_name, w->name) != 0) {
+		w->err = errno;
+		w->err_name = w->name;
+		unlink(w->tmp_name);
+		return NULL;
+	}
+
+	for(uint64_t generation = w->old_generation; w->journal && generation < w->generation; generation++) {
+		snapshot_log_name(w->log_name, strlen(w->name) + SNAPSHOT_NAME_EXTRA, w->name, generation);
+		unlink(w->log_name);
+	}
+
+	return NULL;
+}
+
+static VALUE snapshot_write_body(VALUE ptr) {
+	snapshot_writer *w = (snapshot_writer*) ptr;
+
+	gallery_write(w->g, snapshot_cut_locked, ptr);
+	if(w->old_fd >= 0) {
+		close(w->old_fd);
+		w->old_fd = -1;
+	}
+
+	stats_without_gvl(snapshot_write_without_gvl, w, NULL, NULL);
+	if(w->err) {
+		rb_syserr_fail(w->err, w->err_name);
+	}
+	if(w->journal) {
+		w->g->log.snapshot_generation = w->generation;
+		snapshot_publish(w->g);
+	}
+
+	return Qnil;
+}
+
+static VALUE snapshot_write_ensure(VALUE ptr) {
+	snapshot_writer *w = (snapshot_writer*) ptr;
+
+	if(w->journal) {
+		w->g->log.busy = 0;
+	}
+	xfree(w->entries);
+	xfree(w->views);
+
+	return Qnil;
+}
+
+static void snapshot_write(gallery *g, VALUE path, int journal) {
+	snapshot_writer w;
+	size_t name_len;
+
+	memset(&w, 0, sizeof(w));
+	w.g = g;
+	w.path = path;
+	w.name = StringValueCStr(path);
+	w.journal = journal;
+	w.old_fd = -1;
+
+	name_len = strlen(w.name) + SNAPSHOT_NAME_EXTRA;
+	w.tmp_name = ALLOCA_N(char, name_len);
+	w.log_name = ALLOCA_N(char, name_len);
+	snprintf(w.tmp_name, name_len, "%s.tmp", w.name);
+
+	rb_ensure(snapshot_write_body, (VALUE) &w, snapshot_write_ensure, (VALUE) &w);
+	RB_GC_GUARD(path);
+}
+
+/*
+ * Loads the snapshot at path, if any, and the logs after it. With attach,
+ * path must already be locked, and the gallery goes on logging to the last
+ * log, or a new one. Returns 0 if a checkpoint by another process moved
+ * the files on in the middle.
+ */
+static int snapshot_load(gallery *g, VALUE path, int format_given, int attach) {
+	const char *name = StringValueCStr(path);
+	char *log_name = ALLOCA_N(char, strlen(name) + SNAPSHOT_NAME_EXTRA);
+	struct stat before, after;
+	uint64_t generation, snapshot_generation = 0, end = 0;
+	int found, replayed = 0, torn = 0, rc;
+
+	memset(&before, 0, sizeof(before));
+	found = snapshot_map(g, path, format_given, &snapshot_generation, &before);
+
+	for(generation = snapshot_generation; ; generation++) {
+		int was_torn = torn;
+
+		rc = snapshot_replay(g, name, generation, 0, UINT64_MAX, &end, &torn);
+		if(rc <= 0) {
+			break;
+		}
+		if(was_torn) {
+			/* Only the log being written when a process died may be torn. */
+			rb_raise(rb_eFingerprintError, "%s: corrupt gallery log (generation %llu)", name, (unsigned long long) generation - 1);
+		}
+		replayed = 1;
+	}
+	if(rc < 0) {
+		return 0;
+	}
+
+	g->log.path = ALLOC_N(char, strlen(name) + 1);
+	strcpy(g->log.path, name);
+	g->log.snapshot_generation = snapshot_generation;
+
+	if(!attach) {
+		if(!found && !replayed) {
+			rb_syserr_fail_str(ENOENT, path);
+		}
+		if((stat(name, &after) == 0) != found ||
+		   (found && (after.st_ino != before.st_ino || after.st_dev != before.st_dev))) {
+			return 0;
+		}
+
+		/* Where a follower picks up; size 0 is a log not yet seen. */
+		g->log.generation = replayed ? generation - 1 : snapshot_generation;
+		g->log.size = replayed ? end : 0;
+		return 1;
+	}
+
+	/* Logs a checkpoint had made redundant when the process died. */
+	for(uint64_t stale = snapshot_generation; stale-- > 0; ) {
+		snapshot_log_name(log_name, strlen(name) + SNAPSHOT_NAME_EXTRA, name, stale);
+		if(unlink(log_name) != 0) {
+			break;
+		}
+	}
+
+	if(replayed) {
+		/* Carry on with the last log, less any record torn by a crash. */
+		g->log.generation = generation - 1;
+		snapshot_log_name(log_name, strlen(name) + SNAPSHOT_NAME_EXTRA, name, g->log.generation);
+		g->log.fd = open(log_name, O_WRONLY | O_APPEND | O_CLOEXEC);
+		if(g->log.fd < 0 || ftruncate(g->log.fd, end) != 0) {
+			rb_sys_fail(log_name);
+		}
+		g->log.size = end;
+	} else {
+		g->log.generation = snapshot_generation;
+		snapshot_log_name(log_name, strlen(name) + SNAPSHOT_NAME_EXTRA, name, g->log.generation);
+		g->log.fd = snapshot_log_create(log_name, g->format, g->log.generation, g->entry_cnt);
+		if(g->log.fd < 0) {
+			rb_sys_fail(log_name);
+		}
+		g->log.size = SNAPSHOT_LOG_HEADER_SIZE;
+	}
+
+	g->log.control = snapshot_control_map(name, 1);
+	if(!g->log.control) {
+		snprintf(log_name, strlen(name) + SNAPSHOT_NAME_EXTRA, "%s.epoch", name);
+		rb_sys_fail(log_name);
+	}
+	snapshot_publish(g);
+
+	return 1;
+}
+
+/* Following */
+
+typedef struct snapshot_follow_args {
+	gallery *g;
+	snapshot_control seen;
+} snapshot_follow_args;
+
+static VALUE snapshot_swap_locked(VALUE ptr) {
+	gallery **pair = (gallery**) ptr;
+
+	gallery_swap(pair[0], pair[1]);
+	pair[0]->log.snapshot_generation = pair[1]->log.snapshot_generation;
+	pair[0]->log.generation = pair[1]->log.generation;
+	pair[0]->log.size = pair[1]->log.size;
+
+	return Qnil;
+}
+
+/*
+ * Loads the latest snapshot and logs aside and swaps them in, in one go
+ * under the write lock. The old contents go with the spare Gallery.
+ */
+static void snapshot_reload(gallery *g) {
+	VALUE spare = rb_obj_alloc(rb_cGallery), path = rb_str_new_cstr(g->log.path);
+	gallery *pair[2];
+
+	pair[0] = g;
+	pair[1] = get_gallery(spare);
+	pair[1]->format = g->format;
+	if(!snapshot_load(pair[1], path, 1, 0)) {
+		/* Moved on again meanwhile; the next search tries again. */
+		return;
+	}
+	gallery_write(g, snapshot_swap_locked, (VALUE) pair);
+
+	RB_GC_GUARD(spare);
+}
+
+static VALUE snapshot_catch_up(VALUE ptr) {
+	snapshot_follow_args *args = (snapshot_follow_args*) ptr;
+	gallery *g = args->g;
+	uint64_t end;
+	int torn, rc;
+
+	if(args->seen.snapshot_generation != g->log.snapshot_generation) {
+		snapshot_reload(g);
+		return Qnil;
+	}
+
+	for(;;) {
+		int last = g->log.generation >= args->seen.log_generation;
+
+		rc = snapshot_replay(g, g->log.path, g->log.generation, g->log.size,
+			last ? args->seen.log_size : UINT64_MAX, &end, &torn);
+		if(rc <= 0 || (!last && torn)) {
+			/* The log was dropped or rewritten by a checkpoint. */
+			snapshot_reload(g);
+			return Qnil;
+		}
+		g->log.size = end;
+		if(last) {
+			break;
+		}
+		g->log.generation++;
+		g->log.size = 0;
+	}
+
+	return Qnil;
+}
+
+static VALUE snapshot_catch_up_ensure(VALUE ptr) {
+	((snapshot_follow_args*) ptr)->g->log.busy = 0;
+
+	return Qnil;
+}
+
+/*
+ * Brings a gallery loaded with follow: up to what its writer has
+ * published. Called with the GVL before every search, so it costs a
+ * seqlock read when nothing has changed; a thread that finds another
+ * already catching up searches what is there. Returns whether it did
+ * anything.
+ */
+int snapshot_follow(gallery *g) {
+	snapshot_follow_args args;
+
+	if(!g->log.follow || g->log.busy || !snapshot_observe(g, &args.seen)) {
+		return 0;
+	}
+	if(args.seen.snapshot_generation == g->log.snapshot_generation &&
+	   args.seen.log_generation == g->log.generation &&
+	   args.seen.log_size == g->log.size) {
+		return 0;
+	}
+
+	args.g = g;
+	g->log.busy = 1;
+	rb_ensure(snapshot_catch_up, (VALUE) &args, snapshot_catch_up_ensure, (VALUE) &args);
+
+	return 1;
+}
+
+/*
+ * Takes path.lock, so only one process at a time logs to the gallery.
+ */
+static int snapshot_lock(VALUE path) {
+	VALUE lock_path = rb_sprintf("%s.lock", StringValueCStr(path));
+	int fd = open(StringValueCStr(lock_path), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+
+	if(fd < 0) {
+		rb_sys_fail_str(lock_path);
+	}
+	if(flock(fd, LOCK_EX | LOCK_NB) != 0) {
+		int e = errno;
+
+		close(fd);
+		if(e == EWOULDBLOCK) {
+			rb_raise(rb_eFingerprintError, "%s: gallery is open in another process", StringValueCStr(path));
+		}
+		rb_syserr_fail_str(e, lock_path);
+	}
+
+	return fd;
+}
+
+typedef struct snapshot_load_args {
+	gallery *g;
+	VALUE path;
+	int format_given;
+	int attach;
+} snapshot_load_args;
+
+static VALUE snapshot_load_protected(VALUE ptr) {
+	snapshot_load_args *args = (snapshot_load_args*) ptr;
+
+	return snapshot_load(args->g, args->path, args->format_given, args->attach) ? Qtrue : Qfalse;
+}
+
+static VALUE snapshot_open(int argc, VALUE *argv, VALUE klass, int attach) {
+	VALUE path, opts, obj, loaded;
+	ID keys[2];
+	VALUE values[2];
+	snapshot_load_args args;
+	gallery *g;
+	int lock_fd = -1, state;
+
+	rb_scan_args(argc, argv, "1:", &path, &opts);
+	FilePathValue(path);
+	path = rb_str_new_frozen(path);
+
+	keys[0] = rb_intern("format");
+	keys[1] = rb_intern(attach ? "sync" : "follow");
+	rb_get_kwargs(opts, keys, 0, 2, values);
+
+	if(attach) {
+		lock_fd = snapshot_lock(path);
+	}
+
+	for(int tries = 0; ; tries++) {
+		obj = rb_obj_alloc(klass);
+		g = get_gallery(obj);
+		g->log.lock_fd = lock_fd;
+		if(values[0] != Qundef && !NIL_P(values[0])) {
+			g->format = NUM2INT(values[0]);
+		}
+		if(attach) {
+			g->log.sync = values[1] != Qundef && RTEST(values[1]);
+		}
+
+		args.g = g;
+		args.path = path;
+		args.format_given = values[0] != Qundef && !NIL_P(values[0]);
+		args.attach = attach;
+		loaded = rb_protect(snapshot_load_protected, (VALUE) &args, &state);
+		if(!state && RTEST(loaded)) {
+			break;
+		}
+
+		/* Don't leave path locked until the half-loaded gallery is collected. */
+		snapshot_close(g);
+		if(state) {
+			rb_jump_tag(state);
+		}
+		if(attach || tries + 1 == SNAPSHOT_LOAD_TRIES) {
+			rb_raise(rb_eFingerprintError, "%s: gallery log does not follow on from its snapshot", StringValueCStr(path));
+		}
+	}
+
+	if(!attach && values[1] != Qundef && RTEST(values[1])) {
+		g->log.control = snapshot_control_map(g->log.path, 0);
+		if(!g->log.control) {
+			rb_sys_fail_str(rb_sprintf("%s.epoch", g->log.path));
+		}
+		g->log.follow = 1;
+	}
+
+	return obj;
+}
+
+/*
+ * KeyMe::Fingerprint::Gallery.open(path, format: nil, sync: false)
+ *
+ * Maps the snapshot at path, if there is one, and replays the delta logs
+ * written since, then logs every add and remove made from here on, so the
+ * gallery survives a restart. Only one process may have path open at a
+ * time. With sync, each change is flushed to disk before it is made.
+ * checkpoint writes a fresh snapshot and starts the log afresh.
+ */
+VALUE snapshot_open_wrapper(int argc, VALUE *argv, VALUE klass) {
+	return snapshot_open(argc, argv, klass, 1);
+}
+
+/*
+ * KeyMe::Fingerprint::Gallery.load(path, format: nil, follow: false)
+ *
+ * Like Gallery.open, for any number of processes that only read the
+ * gallery: changes made to the result are not logged.
+ *
+ * With follow, the gallery tracks the one open at path instead: each
+ * identify first takes in whatever has been enrolled or removed there, and
+ * the snapshot written by each checkpoint. Load it before forking and
+ * every worker searches the one copy of the prints in the page cache. It
+ * cannot be changed itself.
+ */
+VALUE snapshot_load_wrapper(int argc, VALUE *argv, VALUE klass) {
+	return snapshot_open(argc, argv, klass, 0);
+}
+
+/*
+ * KeyMe::Fingerprint::Gallery#checkpoint
+ *
+ * Writes a compacted snapshot of a gallery opened with Gallery.open over
+ * the old one and drops the logs it supersedes. Searches and enrollment go
+ * on while it is written, with the GVL released; changes made meanwhile go
+ * to the next log.
+ */
+VALUE snapshot_checkpoint(VALUE self) {
+	gallery *g = get_gallery(self);
+
+	if(g->log.fd < 0) {
+		rb_raise(rb_eFingerprintError, "gallery was not opened with Gallery.open");
+	}
+	if(g->log.busy) {
+		rb_raise(rb_eFingerprintError, "a checkpoint is already running");
+	}
+	g->log.busy = 1;
+
+	snapshot_write(g, rb_str_new_cstr(g->log.path), 1);
+
+	return self;
+}
+
+/*
+ * KeyMe::Fingerprint::Gallery#save(path)
+ *
+ * Writes a compacted snapshot of the gallery to path, for Gallery.load or
+ * Gallery.open. It must not be the path of a gallery opened elsewhere.
+ */
+VALUE snapshot_save(VALUE self, VALUE path) {
+	FilePathValue(path);
+	snapshot_write(get_gallery(self), rb_str_new_frozen(path), 0);
+
+	return self;
+}
+
+/*
+ * KeyMe::Fingerprint::Gallery#log_size
+ *
+ * Bytes of changes logged since the last checkpoint, or nil if the gallery
+ * is not logging.
+ */
+VALUE snapshot_log_size(VALUE self) {
+	gallery *g = get_gallery(self);
+
+	if(g->log.fd < 0) {
+		return Qnil;
+	}
+
+	return ULL2NUM(g->log.size - SNAPSHOT_LOG_HEADER_SIZE);
+}
+
+/*
+ * KeyMe::Fingerprint::Gallery#refresh
+ *
+ * Catches a gallery loaded with follow: up now rather than at the next
+ * identify. Returns whether anything changed.
+ */
+VALUE snapshot_refresh(VALUE self) {
+	return snapshot_follow(get_gallery(self)) ? Qtrue : Qfalse;
+}
+
+VALUE snapshot_following_p(VALUE self) {
+	return get_gallery(self)->log.follow ? Qtrue : Qfalse;
+}
+
+static VALUE snapshot_close_locked(VALUE ptr) {
+	snapshot_close((gallery*) ptr);
+
+	return Qnil;
+}
+
+/*
+ * KeyMe::Fingerprint::Gallery#close_log
+ *
+ * Stops logging and unlocks path, so another process can open it, or
+ * stops following.
+ */
+VALUE snapshot_close_log(VALUE self) {
+	gallery *g = get_gallery(self);
+
+	if(g->log.busy) {
+		rb_raise(rb_eFingerprintError, g->log.follow ? "gallery is catching up" : "a checkpoint is running");
+	}
+	gallery_write(g, snapshot_close_locked, (VALUE) g);
+
+	return Qnil;
+}
+
+void Init_snapshot() {
+	rb_define_singleton_method(
+		rb_cGallery,
+		"open",
+		RUBY_METHOD_FUNC(snapshot_open_wrapper),
+		-1
+	);
+
+	rb_define_singleton_method(
+		rb_cGallery,
+		"load",
+		RUBY_METHOD_FUNC(snapshot_load_wrapper),
+		-1
+	);
+
+	rb_define_method(rb_cGallery, "checkpoint", RUBY_METHOD_FUNC(snapshot_checkpoint), 0);
+	rb_define_method(rb_cGallery, "save", RUBY_METHOD_FUNC(snapshot_save), 1);
+	rb_define_method(rb_cGallery, "log_size", RUBY_METHOD_FUNC(snapshot_log_size), 0);
+	rb_define_method(rb_cGallery, "close_log", RUBY_METHOD_FUNC(snapshot_close_log), 0);
+	rb_define_method(rb_cGallery, "refresh", RUBY_METHOD_FUNC(snapshot_refresh), 0);
+	rb_define_method(rb_cGallery, "following?", RUBY_METHOD_FUNC(snapshot_following_p), 0);
+}
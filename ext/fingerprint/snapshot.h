@@ -0,0 +1,81 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <stdint.h>
+
+#include "fingerprint.h"
+#include "gallery.h"
+
+/*
+ * Gallery snapshot file layout. Integers in the header and entry table
+ * are little-endian; the arenas and view descriptors are kept exactly as
+ * they are in memory, so the snapshot is only good on the kind of machine
+ * that wrote it, which byte_order and descriptor_size vouch for.
+ *
+ *   header    SNAPSHOT_HEADER_SIZE bytes
+ *   arena     the FMDs, each starting on an 8-byte boundary
+ *   minutiae  the decoded blocks, at a SNAPSHOT_ALIGN boundary
+ *   views     one view_descriptor per indexed view
+ *   entries   one SNAPSHOT_ENTRY_SIZE entry per id
+ *
+ * Header: magic[8], version u32, format i32, byte_order u32,
+ * descriptor_size u32, generation u64, entry_cnt u32, view_cnt u32,
+ * arena_offset u64, arena_len u64, minutiae_offset u64, minutiae_len u64,
+ * views_offset u64, entries_offset u64, file_size u64, then zeros.
+ * Entry: offset u64, size u32, live u32, minutiae u64, minutiae_size u64,
+ * offsets relative to their section.
+ *
+ * Every change made to a gallery opened with Gallery.open is appended to
+ * a delta log, path.<generation>.log, before it is applied:
+ *
+ *   header    SNAPSHOT_LOG_HEADER_SIZE bytes: magic[8], version u32,
+ *             format i32, generation u64, base u32, then zeros
+ *   records   len u32, crc u32, op u32, id u32, then len bytes of FMD
+ *
+ * crc is the CRC32C of everything after it. A log starts where the
+ * gallery had base entries. Loading maps the snapshot and replays its log
+ * and any later ones; a torn record at the end of the last is dropped.
+ *
+ * The writer also publishes where it is up to in path.epoch, which every
+ * process maps shared. Galleries loaded with follow: poll it before each
+ * search, a seqlock read of one cache line, and catch up by reading only
+ * the new records, or by swapping in a new snapshot once a checkpoint has
+ * written one. The prints themselves stay in the snapshot's page cache,
+ * one copy for every process on the host.
+ */
+#define SNAPSHOT_MAGIC "KMFPGALL"
+#define SNAPSHOT_LOG_MAGIC "KMFPGLOG"
+#define SNAPSHOT_VERSION 1
+#define SNAPSHOT_HEADER_SIZE 128
+#define SNAPSHOT_ENTRY_SIZE 32
+#define SNAPSHOT_LOG_HEADER_SIZE 32
+#define SNAPSHOT_LOG_RECORD_SIZE 16
+#define SNAPSHOT_ALIGN 64
+#define SNAPSHOT_BYTE_ORDER 0x01020304
+
+#define SNAPSHOT_LOG_ADD 1
+#define SNAPSHOT_LOG_REMOVE 2
+
+#define SNAPSHOT_CONTROL_MAGIC "KMFPGSEQ"
+
+/*
+ * The shared page in path.epoch. seq is odd while the writer updates the
+ * rest, so readers retry; it is only written by the process holding
+ * path.lock. Native byte order, like the arenas.
+ */
+typedef struct snapshot_control {
+	char magic[8];
+	uint64_t seq;
+	uint64_t snapshot_generation;
+	uint64_t log_generation;
+	uint64_t log_size;
+} snapshot_control;
+
+void snapshot_log_add(gallery *g, unsigned int id, const unsigned char *data, unsigned int len);
+void snapshot_log_remove(gallery *g, unsigned int id);
+void snapshot_close(gallery *g);
+int snapshot_follow(gallery *g);
+
+void Init_snapshot();
+
+#endif
@@ -0,0 +1,340 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "stats.h"
+
+/*
+ * Latencies are kept in log-linear buckets, as HdrHistogram does: values
+ * below STATS_SUB nanoseconds get a bucket each, and every power of two
+ * above that is split into STATS_SUB buckets, so any value is known to
+ * within about 3%. Anything past STATS_MAX_NS lands in the last bucket.
+ */
+#define STATS_SUB_BITS 5
+#define STATS_SUB (1u << STATS_SUB_BITS)
+#define STATS_MAX_BITS 40
+#define STATS_MAX_NS ((1ull << STATS_MAX_BITS) - 1)
+#define STATS_BUCKETS ((STATS_MAX_BITS - STATS_SUB_BITS + 1) * STATS_SUB)
+
+/*
+ * One thread's numbers. Only its owner writes to a shard, with plain
+ * relaxed loads and stores, so recording takes no lock and no locked
+ * instruction; readers merge every shard. A shard outlives its thread and
+ * is handed to the next new one, counts and all.
+ */
+typedef struct stats_shard {
+	uint64_t hist[STATS_OPS][STATS_BUCKETS];
+	uint64_t sum[STATS_OPS];
+	uint64_t counters[STATS_COUNTERS];
+	struct stats_shard *next;
+	int owned;
+} stats_shard;
+
+int stats_enabled;
+
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t stats_key;
+static stats_shard *stats_shards;
+static __thread stats_shard *stats_mine;
+
+/* What the shards held at the last reset; reads subtract it. */
+static stats_shard stats_baseline;
+
+static unsigned int stats_bucket(uint64_t ns) {
+	unsigned int msb;
+
+	if(ns > STATS_MAX_NS) {
+		ns = STATS_MAX_NS;
+	}
+	if(ns < STATS_SUB) {
+		return (unsigned int) ns;
+	}
+	msb = 63 - __builtin_clzll(ns);
+
+	return (msb - STATS_SUB_BITS + 1) * STATS_SUB + (unsigned int) (ns >> (msb - STATS_SUB_BITS)) - STATS_SUB;
+}
+
+/* The middle of bucket's range. */
+static uint64_t stats_bucket_value(unsigned int bucket) {
+	unsigned int shift;
+
+	if(bucket < STATS_SUB) {
+		return bucket;
+	}
+	shift = bucket / STATS_SUB - 1;
+
+	return ((uint64_t) (STATS_SUB + bucket % STATS_SUB) << shift) + ((1ull << shift) >> 1);
+}
+
+static void stats_release(void *ptr) {
+	stats_shard *shard = (stats_shard*) ptr;
+
+	pthread_mutex_lock(&stats_lock);
+	shard->owned = 0;
+	pthread_mutex_unlock(&stats_lock);
+}
+
+/* This thread's shard: a free one if any thread has left, else a new one. */
+static stats_shard *stats_shard_mine() {
+	stats_shard *shard;
+
+	if(stats_mine) {
+		return stats_mine;
+	}
+
+	pthread_mutex_lock(&stats_lock);
+	for(shard = stats_shards; shard && shard->owned; shard = shard->next);
+	if(!shard) {
+		shard = (stats_shard*) calloc(1, sizeof(stats_shard));
+		if(shard) {
+			shard->next = stats_shards;
+			stats_shards = shard;
+		}
+	}
+	if(shard) {
+		shard->owned = 1;
+	}
+	pthread_mutex_unlock(&stats_lock);
+
+	if(shard) {
+		pthread_setspecific(stats_key, shard);
+		stats_mine = shard;
+	}
+
+	return shard;
+}
+
+static inline void stats_bump(uint64_t *p, uint64_t n) {
+	__atomic_store_n(p, __atomic_load_n(p, __ATOMIC_RELAXED) + n, __ATOMIC_RELAXED);
+}
+
+void stats_record(int op, uint64_t ns) {
+	stats_shard *shard = stats_shard_mine();
+
+	if(shard) {
+		stats_bump(&shard->hist[op][stats_bucket(ns)], 1);
+		stats_bump(&shard->sum[op], ns);
+	}
+}
+
+void stats_add(int counter, uint64_t n) {
+	stats_shard *shard = stats_shard_mine();
+
+	if(shard) {
+		stats_bump(&shard->counters[counter], n);
+	}
+}
+
+typedef struct stats_call {
+	void *(*func)(void*);
+	void *arg;
+	uint64_t released;
+	uint64_t returned;
+} stats_call;
+
+static void *stats_trampoline(void *ptr) {
+	stats_call *call = (stats_call*) ptr;
+	void *result;
+
+	call->released = stats_now();
+	result = call->func(call->arg);
+	call->returned = stats_now();
+
+	return result;
+}
+
+static void *stats_call_without_gvl(void *(*call_without_gvl)(void *(*)(void*), void*, rb_unblock_function_t*, void*), void *(*func)(void*), void *arg, rb_unblock_function_t *ubf, void *ubf_arg) {
+	stats_call call;
+	void *result;
+
+	if(!__atomic_load_n(&stats_enabled, __ATOMIC_RELAXED)) {
+		return call_without_gvl(func, arg, ubf, ubf_arg);
+	}
+
+	call.func = func;
+	call.arg = arg;
+	call.released = call.returned = 0;
+	result = call_without_gvl(stats_trampoline, &call, ubf, ubf_arg);
+	if(call.returned) {
+		stats_record(STATS_GVL_WAIT, stats_now() - call.returned);
+		stats_add(STATS_GVL_RELEASED_NS, call.returned - call.released);
+		stats_add(STATS_GVL_RELEASES, 1);
+	}
+
+	return result;
+}
+
+/*
+ * rb_thread_call_without_gvl, counting how long the GVL was given up for
+ * and timing the wait to get it back once func is done.
+ */
+void *stats_without_gvl(void *(*func)(void*), void *arg, rb_unblock_function_t *ubf, void *ubf_arg) {
+	return stats_call_without_gvl(rb_thread_call_without_gvl, func, arg, ubf, ubf_arg);
+}
+
+/*
+ * The same over rb_thread_call_without_gvl2, which never raises: pending
+ * interrupts are left for the caller to check once it has cleaned up.
+ * func is not run at all if one is pending already, so callers must be
+ * able to tell whether it was.
+ */
+void *stats_without_gvl2(void *(*func)(void*), void *arg, rb_unblock_function_t *ubf, void *ubf_arg) {
+	return stats_call_without_gvl(rb_thread_call_without_gvl2, func, arg, ubf, ubf_arg);
+}
+
+/* Sums every shard into total. Called holding stats_lock. */
+static void stats_merge(stats_shard *total) {
+	memset(total, 0, sizeof(*total));
+	for(stats_shard *shard = stats_shards; shard; shard = shard->next) {
+		for(unsigned int op = 0; op < STATS_OPS; op++) {
+			for(unsigned int b = 0; b < STATS_BUCKETS; b++) {
+				total->hist[op][b] += __atomic_load_n(&shard->hist[op][b], __ATOMIC_RELAXED);
+			}
+			total->sum[op] += __atomic_load_n(&shard->sum[op], __ATOMIC_RELAXED);
+		}
+		for(unsigned int c = 0; c < STATS_COUNTERS; c++) {
+			total->counters[c] += __atomic_load_n(&shard->counters[c], __ATOMIC_RELAXED);
+		}
+	}
+}
+
+static VALUE stats_op_hash(const uint64_t *hist, uint64_t sum) {
+	static const double percentiles[] = { 0.5, 0.9, 0.99, 0.999 };
+	static const char *names[] = { "p50", "p90", "p99", "p999" };
+	VALUE result = rb_hash_new();
+	uint64_t count = 0, seen = 0;
+	unsigned int p = 0;
+	int min = -1, max = -1;
+
+	for(unsigned int b = 0; b < STATS_BUCKETS; b++) {
+		if(hist[b]) {
+			count += hist[b];
+			if(min < 0) {
+				min = b;
+			}
+			max = b;
+		}
+	}
+
+	rb_hash_aset(result, ID2SYM(rb_intern("count")), ULL2NUM(count));
+	rb_hash_aset(result, ID2SYM(rb_intern("total")), DBL2NUM(sum / 1e9));
+	if(!count) {
+		return result;
+	}
+	rb_hash_aset(result, ID2SYM(rb_intern("mean")), DBL2NUM(sum / 1e9 / count));
+	rb_hash_aset(result, ID2SYM(rb_intern("min")), DBL2NUM(stats_bucket_value(min) / 1e9));
+
+	for(unsigned int b = 0; b < STATS_BUCKETS && p < 4; b++) {
+		seen += hist[b];
+		while(p < 4 && seen >= percentiles[p] * count) {
+			rb_hash_aset(result, ID2SYM(rb_intern(names[p])), DBL2NUM(stats_bucket_value(b) / 1e9));
+			p++;
+		}
+	}
+	rb_hash_aset(result, ID2SYM(rb_intern("max")), DBL2NUM(stats_bucket_value(max) / 1e9));
+
+	return result;
+}
+
+/*
+ * KeyMe::Fingerprint.stats
+ *
+ * What the extension has been doing since the last reset_stats, while
+ * stats were enabled. For each of marshal (copying prints between Ruby
+ * objects and native buffers), match, extract, capture and gvl_wait (how
+ * long a thread waited for the GVL back after native work), a Hash of
+ * count, total, mean, min, p50, p90, p99, p999 and max, in seconds. Plus
+ * bytes_copied, allocations, gvl_released (seconds spent without the GVL)
+ * and gvl_releases.
+ */
+VALUE stats_wrapper(VALUE self) {
+	static const char *ops[STATS_OPS] = { "marshal", "match", "extract", "capture", "gvl_wait" };
+	stats_shard *total = ALLOC(stats_shard);
+	VALUE result = rb_hash_new();
+
+	pthread_mutex_lock(&stats_lock);
+	stats_merge(total);
+	for(unsigned int op = 0; op < STATS_OPS; op++) {
+		for(unsigned int b = 0; b < STATS_BUCKETS; b++) {
+			total->hist[op][b] -= stats_baseline.hist[op][b];
+		}
+		total->sum[op] -= stats_baseline.sum[op];
+	}
+	for(unsigned int c = 0; c < STATS_COUNTERS; c++) {
+		total->counters[c] -= stats_baseline.counters[c];
+	}
+	pthread_mutex_unlock(&stats_lock);
+
+	rb_hash_aset(result, ID2SYM(rb_intern("enabled")), stats_enabled ? Qtrue : Qfalse);
+	for(unsigned int op = 0; op < STATS_OPS; op++) {
+		rb_hash_aset(result, ID2SYM(rb_intern(ops[op])), stats_op_hash(total->hist[op], total->sum[op]));
+	}
+	rb_hash_aset(result, ID2SYM(rb_intern("bytes_copied")), ULL2NUM(total->counters[STATS_BYTES_COPIED]));
+	rb_hash_aset(result, ID2SYM(rb_intern("allocations")), ULL2NUM(total->counters[STATS_ALLOCATIONS]));
+	rb_hash_aset(result, ID2SYM(rb_intern("gvl_released")), DBL2NUM(total->counters[STATS_GVL_RELEASED_NS] / 1e9));
+	rb_hash_aset(result, ID2SYM(rb_intern("gvl_releases")), ULL2NUM(total->counters[STATS_GVL_RELEASES]));
+	xfree(total);
+
+	return result;
+}
+
+/*
+ * KeyMe::Fingerprint.reset_stats
+ *
+ * Starts stats over from zero. Threads recording meanwhile are not held
+ * up; what they record lands on one side of the reset or the other.
+ */
+VALUE reset_stats_wrapper(VALUE self) {
+	pthread_mutex_lock(&stats_lock);
+	stats_merge(&stats_baseline);
+	pthread_mutex_unlock(&stats_lock);
+
+	return Qnil;
+}
+
+VALUE stats_enabled_wrapper(VALUE self) {
+	return stats_enabled ? Qtrue : Qfalse;
+}
+
+/*
+ * KeyMe::Fingerprint.stats_enabled = bool
+ *
+ * Off by default, or on when KEYME_FINGERPRINT_STATS is set.
+ */
+VALUE set_stats_enabled_wrapper(VALUE self, VALUE enabled) {
+	__atomic_store_n(&stats_enabled, RTEST(enabled) ? 1 : 0, __ATOMIC_RELAXED);
+
+	return enabled;
+}
+
+void Init_stats() {
+	const char *env = getenv("KEYME_FINGERPRINT_STATS");
+
+	pthread_key_create(&stats_key, stats_release);
+	stats_enabled = env && *env && strcmp(env, "0") != 0;
+
+	rb_define_singleton_method(
+		rb_mFingerprint,
+		"stats",
+		RUBY_METHOD_FUNC(stats_wrapper),
+		0
+	);
+	rb_define_singleton_method(
+		rb_mFingerprint,
+		"reset_stats",
+		RUBY_METHOD_FUNC(reset_stats_wrapper),
+		0
+	);
+	rb_define_singleton_method(
+		rb_mFingerprint,
+		"stats_enabled?",
+		RUBY_METHOD_FUNC(stats_enabled_wrapper),
+		0
+	);
+	rb_define_singleton_method(
+		rb_mFingerprint,
+		"stats_enabled=",
+		RUBY_METHOD_FUNC(set_stats_enabled_wrapper),
+		1
+	);
+}
@@ -0,0 +1,67 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdint.h>
+#include <time.h>
+
+#include "fingerprint.h"
+
+/* Timed operations, each with its own latency histogram. */
+enum {
+	STATS_MARSHAL,
+	STATS_MATCH,
+	STATS_EXTRACT,
+	STATS_CAPTURE,
+	STATS_GVL_WAIT,
+	STATS_OPS
+};
+
+/* Plain counters. */
+enum {
+	STATS_BYTES_COPIED,
+	STATS_ALLOCATIONS,
+	STATS_GVL_RELEASED_NS,
+	STATS_GVL_RELEASES,
+	STATS_COUNTERS
+};
+
+extern int stats_enabled;
+
+void stats_record(int op, uint64_t ns);
+void stats_add(int counter, uint64_t n);
+
+static inline uint64_t stats_now() {
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (uint64_t) now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+
+/*
+ * The start of a timed operation, or 0 when stats are off, in which case
+ * stats_since does nothing; a disabled probe costs one load and branch.
+ * Both are safe without the GVL.
+ */
+static inline uint64_t stats_start() {
+	return __builtin_expect(__atomic_load_n(&stats_enabled, __ATOMIC_RELAXED), 0) ? stats_now() : 0;
+}
+
+static inline void stats_since(int op, uint64_t start) {
+	if(__builtin_expect(start != 0, 0)) {
+		stats_record(op, stats_now() - start);
+	}
+}
+
+static inline void stats_count(int counter, uint64_t n) {
+	if(__builtin_expect(__atomic_load_n(&stats_enabled, __ATOMIC_RELAXED), 0)) {
+		stats_add(counter, n);
+	}
+}
+
+void *stats_without_gvl(void *(*func)(void*), void *arg, rb_unblock_function_t *ubf, void *ubf_arg);
+void *stats_without_gvl2(void *(*func)(void*), void *arg, rb_unblock_function_t *ubf, void *ubf_arg);
+
+void Init_stats();
+
+#endif
@@ -0,0 +1,601 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "stats.h"
+#include "store.h"
+
+VALUE rb_cStore;
+VALUE rb_cStoreWriter;
+
+/* Reader */
+
+static void store_unmap(store *st) {
+	if(st->map) {
+		munmap(st->map, st->map_len);
+	}
+	xfree(st->fmds);
+	xfree(st->fmds_size);
+	st->map = NULL;
+	st->map_len = 0;
+	st->fmds = NULL;
+	st->fmds_size = NULL;
+	st->cnt = 0;
+}
+
+static void store_free(void *ptr) {
+	store *st = (store*) ptr;
+
+	store_unmap(st);
+	pthread_rwlock_destroy(&st->lock);
+	xfree(st);
+}
+
+static size_t store_memsize(const void *ptr) {
+	const store *st = (const store*) ptr;
+
+	return sizeof(store) + st->cnt * (sizeof(unsigned char*) + sizeof(unsigned int));
+}
+
+static const rb_data_type_t store_type = {
+	"KeyMe::Fingerprint::Store",
+	{ NULL, store_free, store_memsize, },
+	NULL, NULL,
+	RUBY_TYPED_FREE_IMMEDIATELY,
+};
+
+int is_store(VALUE obj) {
+	return rb_typeddata_is_kind_of(obj, &store_type);
+}
+
+store *get_store(VALUE obj) {
+	store *st;
+
+	TypedData_Get_Struct(obj, store, &store_type, st);
+
+	return st;
+}
+
+/*
+ * Called without the GVL. Returns 0, holding nothing, if the store has
+ * been closed.
+ */
+int store_read_lock(store *st, fmd_set *set) {
+	pthread_rwlock_rdlock(&st->lock);
+
+	if(!st->map) {
+		pthread_rwlock_unlock(&st->lock);
+		return 0;
+	}
+
+	set->format = st->format;
+	set->cnt = st->cnt;
+	set->fmds = st->fmds;
+	set->fmds_size = st->fmds_size;
+	set->ids = NULL;
+
+	return 1;
+}
+
+void store_read_unlock(store *st) {
+	pthread_rwlock_unlock(&st->lock);
+}
+
+static VALUE store_alloc(VALUE klass) {
+	store *st;
+	VALUE obj = TypedData_Make_Struct(klass, store, &store_type, st);
+
+	pthread_rwlock_init(&st->lock, NULL);
+
+	return obj;
+}
+
+typedef struct store_write_args {
+	store *st;
+	VALUE (*func)(VALUE);
+	VALUE arg;
+	int locked;
+} store_write_args;
+
+static void *store_write_lock_without_gvl(void *ptr) {
+	store_write_args *args = (store_write_args*) ptr;
+
+	pthread_rwlock_wrlock(&args->st->lock);
+	args->locked = 1;
+
+	return NULL;
+}
+
+static VALUE store_write_body(VALUE ptr) {
+	store_write_args *args = (store_write_args*) ptr;
+
+	stats_without_gvl(store_write_lock_without_gvl, args, NULL, NULL);
+
+	return args->func(args->arg);
+}
+
+static VALUE store_write_unlock(VALUE ptr) {
+	store_write_args *args = (store_write_args*) ptr;
+
+	if(args->locked) {
+		pthread_rwlock_unlock(&args->st->lock);
+	}
+
+	return Qnil;
+}
+
+/*
+ * Runs func(arg) holding the write lock, which is released even if an
+ * interrupt arrives just as it is taken; see gallery_write.
+ */
+static VALUE store_write(store *st, VALUE (*func)(VALUE), VALUE arg) {
+	store_write_args args;
+
+	args.st = st;
+	args.func = func;
+	args.arg = arg;
+	args.locked = 0;
+
+	return rb_ensure(store_write_body, (VALUE) &args, store_write_unlock, (VALUE) &args);
+}
+
+typedef struct store_publish_args {
+	store *st;
+	unsigned int cnt;
+} store_publish_args;
+
+static VALUE store_publish_locked(VALUE ptr) {
+	store_publish_args *args = (store_publish_args*) ptr;
+
+	args->st->cnt = args->cnt;
+
+	return Qnil;
+}
+
+static VALUE store_unmap_locked(VALUE ptr) {
+	store_unmap((store*) ptr);
+
+	return Qnil;
+}
+
+static void store_corrupt(store *st, VALUE path, const char *why) {
+	store_unmap(st);
+	rb_raise(rb_eFingerprintError, "%s: corrupt template store (%s)", StringValueCStr(path), why);
+}
+
+/*
+ * KeyMe::Fingerprint::Store.new(path)
+ *
+ * Maps a template store read-only and points the identify tables at its
+ * records. Only the index is read up front; the records themselves are
+ * paged in by the matcher as it touches them.
+ */
+VALUE store_initialize(VALUE self, VALUE path) {
+	store *st = get_store(self);
+	struct stat sb;
+	const unsigned char *header, *entry;
+	uint64_t index_offset, file_size, offset;
+	uint32_t size, cnt;
+	store_publish_args publish;
+	void *map;
+	int fd;
+
+	if(st->map) {
+		rb_raise(rb_eFingerprintError, "template store is already initialized");
+	}
+	FilePathValue(path);
+
+	fd = open(StringValueCStr(path), O_RDONLY | O_CLOEXEC);
+	if(fd < 0) {
+		rb_sys_fail_str(path);
+	}
+	if(fstat(fd, &sb) < 0) {
+		int e = errno;
+
+		close(fd);
+		errno = e;
+		rb_sys_fail_str(path);
+	}
+	if((size_t) sb.st_size < STORE_HEADER_SIZE) {
+		close(fd);
+		rb_raise(rb_eFingerprintError, "%s: not a template store", StringValueCStr(path));
+	}
+
+	map = mmap(NULL, sb.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if(map == MAP_FAILED) {
+		rb_sys_fail_str(path);
+	}
+
+	st->map = (unsigned char*) map;
+	st->map_len = sb.st_size;
+
+	header = st->map;
+	if(memcmp(header, STORE_MAGIC, 8) != 0) {
+		store_corrupt(st, path, "bad magic");
+	}
+	if(load_le32(header + 8) != STORE_VERSION) {
+		store_corrupt(st, path, "unsupported version");
+	}
+	st->format = (DPFJ_FMD_FORMAT) load_le32(header + 12);
+	cnt = load_le32(header + 16);
+	index_offset = load_le64(header + 24);
+	file_size = load_le64(header + 32);
+
+	if(file_size != st->map_len) {
+		store_corrupt(st, path, "truncated");
+	}
+	if(index_offset < STORE_HEADER_SIZE || index_offset > file_size ||
+	   (file_size - index_offset) / STORE_INDEX_ENTRY_SIZE < cnt) {
+		store_corrupt(st, path, "index out of bounds");
+	}
+
+	/*
+	 * cnt stays 0 until the tables are filled in, so a failure here leaves
+	 * a store with nothing in it rather than one that points nowhere.
+	 */
+	st->fmds = ALLOC_N(unsigned char*, cnt);
+	st->fmds_size = ALLOC_N(unsigned int, cnt);
+
+	entry = st->map + index_offset;
+	for(unsigned int i = 0; i < cnt; i++, entry += STORE_INDEX_ENTRY_SIZE) {
+		offset = load_le64(entry);
+		size = load_le32(entry + 8);
+
+		if(offset % STORE_ALIGN != 0 || offset < STORE_HEADER_SIZE ||
+		   offset > index_offset || index_offset - offset < size) {
+			store_corrupt(st, path, "record out of bounds");
+		}
+		st->fmds[i] = st->map + offset;
+		st->fmds_size[i] = size;
+	}
+
+	publish.st = st;
+	publish.cnt = cnt;
+	store_write(st, store_publish_locked, (VALUE) &publish);
+
+	return self;
+}
+
+/*
+ * Unmaps the store once no search is using it.
+ */
+VALUE store_close(VALUE self) {
+	store *st = get_store(self);
+
+	store_write(st, store_unmap_locked, (VALUE) st);
+
+	return Qnil;
+}
+
+static void store_check_index(store *st, unsigned int index) {
+	if(!st->map) {
+		rb_raise(rb_eFingerprintError, "template store is closed");
+	}
+	if(index >= st->cnt) {
+		rb_raise(rb_eIndexError, "record %u out of range", index);
+	}
+}
+
+VALUE store_aref(VALUE self, VALUE index_v) {
+	store *st = get_store(self);
+	unsigned int index = NUM2UINT(index_v);
+
+	store_check_index(st, index);
+
+	return rb_obj_freeze(rb_str_new((char*) st->fmds[index], st->fmds_size[index]));
+}
+
+typedef struct store_compare_args {
+	store *st;
+	unsigned int index;
+	unsigned int view;
+	unsigned char *probe;
+	unsigned int probe_len;
+	unsigned int probe_view;
+	unsigned int score;
+	int rc;
+} store_compare_args;
+
+static void *store_compare_without_gvl(void *ptr) {
+	store_compare_args *args = (store_compare_args*) ptr;
+	fmd_set set;
+	uint64_t start;
+
+	if(!store_read_lock(args->st, &set)) {
+		args->rc = DPFJ_E_INVALID_PARAMETER;
+		return NULL;
+	}
+	if(args->index >= set.cnt) {
+		store_read_unlock(args->st);
+		args->rc = DPFJ_E_INVALID_PARAMETER;
+		return NULL;
+	}
+
+	start = stats_start();
+	args->rc = dpfj_compare(
+		set.format, set.fmds[args->index], set.fmds_size[args->index], args->view,
+		set.format, args->probe, args->probe_len, args->probe_view,
+		&args->score
+	);
+	stats_since(STATS_MATCH, start);
+
+	store_read_unlock(args->st);
+
+	return NULL;
+}
+
+/*
+ * KeyMe::Fingerprint::Store#compare(index, view, probe, probe_view = 0)
+ *
+ * Scores a probe against a record read in place from the mapping.
+ */
+VALUE store_compare(int argc, VALUE *argv, VALUE self) {
+	VALUE index, view, probe, probe_view, pinned;
+	store_compare_args args;
+
+	rb_scan_args(argc, argv, "31", &index, &view, &probe, &probe_view);
+
+	args.st = get_store(self);
+	args.index = NUM2UINT(index);
+	args.view = NUM2UINT(view);
+	args.probe_view = NIL_P(probe_view) ? 0 : NUM2UINT(probe_view);
+	store_check_index(args.st, args.index);
+
+	pinned = print_pin(probe, &args.probe, &args.probe_len);
+
+	stats_without_gvl(store_compare_without_gvl, &args, NULL, NULL);
+
+	RB_GC_GUARD(pinned);
+
+	check_dpfj(args.rc, "dpfj_compare");
+
+	return UINT2NUM(args.score);
+}
+
+VALUE store_size(VALUE self) {
+	return UINT2NUM(get_store(self)->cnt);
+}
+
+VALUE store_format(VALUE self) {
+	return INT2NUM(get_store(self)->format);
+}
+
+/* Writer */
+
+/*
+ * Records are streamed to path.tmp as they are added; close appends the
+ * index, fills in the header and renames the file into place, so readers
+ * never see a half-written store.
+ */
+typedef struct store_writer {
+	FILE *file;
+	char *path;
+	char *tmp_path;
+	DPFJ_FMD_FORMAT format;
+	uint64_t pos;
+	unsigned char *index;
+	unsigned int cnt;
+	unsigned int capa;
+} store_writer;
+
+static void store_writer_free(void *ptr) {
+	store_writer *w = (store_writer*) ptr;
+
+	if(w->file) {
+		fclose(w->file);
+		unlink(w->tmp_path);
+	}
+	xfree(w->path);
+	xfree(w->tmp_path);
+	xfree(w->index);
+	xfree(w);
+}
+
+static size_t store_writer_memsize(const void *ptr) {
+	const store_writer *w = (const store_writer*) ptr;
+
+	return sizeof(store_writer) + (size_t) w->capa * STORE_INDEX_ENTRY_SIZE;
+}
+
+static const rb_data_type_t store_writer_type = {
+	"KeyMe::Fingerprint::Store::Writer",
+	{ NULL, store_writer_free, store_writer_memsize, },
+	NULL, NULL,
+	RUBY_TYPED_FREE_IMMEDIATELY,
+};
+
+static store_writer *get_store_writer(VALUE obj) {
+	store_writer *w;
+
+	TypedData_Get_Struct(obj, store_writer, &store_writer_type, w);
+	if(!w->file) {
+		rb_raise(rb_eIOError, "template store writer is closed");
+	}
+
+	return w;
+}
+
+static VALUE store_writer_alloc(VALUE klass) {
+	store_writer *w;
+
+	return TypedData_Make_Struct(klass, store_writer, &store_writer_type, w);
+}
+
+static void store_writer_write(store_writer *w, const void *data, size_t len) {
+	if(fwrite(data, 1, len, w->file) != len) {
+		rb_sys_fail(w->tmp_path);
+	}
+	w->pos += len;
+}
+
+/*
+ * KeyMe::Fingerprint::Store::Writer.new(path, format = FMD_ANSI_378_2004)
+ */
+VALUE store_writer_initialize(int argc, VALUE *argv, VALUE self) {
+	VALUE path, format;
+	store_writer *w;
+	unsigned char header[STORE_HEADER_SIZE];
+
+	rb_scan_args(argc, argv, "11", &path, &format);
+	FilePathValue(path);
+
+	TypedData_Get_Struct(self, store_writer, &store_writer_type, w);
+	if(w->path) {
+		rb_raise(rb_eFingerprintError, "template store writer is already initialized");
+	}
+	w->format = NIL_P(format) ? DEFAULT_FMD_FORMAT : NUM2INT(format);
+	w->path = ALLOC_N(char, RSTRING_LEN(path) + 1);
+	strcpy(w->path, StringValueCStr(path));
+	w->tmp_path = ALLOC_N(char, RSTRING_LEN(path) + 5);
+	sprintf(w->tmp_path, "%s.tmp", w->path);
+
+	w->file = fopen(w->tmp_path, "wb");
+	if(!w->file) {
+		rb_sys_fail(w->tmp_path);
+	}
+	setvbuf(w->file, NULL, _IOFBF, 1 << 20);
+
+	/* Placeholder until close knows the count and index offset. */
+	memset(header, 0, sizeof(header));
+	store_writer_write(w, header, sizeof(header));
+
+	return self;
+}
+
+int is_store_writer(VALUE obj) {
+	return rb_typeddata_is_kind_of(obj, &store_writer_type);
+}
+
+/*
+ * Appends an FMD to an open writer and returns its record index.
+ */
+unsigned int store_writer_append(VALUE writer, const unsigned char *data, unsigned int len) {
+	static const unsigned char pad[STORE_ALIGN] = { 0 };
+	store_writer *w = get_store_writer(writer);
+	unsigned char *entry;
+
+	if(w->cnt == w->capa) {
+		w->capa = w->capa ? w->capa * 2 : 1024;
+		REALLOC_N(w->index, unsigned char, (size_t) w->capa * STORE_INDEX_ENTRY_SIZE);
+	}
+
+	entry = w->index + (size_t) w->cnt * STORE_INDEX_ENTRY_SIZE;
+	store_le64(w->pos, entry);
+	store_le32(len, entry + 8);
+	store_le32(0, entry + 12);
+
+	store_writer_write(w, data, len);
+	if(w->pos % STORE_ALIGN) {
+		store_writer_write(w, pad, STORE_ALIGN - w->pos % STORE_ALIGN);
+	}
+
+	return w->cnt++;
+}
+
+/*
+ * Appends a print and returns its record index.
+ */
+VALUE store_writer_add(VALUE self, VALUE print) {
+	unsigned char *data;
+	unsigned int len;
+
+	print_data(print, &data, &len);
+
+	return UINT2NUM(store_writer_append(self, data, len));
+}
+
+VALUE store_writer_push(VALUE self, VALUE print) {
+	store_writer_add(self, print);
+
+	return self;
+}
+
+/*
+ * Finishes the file and returns the number of records written.
+ */
+VALUE store_writer_close(VALUE self) {
+	store_writer *w = get_store_writer(self);
+	unsigned char header[STORE_HEADER_SIZE];
+	uint64_t index_offset = w->pos;
+
+	store_writer_write(w, w->index, (size_t) w->cnt * STORE_INDEX_ENTRY_SIZE);
+
+	memset(header, 0, sizeof(header));
+	memcpy(header, STORE_MAGIC, 8);
+	store_le32(STORE_VERSION, header + 8);
+	store_le32((uint32_t) w->format, header + 12);
+	store_le32(w->cnt, header + 16);
+	store_le64(index_offset, header + 24);
+	store_le64(w->pos, header + 32);
+
+	if(fseek(w->file, 0, SEEK_SET) != 0 ||
+	   fwrite(header, 1, sizeof(header), w->file) != sizeof(header) ||
+	   fflush(w->file) != 0 ||
+	   fsync(fileno(w->file)) != 0) {
+		rb_sys_fail(w->tmp_path);
+	}
+
+	fclose(w->file);
+	w->file = NULL;
+
+	if(rename(w->tmp_path, w->path) != 0) {
+		int e = errno;
+
+		unlink(w->tmp_path);
+		errno = e;
+		rb_sys_fail(w->path);
+	}
+
+	return UINT2NUM(w->cnt);
+}
+
+/*
+ * Closes the writer without finishing the store and removes what it had
+ * written so far. Does nothing if the writer is already closed.
+ */
+VALUE store_writer_abort(VALUE self) {
+	store_writer *w;
+
+	TypedData_Get_Struct(self, store_writer, &store_writer_type, w);
+	if(w->file) {
+		fclose(w->file);
+		w->file = NULL;
+		unlink(w->tmp_path);
+	}
+
+	return Qnil;
+}
+
+void Init_store() {
+	rb_cStore = rb_define_class_under(
+		rb_mFingerprint,
+		"Store",
+		rb_cObject
+	);
+	rb_define_alloc_func(rb_cStore, store_alloc);
+
+	rb_define_method(rb_cStore, "initialize", RUBY_METHOD_FUNC(store_initialize), 1);
+	rb_define_method(rb_cStore, "close", RUBY_METHOD_FUNC(store_close), 0);
+	rb_define_method(rb_cStore, "[]", RUBY_METHOD_FUNC(store_aref), 1);
+	rb_define_method(rb_cStore, "compare", RUBY_METHOD_FUNC(store_compare), -1);
+	rb_define_method(rb_cStore, "size", RUBY_METHOD_FUNC(store_size), 0);
+	rb_define_method(rb_cStore, "format", RUBY_METHOD_FUNC(store_format), 0);
+
+	rb_cStoreWriter = rb_define_class_under(
+		rb_cStore,
+		"Writer",
+		rb_cObject
+	);
+	rb_define_alloc_func(rb_cStoreWriter, store_writer_alloc);
+
+	rb_define_method(rb_cStoreWriter, "initialize", RUBY_METHOD_FUNC(store_writer_initialize), -1);
+	rb_define_method(rb_cStoreWriter, "add", RUBY_METHOD_FUNC(store_writer_add), 1);
+	rb_define_method(rb_cStoreWriter, "<<", RUBY_METHOD_FUNC(store_writer_push), 1);
+	rb_define_method(rb_cStoreWriter, "close", RUBY_METHOD_FUNC(store_writer_close), 0);
+	rb_define_method(rb_cStoreWriter, "abort", RUBY_METHOD_FUNC(store_writer_abort), 0);
+}
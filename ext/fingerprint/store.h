@@ -0,0 +1,74 @@
+#ifndef STORE_H
+#define STORE_H
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include "fingerprint.h"
+
+/*
+ * Template store file layout. All integers are little-endian.
+ *
+ *   header    STORE_HEADER_SIZE bytes
+ *   records   each FMD starting on an 8-byte boundary
+ *   index     one STORE_INDEX_ENTRY_SIZE entry per record
+ *
+ * Header: magic[8], version u32, format i32, count u32, reserved u32,
+ * index_offset u64, file_size u64, then zeros.
+ * Index entry: offset u64, size u32, reserved u32.
+ */
+#define STORE_MAGIC "KMFPSTOR"
+#define STORE_VERSION 1
+#define STORE_HEADER_SIZE 64
+#define STORE_INDEX_ENTRY_SIZE 16
+#define STORE_ALIGN 8
+
+/* Little-endian field access, shared with the gallery snapshot format. */
+static inline uint32_t load_le32(const unsigned char *p) {
+	return (uint32_t) p[0] | (uint32_t) p[1] << 8 | (uint32_t) p[2] << 16 | (uint32_t) p[3] << 24;
+}
+
+static inline uint64_t load_le64(const unsigned char *p) {
+	return (uint64_t) load_le32(p) | (uint64_t) load_le32(p + 4) << 32;
+}
+
+static inline void store_le32(uint32_t v, unsigned char *p) {
+	p[0] = v;
+	p[1] = v >> 8;
+	p[2] = v >> 16;
+	p[3] = v >> 24;
+}
+
+static inline void store_le64(uint64_t v, unsigned char *p) {
+	store_le32((uint32_t) v, p);
+	store_le32((uint32_t) (v >> 32), p + 4);
+}
+
+/*
+ * An open, read-only store. fmds and fmds_size point straight into the
+ * mapping. lock is held for reading by searches running without the GVL
+ * and for writing by close, so the file is never unmapped under them.
+ */
+typedef struct store {
+	pthread_rwlock_t lock;
+	unsigned char *map;
+	size_t map_len;
+	DPFJ_FMD_FORMAT format;
+	unsigned int cnt;
+	unsigned char **fmds;
+	unsigned int *fmds_size;
+} store;
+
+extern VALUE rb_cStore;
+
+int is_store(VALUE obj);
+store *get_store(VALUE obj);
+int store_read_lock(store *st, fmd_set *set);
+void store_read_unlock(store *st);
+
+int is_store_writer(VALUE obj);
+unsigned int store_writer_append(VALUE writer, const unsigned char *data, unsigned int len);
+
+void Init_store();
+
+#endif
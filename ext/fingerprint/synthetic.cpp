@@ -0,0 +1,480 @@
+#include <math.h>
+#include <string.h>
+
+#include "gallery.h"
+#include "pool.h"
+#include "stats.h"
+#include "store.h"
+#include "synthetic.h"
+
+#define DEFAULT_SYNTH_MIN_MINUTIAE 25
+#define DEFAULT_SYNTH_MAX_MINUTIAE 45
+#define DEFAULT_SYNTH_WIDTH 400
+#define DEFAULT_SYNTH_HEIGHT 500
+#define DEFAULT_SYNTH_DPI 500
+#define DEFAULT_SYNTH_JITTER 4
+
+/* Records made per trip out of the GVL, and per pool task within it. */
+#define SYNTH_CHUNK 4096
+#define SYNTH_TASK 256
+
+/* Impressions of the same finger differ by about this much. */
+#define SYNTH_ROTATION 8.0
+#define SYNTH_ANGLE_NOISE 4.0
+#define SYNTH_DROP_PERCENT 12
+#define SYNTH_SPURIOUS 3
+
+VALUE rb_cGenerator;
+
+/* splitmix64 */
+typedef struct synth_rng {
+	uint64_t state;
+} synth_rng;
+
+static uint64_t synth_next(synth_rng *rng) {
+	uint64_t z = (rng->state += 0x9e3779b97f4a7c15ull);
+
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+
+	return z ^ (z >> 31);
+}
+
+/* Uniform in [0, 1). */
+static double synth_unit(synth_rng *rng) {
+	return (synth_next(rng) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static double synth_uniform(synth_rng *rng, double lo, double hi) {
+	return lo + (hi - lo) * synth_unit(rng);
+}
+
+static unsigned int synth_below(synth_rng *rng, unsigned int n) {
+	return (unsigned int) (synth_next(rng) % n);
+}
+
+typedef struct synth_minutia {
+	double x;
+	double y;
+	double angle;
+	unsigned int type;
+	unsigned int quality;
+} synth_minutia;
+
+/* Where the finger lies on the image, and how its ridges flow. */
+typedef struct synth_finger {
+	double cx;
+	double cy;
+	double rx;
+	double ry;
+	double core_x;
+	double core_y;
+	double tilt;
+} synth_finger;
+
+static int synth_inside(const synth_finger *f, double x, double y) {
+	double dx = (x - f->cx) / f->rx, dy = (y - f->cy) / f->ry;
+
+	return dx * dx + dy * dy <= 1;
+}
+
+/*
+ * A minutia somewhere on the finger, pointing along a loop-shaped ridge
+ * flow around the core, either way along the ridge.
+ */
+static void synth_place(synth_rng *rng, const synth_finger *f, synth_minutia *m) {
+	double flow;
+
+	do {
+		m->x = synth_uniform(rng, f->cx - f->rx, f->cx + f->rx);
+		m->y = synth_uniform(rng, f->cy - f->ry, f->cy + f->ry);
+	} while(!synth_inside(f, m->x, m->y));
+
+	flow = atan2(m->y - f->core_y, m->x - f->core_x) * 0.5 * 180 / M_PI + 90 + f->tilt;
+	m->angle = fmod(flow + (synth_below(rng, 2) ? 180 : 0) + synth_uniform(rng, -10, 10) + 720, 360);
+	m->type = 1 + synth_below(rng, 2);
+	m->quality = 40 + synth_below(rng, 61);
+}
+
+/*
+ * The subject's minutiae as first enrolled: spread over an elliptical
+ * finger and kept at least a ridge or so apart. Returns how many.
+ */
+static unsigned int synth_master(const synth_params *p, uint64_t subject, synth_finger *f, synth_minutia *ms) {
+	synth_rng rng = { p->seed ^ (subject * 0xd1b54a32d192ed03ull) };
+	double spacing = p->dpi / 50.0;
+	unsigned int cnt, n = 0;
+
+	f->cx = p->width * synth_uniform(&rng, 0.42, 0.58);
+	f->cy = p->height * synth_uniform(&rng, 0.42, 0.58);
+	f->rx = p->width * 0.36;
+	f->ry = p->height * 0.4;
+	f->core_x = f->cx + synth_uniform(&rng, -0.2, 0.2) * f->rx;
+	f->core_y = f->cy + synth_uniform(&rng, -0.3, 0.1) * f->ry;
+	f->tilt = synth_uniform(&rng, -20, 20);
+
+	cnt = p->min_minutiae + synth_below(&rng, p->max_minutiae - p->min_minutiae + 1);
+	for(unsigned int attempt = 0; n < cnt && attempt < cnt * 32; attempt++) {
+		synth_minutia *m = &ms[n];
+		int crowded = 0;
+
+		synth_place(&rng, f, m);
+		for(unsigned int i = 0; i < n && !crowded; i++) {
+			double dx = ms[i].x - m->x, dy = ms[i].y - m->y;
+
+			crowded = dx * dx + dy * dy < spacing * spacing;
+		}
+		if(!crowded) {
+			n++;
+		}
+	}
+
+	return n;
+}
+
+/*
+ * Another impression of the same finger: placed a little differently on
+ * the reader, each minutia a few pixels and degrees off, some missed and
+ * a few spurious ones found. Returns how many.
+ */
+static unsigned int synth_mate(const synth_params *p, uint64_t subject, unsigned int impression, const synth_finger *f, const synth_minutia *master, unsigned int master_cnt, synth_minutia *ms) {
+	synth_rng rng = { p->seed ^ (subject * 0xd1b54a32d192ed03ull) ^ (impression * 0x8cb92ba72f3d8dd7ull) };
+	double rotation = synth_uniform(&rng, -SYNTH_ROTATION, SYNTH_ROTATION);
+	double c = cos(rotation * M_PI / 180), s = sin(rotation * M_PI / 180);
+	double tx = synth_uniform(&rng, -0.05, 0.05) * p->width, ty = synth_uniform(&rng, -0.05, 0.05) * p->height;
+	unsigned int n = 0, spurious = synth_below(&rng, SYNTH_SPURIOUS + 1);
+
+	for(unsigned int i = 0; i < master_cnt; i++) {
+		const synth_minutia *from = &master[i];
+		synth_minutia *m = &ms[n];
+		double dx = from->x - f->cx, dy = from->y - f->cy;
+		int quality;
+
+		if(synth_below(&rng, 100) < SYNTH_DROP_PERCENT) {
+			continue;
+		}
+		m->x = f->cx + c * dx - s * dy + tx + synth_uniform(&rng, -(double) p->jitter, p->jitter);
+		m->y = f->cy + s * dx + c * dy + ty + synth_uniform(&rng, -(double) p->jitter, p->jitter);
+		m->angle = fmod(from->angle + rotation + synth_uniform(&rng, -SYNTH_ANGLE_NOISE, SYNTH_ANGLE_NOISE) + 720, 360);
+		/* A broken ridge end and a bifurcation are easily mistaken. */
+		m->type = synth_below(&rng, 20) ? from->type : 3 - from->type;
+		quality = (int) from->quality + (int) synth_below(&rng, 21) - 10;
+		m->quality = quality < 1 ? 1 : quality > 100 ? 100 : quality;
+		n++;
+	}
+	for(unsigned int i = 0; i < spurious && n < SYNTH_MAX_MINUTIAE; i++) {
+		synth_place(&rng, f, &ms[n++]);
+	}
+
+	return n;
+}
+
+/*
+ * Writes subject's FMD for the given impression into out, which holds
+ * SYNTH_MAX_SIZE bytes, and returns its length. Impression 0 is the
+ * subject's reference print and every other one a mate of it. Safe to call
+ * without the GVL.
+ */
+unsigned int synth_fmd(const synth_params *p, uint64_t subject, unsigned int impression, unsigned char *out) {
+	synth_minutia master[SYNTH_MAX_MINUTIAE], mated[SYNTH_MAX_MINUTIAE + SYNTH_SPURIOUS];
+	const synth_minutia *ms = master;
+	DPFJ_FMD_RECORD_PARAMS record;
+	DPFJ_FMD_VIEW_PARAMS view;
+	synth_finger f;
+	unsigned int cnt = synth_master(p, subject, &f, master), kept = 0, header;
+	unsigned char *v, *m;
+
+	if(impression) {
+		cnt = synth_mate(p, subject, impression, &f, master, cnt, mated);
+		ms = mated;
+	}
+
+	header = p->format == DPFJ_FMD_ISO_19794_2_2005 ? DPFJ_FMD_ISO_19794_2_2005_RECORD_HEADER_LENGTH : DPFJ_FMD_ANSI_378_2004_RECORD_HEADER_LENGTH;
+	v = out + header;
+	m = v + DPFJ_FMD_ANSI_ISO_VIEW_HEADER_LENGTH;
+	for(unsigned int i = 0; i < cnt && kept < SYNTH_MAX_MINUTIAE; i++) {
+		unsigned int x, y, angle;
+
+		if(ms[i].x < 0 || ms[i].y < 0 || ms[i].x >= p->width || ms[i].y >= p->height) {
+			continue;
+		}
+		x = (unsigned int) ms[i].x;
+		y = (unsigned int) ms[i].y;
+		if(p->format == DPFJ_FMD_ISO_19794_2_2005) {
+			angle = (unsigned int) (ms[i].angle * 256 / 360 + 0.5) % 256;
+		} else {
+			angle = (unsigned int) (ms[i].angle / 2 + 0.5) % 180;
+		}
+
+		m[0] = (unsigned char) (ms[i].type << 6 | x >> 8);
+		m[1] = (unsigned char) x;
+		m[2] = (unsigned char) (y >> 8);
+		m[3] = (unsigned char) y;
+		m[4] = (unsigned char) angle;
+		m[5] = (unsigned char) ms[i].quality;
+		m += DPFJ_FMD_ANSI_ISO_MINITIA_LENGTH;
+		kept++;
+	}
+
+	memset(&record, 0, sizeof(record));
+	record.record_length = header + DPFJ_FMD_ANSI_ISO_VIEW_HEADER_LENGTH + kept * DPFJ_FMD_ANSI_ISO_MINITIA_LENGTH + 2;
+	record.width = p->width;
+	record.height = p->height;
+	/* Both formats give resolution in pixels per centimetre. */
+	record.resolution = (unsigned int) (p->dpi / 2.54 + 0.5);
+	record.view_cnt = 1;
+	memset(out, 0, header);
+	dpfj_set_fmd_record_params(&record, p->format, out);
+
+	memset(&view, 0, sizeof(view));
+	view.finger_position = DPFJ_POSITION_UNKNOWN;
+	view.impression_type = DPFJ_SCAN_LIVE_PLAIN;
+	view.quality = 60 + subject % 41;
+	view.minutia_cnt = kept;
+	view.ext_block = m + 2;
+	dpfj_set_fmd_view_params(&view, v);
+
+	return record.record_length;
+}
+
+/* Ruby objects */
+
+static void generator_free(void *ptr) {
+	xfree(ptr);
+}
+
+static size_t generator_memsize(const void *ptr) {
+	return sizeof(synth_params);
+}
+
+static const rb_data_type_t generator_type = {
+	"KeyMe::Fingerprint::Generator",
+	{ NULL, generator_free, generator_memsize, },
+	NULL, NULL,
+	RUBY_TYPED_FREE_IMMEDIATELY,
+};
+
+static synth_params *get_generator(VALUE obj) {
+	synth_params *p;
+
+	TypedData_Get_Struct(obj, synth_params, &generator_type, p);
+
+	return p;
+}
+
+static VALUE generator_alloc(VALUE klass) {
+	synth_params *p;
+
+	return TypedData_Make_Struct(klass, synth_params, &generator_type, p);
+}
+
+/*
+ * KeyMe::Fingerprint::Generator.new(seed: 0, format: FMD_ANSI_378_2004, minutiae: 25..45, width: 400, height: 500, dpi: 500, jitter: 4)
+ *
+ * Makes synthetic single-view FMDs for load and scale testing. A print is
+ * drawn from seed and its subject number alone; minutiae is how many it
+ * has, and jitter how many pixels its mates' minutiae wander.
+ */
+VALUE generator_initialize(int argc, VALUE *argv, VALUE self) {
+	VALUE opts;
+	ID keys[7];
+	VALUE values[7];
+	synth_params *p = get_generator(self);
+
+	rb_scan_args(argc, argv, ":", &opts);
+
+	keys[0] = rb_intern("seed");
+	keys[1] = rb_intern("format");
+	keys[2] = rb_intern("minutiae");
+	keys[3] = rb_intern("width");
+	keys[4] = rb_intern("height");
+	keys[5] = rb_intern("dpi");
+	keys[6] = rb_intern("jitter");
+	rb_get_kwargs(opts, keys, 0, 7, values);
+
+	p->seed = values[0] == Qundef ? 0 : NUM2ULL(values[0]);
+	p->format = values[1] == Qundef ? DEFAULT_FMD_FORMAT : NUM2INT(values[1]);
+	p->min_minutiae = DEFAULT_SYNTH_MIN_MINUTIAE;
+	p->max_minutiae = DEFAULT_SYNTH_MAX_MINUTIAE;
+	if(values[2] != Qundef) {
+		VALUE first, last;
+		int exclusive;
+
+		if(rb_range_values(values[2], &first, &last, &exclusive)) {
+			p->min_minutiae = NUM2UINT(first);
+			p->max_minutiae = NUM2UINT(last) - (exclusive ? 1 : 0);
+		} else {
+			p->min_minutiae = p->max_minutiae = NUM2UINT(values[2]);
+		}
+	}
+	p->width = values[3] == Qundef ? DEFAULT_SYNTH_WIDTH : NUM2UINT(values[3]);
+	p->height = values[4] == Qundef ? DEFAULT_SYNTH_HEIGHT : NUM2UINT(values[4]);
+	p->dpi = values[5] == Qundef ? DEFAULT_SYNTH_DPI : NUM2UINT(values[5]);
+	p->jitter = values[6] == Qundef ? DEFAULT_SYNTH_JITTER : NUM2UINT(values[6]);
+
+	if(p->format != DPFJ_FMD_ANSI_378_2004 && p->format != DPFJ_FMD_ISO_19794_2_2005) {
+		rb_raise(rb_eArgError, "can only generate ANSI 378-2004 and ISO 19794-2-2005 FMDs");
+	}
+	if(p->min_minutiae < 1 || p->min_minutiae > p->max_minutiae || p->max_minutiae > SYNTH_MAX_MINUTIAE) {
+		rb_raise(rb_eArgError, "minutiae must be between 1 and %d", SYNTH_MAX_MINUTIAE);
+	}
+	/* Minutia coordinates have 14 bits. */
+	if(p->width < 64 || p->height < 64 || p->width > 0x3fff || p->height > 0x3fff) {
+		rb_raise(rb_eArgError, "width and height must be between 64 and %d", 0x3fff);
+	}
+	if(p->dpi < 100) {
+		rb_raise(rb_eArgError, "dpi must be at least 100");
+	}
+
+	return self;
+}
+
+/*
+ * The FMD of subject's given impression, as a frozen binary String.
+ * Impression 0 is the subject's reference print; every other impression
+ * is a different mate of it.
+ */
+VALUE generator_fmd(int argc, VALUE *argv, VALUE self) {
+	VALUE subject, impression;
+	synth_params *p = get_generator(self);
+	unsigned char fmd[SYNTH_MAX_SIZE];
+	unsigned int len;
+
+	rb_scan_args(argc, argv, "11", &subject, &impression);
+	len = synth_fmd(p, NUM2ULL(subject), NIL_P(impression) ? 0 : NUM2UINT(impression), fmd);
+
+	return rb_obj_freeze(rb_str_new((char*) fmd, len));
+}
+
+/*
+ * [reference, mate] for subject: a mated pair, impressions 0 and 1.
+ */
+VALUE generator_pair(VALUE self, VALUE subject) {
+	VALUE argv[2], reference;
+
+	argv[0] = subject;
+	argv[1] = INT2FIX(0);
+	reference = generator_fmd(2, argv, self);
+	argv[1] = INT2FIX(1);
+
+	return rb_assoc_new(reference, generator_fmd(2, argv, self));
+}
+
+typedef struct generate_args {
+	const synth_params *p;
+	uint64_t first;
+	unsigned int impression;
+	unsigned int cnt;
+	unsigned char *fmds;
+	unsigned int *sizes;
+} generate_args;
+
+static void generate_task(void *ptr, unsigned int index) {
+	generate_args *args = (generate_args*) ptr;
+	unsigned int end = (index + 1) * SYNTH_TASK;
+
+	if(end > args->cnt) {
+		end = args->cnt;
+	}
+	for(unsigned int i = index * SYNTH_TASK; i < end; i++) {
+		args->sizes[i] = synth_fmd(args->p, args->first + i, args->impression, args->fmds + (size_t) i * SYNTH_MAX_SIZE);
+	}
+}
+
+static void *generate_without_gvl(void *ptr) {
+	generate_args *args = (generate_args*) ptr;
+
+	pool_run((args->cnt + SYNTH_TASK - 1) / SYNTH_TASK, generate_task, args);
+
+	return NULL;
+}
+
+/*
+ * KeyMe::Fingerprint::Generator#generate(target, count, first: 0, impression: 0)
+ *
+ * Streams the FMDs of count subjects, numbered from first, into target: a
+ * Gallery, a Store::Writer or an Array. Prints are made a chunk at a time
+ * on the thread pool with the GVL released, and the chunk then appended in
+ * order, so a store is written about as fast as the disk takes it.
+ * Returns target.
+ */
+VALUE generator_generate(int argc, VALUE *argv, VALUE self) {
+	VALUE target, count, opts, fmds_v, sizes_v;
+	ID keys[2];
+	VALUE values[2];
+	synth_params *p = get_generator(self);
+	generate_args args;
+	unsigned long long total, done = 0;
+	gallery *g = NULL;
+
+	rb_scan_args(argc, argv, "2:", &target, &count, &opts);
+
+	keys[0] = rb_intern("first");
+	keys[1] = rb_intern("impression");
+	rb_get_kwargs(opts, keys, 0, 2, values);
+
+	if(is_gallery(target)) {
+		g = get_gallery(target);
+		if(g->format != p->format) {
+			rb_raise(rb_eArgError, "gallery holds a different FMD format");
+		}
+	} else if(!is_store_writer(target)) {
+		Check_Type(target, T_ARRAY);
+	}
+
+	total = NUM2ULL(count);
+	args.p = p;
+	args.first = values[0] == Qundef ? 0 : NUM2ULL(values[0]);
+	args.impression = values[1] == Qundef ? 0 : NUM2UINT(values[1]);
+	args.fmds = (unsigned char*) ALLOCV(fmds_v, (size_t) SYNTH_CHUNK * SYNTH_MAX_SIZE);
+	args.sizes = ALLOCV_N(unsigned int, sizes_v, SYNTH_CHUNK);
+
+	while(done < total) {
+		args.cnt = total - done < SYNTH_CHUNK ? (unsigned int) (total - done) : SYNTH_CHUNK;
+		stats_without_gvl(generate_without_gvl, &args, NULL, NULL);
+
+		for(unsigned int i = 0; i < args.cnt; i++) {
+			const unsigned char *fmd = args.fmds + (size_t) i * SYNTH_MAX_SIZE;
+
+			if(g) {
+				gallery_insert(g, fmd, args.sizes[i]);
+			} else if(RB_TYPE_P(target, T_ARRAY)) {
+				rb_ary_push(target, rb_obj_freeze(rb_str_new((const char*) fmd, args.sizes[i])));
+			} else {
+				store_writer_append(target, fmd, args.sizes[i]);
+			}
+		}
+
+		args.first += args.cnt;
+		done += args.cnt;
+	}
+
+	ALLOCV_END(fmds_v);
+	ALLOCV_END(sizes_v);
+
+	return target;
+}
+
+VALUE generator_seed(VALUE self) {
+	return ULL2NUM(get_generator(self)->seed);
+}
+
+VALUE generator_format(VALUE self) {
+	return INT2NUM(get_generator(self)->format);
+}
+
+void Init_synthetic() {
+	rb_cGenerator = rb_define_class_under(
+		rb_mFingerprint,
+		"Generator",
+		rb_cObject
+	);
+	rb_define_alloc_func(rb_cGenerator, generator_alloc);
+
+	rb_define_method(rb_cGenerator, "initialize", RUBY_METHOD_FUNC(generator_initialize), -1);
+	rb_define_method(rb_cGenerator, "fmd", RUBY_METHOD_FUNC(generator_fmd), -1);
+	rb_define_method(rb_cGenerator, "pair", RUBY_METHOD_FUNC(generator_pair), 1);
+	rb_define_method(rb_cGenerator, "generate", RUBY_METHOD_FUNC(generator_generate), -1);
+	rb_define_method(rb_cGenerator, "seed", RUBY_METHOD_FUNC(generator_seed), 0);
+	rb_define_method(rb_cGenerator, "format", RUBY_METHOD_FUNC(generator_format), 0);
+}
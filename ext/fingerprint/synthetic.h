@@ -0,0 +1,35 @@
+#ifndef SYNTHETIC_H
+#define SYNTHETIC_H
+
+#include <stdint.h>
+
+#include "fingerprint.h"
+
+#define SYNTH_MAX_MINUTIAE 128
+
+/* The largest record synth_fmd writes: one view, no extended data. */
+#define SYNTH_MAX_SIZE (DPFJ_FMD_ANSI_378_2004_RECORD_HEADER_LENGTH + DPFJ_FMD_ANSI_ISO_VIEW_HEADER_LENGTH + SYNTH_MAX_MINUTIAE * DPFJ_FMD_ANSI_ISO_MINITIA_LENGTH + 2)
+
+/*
+ * How a Generator draws prints. Every print is a pure function of these
+ * and its subject and impression numbers, so any record can be remade
+ * without the ones before it.
+ */
+typedef struct synth_params {
+	DPFJ_FMD_FORMAT format;
+	uint64_t seed;
+	unsigned int min_minutiae;
+	unsigned int max_minutiae;
+	unsigned int width;
+	unsigned int height;
+	unsigned int dpi;
+	unsigned int jitter;
+} synth_params;
+
+unsigned int synth_fmd(const synth_params *p, uint64_t subject, unsigned int impression, unsigned char *out);
+
+extern VALUE rb_cGenerator;
+
+void Init_synthetic();
+
+#endif
@@ -0,0 +1,285 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "minutiae.h"
+#include "stats.h"
+#include "template.h"
+
+VALUE rb_cTemplate;
+
+static void template_free(void *ptr) {
+	fmd_template *t = (fmd_template*) ptr;
+
+	free(t->data);
+	xfree(t->views);
+	xfree(t);
+}
+
+static size_t template_memsize(const void *ptr) {
+	const fmd_template *t = (const fmd_template*) ptr;
+
+	return sizeof(fmd_template) + t->len + (t->views ? t->record.view_cnt * sizeof(DPFJ_FMD_VIEW_PARAMS) : 0);
+}
+
+static const rb_data_type_t template_type = {
+	"KeyMe::Fingerprint::Template",
+	{ NULL, template_free, template_memsize, },
+	NULL, NULL,
+	RUBY_TYPED_FREE_IMMEDIATELY,
+};
+
+int is_template(VALUE obj) {
+	return rb_typeddata_is_kind_of(obj, &template_type);
+}
+
+fmd_template *get_template(VALUE obj) {
+	fmd_template *t;
+
+	TypedData_Get_Struct(obj, fmd_template, &template_type, t);
+
+	return t;
+}
+
+static VALUE template_alloc(VALUE klass) {
+	fmd_template *t;
+	VALUE obj = TypedData_Make_Struct(klass, fmd_template, &template_type, t);
+
+	t->format = DEFAULT_FMD_FORMAT;
+
+	return obj;
+}
+
+/*
+ * Wraps data, which must have come from malloc and now belongs to the
+ * Template. The Template is frozen: nothing can change its bytes.
+ */
+VALUE template_wrap(DPFJ_FMD_FORMAT format, unsigned char *data, unsigned int len) {
+	VALUE obj = template_alloc(rb_cTemplate);
+	fmd_template *t = get_template(obj);
+
+	t->data = data;
+	t->len = len;
+	t->format = format;
+
+	return rb_obj_freeze(obj);
+}
+
+/*
+ * Reads the record and view headers, once. Every view is bounds-checked
+ * first, so the dpfj header helpers never read past the buffer.
+ */
+static fmd_template *template_parsed(VALUE self) {
+	fmd_template *t = get_template(self);
+	size_t size;
+	int rc;
+
+	if(t->parsed) {
+		return t;
+	}
+
+	rc = minutiae_check(t->format, t->data, t->len, &size);
+	if(rc != MINUTIAE_OK) {
+		rb_raise(rb_eFingerprintError, "malformed FMD (%s)", minutiae_error_name(rc));
+	}
+
+	dpfj_get_fmd_record_params(t->format, t->data, &t->record);
+	t->views = ALLOC_N(DPFJ_FMD_VIEW_PARAMS, t->record.view_cnt ? t->record.view_cnt : 1);
+	for(unsigned int v = 0; v < t->record.view_cnt; v++) {
+		dpfj_get_fmd_view_params(t->data + dpfj_get_fmd_view_offset(t->format, t->data, v), &t->views[v]);
+	}
+	t->parsed = 1;
+
+	return t;
+}
+
+/*
+ * KeyMe::Fingerprint::Template.new(fmd, format: FMD_ANSI_378_2004)
+ *
+ * Copies fmd, a String, into a new Template.
+ */
+VALUE template_initialize(int argc, VALUE *argv, VALUE self) {
+	VALUE fmd, opts;
+	ID keys[1];
+	VALUE values[1];
+	fmd_template *t = get_template(self);
+
+	rb_scan_args(argc, argv, "1:", &fmd, &opts);
+
+	keys[0] = rb_intern("format");
+	rb_get_kwargs(opts, keys, 0, 1, values);
+
+	if(t->data) {
+		rb_raise(rb_eFingerprintError, "template is already initialized");
+	}
+	StringValue(fmd);
+
+	t->format = values[0] == Qundef ? DEFAULT_FMD_FORMAT : NUM2INT(values[0]);
+	t->len = RSTRING_LEN(fmd);
+	t->data = (unsigned char*) malloc(t->len ? t->len : 1);
+	if(!t->data) {
+		t->len = 0;
+		rb_raise(rb_eNoMemError, "failed to allocate memory");
+	}
+	memcpy(t->data, RSTRING_PTR(fmd), t->len);
+
+	return rb_obj_freeze(self);
+}
+
+VALUE template_size(VALUE self) {
+	return UINT2NUM(get_template(self)->len);
+}
+
+VALUE template_format(VALUE self) {
+	return INT2NUM(get_template(self)->format);
+}
+
+/*
+ * KeyMe::Fingerprint::Template#parsed?
+ *
+ * Whether the headers have been read yet.
+ */
+VALUE template_parsed_p(VALUE self) {
+	return get_template(self)->parsed ? Qtrue : Qfalse;
+}
+
+/*
+ * KeyMe::Fingerprint::Template#to_s
+ *
+ * The bytes, as a frozen binary String.
+ */
+VALUE template_to_s(VALUE self) {
+	fmd_template *t = get_template(self);
+	uint64_t start = stats_start();
+	VALUE result = rb_str_new((char*) t->data, t->len);
+
+	stats_since(STATS_MARSHAL, start);
+	stats_count(STATS_BYTES_COPIED, t->len);
+	stats_count(STATS_ALLOCATIONS, 1);
+
+	return rb_obj_freeze(result);
+}
+
+/*
+ * KeyMe::Fingerprint::Template#to_a
+ *
+ * The bytes as an Array of Integers, what load_print used to return.
+ */
+VALUE template_to_a(VALUE self) {
+	fmd_template *t = get_template(self);
+	uint64_t start = stats_start();
+	VALUE result = rb_ary_new_capa(t->len);
+
+	for(unsigned int i = 0; i < t->len; i++) {
+		rb_ary_push(result, UINT2NUM(t->data[i]));
+	}
+
+	stats_since(STATS_MARSHAL, start);
+	stats_count(STATS_BYTES_COPIED, t->len);
+	stats_count(STATS_ALLOCATIONS, 1);
+
+	return result;
+}
+
+/*
+ * KeyMe::Fingerprint::Template#record
+ *
+ * The record header: a Hash of record_length, cbeff_id,
+ * capture_equipment_comp, capture_equipment_id, width, height,
+ * resolution and view_count. Raises if the record is malformed.
+ */
+VALUE template_record(VALUE self) {
+	fmd_template *t = template_parsed(self);
+	VALUE result = rb_hash_new();
+
+	rb_hash_aset(result, ID2SYM(rb_intern("record_length")), UINT2NUM(t->record.record_length));
+	rb_hash_aset(result, ID2SYM(rb_intern("cbeff_id")), UINT2NUM(t->record.cbeff_id));
+	rb_hash_aset(result, ID2SYM(rb_intern("capture_equipment_comp")), UINT2NUM(t->record.capture_equipment_comp));
+	rb_hash_aset(result, ID2SYM(rb_intern("capture_equipment_id")), UINT2NUM(t->record.capture_equipment_id));
+	rb_hash_aset(result, ID2SYM(rb_intern("width")), UINT2NUM(t->record.width));
+	rb_hash_aset(result, ID2SYM(rb_intern("height")), UINT2NUM(t->record.height));
+	rb_hash_aset(result, ID2SYM(rb_intern("resolution")), UINT2NUM(t->record.resolution));
+	rb_hash_aset(result, ID2SYM(rb_intern("view_count")), UINT2NUM(t->record.view_cnt));
+
+	return result;
+}
+
+/*
+ * KeyMe::Fingerprint::Template#views
+ *
+ * An Array with a Hash of position, number, impression, quality,
+ * minutia_count and ext_block_length for each view.
+ */
+VALUE template_views(VALUE self) {
+	fmd_template *t = template_parsed(self);
+	VALUE result = rb_ary_new_capa(t->record.view_cnt);
+
+	for(unsigned int v = 0; v < t->record.view_cnt; v++) {
+		DPFJ_FMD_VIEW_PARAMS *view = &t->views[v];
+		VALUE hash = rb_hash_new();
+
+		rb_hash_aset(hash, ID2SYM(rb_intern("position")), UINT2NUM(view->finger_position));
+		rb_hash_aset(hash, ID2SYM(rb_intern("number")), UINT2NUM(view->view_number));
+		rb_hash_aset(hash, ID2SYM(rb_intern("impression")), UINT2NUM(view->impression_type));
+		rb_hash_aset(hash, ID2SYM(rb_intern("quality")), UINT2NUM(view->quality));
+		rb_hash_aset(hash, ID2SYM(rb_intern("minutia_count")), UINT2NUM(view->minutia_cnt));
+		rb_hash_aset(hash, ID2SYM(rb_intern("ext_block_length")), UINT2NUM(view->ext_block_length));
+		rb_ary_push(result, hash);
+	}
+
+	return result;
+}
+
+VALUE template_view_count(VALUE self) {
+	return UINT2NUM(template_parsed(self)->record.view_cnt);
+}
+
+/*
+ * KeyMe::Fingerprint::Template#==(other)
+ *
+ * True for a Template or String with the same bytes.
+ */
+VALUE template_equal(VALUE self, VALUE other) {
+	fmd_template *t = get_template(self);
+	unsigned char *data;
+	unsigned int len;
+
+	if(!is_template(other) && !RB_TYPE_P(other, T_STRING)) {
+		return Qfalse;
+	}
+	print_data(other, &data, &len);
+
+	return len == t->len && memcmp(data, t->data, len) == 0 ? Qtrue : Qfalse;
+}
+
+VALUE template_eql(VALUE self, VALUE other) {
+	return is_template(other) ? template_equal(self, other) : Qfalse;
+}
+
+VALUE template_hash(VALUE self) {
+	fmd_template *t = get_template(self);
+
+	return ST2FIX(rb_memhash(t->data, t->len));
+}
+
+void Init_template() {
+	rb_cTemplate = rb_define_class_under(
+		rb_mFingerprint,
+		"Template",
+		rb_cObject
+	);
+	rb_define_alloc_func(rb_cTemplate, template_alloc);
+
+	rb_define_method(rb_cTemplate, "initialize", RUBY_METHOD_FUNC(template_initialize), -1);
+	rb_define_method(rb_cTemplate, "size", RUBY_METHOD_FUNC(template_size), 0);
+	rb_define_method(rb_cTemplate, "bytesize", RUBY_METHOD_FUNC(template_size), 0);
+	rb_define_method(rb_cTemplate, "format", RUBY_METHOD_FUNC(template_format), 0);
+	rb_define_method(rb_cTemplate, "parsed?", RUBY_METHOD_FUNC(template_parsed_p), 0);
+	rb_define_method(rb_cTemplate, "to_s", RUBY_METHOD_FUNC(template_to_s), 0);
+	rb_define_method(rb_cTemplate, "to_a", RUBY_METHOD_FUNC(template_to_a), 0);
+	rb_define_method(rb_cTemplate, "record", RUBY_METHOD_FUNC(template_record), 0);
+	rb_define_method(rb_cTemplate, "views", RUBY_METHOD_FUNC(template_views), 0);
+	rb_define_method(rb_cTemplate, "view_count", RUBY_METHOD_FUNC(template_view_count), 0);
+	rb_define_method(rb_cTemplate, "==", RUBY_METHOD_FUNC(template_equal), 1);
+	rb_define_method(rb_cTemplate, "eql?", RUBY_METHOD_FUNC(template_eql), 1);
+	rb_define_method(rb_cTemplate, "hash", RUBY_METHOD_FUNC(template_hash), 0);
+}
@@ -0,0 +1,30 @@
+#ifndef TEMPLATE_H
+#define TEMPLATE_H
+
+#include "fingerprint.h"
+
+/*
+ * A print held in a native buffer, as load_print returns it. The bytes
+ * never change once wrapped, so the matcher reads them in place with the
+ * GVL released. The record and view headers are only parsed the first
+ * time they are asked for.
+ */
+typedef struct fmd_template {
+	unsigned char *data;
+	unsigned int len;
+	DPFJ_FMD_FORMAT format;
+
+	int parsed;
+	DPFJ_FMD_RECORD_PARAMS record;
+	DPFJ_FMD_VIEW_PARAMS *views;
+} fmd_template;
+
+extern VALUE rb_cTemplate;
+
+int is_template(VALUE obj);
+fmd_template *get_template(VALUE obj);
+VALUE template_wrap(DPFJ_FMD_FORMAT format, unsigned char *data, unsigned int len);
+
+void Init_template();
+
+#endif
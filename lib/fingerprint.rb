@@ -1,2 +1,165 @@
 require 'u_are_u/library'
 require 'keyme/fingerprint'
+
+module KeyMe
+	module Fingerprint
+		class CaptureStream
+			include Enumerable
+
+			# Yields each template as it is extracted, until the stream stops.
+			def each
+				return enum_for(:each) unless block_given?
+
+				while (fmd = pop)
+					yield fmd
+				end
+				self
+			end
+
+			# Pushes templates onto queue from a background thread, closing it
+			# when the stream stops. Returns queue.
+			def feed(queue = Thread::Queue.new)
+				Thread.new do
+					begin
+						each { |fmd| queue << fmd }
+					ensure
+						queue.close
+					end
+				end
+				queue
+			end
+		end
+
+		class Reader
+			# A set of open readers handed out one caller at a time. A reader
+			# whose cached status says it is busy is passed over until a fresh
+			# reading says otherwise; one that needs calibration or has failed
+			# is handed out, and calibrated or reset by its next capture, which
+			# is the only thing that would ever clear a failure.
+			class Pool
+				# Opens the named readers, or every one connected, and takes
+				# over any Reader given instead of a name.
+				def initialize(readers = nil, status_ttl: 1.0)
+					readers ||= Reader.devices.map { |device| device[:name] }
+					@readers = readers.map { |reader| reader.is_a?(Reader) ? reader : Reader.new(reader) }
+					@readers.each { |reader| reader.status_ttl = status_ttl }
+					@idle = @readers.dup
+					@lock = Mutex.new
+					@returned = ConditionVariable.new
+				end
+
+				def size
+					@readers.size
+				end
+
+				# Takes an idle, usable reader, waiting up to timeout seconds
+				# (or for ever) for one. Returns nil on timeout.
+				def checkout(timeout = nil)
+					deadline = timeout && Process.clock_gettime(Process::CLOCK_MONOTONIC) + timeout
+
+					@lock.synchronize do
+						loop do
+							reader = @idle.find { |r| usable?(r) }
+							if reader
+								@idle.delete(reader)
+								return reader
+							end
+
+							raise Error, 'reader pool is closed' if @readers.empty?
+
+							# Unusable readers are looked at again after their status expires.
+							wait = @idle.empty? ? nil : @idle.map(&:status_ttl).min
+							if deadline
+								left = deadline - Process.clock_gettime(Process::CLOCK_MONOTONIC)
+								return nil if left <= 0
+								wait = wait ? [wait, left].min : left
+							end
+							@returned.wait(@lock, wait)
+						end
+					end
+				end
+
+				def checkin(reader)
+					@lock.synchronize do
+						@idle << reader unless reader.closed? || @idle.include?(reader)
+						@returned.signal
+					end
+					self
+				end
+
+				# Yields a checked-out reader and checks it back in.
+				def with(timeout = nil)
+					reader = checkout(timeout)
+					raise Error, 'no reader available' unless reader
+
+					begin
+						yield reader
+					ensure
+						checkin(reader)
+					end
+				end
+
+				def close
+					@lock.synchronize do
+						@readers.each(&:close)
+						@readers.clear
+						@idle.clear
+						@returned.broadcast
+					end
+					nil
+				end
+
+				private
+
+				def usable?(reader)
+					!reader.closed? && reader.status[:status] != :busy
+				rescue Error
+					false
+				end
+			end
+		end
+
+		class Gallery
+			# Checkpoints on a background thread once more than min_log_size
+			# bytes of changes have been logged. Returns the thread, or nil if
+			# there was nothing to do.
+			def checkpoint_async(min_log_size = 0)
+				size = log_size
+				return nil unless size && size > min_log_size
+
+				Thread.new { checkpoint }
+			end
+		end
+
+		class Store
+			# Writes prints, an Enumerable of binary Strings, to a new template
+			# store at path and returns the number of records.
+			def self.write(path, prints, format = FMD_ANSI_378_2004)
+				writer = Writer.new(path, format)
+				begin
+					prints.each { |print| writer << print }
+					writer.close
+				ensure
+					writer.abort
+				end
+			end
+
+			# Builds a template store at path from per-file prints, in order.
+			def self.convert(files, path, format = FMD_ANSI_378_2004)
+				write(path, files.lazy.map { |file| Fingerprint.read_print(file) }, format)
+			end
+
+			# Writes count synthetic prints from generator to a new template
+			# store at path, subjects first onwards, and returns the count.
+			def self.generate(path, count, generator = Generator.new, first: 0, impression: 0)
+				writer = Writer.new(path, generator.format)
+				begin
+					generator.generate(writer, count, first: first, impression: impression)
+					writer.close
+				ensure
+					writer.abort
+				end
+			end
+		end
+	end
+end
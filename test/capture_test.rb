@@ -0,0 +1,126 @@
+require_relative 'test_helper'
+
+# CaptureStream's producer, selector and extractor threads, driven by a
+# fake reader so no hardware is needed.
+class CaptureStreamTest < Minitest::Test
+	include FingerprintTest
+
+	def test_each_yields_one_template_per_touch
+		reader = F::Reader.fake([frame(1), frame(1, quality: F::Reader::QUALITY_NO_FINGER)], interval: 0.01)
+		stream = F::CaptureStream.new(reader, window: 2)
+		fmds = []
+
+		stream.each do |fmd|
+			fmds << fmd
+			stream.stop if fmds.size == 3
+		end
+
+		assert_equal 3, fmds.size
+		fmds.each do |fmd|
+			assert fmd.frozen?
+			assert_operator F.compare(fmd, 0, fmds.first, 0), :<, F::DEFAULT_THRESHOLD
+		end
+		stats = stream.stats
+		assert_operator stats[:selected], :>=, 3
+		assert_operator stats[:extracted], :>=, 3
+		assert_equal 0, stats[:failed]
+		refute stream.running?
+	end
+
+	def test_feed_closes_the_queue_when_the_stream_stops
+		stream = F::CaptureStream.new(F::Reader.fake([frame(1)], interval: 0.01))
+		queue = stream.feed
+
+		fmd = queue.pop
+		refute_nil fmd
+		stream.stop
+
+		loop { break unless queue.pop }
+		assert queue.closed?
+		refute stream.running?
+	end
+
+	def test_stop_cancels_a_pending_capture
+		# Frames every 10s, so the producer is always inside a capture.
+		stream = F::CaptureStream.new(F::Reader.fake([frame(1)], interval: 10))
+		queue = stream.feed
+		started = Process.clock_gettime(Process::CLOCK_MONOTONIC)
+
+		sleep 0.05
+		stream.stop
+
+		assert_nil queue.pop
+		assert queue.closed?
+		assert_operator Process.clock_gettime(Process::CLOCK_MONOTONIC) - started, :<, 5
+		assert_equal 0, stream.stats[:extracted]
+	end
+
+	def test_a_frame_that_will_not_extract_is_counted_not_yielded
+		stream = F::CaptureStream.new(F::Reader.fake([blank_frame], interval: 0.01), window: 1)
+
+		assert_nil stream.pop(0.3)
+		stream.stop
+		assert_operator stream.stats[:failed], :>, 0
+		assert_equal 0, stream.stats[:extracted]
+	end
+
+	def test_the_reader_is_the_streams_until_it_stops
+		reader = F::Reader.fake([frame(1)], interval: 0.01)
+		stream = F::CaptureStream.new(reader)
+
+		assert_raises(F::Error) { F::CaptureStream.new(reader) }
+		stream.stop
+
+		again = F::CaptureStream.new(reader)
+		refute_nil again.pop(5)
+		again.stop
+	end
+end
+
+# capture_and_verify's capturer and verifier threads.
+class CaptureAndVerifyTest < Minitest::Test
+	include FingerprintTest
+
+	def enrolled
+		F.extract_raw(FingerprintTest.image(1), Fixtures::WIDTH, Fixtures::HEIGHT, dpi: Fixtures::DPI)
+	end
+
+	def test_a_mated_frame_matches_and_cancels_the_next_capture
+		# The second capture would take another interval; a match stops it.
+		result = F.capture_and_verify(F::Reader.fake([frame(1)], interval: 0.5), enrolled, timeout: 10)
+
+		assert_equal true, result[:match]
+		assert_operator result[:score], :<, F::DEFAULT_THRESHOLD
+		assert_equal 1, result[:frames]
+		assert_equal 1, result[:verified]
+
+		latency = result[:latency]
+		assert_equal %i[capture extract compare total], latency.keys
+		assert_in_delta 0.5, latency[:capture], 0.25
+		assert_operator latency[:extract], :>, 0
+		assert_operator latency[:compare], :>, 0
+		assert_operator latency[:total], :>=, latency[:capture]
+		assert_operator latency[:total], :<, 1.0
+	end
+
+	def test_a_non_mated_frame_runs_until_the_timeout
+		result = F.capture_and_verify(F::Reader.fake([frame(2)], interval: 0.02), enrolled, timeout: 0.3)
+
+		assert_equal false, result[:match]
+		assert_operator result[:score], :>=, F::DEFAULT_THRESHOLD
+		assert_operator result[:frames], :>, 1
+		assert_operator result[:verified], :>=, 1
+		assert_operator result[:verified], :<=, result[:frames]
+		assert_in_delta 0.3, result[:latency][:total], 0.2
+	end
+
+	def test_frames_without_a_finger_are_never_verified
+		reader = F::Reader.fake([frame(1, quality: F::Reader::QUALITY_NO_FINGER)], interval: 0.02)
+		result = F.capture_and_verify(reader, enrolled, timeout: 0.2)
+
+		assert_equal false, result[:match]
+		assert_nil result[:score]
+		assert_equal 0, result[:verified]
+		assert_operator result[:frames], :>, 0
+	end
+end
@@ -0,0 +1,87 @@
+require_relative 'test_helper'
+
+# An in-memory Gallery: adding, removing, compacting and searching it,
+# also while other threads write to it and get interrupted.
+class GalleryTest < Minitest::Test
+	include FingerprintTest
+
+	PRINTS = 2000
+
+	def matches(gallery, seed)
+		F.identify(Fixtures.fmd(seed, 1), gallery).map(&:fmd_index)
+	end
+
+	def test_identify_finds_each_added_print_by_its_id
+		gallery = F::Gallery.new
+		ids = (1..50).map { |seed| gallery.add(Fixtures.fmd(seed)) }
+
+		assert_equal (0...50).to_a, ids
+		assert_equal 50, gallery.size
+		assert_equal Fixtures.fmd(7), gallery[6]
+		assert_equal [6], matches(gallery, 7)
+		assert_empty matches(gallery, 51)
+	end
+
+	def test_removed_prints_are_not_found_and_compact_keeps_the_ids
+		gallery = F::Gallery.new
+		50.times { |i| gallery.add(Fixtures.fmd(i + 1)) }
+
+		assert gallery.remove(10)
+		refute gallery.remove(10)
+		assert_nil gallery[10]
+		assert_empty matches(gallery, 11)
+		assert_equal 49, gallery.size
+
+		before = gallery.bytesize
+		gallery.compact
+		assert_operator gallery.bytesize, :<=, before
+		assert_equal [20], matches(gallery, 21)
+		assert_equal Fixtures.fmd(50), gallery[49]
+		assert_equal 50, gallery.add(Fixtures.fmd(51))
+		assert_equal [50], matches(gallery, 51)
+	end
+
+	def test_the_format_cannot_change_once_the_gallery_has_prints
+		gallery = F::Gallery.new(F::FMD_ISO_19794_2_2005)
+		gallery.send(:initialize, F::FMD_ANSI_378_2004)
+		gallery.add(Fixtures.fmd(1))
+
+		assert_raises(F::Error) { gallery.send(:initialize, F::FMD_ISO_19794_2_2005) }
+		assert_equal F::FMD_ANSI_378_2004, gallery.format
+	end
+
+	# Adds wait for the write lock behind the searches; a Thread#raise that
+	# lands then must not leave the lock taken. Threads stuck on a leaked
+	# lock cannot be interrupted, so every wait is bounded and a failure is
+	# reported before the process hangs on exit.
+	def test_raising_into_a_blocked_add_leaves_the_gallery_usable
+		gallery = F::Gallery.new
+		PRINTS.times { |i| gallery.add(Fixtures.fmd(i + 1)) }
+		searching = true
+		searcher = Thread.new { F.identify(Fixtures.fmd(1, 1), gallery) while searching }
+
+		20.times do |i|
+			adder = Thread.new { loop { gallery.add(Fixtures.fmd(PRINTS + i + 1)) } }
+			adder.report_on_exception = false
+			sleep 0.01
+			adder.raise(Interrupt)
+			finished = begin
+				adder.join(5)
+			rescue Interrupt
+				true
+			end
+			assert finished, 'an interrupted add left the write lock taken'
+		end
+		searching = false
+		assert searcher.join(10), 'identify hung after an interrupted add'
+
+		check = Thread.new do
+			id = gallery.add(Fixtures.fmd(PRINTS * 2))
+			[id, matches(gallery, PRINTS * 2)]
+		end
+		assert check.join(10), 'add or identify hung after an interrupted add'
+		id, found = check.value
+		assert_equal [id], found
+		assert_equal [0], matches(gallery, 1)
+	end
+end
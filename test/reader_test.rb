@@ -0,0 +1,39 @@
+require_relative 'test_helper'
+
+# Reader's status cache and Reader::Pool, on fake readers.
+class ReaderTest < Minitest::Test
+	include FingerprintTest
+
+	def test_status_can_be_read_from_several_threads_at_once
+		reader = F::Reader.fake([frame(1)])
+		reader.status_ttl = 0
+
+		threads = 4.times.map do
+			Thread.new { 2000.times.map { reader.status[:status] }.uniq }
+		end
+
+		threads.each { |thread| assert_equal [:ready], thread.value }
+		assert_operator reader.stats[:status_reads], :>=, 8000
+	end
+
+	def test_status_is_cached_for_status_ttl
+		reader = F::Reader.fake([frame(1)])
+		reader.status_ttl = 60
+
+		3.times { reader.status }
+
+		assert_equal 1, reader.stats[:status_reads]
+	end
+
+	def test_the_pool_hands_out_a_failed_reader_and_its_capture_resets_it
+		reader = F::Reader.fake([frame(1)], interval: 0.01, status: F::Reader::STATUS_FAILURE)
+		pool = F::Reader::Pool.new([reader], status_ttl: 0)
+
+		pool.with(1) { |r| refute_nil r.capture[:image] }
+
+		assert_equal :ready, reader.status[:status]
+		assert_equal 1, reader.stats[:resets]
+	ensure
+		pool&.close
+	end
+end
@@ -0,0 +1,131 @@
+require 'fileutils'
+require 'objspace'
+require 'tmpdir'
+
+require_relative 'test_helper'
+
+# A Gallery followed from another process while its writer enrolls,
+# removes and checkpoints.
+class GalleryFollowTest < Minitest::Test
+	include FingerprintTest
+
+	PRINTS = 2000
+
+	def setup
+		skip 'needs fork' unless Process.respond_to?(:fork)
+		@dir = Dir.mktmpdir('fingerprint-test')
+		@path = File.join(@dir, 'gallery.snap')
+	end
+
+	def teardown
+		FileUtils.rm_rf(@dir) if @dir
+	end
+
+	def matches(gallery, seed)
+		F.identify(Fixtures.fmd(seed, 1), gallery).map(&:fmd_index)
+	end
+
+	# Private_Dirty kB of the mappings of path, or nil where /proc does not say.
+	def private_dirty(path)
+		return nil unless File.exist?('/proc/self/smaps')
+
+		dirty = 0
+		mine = false
+		File.foreach('/proc/self/smaps') do |line|
+			if line =~ /\A\h+-\h+ /
+				mine = line.chomp.end_with?(" #{path}")
+			elsif mine && line =~ /\APrivate_Dirty:\s+(\d+) kB/
+				dirty += Integer($1)
+			end
+		end
+		dirty
+	end
+
+	def test_a_follower_in_another_process_sees_the_writer_without_copying_the_snapshot
+		writer = F::Gallery.open(@path)
+		PRINTS.times { |i| writer.add(Fixtures.fmd(i + 1)) }
+		writer.checkpoint
+
+		from_parent, to_child = IO.pipe
+		from_child, to_parent = IO.pipe
+		pid = fork do
+			to_child.close
+			from_child.close
+			follower = F::Gallery.load(@path, follow: true)
+			result = { following: follower.following?, size: follower.size, before: ObjectSpace.memsize_of(follower) }
+			result[:refused] = begin
+				follower.add(Fixtures.fmd(1))
+				false
+			rescue F::Error
+				true
+			end
+			to_parent.puts 'ready'
+			to_parent.flush
+
+			from_parent.gets
+			result[:added] = matches(follower, PRINTS + 1)
+			result[:removed] = matches(follower, 5)
+			result[:kept] = matches(follower, 6)
+			result[:after] = ObjectSpace.memsize_of(follower)
+			result[:bytesize] = follower.bytesize
+			result[:dirty] = private_dirty(@path)
+			to_parent.puts 'caught up'
+			to_parent.flush
+
+			from_parent.gets
+			result[:checkpointed] = matches(follower, PRINTS + 2)
+			result[:still_removed] = matches(follower, 5)
+			result[:final_size] = follower.size
+			to_parent.write(Marshal.dump(result))
+			to_parent.close
+			exit!(0)
+		end
+		to_parent.close
+		from_parent.close
+
+		assert_equal "ready\n", from_child.gets
+		added = writer.add(Fixtures.fmd(PRINTS + 1))
+		assert writer.remove(4)
+		to_child.puts 'go'
+		to_child.flush
+
+		assert_equal "caught up\n", from_child.gets
+		writer.checkpoint
+		checkpointed = writer.add(Fixtures.fmd(PRINTS + 2))
+		to_child.puts 'go'
+		to_child.flush
+
+		result = Marshal.load(from_child.read)
+		Process.wait(pid)
+		assert_predicate $?, :success?
+
+		assert result[:following]
+		assert result[:refused]
+		assert_equal PRINTS, result[:size]
+		assert_equal [added], result[:added]
+		assert_empty result[:removed]
+		assert_equal [5], result[:kept]
+		assert_equal [checkpointed], result[:checkpointed]
+		assert_empty result[:still_removed]
+		assert_equal PRINTS + 1, result[:final_size]
+
+		# The snapshot's prints stay in the shared mapping: catching up on
+		# the log costs the new print, not a private copy of the arena.
+		assert_operator result[:after] - result[:before], :<, result[:bytesize] / 2
+		assert_equal 0, result[:dirty] if result[:dirty]
+	end
+
+	def test_compact_leaves_a_mapped_gallery_alone
+		writer = F::Gallery.open(@path)
+		20.times { |i| writer.add(Fixtures.fmd(i + 1)) }
+		writer.checkpoint
+
+		loaded = F::Gallery.load(@path)
+		10.times { |i| loaded.remove(i) }
+		bytesize = loaded.bytesize
+
+		assert_same loaded, loaded.compact
+		assert_equal bytesize, loaded.bytesize
+		assert_equal [11], matches(loaded, 12)
+	end
+end
@@ -0,0 +1,28 @@
+# Loads the extension the way an application would, plus the synthetic
+# prints and images the benchmarks use. Run a file from the top of the
+# tree with the built extension on the load path:
+#
+#   ruby -Ilib -I<dir holding keyme/fingerprint.so> test/capture_test.rb
+
+require 'minitest/autorun'
+require 'fingerprint'
+
+require_relative '../bench/fixtures'
+
+module FingerprintTest
+	F = KeyMe::Fingerprint
+
+	# Fixtures.image takes a second or two, so each seed is drawn once.
+	def self.image(seed)
+		@images ||= {}
+		@images[seed] ||= Fixtures.image(seed)
+	end
+
+	def frame(seed, **extra)
+		{ image: FingerprintTest.image(seed), width: Fixtures::WIDTH, height: Fixtures::HEIGHT }.merge(extra)
+	end
+
+	def blank_frame(**extra)
+		{ image: ("\xff".b * (Fixtures::WIDTH * Fixtures::HEIGHT)), width: Fixtures::WIDTH, height: Fixtures::HEIGHT }.merge(extra)
+	end
+end